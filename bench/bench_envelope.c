@@ -0,0 +1,129 @@
+/**
+ * @file bench_envelope.c
+ * @brief Compares the binary envelope (chat_protocol.h) with an equivalent text envelope.
+ *
+ * The text envelope carries the same fields as "type|flags|room|sender|seq|ts|payload\n",
+ * which is what the old newline protocol would have needed to grow into. For a stream
+ * of messages with a range of payload sizes it reports:
+ *   - bytes on the wire per message
+ *   - encode cost
+ *   - routing cost: find the frame boundary and read type + room, the only work the
+ *     server does before forwarding a frame
+ *
+ * Build: gcc -O2 -Wall -I.. -o bench_envelope bench_envelope.c
+ * Run:   ./bench_envelope [messages]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chat_protocol.h"
+
+#define DEFAULT_MESSAGES 1000000
+#define TEXT_MAX_FRAME   (CHAT_MAX_PAYLOAD + 128)
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t text_encode(char *buf, int type, int flags, int room, unsigned long sender,
+                          unsigned long long seq, unsigned long long ts, const char *payload, size_t len) {
+    int n = snprintf(buf, TEXT_MAX_FRAME, "%d|%d|%d|%lu|%llu|%llu|", type, flags, room, sender, seq, ts);
+    memcpy(buf + n, payload, len);
+    buf[n + len] = '\n';
+    return n + len + 1;
+}
+
+// Routing on the text envelope: find the end of the message, then parse the leading fields
+static size_t text_route(const char *buf, size_t avail, int *type, int *room) {
+    const char *end = memchr(buf, '\n', avail);
+    char *p;
+
+    if (end == NULL) return 0;
+    *type = (int)strtoul(buf, &p, 10);
+    strtoul(p + 1, &p, 10); // flags
+    *room = (int)strtoul(p + 1, &p, 10);
+    return end - buf + 1;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = { 16, 64, 256, 1024 };
+    long messages = argc > 1 ? atol(argv[1]) : DEFAULT_MESSAGES;
+    char payload[CHAT_MAX_PAYLOAD];
+
+    memset(payload, 'x', sizeof payload);
+    printf("%-8s %-6s %10s %12s %12s\n", "payload", "format", "bytes/msg", "encode ns", "route ns");
+
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+        size_t len = sizes[s];
+        size_t bin_frame = CHAT_HEADER_LEN + CHAT_VARINT_MAX + len;
+        size_t text_frame = TEXT_MAX_FRAME;
+        // Room for a batch of back-to-back frames, like a receive buffer holding several messages
+        long batch = (64 * 1024) / (text_frame > bin_frame ? text_frame : bin_frame) + 1;
+        uint8_t *bin = malloc(batch * bin_frame);
+        char *text = malloc(batch * text_frame);
+        size_t bin_used = 0, text_used = 0;
+        long rounds = messages / batch;
+        long checksum = 0;
+        double t0, enc_bin, enc_text, route_bin, route_text;
+
+        if (bin == NULL || text == NULL) {
+            perror("malloc");
+            return 1;
+        }
+
+        t0 = now_sec();
+        for (long r = 0; r < rounds; r++) {
+            bin_used = 0;
+            for (long k = 0; k < batch; k++) {
+                bin_used += chat_encode(bin + bin_used, CHAT_MSG_CHAT, 0, (uint16_t)(k & 7), 42,
+                                        r * batch + k, 1700000000000000ull + k, payload, len);
+            }
+        }
+        enc_bin = now_sec() - t0;
+
+        t0 = now_sec();
+        for (long r = 0; r < rounds; r++) {
+            text_used = 0;
+            for (long k = 0; k < batch; k++) {
+                text_used += text_encode(text + text_used, CHAT_MSG_CHAT, 0, (int)(k & 7), 42,
+                                         r * batch + k, 1700000000000000ull + k, payload, len);
+            }
+        }
+        enc_text = now_sec() - t0;
+
+        t0 = now_sec();
+        for (long r = 0; r < rounds; r++) {
+            size_t off = 0, payload_off, payload_len;
+            ssize_t n;
+            while ((n = chat_frame_parse(bin + off, bin_used - off, &payload_off, &payload_len)) > 0) {
+                checksum += chat_type(bin + off) + chat_room(bin + off);
+                off += n;
+            }
+        }
+        route_bin = now_sec() - t0;
+
+        t0 = now_sec();
+        for (long r = 0; r < rounds; r++) {
+            size_t off = 0, n;
+            int type, room;
+            while ((n = text_route(text + off, text_used - off, &type, &room)) > 0) {
+                checksum += type + room;
+                off += n;
+            }
+        }
+        route_text = now_sec() - t0;
+
+        double per = 1e9 / (double)(rounds * batch);
+        printf("%-8zu %-6s %10.1f %12.1f %12.1f\n", len, "binary", (double)bin_used / batch, enc_bin * per, route_bin * per);
+        printf("%-8zu %-6s %10.1f %12.1f %12.1f\n", len, "text", (double)text_used / batch, enc_text * per, route_text * per);
+        if (checksum == 0) printf("(checksum %ld)\n", checksum); // Keep the routing loops alive
+
+        free(bin);
+        free(text);
+    }
+    return 0;
+}
@@ -0,0 +1,373 @@
+/**
+ * @file bench_micro.c
+ * @brief Microbenchmarks of the server's hot paths, without a network, reported as JSON.
+ *
+ * Each benchmark runs one operation in a loop: the iteration count is doubled until a
+ * run takes at least --min-time seconds, then that many iterations are repeated --reps
+ * times and the fastest and the median run are reported in nanoseconds per operation.
+ *   frame_parse/N      chat_frame_parse() over back-to-back frames with N-byte payloads
+ *   buf_alloc/N        out_buf_new() + out_buf_release() of an N-byte message body, in
+ *                      batches of 64; the server has no message pool, bodies come from malloc
+ *   outq/N             outq_push() of an N-byte message, flushed every 64 messages into
+ *                      an in-memory sink that copies what it is given, like a socket would
+ *   fanout/N           one broadcast to N in-memory sinks the way broadcast_local() does
+ *                      it: a shared body plus a per-recipient header, then a
+ *                      flush of every sink
+ *   fanout_encode/N    the same broadcast encoding a whole frame per recipient, for comparison
+ *   dedup/in_order     dedup_check_and_set() on new ids: the retransmit filter every CHAT
+ *   dedup/retransmits  ...and on a stream where one id in eight is a resend
+ *   presence/timeout   presence_timeout_ms() with every user typing: the event loop's
+ *                      next-deadline computation, a scan of all users (there is no timer wheel)
+ *   presence/tick      presence_set() typing for one user, with a presence_tick() every 64
+ *   recent/append      recent_cache_append() of a 64-byte chat frame
+ *   recent/lookup      recent_cache_lookup() of a full room (a join served from memory)
+ *
+ * Build: make bench        (or: gcc -O2 -Wall -I.. -o bench_micro bench_micro.c ../outq.c
+ *                           ../presence.c ../recent_cache.c)
+ * Run:   ./bench_micro [--filter SUBSTRING] [--min-time SEC] [--reps N] > results.json
+ * Progress goes to stderr, the JSON document to stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chat_protocol.h"
+#include "dedup.h"
+#include "outq.h"
+#include "presence.h"
+#include "recent_cache.h"
+
+#define DEFAULT_MIN_TIME 0.1
+#define DEFAULT_REPS     5
+#define BATCH            64        // Messages per flush / allocations per batch
+#define SINK_BYTES       (256 * 1024)
+#define MAX_FANOUT       1000
+#define PRESENCE_USERS   64        // MAX_USERS in the server
+
+struct bench {
+    const char *name;
+    const char *component;
+    long arg;                           // Payload size or fan-out
+    void (*run)(long arg, long iters);  // Performs iters operations
+    long items;                         // Deliveries per operation (fan-out), 1 otherwise
+};
+
+// Results nobody looks at, so the compiler cannot drop the work
+static volatile uint64_t sink_total;
+static uint8_t sink_buf[SINK_BYTES];
+static char payload[CHAT_MAX_PAYLOAD];
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// outq_writev_fn standing in for a socket with room for everything: copies and accepts it all
+static ssize_t sink_writev(void *ctx, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    (void)ctx;
+
+    for (int k = 0; k < iovcnt; k++) {
+        size_t off = 0;
+        while (off < iov[k].iov_len) {
+            size_t n = iov[k].iov_len - off < SINK_BYTES ? iov[k].iov_len - off : SINK_BYTES;
+            memcpy(sink_buf, (const char *)iov[k].iov_base + off, n);
+            off += n;
+        }
+        total += iov[k].iov_len;
+    }
+    sink_total += total;
+    return (ssize_t)total;
+}
+
+// --- framing parser ---
+
+static void run_frame_parse(long size, long iters) {
+    static uint8_t buf[64 * 1024];
+    size_t used = 0, off = 0, payload_off = 0, payload_len = 0;
+    uint64_t sum = 0;
+
+    while (used + CHAT_HEADER_LEN + CHAT_VARINT_MAX + size <= sizeof buf) {
+        used += chat_encode(buf + used, CHAT_MSG_CHAT, 0, 0, 42, used, 0, payload, size);
+    }
+    for (long i = 0; i < iters; i++) {
+        ssize_t n = chat_frame_parse(buf + off, used - off, &payload_off, &payload_len);
+        sum += chat_room(buf + off) + payload_len;
+        off += n;
+        if (off >= used) off = 0;
+    }
+    sink_total += sum;
+}
+
+// --- message bodies ---
+
+static void run_buf_alloc(long size, long iters) {
+    struct out_buf *bufs[BATCH];
+
+    for (long i = 0; i < iters; i += BATCH) {
+        int n = iters - i < BATCH ? (int)(iters - i) : BATCH;
+        for (int k = 0; k < n; k++) {
+            bufs[k] = out_buf_new(payload, size);
+        }
+        for (int k = 0; k < n; k++) {
+            out_buf_release(bufs[k]);
+        }
+    }
+}
+
+// --- outbound queue ---
+
+static void run_outq(long size, long iters) {
+    struct out_buf *body = out_buf_new(payload, size);
+    struct outq q;
+
+    outq_init(&q);
+    for (long i = 0; i < iters; i++) {
+        outq_push(&q, (enum outq_lane)(i % OUTQ_NUM_LANES), body);
+        if (i % BATCH == BATCH - 1) outq_flush(&q, sink_writev, NULL);
+    }
+    outq_flush(&q, sink_writev, NULL);
+    out_buf_release(body);
+}
+
+// --- broadcast fan-out ---
+
+static struct outq fanout_q[MAX_FANOUT];
+
+static void run_fanout(long n, long iters) {
+    uint8_t frame[CHAT_MAX_FRAME];
+    size_t len;
+
+    for (long r = 0; r < n; r++) outq_init(&fanout_q[r]);
+    for (long i = 0; i < iters; i++) {
+        struct out_buf *body;
+
+        len = chat_encode(frame, CHAT_MSG_CHAT, 0, 0, 42, i, 0, payload, 64);
+        if ((body = out_buf_new((const char *)frame + CHAT_HEADER_LEN, len - CHAT_HEADER_LEN)) == NULL) return;
+        for (long r = 0; r < n; r++) {
+            outq_push_split(&fanout_q[r], OUTQ_INTERACTIVE, frame, CHAT_HEADER_LEN, body);
+        }
+        out_buf_release(body);
+        for (long r = 0; r < n; r++) {
+            outq_flush(&fanout_q[r], sink_writev, NULL);
+        }
+    }
+}
+
+static void run_fanout_encode(long n, long iters) {
+    uint8_t frame[CHAT_MAX_FRAME];
+
+    for (long r = 0; r < n; r++) outq_init(&fanout_q[r]);
+    for (long i = 0; i < iters; i++) {
+        for (long r = 0; r < n; r++) {
+            size_t len = chat_encode(frame, CHAT_MSG_CHAT, 0, 0, 42, i, 0, payload, 64);
+            outq_push_copy(&fanout_q[r], OUTQ_INTERACTIVE, (const char *)frame, len);
+        }
+        for (long r = 0; r < n; r++) {
+            outq_flush(&fanout_q[r], sink_writev, NULL);
+        }
+    }
+}
+
+// --- retransmit filter ---
+
+static void run_dedup(long resend_every, long iters) {
+    struct dedup_window w;
+    uint64_t seq = 0, fresh = 0;
+
+    dedup_init(&w);
+    for (long i = 0; i < iters; i++) {
+        // A resend repeats an id from a little while ago, as after a lost ACK
+        uint64_t id = resend_every && i % resend_every == 0 && seq > 16 ? seq - 16 : ++seq;
+        fresh += dedup_check_and_set(&w, id);
+    }
+    sink_total += fresh;
+}
+
+// --- presence timers ---
+
+static void presence_setup(void) {
+    static int done;
+    char name[16];
+
+    if (done) return;
+    done = 1;
+    presence_init(PRESENCE_USERS);
+    for (int u = 0; u < PRESENCE_USERS; u++) {
+        snprintf(name, sizeof name, "user%d", u);
+        presence_register(u, name);
+    }
+}
+
+static void ignore_delta(void *ctx, int room_id, const char *line, size_t len) {
+    (void)ctx;
+    sink_total += room_id + len + (uint8_t)line[0];
+}
+
+static void run_presence_timeout(long arg, long iters) {
+    long now = 1000000, wait = 0;
+    (void)arg;
+
+    presence_setup();
+    for (int u = 0; u < PRESENCE_USERS; u++) {
+        presence_set(u, u % 8, PRESENCE_TYPING, now);
+    }
+    for (long i = 0; i < iters; i++) {
+        wait += presence_timeout_ms(now + (i & 1023));
+    }
+    sink_total += wait;
+}
+
+static void run_presence_tick(long arg, long iters) {
+    static long now = 2000000;
+    (void)arg;
+
+    presence_setup();
+    for (long i = 0; i < iters; i++) {
+        presence_set(i % PRESENCE_USERS, 0, (i / PRESENCE_USERS) % 2 ? PRESENCE_ONLINE : PRESENCE_TYPING, now);
+        if (i % BATCH == BATCH - 1) {
+            now += PRESENCE_FLUSH_MS;
+            presence_tick(now, ignore_delta, NULL);
+        }
+    }
+}
+
+// --- recent-history cache ---
+
+static void fill_nothing(void *ctx, int room_id) {
+    (void)ctx;
+    (void)room_id;
+}
+
+static void recent_setup(void) {
+    static int done;
+    struct recent_view view;
+    uint8_t frame[CHAT_MAX_FRAME];
+    size_t len;
+
+    if (done) return;
+    done = 1;
+    recent_cache_init(2, RECENT_DEFAULT_BYTES);
+    // Room 0 for appends, room 1 full for lookups
+    recent_cache_lookup(0, 0, &view, fill_nothing, NULL);
+    recent_cache_lookup(1, 0, &view, fill_nothing, NULL);
+    for (int k = 0; k < RECENT_PER_ROOM; k++) {
+        len = chat_encode(frame, CHAT_MSG_CHAT, 0, 1, k % 8, k + 1, 0, payload, 64);
+        recent_cache_append(1, frame, len);
+    }
+}
+
+static void run_recent_append(long arg, long iters) {
+    static uint64_t seq;
+    uint8_t frame[CHAT_MAX_FRAME];
+    size_t len = chat_encode(frame, CHAT_MSG_CHAT, 0, 0, 42, 0, 0, payload, 64);
+    (void)arg;
+
+    recent_setup();
+    for (long i = 0; i < iters; i++) {
+        chat_set_sequence(frame, ++seq);
+        recent_cache_append(0, frame, len);
+    }
+}
+
+static void run_recent_lookup(long arg, long iters) {
+    struct recent_view view;
+    uint64_t sum = 0;
+    (void)arg;
+
+    recent_setup();
+    for (long i = 0; i < iters; i++) {
+        sum += recent_cache_lookup(1, RECENT_PER_ROOM, &view, fill_nothing, NULL) + view.len;
+    }
+    sink_total += sum;
+}
+
+static const struct bench benches[] = {
+    { "frame_parse/16",    "framing parser", 16,   run_frame_parse, 1 },
+    { "frame_parse/256",   "framing parser", 256,  run_frame_parse, 1 },
+    { "frame_parse/1024",  "framing parser", 1024, run_frame_parse, 1 },
+    { "buf_alloc/64",      "message bodies", 64,   run_buf_alloc, 1 },
+    { "buf_alloc/1024",    "message bodies", 1024, run_buf_alloc, 1 },
+    { "outq/64",           "outbound queue", 64,   run_outq, 1 },
+    { "outq/1024",         "outbound queue", 1024, run_outq, 1 },
+    { "fanout/1",          "broadcast fan-out", 1,    run_fanout, 1 },
+    { "fanout/10",         "broadcast fan-out", 10,   run_fanout, 10 },
+    { "fanout/100",        "broadcast fan-out", 100,  run_fanout, 100 },
+    { "fanout/1000",       "broadcast fan-out", 1000, run_fanout, 1000 },
+    { "fanout_encode/10",  "broadcast fan-out", 10,   run_fanout_encode, 10 },
+    { "fanout_encode/100", "broadcast fan-out", 100,  run_fanout_encode, 100 },
+    { "dedup/in_order",    "retransmit filter", 0, run_dedup, 1 },
+    { "dedup/retransmits", "retransmit filter", 8, run_dedup, 1 },
+    { "presence/timeout",  "presence timers", 0, run_presence_timeout, 1 },
+    { "presence/tick",     "presence timers", 0, run_presence_tick, 1 },
+    { "recent/append",     "recent-history cache", 0, run_recent_append, 1 },
+    { "recent/lookup",     "recent-history cache", 0, run_recent_lookup, 1 },
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double time_run(const struct bench *b, long iters) {
+    double t0 = now_sec();
+    b->run(b->arg, iters);
+    return now_sec() - t0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL;
+    double min_time = DEFAULT_MIN_TIME;
+    int reps = DEFAULT_REPS, first = 1;
+
+    for (int k = 1; k < argc; k++) {
+        if (strcmp(argv[k], "--filter") == 0 && k + 1 < argc) {
+            filter = argv[++k];
+        } else if (strcmp(argv[k], "--min-time") == 0 && k + 1 < argc) {
+            min_time = atof(argv[++k]);
+        } else if (strcmp(argv[k], "--reps") == 0 && k + 1 < argc) {
+            reps = atoi(argv[++k]);
+        } else {
+            fprintf(stderr, "Usage: %s [--filter SUBSTRING] [--min-time SEC] [--reps N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (reps < 1) reps = 1;
+    memset(payload, 'x', sizeof payload);
+
+    printf("{\n  \"suite\": \"bench_micro\",\n  \"min_time_sec\": %g,\n  \"repetitions\": %d,\n"
+           "  \"results\": [", min_time, reps);
+    for (size_t k = 0; k < sizeof benches / sizeof benches[0]; k++) {
+        const struct bench *b = &benches[k];
+        double *ns = malloc(reps * sizeof *ns);
+        long iters = 1;
+
+        if (filter != NULL && strstr(b->name, filter) == NULL) {
+            free(ns);
+            continue;
+        }
+        if (ns == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        // Calibrate: double the iteration count until one run is long enough to time
+        while (time_run(b, iters) < min_time && iters < (1L << 40)) {
+            iters *= 2;
+        }
+        for (int r = 0; r < reps; r++) {
+            ns[r] = time_run(b, iters) * 1e9 / iters;
+        }
+        qsort(ns, reps, sizeof *ns, cmp_double);
+        fprintf(stderr, "%-20s %12.1f ns/op (min %.1f)\n", b->name, ns[reps / 2], ns[0]);
+        printf("%s\n    { \"name\": \"%s\", \"component\": \"%s\", \"iterations\": %ld, \"items_per_op\": %ld,"
+               " \"ns_per_op_min\": %.2f, \"ns_per_op_median\": %.2f, \"ops_per_sec\": %.0f }",
+               first ? "" : ",", b->name, b->component, iters, b->items, ns[0], ns[reps / 2],
+               ns[reps / 2] > 0 ? 1e9 / ns[reps / 2] : 0.0);
+        first = 0;
+        free(ns);
+    }
+    printf("\n  ],\n  \"checksum\": %llu\n}\n", (unsigned long long)sink_total);
+    return 0;
+}
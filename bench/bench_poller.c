@@ -0,0 +1,317 @@
+/**
+ * @file bench_poller.c
+ * @brief Conformance checks and wakeup cost for every poller.h backend.
+ *
+ * First every backend compiled in runs the same checks: timeouts, level-triggered
+ * readiness, adding and removing write interest, unregistering, hangups, a descriptor
+ * number reused after close, and only the written descriptors being reported out of
+ * many. Then, for each descriptor count, N eventfds are registered for reading and the
+ * benchmark repeatedly makes one of them readable, waits, and drains it. That is one
+ * wakeup of the server loop with N idle connections; select() and poll() pay for every
+ * registered descriptor on each wait, epoll and io_uring only for the ready one.
+ *
+ * Counts that need more descriptors than RLIMIT_NOFILE allows are skipped (raise it with
+ * `ulimit -n` first), as are counts that do not fit select()'s FD_SETSIZE.
+ *
+ * Last, wakeup latency: another thread writes a timestamp to a socket at random
+ * intervals while the loop waits on it, first with plain blocking waits and then in
+ * busy-poll mode, and the benchmark reports the latency percentiles and CPU time of
+ * both. Busy polling wants a core for the spinning thread; with a single CPU the
+ * writer has to preempt the spinner, which eats into the gain.
+ *
+ * Build: gcc -O2 -Wall -pthread -I.. -o bench_poller bench_poller.c ../poller.c
+ * Run:   ./bench_poller [fd counts...]     (default: 10 1000 100000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+
+#include "poller.h"
+
+#define FD_SLACK      16 // Descriptors needed besides the benchmark's own
+#define MANY_FDS      100
+#define LATENCY_SAMPLES 5000
+#define BUSY_BUDGET_US  200 // Spin budget for the busy-poll latency runs
+#define MAX_GAP_US      150 // Writer pauses up to this long between messages
+
+static int failures = 0;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(const char *backend, const char *what, int ok) {
+    printf("  %-9s %-44s %s\n", backend, what, ok ? "ok" : "FAIL");
+    if (!ok) failures++;
+}
+
+// Events reported for fd by the last wait, 0 if it was not reported
+static int events_for(const struct poller *p, int fd) {
+    for (int k = 0; k < p->num_ready; k++) {
+        if (p->ready[k].fd == fd) return p->ready[k].events;
+    }
+    return 0;
+}
+
+static void conformance(enum poller_backend backend) {
+    const char *name = poller_backend_name(backend);
+    struct poller *p = poller_create(backend);
+    int sv[2], many[MANY_FDS];
+    char buf[64];
+    double t0;
+    int n;
+
+    if (p == NULL) {
+        check(name, "create", 0);
+        return;
+    }
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+
+    t0 = now_sec();
+    n = poller_wait(p, 50);
+    check(name, "empty wait times out", n == 0 && now_sec() - t0 >= 0.045);
+
+    poller_add(p, sv[0], POLLER_IN);
+    check(name, "idle socket not reported", poller_wait(p, 0) == 0);
+    write(sv[1], "x", 1);
+    n = poller_wait(p, 1000);
+    check(name, "readable socket reported", n == 1 && events_for(p, sv[0]) == POLLER_IN);
+    n = poller_wait(p, 1000);
+    check(name, "still readable: reported again", n == 1 && events_for(p, sv[0]) == POLLER_IN);
+    read(sv[0], buf, sizeof buf);
+
+    poller_mod(p, sv[0], POLLER_IN | POLLER_OUT);
+    n = poller_wait(p, 1000);
+    check(name, "write interest reports POLLER_OUT", n == 1 && events_for(p, sv[0]) == POLLER_OUT);
+    poller_mod(p, sv[0], POLLER_IN);
+    check(name, "write interest removed", poller_wait(p, 20) == 0);
+
+    poller_del(p, sv[0]);
+    write(sv[1], "x", 1);
+    check(name, "unregistered socket not reported", poller_wait(p, 20) == 0 && p->count == 0);
+    check(name, "removing twice fails", poller_del(p, sv[0]) == -1 && errno == ENOENT);
+
+    poller_add(p, sv[0], POLLER_IN);
+    read(sv[0], buf, sizeof buf);
+    close(sv[1]);
+    n = poller_wait(p, 1000);
+    check(name, "hangup reported as readable", n == 1 && (events_for(p, sv[0]) & POLLER_IN));
+    check(name, "...and read returns 0", read(sv[0], buf, sizeof buf) == 0);
+
+    // The same descriptor number comes back for the next socket
+    poller_del(p, sv[0]);
+    close(sv[0]);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    poller_add(p, sv[0], POLLER_IN);
+    check(name, "reused descriptor starts idle", poller_wait(p, 20) == 0);
+    write(sv[1], "y", 1);
+    n = poller_wait(p, 1000);
+    check(name, "reused descriptor reported", n == 1 && events_for(p, sv[0]) == POLLER_IN);
+    poller_del(p, sv[0]);
+
+    for (int k = 0; k < MANY_FDS; k++) {
+        many[k] = eventfd(0, EFD_NONBLOCK);
+        poller_add(p, many[k], POLLER_IN);
+    }
+    for (int k = 7; k < MANY_FDS; k += 40) {
+        uint64_t one = 1;
+        write(many[k], &one, sizeof one);
+    }
+    n = poller_wait(p, 1000);
+    check(name, "only written descriptors reported", n == 3 && events_for(p, many[7]) && events_for(p, many[47])
+          && events_for(p, many[87]) && !events_for(p, many[8]));
+    for (int k = 0; k < MANY_FDS; k++) {
+        poller_del(p, many[k]);
+        close(many[k]);
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    poller_free(p);
+}
+
+static void wakeup_cost(enum poller_backend backend, int nfds, long limit) {
+    const char *name = poller_backend_name(backend);
+    int iterations = nfds <= 1000 ? 100000 : 2000;
+    struct poller *p;
+    int *fds;
+    double t0, setup, elapsed;
+
+    if (nfds + FD_SLACK > limit) {
+        printf("  %-9s %7d fds   skipped: RLIMIT_NOFILE is %ld\n", name, nfds, limit);
+        return;
+    }
+    if (backend == POLLER_SELECT && nfds + FD_SLACK > FD_SETSIZE) {
+        printf("  %-9s %7d fds   skipped: more than FD_SETSIZE (%d)\n", name, nfds, FD_SETSIZE);
+        return;
+    }
+    if ((p = poller_create(backend)) == NULL || (fds = malloc(nfds * sizeof *fds)) == NULL) {
+        failures++;
+        return;
+    }
+
+    t0 = now_sec();
+    for (int k = 0; k < nfds; k++) {
+        if ((fds[k] = eventfd(0, EFD_NONBLOCK)) == -1 || poller_add(p, fds[k], POLLER_IN) == -1) {
+            perror("eventfd / poller_add");
+            exit(1);
+        }
+    }
+    setup = now_sec() - t0;
+    poller_wait(p, 0); // Lets io_uring submit its poll requests before timing starts
+
+    t0 = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        int fd = fds[(int)((i * 7919L) % nfds)];
+        uint64_t value = 1;
+        write(fd, &value, sizeof value);
+        if (poller_wait(p, -1) != 1 || events_for(p, fd) != POLLER_IN) {
+            fprintf(stderr, "%s: wrong wakeup at iteration %d\n", name, i);
+            failures++;
+            break;
+        }
+        read(fd, &value, sizeof value);
+    }
+    elapsed = now_sec() - t0;
+
+    printf("  %-9s %7d fds %10.0f ns/wakeup   (register: %.0f ns/fd)\n", name, nfds,
+           elapsed / iterations * 1e9, setup / nfds * 1e9);
+    for (int k = 0; k < nfds; k++) {
+        close(fds[k]);
+    }
+    free(fds);
+    poller_free(p);
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double cpu_sec(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void *latency_writer(void *arg) {
+    int fd = *(int *)arg;
+    unsigned seed = 12345;
+
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        struct timespec gap = { 0, (long)(rand_r(&seed) % MAX_GAP_US + 1) * 1000 };
+        long long t;
+        nanosleep(&gap, NULL);
+        t = now_ns();
+        if (write(fd, &t, sizeof t) != sizeof t) break;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Measure write-to-wakeup latency with the given spin budget.
+ * @return p99 in nanoseconds, or -1 on error.
+ */
+static long long wakeup_latency(enum poller_backend backend, long busy_us) {
+    static long long samples[LATENCY_SAMPLES];
+    struct poller *p = poller_create(backend);
+    pthread_t writer;
+    int sv[2], n = 0;
+    double cpu0, t0;
+
+    if (p == NULL || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        failures++;
+        return -1;
+    }
+    poller_add(p, sv[0], POLLER_IN);
+    poller_set_busy_poll(p, busy_us);
+    cpu0 = cpu_sec();
+    t0 = now_sec();
+    pthread_create(&writer, NULL, latency_writer, &sv[1]);
+
+    while (n < LATENCY_SAMPLES) {
+        long long woke, sent;
+        if (poller_wait(p, 1000) <= 0) break;
+        woke = now_ns();
+        if (read(sv[0], &sent, sizeof sent) != sizeof sent) break;
+        samples[n++] = woke - sent;
+    }
+    pthread_join(writer, NULL);
+    qsort(samples, n, sizeof samples[0], cmp_ll);
+
+    printf("  %-9s %-10s p50 %7.1f us  p99 %7.1f us  p99.9 %7.1f us  CPU %3.0f%%", poller_backend_name(backend),
+           busy_us > 0 ? "busy-poll" : "blocking", samples[n / 2] / 1e3, samples[n * 99 / 100] / 1e3,
+           samples[n * 999 / 1000] / 1e3, (cpu_sec() - cpu0) / (now_sec() - t0) * 100);
+    if (busy_us > 0) printf("  (%lu spin hits, %lu blocked)", p->spin_hits, p->spin_misses);
+    printf("\n");
+
+    close(sv[0]);
+    close(sv[1]);
+    poller_free(p);
+    return n == LATENCY_SAMPLES ? samples[n * 99 / 100] : -1;
+}
+
+int main(int argc, char *argv[]) {
+    static const int default_counts[] = { 10, 1000, 100000 };
+    struct rlimit rl;
+    int available[POLLER_NUM_BACKENDS], num_available = 0;
+
+    // Use every descriptor we are allowed
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+
+    for (int b = 0; b < POLLER_NUM_BACKENDS; b++) {
+        if (poller_parse_backend(poller_backend_name(b)) == b) {
+            available[num_available++] = b;
+        }
+    }
+
+    printf("Conformance:\n");
+    for (int k = 0; k < num_available; k++) {
+        conformance(available[k]);
+    }
+
+    printf("\nWakeup cost (one ready descriptor among N registered):\n");
+    for (int i = 0; i < (argc > 1 ? argc - 1 : 3); i++) {
+        int nfds = argc > 1 ? atoi(argv[i + 1]) : default_counts[i];
+        for (int k = 0; k < num_available; k++) {
+            wakeup_cost(available[k], nfds, (long)rl.rlim_cur);
+        }
+    }
+
+    printf("\nWakeup latency, blocking vs busy-poll (%d us budget), %ld CPU(s):\n", BUSY_BUDGET_US,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    for (int k = 0; k < num_available; k++) {
+        long long blocking = wakeup_latency(available[k], 0);
+        long long busy = wakeup_latency(available[k], BUSY_BUDGET_US);
+        if (blocking > 0 && busy > 0) {
+            printf("  %-9s p99 %s by %.1f us (%.0f%%)\n", poller_backend_name(available[k]),
+                   busy <= blocking ? "improved" : "WORSE", (blocking > busy ? blocking - busy : busy - blocking) / 1e3,
+                   (double)(blocking - busy) / blocking * 100);
+        }
+    }
+
+    if (failures > 0) {
+        printf("\n%d check(s) FAILED\n", failures);
+        return 1;
+    }
+    return 0;
+}
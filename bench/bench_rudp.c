@@ -0,0 +1,331 @@
+/**
+ * @file bench_rudp.c
+ * @brief rudp.h over a lossy loopback link: message latency with one ordering for
+ * everything (what a TCP connection gives) versus one ordering per room.
+ *
+ * Three threads: a server that accepts one connection the way chat_server_select
+ * does (rudp_next_hello(), rudp_open()) and sends it CHAT frames at a steady rate,
+ * round robin over the rooms; a client that receives them through a proxy and checks
+ * that every room's frames arrive complete and in order; and the proxy, which works
+ * like netem on both directions: each datagram is dropped with the given probability
+ * and the rest are held back for the given one-way delay. A TCP connection cannot be
+ * put through a user-space proxy like that (it would only see the proxy's own, loss-
+ * free connections), so the total order a TCP connection imposes is measured the same
+ * way instead: the same transport with everything on one stream.
+ *
+ * The latency of a frame is from the moment the server generated it to the moment the
+ * client read it, so time spent waiting for the congestion window, the pacer, a
+ * retransmission or an earlier frame of the same ordering all counts. The tail (p99) is
+ * the lost frames themselves, which wait for their retransmission either way; what the
+ * ordering changes is how many other frames wait with them (mean, p50, p90).
+ *
+ * Build: gcc -O2 -Wall -pthread -I.. -o bench_rudp bench_rudp.c ../rudp.c
+ * Run:   ./bench_rudp [messages [per_second [delay_ms]]]   (default: 5000 500 20)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rudp.h"
+
+#define DEFAULT_MESSAGES 5000
+#define DEFAULT_RATE     500   // Messages per second
+#define DEFAULT_DELAY_MS 20    // One way, so the round trip is twice this
+#define ROOMS            8
+#define PAYLOAD_LEN      100
+#define PROXY_QUEUE      8192  // Datagrams held back by the proxy; beyond that they are dropped
+#define RUN_TIMEOUT_S    60
+
+struct proxied {
+    uint64_t release_us;
+    int to_server;
+    uint16_t len;
+    uint8_t data[RUDP_MTU];
+};
+
+struct run {
+    int messages, rate, per_room;
+    double loss;
+    uint64_t delay_us;
+    struct sockaddr_in server_addr, proxy_addr;
+    int listen_fd, proxy_fd;
+    volatile int stop;
+    struct rudp_stats server_stats;
+    uint64_t *latency_us;
+    uint64_t elapsed_us;        // From connecting to the last frame received
+    int received, out_of_order;
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static int bind_loopback(int type, struct sockaddr_in *addr) {
+    socklen_t len = sizeof *addr;
+    int fd = socket(AF_INET, type, 0), one = 1;
+
+    memset(addr, 0, sizeof *addr);
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    // As setup_listener() does: rudp_open() binds every client's socket to the same port
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1 || bind(fd, (struct sockaddr *)addr, sizeof *addr) == -1
+            || getsockname(fd, (struct sockaddr *)addr, &len) == -1) {
+        perror("bind loopback");
+        exit(1);
+    }
+    return fd;
+}
+
+// --- The lossy link ---
+
+static void *proxy(void *arg) {
+    struct run *r = arg;
+    struct proxied *queue = calloc(PROXY_QUEUE, sizeof *queue);
+    struct sockaddr_in client_addr, from;
+    int front = r->proxy_fd, back = socket(AF_INET, SOCK_DGRAM, 0);
+    int head = 0, tail = 0, have_client = 0;
+    unsigned int seed = 12345;
+
+    if (queue == NULL || connect(back, (struct sockaddr *)&r->server_addr, sizeof r->server_addr) == -1) {
+        perror("proxy");
+        exit(1);
+    }
+    while (!r->stop) {
+        struct pollfd pfd[2] = { { front, POLLIN, 0 }, { back, POLLIN, 0 } };
+        uint64_t now = now_us();
+        int timeout = 10;
+
+        // Release what has been delayed long enough, in order
+        while (head != tail && queue[head].release_us <= now) {
+            struct proxied *d = &queue[head];
+            if (d->to_server) send(back, d->data, d->len, 0);
+            else if (have_client) sendto(front, d->data, d->len, 0, (struct sockaddr *)&client_addr, sizeof client_addr);
+            head = (head + 1) % PROXY_QUEUE;
+        }
+        if (head != tail) timeout = (int)((queue[head].release_us - now + 999) / 1000);
+        if (poll(pfd, 2, timeout) <= 0) continue;
+
+        for (int k = 0; k < 2; k++) {
+            for (;;) {
+                socklen_t from_len = sizeof from;
+                struct proxied *d = &queue[tail];
+                ssize_t n = recvfrom(pfd[k].fd, d->data, sizeof d->data, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+
+                if (n < 0) break;
+                if (k == 0) {
+                    client_addr = from;
+                    have_client = 1;
+                }
+                if ((double)rand_r(&seed) / RAND_MAX < r->loss || (tail + 1) % PROXY_QUEUE == head) continue;
+                d->to_server = k == 0;
+                d->len = (uint16_t)n;
+                d->release_us = now_us() + r->delay_us;
+                tail = (tail + 1) % PROXY_QUEUE;
+            }
+        }
+    }
+    close(back);
+    free(queue);
+    return NULL;
+}
+
+// --- Server: one connection, CHAT frames at a steady rate ---
+
+static void *server(void *arg) {
+    struct run *r = arg;
+    struct rudp_hello hello;
+    struct rudp_conn *c = NULL;
+    uint8_t frames[64 * CHAT_MAX_FRAME], payload[PAYLOAD_LEN];
+    uint64_t room_seq[ROOMS] = { 0 }, started = 0;
+    size_t frames_len = 0, frames_off = 0;
+    int generated = 0, fd = -1;
+
+    memset(payload, 'x', sizeof payload);
+    while (!r->stop && c == NULL) {
+        struct pollfd pfd = { r->listen_fd, POLLIN, 0 };
+        poll(&pfd, 1, 100);
+        if (rudp_next_hello(r->listen_fd, &hello) == 1 && (fd = rudp_open(&hello)) != -1) {
+            c = rudp_new(fd, RUDP_SERVER | (r->per_room ? RUDP_PER_ROOM : 0));
+        }
+    }
+    started = now_us();
+    while (!r->stop && c != NULL) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        uint64_t now = now_us(), due = (now - started) * r->rate / 1000000u;
+        int timeout = rudp_timeout_ms(c);
+        uint8_t discard[256];
+        ssize_t n;
+
+        // Frame what is due; whatever the transport does not take waits here
+        if (frames_off == frames_len) frames_off = frames_len = 0;
+        while (generated < r->messages && (uint64_t)generated < due && frames_len + CHAT_MAX_FRAME <= sizeof frames) {
+            int room = generated % ROOMS;
+            frames_len += chat_encode(frames + frames_len, CHAT_MSG_CHAT, 0, room, 0, ++room_seq[room],
+                                      started + (uint64_t)generated * 1000000u / r->rate, payload, sizeof payload);
+            generated++;
+        }
+        if (frames_off < frames_len) {
+            struct iovec iov = { frames + frames_off, frames_len - frames_off };
+            if ((n = rudp_writev(c, &iov, 1)) > 0) frames_off += n;
+        }
+        if (rudp_flush(c) == -1) break;
+
+        if (generated < r->messages) {
+            uint64_t next = started + (uint64_t)(generated + 1) * 1000000u / r->rate;
+            int gen_wait = next > now ? (int)((next - now + 999) / 1000) : 0;
+            if (gen_wait < timeout) timeout = gen_wait;
+        }
+        if (frames_off < frames_len && timeout > 1) timeout = 1;
+        if (timeout > 100) timeout = 100; // Notice r->stop soon enough
+        poll(&pfd, 1, timeout);
+        // Only ACKs come back; the client hanging up ends the run
+        while ((n = rudp_read(c, discard, sizeof discard)) > 0) {
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN)) break;
+    }
+    if (c != NULL) {
+        rudp_get_stats(c, &r->server_stats);
+        rudp_free(c);
+        close(fd);
+    }
+    return NULL;
+}
+
+// --- Client ---
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run_once(struct run *r) {
+    static uint8_t buf[64 * 1024];
+    pthread_t proxy_thread, server_thread;
+    struct rudp_conn *c;
+    uint64_t next_seq[ROOMS], deadline;
+    size_t len = 0;
+    int fd;
+
+    r->stop = 0;
+    r->received = r->out_of_order = 0;
+    memset(&r->server_stats, 0, sizeof r->server_stats);
+    for (int k = 0; k < ROOMS; k++) next_seq[k] = 1;
+
+    r->listen_fd = bind_loopback(SOCK_DGRAM, &r->server_addr);
+    r->proxy_fd = bind_loopback(SOCK_DGRAM, &r->proxy_addr);
+    if (rudp_listen(r->listen_fd) == -1) exit(1);
+    pthread_create(&proxy_thread, NULL, proxy, r);
+    pthread_create(&server_thread, NULL, server, r);
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (connect(fd, (struct sockaddr *)&r->proxy_addr, sizeof r->proxy_addr) == -1) {
+        perror("connect proxy");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c = rudp_new(fd, 0);
+    if (c == NULL || rudp_connect(c) == -1) {
+        perror("rudp_connect");
+        exit(1);
+    }
+
+    r->elapsed_us = now_us();
+    deadline = r->elapsed_us + RUN_TIMEOUT_S * 1000000u;
+    while (r->received < r->messages && now_us() < deadline) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        ssize_t n;
+
+        poll(&pfd, 1, rudp_pending(c) > 0 ? 0 : rudp_timeout_ms(c));
+        while ((n = rudp_read(c, buf + len, sizeof buf - len)) > 0) {
+            size_t start = 0, payload_off, payload_len;
+            ssize_t frame_len;
+            uint64_t now = now_us();
+
+            len += n;
+            while ((frame_len = chat_frame_parse(buf + start, len - start, &payload_off, &payload_len)) > 0) {
+                const uint8_t *f = buf + start;
+                int room = chat_room(f) % ROOMS;
+
+                if (chat_sequence(f) != next_seq[room]) r->out_of_order++;
+                next_seq[room] = chat_sequence(f) + 1;
+                if (r->received < r->messages) r->latency_us[r->received++] = now - chat_timestamp(f);
+                start += frame_len;
+            }
+            memmove(buf, buf + start, len - start);
+            len -= start;
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN) || rudp_flush(c) == -1) break;
+    }
+    r->elapsed_us = now_us() - r->elapsed_us;
+    rudp_free(c);
+    close(fd);
+    // The server stops when the CLOSE reaches it; the flag is for a CLOSE the proxy dropped
+    usleep(2 * r->delay_us + 50000);
+    r->stop = 1;
+    pthread_join(server_thread, NULL);
+    pthread_join(proxy_thread, NULL);
+    close(r->listen_fd);
+    close(r->proxy_fd);
+    return r->received == r->messages && r->out_of_order == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    static const double losses[] = { 0.0, 0.01, 0.05 };
+    struct run r;
+
+    memset(&r, 0, sizeof r);
+    r.messages = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+    r.rate = argc > 2 ? atoi(argv[2]) : DEFAULT_RATE;
+    r.delay_us = (uint64_t)(argc > 3 ? atoi(argv[3]) : DEFAULT_DELAY_MS) * 1000u;
+    if (r.messages <= 0 || r.rate <= 0) {
+        fprintf(stderr, "Usage: %s [messages [per_second [delay_ms]]]\n", argv[0]);
+        return 1;
+    }
+    r.latency_us = malloc(r.messages * sizeof *r.latency_us);
+    if (r.latency_us == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%d messages of %d bytes, %d/s over %d rooms, %.1f ms one-way delay\n\n",
+           r.messages, PAYLOAD_LEN, r.rate, ROOMS, r.delay_us / 1000.0);
+    printf("%-5s %-9s %8s %8s %8s %8s %8s %8s %7s %7s %8s %8s\n", "loss", "ordering", "msgs/s", "mean ms",
+           "p50 ms", "p90 ms", "p99 ms", "max ms",
+           "resent", "probes", "timeouts", "srtt ms");
+    for (size_t k = 0; k < sizeof losses / sizeof losses[0]; k++) {
+        for (r.per_room = 0; r.per_room <= 1; r.per_room++) {
+            uint64_t sum = 0;
+            int ok;
+
+            r.loss = losses[k];
+            ok = run_once(&r) == 0;
+            if (r.received == 0) {
+                printf("%4.0f%% %-9s nothing received\n", r.loss * 100, r.per_room ? "per room" : "one");
+                continue;
+            }
+            qsort(r.latency_us, r.received, sizeof *r.latency_us, cmp_u64);
+            for (int m = 0; m < r.received; m++) sum += r.latency_us[m];
+            printf("%4.0f%% %-9s %8.0f %8.2f %8.2f %8.2f %8.2f %8.2f %7lu %7lu %8lu %8.2f%s\n",
+                   r.loss * 100, r.per_room ? "per room" : "one", r.received / (r.elapsed_us / 1e6),
+                   sum / 1000.0 / r.received, r.latency_us[r.received / 2] / 1000.0,
+                   r.latency_us[(size_t)r.received * 9 / 10] / 1000.0,
+                   r.latency_us[(size_t)r.received * 99 / 100] / 1000.0,
+                   r.latency_us[r.received - 1] / 1000.0, r.server_stats.retransmitted, r.server_stats.probes,
+                   r.server_stats.timeouts, r.server_stats.srtt_us / 1000.0,
+                   ok ? "" : "  INCOMPLETE OR OUT OF ORDER");
+        }
+    }
+    free(r.latency_us);
+    return 0;
+}
@@ -0,0 +1,195 @@
+/**
+ * @file bus.c
+ * @brief Shared-memory message bus between pre-forked workers (see bus.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "bus.h"
+
+/**
+ * @brief Map and initialise the bus. Must be called before forking the workers.
+ * @return NULL on error.
+ */
+struct bus *bus_create(int num_workers) {
+    pthread_mutexattr_t attr;
+    struct bus *b;
+
+    if (num_workers < 1 || num_workers > BUS_MAX_WORKERS) {
+        fprintf(stderr, "Worker count must be between 1 and %d\n", BUS_MAX_WORKERS);
+        return NULL;
+    }
+    b = mmap(NULL, sizeof *b, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) {
+        perror("mmap bus");
+        return NULL;
+    }
+    // MAP_ANONYMOUS memory is already zeroed
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&b->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    b->num_workers = num_workers;
+    for (int w = 0; w < num_workers; w++) {
+        if ((b->event_fd[w] = eventfd(0, EFD_NONBLOCK)) == -1) {
+            perror("eventfd");
+            return NULL;
+        }
+    }
+    return b;
+}
+
+void bus_lock(struct bus *b) {
+    if (pthread_mutex_lock(&b->lock) == EOWNERDEAD) {
+        // The holder crashed. Every update below is complete before the next field is
+        // touched, so the state is usable as it is.
+        fprintf(stderr, "[BUS] Recovered lock from a crashed worker\n");
+        pthread_mutex_consistent(&b->lock);
+    }
+}
+
+void bus_unlock(struct bus *b) {
+    pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * @brief Append a frame to the ring and wake every other worker.
+ * @return 0 on success, -1 if the frame is too large.
+ */
+int bus_publish(struct bus *b, int origin, int kind, uint32_t target, const void *frame, size_t len) {
+    struct bus_msg *m;
+    uint64_t one = 1;
+
+    if (len > sizeof m->data) return -1;
+    bus_lock(b);
+    m = &b->slots[b->next_seq % BUS_SLOTS];
+    m->seq = b->next_seq++;
+    m->origin = origin;
+    m->kind = kind;
+    m->target = target;
+    m->len = (uint32_t)len;
+    memcpy(m->data, frame, len);
+    bus_unlock(b);
+
+    for (int w = 0; w < b->num_workers; w++) {
+        if (w != origin && write(b->event_fd[w], &one, sizeof one) == -1 && errno != EAGAIN) {
+            perror("write bus eventfd");
+        }
+    }
+    return 0;
+}
+
+// Where a (re)started worker begins reading: only messages published from now on
+uint64_t bus_cursor(struct bus *b) {
+    uint64_t seq;
+
+    bus_lock(b);
+    seq = b->next_seq;
+    bus_unlock(b);
+    return seq;
+}
+
+/**
+ * @brief Deliver every message published since *cursor by other workers.
+ * Messages are copied out in batches under the lock and delivered without it.
+ * @return Number of messages lost because this worker fell behind the ring.
+ */
+int bus_poll(struct bus *b, int self, uint64_t *cursor, bus_deliver_fn deliver, void *ctx) {
+    static struct bus_msg batch[BUS_BATCH];
+    uint64_t counter;
+    int lost = 0;
+
+    // Reset the wakeup counter first so nothing published after this point is missed
+    if (read(b->event_fd[self], &counter, sizeof counter) == -1 && errno != EAGAIN) {
+        perror("read bus eventfd");
+    }
+
+    for (;;) {
+        int n = 0;
+
+        bus_lock(b);
+        if (b->next_seq - *cursor > BUS_SLOTS) {
+            lost += (int)(b->next_seq - BUS_SLOTS - *cursor);
+            *cursor = b->next_seq - BUS_SLOTS;
+        }
+        while (*cursor < b->next_seq && n < BUS_BATCH) {
+            const struct bus_msg *m = &b->slots[*cursor % BUS_SLOTS];
+            (*cursor)++;
+            if (m->origin == self) continue;
+            memcpy(&batch[n], m, offsetof(struct bus_msg, data) + m->len);
+            n++;
+        }
+        bus_unlock(b);
+
+        if (n == 0) break;
+        for (int k = 0; k < n; k++) {
+            deliver(ctx, &batch[k]);
+        }
+    }
+    if (lost > 0) {
+        fprintf(stderr, "[BUS] Worker %d fell behind and lost %d message(s)\n", self, lost);
+    }
+    return lost;
+}
+
+/**
+ * @brief Find a user by name, adding them if new. Ids never change once assigned.
+ * @return User id, or -1 if the table is full.
+ */
+int bus_register_user(struct bus *b, const char *name) {
+    int id = -1;
+
+    bus_lock(b);
+    for (int u = 0; u < b->num_users; u++) {
+        if (strcmp(b->user_names[u], name) == 0) {
+            id = u;
+            break;
+        }
+    }
+    if (id == -1 && b->num_users < BUS_MAX_USERS) {
+        id = b->num_users;
+        snprintf(b->user_names[id], BUS_NAME_LEN, "%s", name);
+        b->num_users++; // Publish the name only once it is complete
+    }
+    bus_unlock(b);
+    return id;
+}
+
+/**
+ * @brief Record which worker a user is logged in on (owner = worker + 1, 0 to clear).
+ * Claiming a user who is already owned by another worker fails.
+ * @return 0 on success, -1 if another worker owns the user.
+ */
+int bus_set_owner(struct bus *b, int user_id, int owner) {
+    int rv = 0;
+
+    bus_lock(b);
+    if (owner != 0 && b->user_owner[user_id] != 0 && b->user_owner[user_id] != owner) {
+        rv = -1;
+    } else {
+        b->user_owner[user_id] = owner;
+    }
+    bus_unlock(b);
+    return rv;
+}
+
+// Supervisor: a worker exited, so nobody is logged in through it any more
+void bus_worker_died(struct bus *b, int worker) {
+    bus_lock(b);
+    for (int u = 0; u < b->num_users; u++) {
+        if (b->user_owner[u] == worker + 1) {
+            b->user_owner[u] = 0;
+        }
+    }
+    for (int r = 0; r < BUS_MAX_ROOMS; r++) {
+        __atomic_store_n(&b->mcast_rooms[worker][r], 0, __ATOMIC_RELAXED);
+    }
+    bus_unlock(b);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file bus.h
+ * @brief Shared-memory message bus between pre-forked server workers.
+ *
+ * The supervisor maps one struct bus (MAP_SHARED | MAP_ANONYMOUS) before forking, so
+ * every worker, including ones restarted later, sees the same memory. It holds:
+ *   - a ring of BUS_SLOTS messages, each a complete frame plus routing info; a
+ *     publisher copies its frame into the next slot and bumps the eventfd of every
+ *     other worker, which then reads everything past its own cursor
+ *   - the user table, so user ids (and therefore sender_id in frames) mean the same
+ *     thing in every worker, and which worker each user is logged in on
+ *   - each user's window of recently seen message ids, so a retransmit is dropped
+ *     even when the reconnect that carries it lands on another worker. Only the
+ *     worker the user is logged in on touches it, and bus_set_owner() hands it over
+ *   - the per-room message sequence counters
+ *   - which rooms have multicast subscribers on which worker, so that the worker a
+ *     message comes in on can publish it to the group for all of them
+ *
+ * All of it but the sequence counters, the multicast flags and the dedup windows is
+ * guarded by one process-shared robust mutex: a worker that dies while holding it does
+ * not wedge the others. The counters are only ever bumped with an atomic add, which
+ * cannot be left half done, and each worker sets its own multicast flags with atomic
+ * stores. A worker that falls more than BUS_SLOTS messages behind skips ahead and
+ * counts what it lost.
+ */
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "chat_protocol.h"
+#include "dedup.h"
+
+#define BUS_SLOTS       1024 // Messages kept in the ring
+#define BUS_MAX_WORKERS 16
+#define BUS_MAX_USERS   64   // Same as the server's MAX_USERS
+#define BUS_NAME_LEN    32   // Same as the server's MAX_NAME_LEN
+#define BUS_MAX_ROOMS   64   // Same as the server's MAX_ROOMS
+#define BUS_BATCH       32   // Messages copied out per lock acquisition
+
+enum bus_kind {
+    BUS_ROOM = 1, // Deliver the frame to every local member of chat_room(frame)
+    BUS_USER      // Deliver the frame to user `target` if they are connected locally
+};
+
+struct bus_msg {
+    uint64_t seq;
+    int origin;      // Worker that published it
+    int kind;        // enum bus_kind
+    uint32_t target; // User id for BUS_USER
+    uint32_t len;
+    uint8_t data[CHAT_MAX_FRAME];
+};
+
+struct bus {
+    pthread_mutex_t lock;
+    uint64_t next_seq;                      // Sequence of the next message published
+    int num_workers;
+    int event_fd[BUS_MAX_WORKERS];          // Created before fork, inherited by every worker
+    int num_users;
+    char user_names[BUS_MAX_USERS][BUS_NAME_LEN];
+    int user_owner[BUS_MAX_USERS];          // Worker index + 1 while logged in, 0 otherwise
+    struct dedup_window user_seen[BUS_MAX_USERS]; // Message ids seen per user, used by its owner
+    uint64_t room_seq[BUS_MAX_ROOMS];       // Last sequence number given out per room
+    uint8_t mcast_rooms[BUS_MAX_WORKERS][BUS_MAX_ROOMS]; // 1 where the worker has multicast subscribers
+    struct bus_msg slots[BUS_SLOTS];
+};
+
+// Called by the worker for each message read from the bus
+typedef void (*bus_deliver_fn)(void *ctx, const struct bus_msg *msg);
+
+struct bus *bus_create(int num_workers);
+void bus_lock(struct bus *b);
+void bus_unlock(struct bus *b);
+int bus_publish(struct bus *b, int origin, int kind, uint32_t target, const void *frame, size_t len);
+uint64_t bus_cursor(struct bus *b);
+int bus_poll(struct bus *b, int self, uint64_t *cursor, bus_deliver_fn deliver, void *ctx);
+int bus_register_user(struct bus *b, const char *name);
+int bus_set_owner(struct bus *b, int user_id, int owner);
+void bus_worker_died(struct bus *b, int worker);
+
+#endif // BUS_H
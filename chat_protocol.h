@@ -0,0 +1,197 @@
+/**
+ * @file chat_protocol.h
+ * @brief Binary message envelope shared by the server and the client.
+ *
+ * Every message on the wire is one frame:
+ *
+ *   offset  size  field
+ *   0       1     type       (enum chat_msg_type)
+ *   1       1     flags      (CHAT_FLAG_*)
+ *   2       2     room_id
+ *   4       4     sender_id  (user id, CHAT_ANONYMOUS before /login)
+ *   8       8     sequence   (meaning depends on type, see below)
+ *   16      8     timestamp  (microseconds since the Unix epoch)
+ *   24      1-5   payload length, unsigned LEB128 varint
+ *   ...           payload
+ *
+ * All fixed fields are big-endian and sit at fixed offsets, so a receiver can read
+ * any of them straight out of its receive buffer without decoding the rest of the
+ * frame. The accessors below do exactly that; nothing is copied. The server routes
+ * on type and room_id alone and forwards the frame bytes without touching the
+ * payload.
+ *
+ * Sequence field by type:
+ *   CHAT, COMMAND  client -> server: client-assigned message id (echoed back in the ACK)
+ *   CHAT           server -> client: the room's sequence number, assigned by the server
+ *                  when it accepts the message (1, 2, ... per room, kept across restarts)
+ *   ACK            id of the message being acknowledged
+ *   CREDIT         number of message credits granted
+ *   PING, PONG     probe id chosen by the client
+ *   JOINED         the room's last sequence number when the client joined
+ *   NACK           first sequence number of the room's messages to resend; the payload
+ *                  is the last one, as 8 big-endian bytes
+ *   SYNC           the last sequence number published to the multicast group in room_id
+ *
+ * The server replaces the timestamp of a CHAT frame with the time it accepted the
+ * message, and stamps its own frames with the time they were created. A PONG echoes
+ * the sequence and timestamp of the PING it answers, so the client can put whatever
+ * clock it likes in a PING's timestamp; the server never interprets it.
+ */
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define CHAT_HEADER_LEN   24                      // Fixed part of the header
+#define CHAT_VARINT_MAX   5                       // Longest varint for a 32-bit length
+#define CHAT_MAX_PAYLOAD  1024                    // Largest payload a peer has to accept
+#define CHAT_MAX_FRAME    (CHAT_HEADER_LEN + CHAT_VARINT_MAX + CHAT_MAX_PAYLOAD)
+#define CHAT_ANONYMOUS    0xffffffffu             // sender_id of a client that has not logged in
+
+enum chat_msg_type {
+    CHAT_MSG_CHAT = 1,  // Chat text for the room in room_id
+    CHAT_MSG_COMMAND,   // Client -> server: a slash command, payload is the command text
+    CHAT_MSG_NOTICE,    // Server -> client: text to display (replies, errors, DMs, search hits)
+    CHAT_MSG_ACK,       // Server -> client: sequence was accepted
+    CHAT_MSG_PRESENCE,  // Server -> client: coalesced presence delta for room_id
+    CHAT_MSG_CREDIT,    // Client -> server: grant sequence more message credits
+    CHAT_MSG_USER,      // Server -> client: payload is the name of user sender_id
+    CHAT_MSG_JOINED,    // Server -> client: now in room_id, payload is the room name
+    CHAT_MSG_PING,      // Client -> server: answer with a PONG right away
+    CHAT_MSG_PONG,      // Server -> client: echo of a PING's sequence and timestamp
+    CHAT_MSG_NACK,      // Client -> server: resend messages of room_id missed on multicast
+    CHAT_MSG_SYNC       // Server -> multicast group: where room_id's numbering is
+};
+
+#define CHAT_FLAG_ERROR  0x01 // NOTICE reports an error
+#define CHAT_FLAG_REPLAY 0x02 // Replayed from storage (offline queue, search), not live
+
+// --- Fixed-width big-endian loads and stores ---
+
+static inline uint16_t chat_load16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t chat_load32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t chat_load64(const uint8_t *p) {
+    return (uint64_t)chat_load32(p) << 32 | chat_load32(p + 4);
+}
+
+static inline void chat_store16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void chat_store32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline void chat_store64(uint8_t *p, uint64_t v) {
+    chat_store32(p, (uint32_t)(v >> 32));
+    chat_store32(p + 4, (uint32_t)v);
+}
+
+// --- In-place field access on a complete frame ---
+
+static inline uint8_t chat_type(const uint8_t *f) { return f[0]; }
+static inline uint8_t chat_flags(const uint8_t *f) { return f[1]; }
+static inline uint16_t chat_room(const uint8_t *f) { return chat_load16(f + 2); }
+static inline uint32_t chat_sender(const uint8_t *f) { return chat_load32(f + 4); }
+static inline uint64_t chat_sequence(const uint8_t *f) { return chat_load64(f + 8); }
+static inline uint64_t chat_timestamp(const uint8_t *f) { return chat_load64(f + 16); }
+
+static inline void chat_set_flags(uint8_t *f, uint8_t flags) { f[1] = flags; }
+static inline void chat_set_room(uint8_t *f, uint16_t room_id) { chat_store16(f + 2, room_id); }
+static inline void chat_set_sender(uint8_t *f, uint32_t sender_id) { chat_store32(f + 4, sender_id); }
+static inline void chat_set_sequence(uint8_t *f, uint64_t seq) { chat_store64(f + 8, seq); }
+static inline void chat_set_timestamp(uint8_t *f, uint64_t ts) { chat_store64(f + 16, ts); }
+
+/**
+ * @brief Check whether buf starts with a complete frame.
+ * @param payload_off Set to the payload offset within the frame.
+ * @param payload_len Set to the payload length.
+ * @return Total frame length, 0 if more bytes are needed, -1 if the frame is malformed
+ * (over-long varint or payload larger than CHAT_MAX_PAYLOAD).
+ */
+static inline ssize_t chat_frame_parse(const uint8_t *buf, size_t avail,
+                                       size_t *payload_off, size_t *payload_len) {
+    uint32_t len = 0;
+    size_t k;
+
+    for (k = 0; k < CHAT_VARINT_MAX; k++) {
+        uint8_t byte;
+        if (CHAT_HEADER_LEN + k >= avail) return 0;
+        byte = buf[CHAT_HEADER_LEN + k];
+        len |= (uint32_t)(byte & 0x7f) << (7 * k);
+        if (!(byte & 0x80)) break;
+    }
+    if (k == CHAT_VARINT_MAX || len > CHAT_MAX_PAYLOAD) return -1;
+
+    *payload_off = CHAT_HEADER_LEN + k + 1;
+    *payload_len = len;
+    if (*payload_off + len > avail) return 0;
+    return (ssize_t)(*payload_off + len);
+}
+
+/**
+ * @brief Write a frame header. The caller places payload_len payload bytes right after.
+ * @return Header length (CHAT_HEADER_LEN plus the varint).
+ */
+static inline size_t chat_encode_header(uint8_t *buf, uint8_t type, uint8_t flags, uint16_t room_id,
+                                        uint32_t sender_id, uint64_t seq, uint64_t ts, size_t payload_len) {
+    size_t n = CHAT_HEADER_LEN;
+
+    buf[0] = type;
+    buf[1] = flags;
+    chat_store16(buf + 2, room_id);
+    chat_store32(buf + 4, sender_id);
+    chat_store64(buf + 8, seq);
+    chat_store64(buf + 16, ts);
+    do {
+        uint8_t byte = payload_len & 0x7f;
+        payload_len >>= 7;
+        buf[n++] = byte | (payload_len ? 0x80 : 0);
+    } while (payload_len);
+    return n;
+}
+
+/**
+ * @brief Encode a whole frame into buf (at least CHAT_MAX_FRAME bytes).
+ * Payloads longer than CHAT_MAX_PAYLOAD are truncated.
+ * @return Frame length.
+ */
+static inline size_t chat_encode(uint8_t *buf, uint8_t type, uint8_t flags, uint16_t room_id, uint32_t sender_id,
+                                 uint64_t seq, uint64_t ts, const void *payload, size_t len) {
+    size_t n;
+
+    if (len > CHAT_MAX_PAYLOAD) len = CHAT_MAX_PAYLOAD;
+    n = chat_encode_header(buf, type, flags, room_id, sender_id, seq, ts, len);
+    memcpy(buf + n, payload, len);
+    return n + len;
+}
+
+/**
+ * @brief Count the complete frames in a buffer holding back-to-back frames.
+ */
+static inline long chat_count_frames(const uint8_t *buf, size_t len) {
+    size_t off = 0, payload_off, payload_len;
+    long count = 0;
+    ssize_t n;
+
+    while (off < len && (n = chat_frame_parse(buf + off, len - off, &payload_off, &payload_len)) > 0) {
+        off += n;
+        count++;
+    }
+    return count;
+}
+
+#endif // CHAT_PROTOCOL_H
@@ -1,8 +1,45 @@
 /**
  * @file chat_server_select.c
- * @brief A single-process chat server that uses I/O multiplexing (select()) 
- * to handle multiple clients and forward (broadcast) messages between them.
+ * @brief A single-process chat server that uses I/O multiplexing (select() or one of
+ * the other poller.h backends) to handle multiple clients and forward (broadcast)
+ * messages between them. Clients and server speak the binary frame format in chat_protocol.h.
+ *
+ * Build: gcc -Wall -pthread -o chat_server_select chat_server_select.c offline_queue.c \
+ *        history.c compactor.c search_index.c presence.c recent_cache.c outq.c tls.c bus.c \
+ *        poller.c loop_watch.c profiler.c multicast.c rudp.c -rdynamic -lssl -lcrypto -lz -lrt -ldl
+ *
+ * Usage: chat_server_select [--poller select|poll|epoll|io_uring] [--busy-poll USEC]
+ *                           [--workers N] [--tls-cert server.crt --tls-key server.key]
+ *                           [--retain-age SEC] [--retain-count N] [--retain-bytes N]
+ *                           [--compact-rate BYTES_PER_SEC] [--recent-cache BYTES]
+ *                           [--slow-loop USEC] [--stall-timeout MS] [--profile HZ]
+ *                           [--multicast GROUP:PORT [--multicast-if ADDR]] [--udp]
+ * --busy-poll makes the event loop spin for up to USEC microseconds before blocking
+ * and asks the kernel to busy-poll client sockets too (SO_BUSY_POLL): lower wakeup
+ * latency for a dedicated core's worth of CPU.
+ * The --retain-* limits apply to the history of each room; the compactor thread drops
+ * what falls outside them and compresses old history (see compactor.h), reading and
+ * writing at most --compact-rate bytes per second.
+ * A join replays the room's recent messages from an in-memory cache of at most
+ * --recent-cache bytes (see recent_cache.h); "stats" on stdin shows its hit ratio.
+ * Loop iterations taking --slow-loop microseconds or more are captured with what they
+ * did, for "slow" on stdin to print, and a watchdog thread reports on stderr a loop
+ * stuck for over --stall-timeout milliseconds (see loop_watch.h; 0 turns either off).
+ * --profile samples the event loop's stack HZ times per CPU second (99 is a good
+ * start) and writes profile.PID.folded for flame-graph tools on exit (see profiler.h).
+ * With --multicast, clients that ask for it ("/multicast on") get their room's messages
+ * as datagrams sent once to the group, repaired over TCP when lost (see multicast.h);
+ * --multicast-if picks the interface they leave by, e.g. 127.0.0.1 for a loopback test.
+ * --udp also accepts clients over UDP on RUDP_PORT, with a reliable transport that
+ * keeps each room in order on its own (see rudp.h): on a lossy link a lost packet
+ * only holds back the rooms it carried, where TCP holds back everything behind it.
+ * With --workers the process becomes a supervisor for N pre-forked workers (see
+ * run_supervisor()). With a certificate the server also accepts TLS connections on
+ * TLS_PORT. A self-signed pair for testing:
+ *   openssl req -x509 -newkey rsa:2048 -nodes -keyout server.key -out server.crt \
+ *       -days 365 -subj /CN=localhost
  */
+#define _GNU_SOURCE // sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,42 +49,249 @@
 #include <unistd.h>     // Often contains the select definition
 #include <sys/select.h> // Most systems define fd_set and macros here
 #include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/time.h> // For struct timeval (optional, but good practice)
+#include <sys/stat.h> // mkdir() for the offline queue directory
+#include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h> // PR_SET_PDEATHSIG for pre-fork workers
+#endif
+
+#include "offline_queue.h"
+#include "history.h"
+#include "compactor.h"
+#include "search_index.h"
+#include "presence.h"
+#include "recent_cache.h"
+#include "outq.h"
+#include "chat_protocol.h"
+#include "dedup.h"
+#include "tls.h"
+#include "bus.h"
+#include "poller.h"
+#include "loop_watch.h"
+#include "profiler.h"
+#include "multicast.h"
+#include "rudp.h"
 
 // Define some macros 
 #define PORT "3491"
 #define MAX_CLIENTS 10 // Maximum number of clients the server will manage
 #define BUF_SIZE 256   // Maximum message length
 #define BACKLOG 10 //How many pending connections queue will hold
+#define MAX_NAME_LEN 32 // Longest user name accepted by /login (including the terminator)
+#define MAX_USERS 64    // How many registered users the server remembers
+#define MAX_ROOMS 64    // How many rooms /join can create (room 0 is the lobby)
+#define CREDIT_MAX 4096 // Most message credits a client can hold at once
+#define RECENT_FILL_SEGMENTS 4 // Newest history segments a recent-cache miss looks through
+#define READ_BUDGET_BYTES (16 * 1024) // Most bytes read from one client per loop iteration...
+#define READ_BUDGET_FRAMES 32         // ...and most frames handled
+#define PROFILE_FILE "profile.%d.folded" // Written on exit with --profile; %d is the pid
+#define MULTICAST_BATCH 64 // Datagrams collected per iteration and sent with one sendmmsg()
 
 // Global array to store the file descriptors of all connected clients
 // A value of 0 indicates the slot is free.
 int client_socket[MAX_CLIENTS]; 
 //int max_sd = 0; // Highest file descriptor number (used by select)
 int listener_sfd = -1; // Global variable that tracks the listener socket
+int tls_listener_sfd = -1; // TLS listener, only open when started with a certificate
+SSL_CTX *tls_ctx = NULL;
+int udp_listener_sfd = -1; // UDP listener (--udp), takes the HELLOs of new UDP clients
+struct poller *poller = NULL; // Watches stdin (or the bus), the listeners and every client socket
+long busy_poll_us = 0;        // --busy-poll budget, 0 when off
+
+// Set by sigint_handler(); the event loop shuts down when it next wakes up. The handler
+// also writes a byte to stop_pipe, which the poller watches, so that wakeup comes even
+// when the signal arrives outside poller_wait()'s blocking call (e.g. while busy polling).
+volatile sig_atomic_t stop_requested = 0;
+int stop_pipe[2] = { -1, -1 };
+
+// Per-connection state, indexed the same way as client_socket[]
+struct client_session {
+    int user_id;           // Index into registered_users[], or -1 before /login
+    int room_id;           // Index into room_names[]; messages only reach the same room
+    uint8_t inbuf[CHAT_MAX_FRAME]; // Received bytes that do not form a complete frame yet
+    size_t inbuf_len;
+    unsigned char known_users[(MAX_USERS + 7) / 8]; // Users whose name this client has been sent
+    struct dedup_window seen; // Message ids seen from this connection before /login
+    struct outq outq;      // Everything queued for this client, written when the socket is writable
+    struct tls_conn *tls;  // NULL for plaintext connections
+    struct rudp_conn *rudp; // NULL unless the client came in over UDP
+    int revents;           // POLLER_* events reported for this socket by the last wait
+    int read_more;         // Used up its read budget with input left: serve again next iteration
+    int multicast;         // "/multicast on": CHAT frames of its room reach it through the group
+    // Application-level flow control. Once a client sends a CREDIT frame it may only be sent
+    // as many non-control messages as it has granted; live messages beyond that are
+    // dropped (and counted) and bulk replay is deferred until more credit arrives.
+    int credit_enabled;
+    long credits;
+    unsigned long dropped;
+};
+struct client_session client_session[MAX_CLIENTS];
+
+// A user that has logged in at least once. Direct messages and mentions addressed
+// to them while they are disconnected are kept in their offline queue.
+struct registered_user {
+    char name[MAX_NAME_LEN];
+    int slot; // Index into client_socket[] while connected, -1 while offline
+    struct offline_queue queue;
+    struct dedup_window seen; // Message ids seen from this user, across reconnects (single process)
+};
+struct registered_user registered_users[MAX_USERS];
+int num_users = 0;
+
+// Room names, persisted in HISTORY_ROOMS so room ids in the history log stay valid
+char room_names[MAX_ROOMS][MAX_NAME_LEN];
+int num_rooms = 0;
+
+struct history_log history_log = { .fd = -1 };  // Append side of the history log
+struct history_reader history_search_reader;      // Fetches search results
+struct compactor_config retention = { .rate_bytes = COMPACT_DEFAULT_RATE };
+size_t recent_cache_bytes = RECENT_DEFAULT_BYTES;
+uint32_t slow_loop_us = LOOP_WATCH_DEFAULT_SLOW_US;
+uint32_t stall_timeout_ms = LOOP_WATCH_DEFAULT_STALL_MS;
+int profile_hz = 0; // --profile, 0 when off
+
+// --multicast: room fan-out to a LAN multicast group (see multicast.h). mcast_fd is -1
+// when off. Datagrams are collected during an iteration and sent after the TCP flush,
+// so the USER frames introducing their senders are on the wire first. In pre-fork mode
+// a message is published by the worker it came in on and SYNCs by worker 0 only.
+int mcast_fd = -1;
+struct sockaddr_in mcast_group;
+const char *mcast_spec = NULL, *mcast_if = NULL;
+uint8_t mcast_batch[MULTICAST_BATCH][CHAT_MAX_FRAME];
+size_t mcast_batch_len[MULTICAST_BATCH];
+int mcast_batch_count = 0;
+uint64_t mcast_last_seq[MAX_ROOMS]; // Last message published per room
+long mcast_next_sync = 0;
+unsigned long mcast_sent = 0, mcast_dropped = 0, mcast_repaired = 0, mcast_unavailable = 0;
+
+// Pre-fork mode only: the bus shared with the other workers, and who we are.
+// bus is NULL in the default single-process mode.
+struct bus *bus = NULL;
+int worker_id = -1;
+uint64_t bus_read_seq = 0; // Next bus message this worker has not seen
+
+// Last sequence number given out per room. They live in the bus in pre-fork mode.
+uint64_t local_room_seq[MAX_ROOMS];
+uint64_t *room_seq = local_room_seq;
+
+
+/**
+ * @brief Print the recent-cache counters (admin "stats" command, and at shutdown).
+ */
+void print_recent_cache_stats(void) {
+    struct recent_cache_stats st;
+
+    recent_cache_get_stats(&st);
+    printf("Recent cache: %lu join(s), %lu hit(s) (%.1f%%), %lu fill(s) from the log, %lu eviction(s); "
+           "%d room(s) in %zu of %zu bytes\n", st.lookups, st.hits,
+           st.lookups ? 100.0 * st.hits / st.lookups : 0.0, st.fills, st.evictions, st.rooms, st.bytes,
+           st.max_bytes);
+}
+
+/**
+ * @brief Print the event loop timings (admin "stats" command, and at shutdown).
+ */
+void print_loop_stats(void) {
+    struct loop_watch_stats st;
+
+    loop_watch_get_stats(&st);
+    printf("Event loop: %lu iteration(s), longest %.3f ms, %lu slow, %lu stall(s)\n", st.iterations,
+           st.max_us / 1000.0, st.slow, st.stalls);
+    for (int h = 0; h < LOOP_NUM_HANDLERS; h++) {
+        if (st.calls[h] == 0) continue;
+        printf("  %-9s %lu call(s), average %.3f ms, longest %.3f ms\n", loop_handler_name(h), st.calls[h],
+               st.total_us[h] / 1000.0 / st.calls[h], st.handler_max_us[h] / 1000.0);
+    }
+}
+
+/**
+ * @brief Print the multicast counters, if multicast is on.
+ */
+void print_multicast_stats(void) {
+    if (mcast_fd == -1) return;
+    printf("Multicast to %s: %lu datagram(s) sent, %lu dropped; %lu message(s) resent on request, "
+           "%lu no longer available\n", mcast_spec, mcast_sent, mcast_dropped, mcast_repaired, mcast_unavailable);
+}
+
+/**
+ * @brief Print the transport counters of every UDP client (admin "stats" command,
+ * and at shutdown).
+ */
+void print_udp_stats(void) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        struct rudp_stats st;
 
+        if (client_socket[i] <= 0 || client_session[i].rudp == NULL) continue;
+        rudp_get_stats(client_session[i].rudp, &st);
+        printf("UDP client on socket %d: srtt %.1f ms, cwnd %u, %lu packet(s) sent, %lu retransmitted, "
+               "%lu probe(s), %lu timeout(s), %u queued\n", client_socket[i], st.srtt_us / 1000.0, st.cwnd,
+               st.sent, st.retransmitted, st.probes, st.timeouts, st.queued);
+    }
+}
 
 void cleanup_and_exit() {
     printf("\n--- Graceful Shutdown Initiated ---\n");
+    // Shutting down may take a while; that is not a stall, nor worth profiling
+    loop_watch_stop();
+    if (profile_hz > 0) {
+        char profile_path[64];
+        snprintf(profile_path, sizeof profile_path, PROFILE_FILE, (int)getpid());
+        profiler_write(profile_path);
+    }
     
     // 1. Close the listener socket first
     if (listener_sfd != -1) {
         close(listener_sfd);
         printf("Closed listener socket (FD %d).\n", listener_sfd);
     }
+    if (tls_listener_sfd != -1) {
+        close(tls_listener_sfd);
+        printf("Closed TLS listener socket (FD %d).\n", tls_listener_sfd);
+    }
+    if (udp_listener_sfd != -1) {
+        close(udp_listener_sfd);
+        printf("Closed UDP listener socket (FD %d).\n", udp_listener_sfd);
+    }
+    print_udp_stats();
 
     // 2. Close all active client sockets to signal them to disconnect
     for (int i = 0; i < MAX_CLIENTS; i++) {
         int sd = client_socket[i];
         if (sd > 0) {
+            // A UDP client only learns of it from a CLOSE
+            rudp_free(client_session[i].rudp);
+            client_session[i].rudp = NULL;
             close(sd);
             client_socket[i] = 0; // Mark as closed
             printf("Closed client socket (FD %d).\n", sd);
         }
     }
+
+    if (poller != NULL && busy_poll_us > 0) {
+        printf("Busy polling: %lu wait(s) served while spinning, %lu blocked.\n",
+               poller->spin_hits, poller->spin_misses);
+    }
+    print_recent_cache_stats();
+    print_loop_stats();
+    print_multicast_stats();
+
+    // Let a compaction in progress give up cleanly: the segment stays as it was
+    compactor_stop();
+
+    // 3. Move queued offline messages to disk so they survive the restart
+    for (int u = 0; u < num_users; u++) {
+        offline_queue_spill_all(&registered_users[u].queue);
+        offline_queue_free(&registered_users[u].queue);
+    }
     
     printf("Cleanup complete. Exiting server process.\n");
     exit(0); 
@@ -57,14 +301,20 @@ void cleanup_and_exit() {
 
 /**
  * @brief Signal handler function for SIGINT (Ctrl+C).
- * Calls the cleanup function to shut down the server gracefully.
+ * Only asks the event loop to stop: cleanup_and_exit() spills the offline queues,
+ * joins threads and writes files, none of which is safe in the middle of whatever
+ * the loop was doing when the signal arrived.
  * @param sig The signal number caught (always SIGINT, which is 2).
  */
 void sigint_handler(int sig) {
-    // Note: Calling non-reentrant functions like printf/close/exit in a signal handler 
-    // is often discouraged, but it is common practice for immediate, fatal process cleanup
-    // in simple server applications.
-    cleanup_and_exit();
+    int saved_errno = errno;
+    (void)sig;
+
+    stop_requested = 1;
+    if (stop_pipe[1] != -1 && write(stop_pipe[1], "", 1) == -1) {
+        // The pipe is full: a wakeup is pending already
+    }
+    errno = saved_errno;
 }
 
 /**
@@ -80,21 +330,26 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 
-int setup_listener() {
+/**
+ * @brief Bind a listening socket to port on every address: a TCP listener, or with
+ * SOCK_DGRAM a UDP one for rudp.h connections.
+ * @return The socket, or 0 on failure.
+ */
+int setup_listener(const char *port, int socktype) {
 
     int listen_fd;
     struct addrinfo hints, *servinfo, *p;
     int rv;
-    int yes;
+    int yes = 1;
 
     memset(&hints, 0, sizeof hints);
 
     hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = socktype;
     hints.ai_flags = AI_PASSIVE;
 
     // "Give me an address structure for a TCP server listening on port 3490"
-    if(getaddrinfo(NULL, PORT, &hints, &servinfo) != 0) {
+    if(getaddrinfo(NULL, port, &hints, &servinfo) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return 0;
     }
@@ -117,6 +372,13 @@ int setup_listener() {
             // This is a FATAL, non-recoverable error for the program.
             return 0;
         }
+        // Pre-fork workers each bind their own socket to the same port and the kernel
+        // spreads incoming connections across them
+        if (bus != NULL && setsockopt(rv, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt SO_REUSEPORT");
+            close(rv);
+            return 0;
+        }
         // Then bind the socket 
         if(bind(rv, p->ai_addr, p->ai_addrlen) == -1) {
             perror("bind");
@@ -135,7 +397,12 @@ int setup_listener() {
        return 0;
     }
 
-    if(listen(rv, BACKLOG) != 0) {
+    if(socktype == SOCK_DGRAM) {
+        if(rudp_listen(rv) != 0) {
+            close(rv);
+            return 0;
+        }
+    } else if(listen(rv, BACKLOG) != 0) {
         perror("listen");
         return 0;
     }
@@ -144,162 +411,1871 @@ int setup_listener() {
     return rv;
 }
 
-// Function to handle broadcasting a received message to all other clients
-void broadcast_message(int sender_fd, const char *message, size_t len) {
-    printf("broadcast message called\n");
-    ssize_t send_bytes;
-    
+// Milliseconds on a monotonic clock, used for presence timing
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+ * @brief Pre-fork mode: tell the other workers which rooms have multicast subscribers
+ * here. Call after a client subscribes, unsubscribes, changes room or leaves.
+ */
+void note_multicast_rooms(void) {
+    uint8_t has_subscribers[MAX_ROOMS] = { 0 };
+
+    if (bus == NULL || mcast_fd == -1) return;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_socket[i] > 0 && client_session[i].multicast) has_subscribers[client_session[i].room_id] = 1;
+    }
+    for (int r = 0; r < MAX_ROOMS; r++) {
+        __atomic_store_n(&bus->mcast_rooms[worker_id][r], has_subscribers[r], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Close a client connection and release its slot.
+ * A logged-in user is marked offline so later messages go to their offline queue.
+ */
+void disconnect_client(int slot) {
+    int user_id = client_session[slot].user_id;
+
+    if (user_id >= 0) {
+        registered_users[user_id].slot = -1;
+        if (bus != NULL) bus_set_owner(bus, user_id, 0);
+        presence_set(user_id, client_session[slot].room_id, PRESENCE_OFFLINE, now_ms());
+        printf("User '%s' is now offline\n", registered_users[user_id].name);
+    }
+    tls_free(client_session[slot].tls);
+    client_session[slot].tls = NULL;
+    rudp_free(client_session[slot].rudp);
+    client_session[slot].rudp = NULL;
+    poller_del(poller, client_socket[slot]);
+    close(client_socket[slot]);
+    client_socket[slot] = 0;
+    client_session[slot].user_id = -1;
+    client_session[slot].room_id = 0;
+    client_session[slot].inbuf_len = 0;
+    client_session[slot].revents = 0;
+    client_session[slot].read_more = 0;
+    client_session[slot].multicast = 0;
+    client_session[slot].credit_enabled = 0;
+    client_session[slot].credits = 0;
+    client_session[slot].dropped = 0;
+    memset(client_session[slot].known_users, 0, sizeof client_session[slot].known_users);
+    dedup_init(&client_session[slot].seen);
+    outq_clear(&client_session[slot].outq);
+    note_multicast_rooms();
+}
+
+// recv() on a client connection, decrypting if it is a TLS connection
+ssize_t client_read(int slot, void *buf, size_t len) {
+    if (client_session[slot].tls != NULL) {
+        return tls_read(client_session[slot].tls, buf, len);
+    }
+    if (client_session[slot].rudp != NULL) {
+        return rudp_read(client_session[slot].rudp, buf, len);
+    }
+    return recv(client_socket[slot], buf, len, 0);
+}
+
+// outq_writev_fn for a client connection; ctx points at the slot
+static ssize_t client_writev(void *ctx, const struct iovec *iov, int iovcnt) {
+    int slot = *(int *)ctx;
+
+    if (client_session[slot].tls != NULL) {
+        return tls_writev(client_session[slot].tls, iov, iovcnt);
+    }
+    if (client_session[slot].rudp != NULL) {
+        return rudp_writev(client_session[slot].rudp, iov, iovcnt);
+    }
+    return writev(client_socket[slot], iov, iovcnt);
+}
+
+// Whether a client may be sent another non-control message right now
+int client_has_credit(int slot) {
+    return !client_session[slot].credit_enabled || client_session[slot].credits > 0;
+}
+
+// Wall-clock microseconds, stamped into the timestamp field of server-generated frames
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Queue a (shared) buffer for a client on the given lane, behind a header of
+ * this client's own. With a header, the two together are one frame; without one, the
+ * buffer holds one or more whole frames.
+ * A client whose queue grows past OUTQ_MAX_BYTES is not reading and is disconnected.
+ * @return 0 if queued (or dropped for lack of credit), -1 if the client was disconnected.
+ */
+int queue_split_to_client(int slot, enum outq_lane lane, const uint8_t *hdr, size_t hdr_len, struct out_buf *body) {
+    struct client_session *s = &client_session[slot];
+    struct outq *q = &s->outq;
+
+    // Control frames are never subject to credit. A batch may take the balance below
+    // zero; the client simply has to grant more before the next message goes out.
+    if (lane != OUTQ_CONTROL && s->credit_enabled) {
+        if (s->credits <= 0) {
+            s->dropped++;
+            return 0;
+        }
+        s->credits -= hdr_len > 0 ? 1 : chat_count_frames((const uint8_t *)body->data, body->len);
+    }
+
+    if (outq_push_split(q, lane, hdr, hdr_len, body) == -1 || q->total_bytes > OUTQ_MAX_BYTES) {
+        printf("[OUTQ] Client on socket %d has %zu bytes queued, disconnecting\n",
+               client_socket[slot], q->total_bytes);
+        disconnect_client(slot);
+        return -1;
+    }
+    return 0;
+}
+
+int queue_buf_to_client(int slot, enum outq_lane lane, struct out_buf *body) {
+    return queue_split_to_client(slot, lane, NULL, 0, body);
+}
+
+int queue_to_client(int slot, enum outq_lane lane, const void *data, size_t len) {
+    struct out_buf *body = out_buf_new(data, len);
+    int rv;
+
+    if (body == NULL) return -1;
+    rv = queue_buf_to_client(slot, lane, body);
+    out_buf_release(body);
+    return rv;
+}
+
+/**
+ * @brief Queue a NOTICE frame carrying text for the client to display.
+ * Errors (CHAT_FLAG_ERROR) go out on the control lane.
+ */
+int queue_notice(int slot, enum outq_lane lane, uint8_t flags, const char *text) {
+    uint8_t frame[CHAT_MAX_FRAME];
+    size_t len = chat_encode(frame, CHAT_MSG_NOTICE, flags, client_session[slot].room_id, CHAT_ANONYMOUS,
+                             0, now_us(), text, strlen(text));
+    return queue_to_client(slot, lane, frame, len);
+}
+
+int queue_error(int slot, const char *text) {
+    return queue_notice(slot, OUTQ_CONTROL, CHAT_FLAG_ERROR, text);
+}
+
+int queue_ack(int slot, uint64_t seq) {
+    uint8_t frame[CHAT_HEADER_LEN + 1];
+    size_t len = chat_encode_header(frame, CHAT_MSG_ACK, 0, client_session[slot].room_id, CHAT_ANONYMOUS,
+                                    seq, now_us(), 0);
+    return queue_to_client(slot, OUTQ_CONTROL, frame, len);
+}
+
+/**
+ * @brief Acknowledge a command once it has been handled. Unlike other ACKs this one
+ * goes on the interactive lane, behind the command's reply (JOINED, a NOTICE), so a
+ * client that waits for it has the reply as well. It costs no credit.
+ * @return 0 if queued, -1 if the client was disconnected.
+ */
+int queue_command_ack(int slot, uint64_t seq) {
+    struct outq *q = &client_session[slot].outq;
+    uint8_t frame[CHAT_HEADER_LEN + 1];
+    size_t len = chat_encode_header(frame, CHAT_MSG_ACK, 0, client_session[slot].room_id, CHAT_ANONYMOUS,
+                                    seq, now_us(), 0);
+
+    if (outq_push_copy(q, OUTQ_INTERACTIVE, (const char *)frame, len) == -1 || q->total_bytes > OUTQ_MAX_BYTES) {
+        printf("[OUTQ] Client on socket %d has %zu bytes queued, disconnecting\n",
+               client_socket[slot], q->total_bytes);
+        disconnect_client(slot);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Answer a PING, echoing its sequence and timestamp. A PONG skips the queues:
+ * if nothing is waiting to go out to the client it is written to the socket right
+ * away, and only what the socket does not take is queued on the control lane, which
+ * the next flush sends ahead of everything else.
+ */
+void send_pong(int slot, const uint8_t *ping) {
+    struct client_session *s = &client_session[slot];
+    uint8_t frame[CHAT_HEADER_LEN + 1];
+    size_t len = chat_encode_header(frame, CHAT_MSG_PONG, 0, s->room_id, CHAT_ANONYMOUS,
+                                    chat_sequence(ping), chat_timestamp(ping), 0);
+    ssize_t written = 0;
+
+    if (outq_empty(&s->outq) && (s->tls == NULL || !tls_wants_write(s->tls))) {
+        struct iovec iov = { frame, len };
+        // A hard error is left for the next flush to find
+        if ((written = client_writev(&slot, &iov, 1)) < 0) written = 0;
+    }
+    if ((size_t)written < len) {
+        queue_to_client(slot, OUTQ_CONTROL, frame + written, len - written);
+    }
+}
+
+/**
+ * @brief Make sure the client knows the name behind a sender_id before it sees a
+ * CHAT frame from that user. Names go out once per connection, on the control lane
+ * so they are always written ahead of the interactive frames that need them.
+ */
+void introduce_user(int slot, uint32_t user_id) {
+    struct client_session *s = &client_session[slot];
+    uint8_t frame[CHAT_HEADER_LEN + 1 + MAX_NAME_LEN];
+    const char *name;
+    size_t len;
+
+    if (user_id >= (uint32_t)num_users || (s->known_users[user_id / 8] & (1 << (user_id % 8)))) {
+        return;
+    }
+    name = registered_users[user_id].name;
+    len = chat_encode(frame, CHAT_MSG_USER, 0, s->room_id, user_id, 0, now_us(), name, strlen(name));
+    if (queue_to_client(slot, OUTQ_CONTROL, frame, len) == 0) {
+        s->known_users[user_id / 8] |= 1 << (user_id % 8);
+    }
+}
+
+/**
+ * @brief Send the collected datagrams with one sendmmsg(). Whatever the socket does
+ * not take is dropped; receivers ask for it again over TCP.
+ * @return Bytes sent.
+ */
+size_t multicast_flush(void) {
+    struct mmsghdr msgs[MULTICAST_BATCH];
+    struct iovec iov[MULTICAST_BATCH];
+    size_t bytes = 0;
+    int sent;
+
+    if (mcast_batch_count == 0) return 0;
+    memset(msgs, 0, sizeof msgs[0] * mcast_batch_count);
+    for (int k = 0; k < mcast_batch_count; k++) {
+        iov[k].iov_base = mcast_batch[k];
+        iov[k].iov_len = mcast_batch_len[k];
+        msgs[k].msg_hdr.msg_name = &mcast_group;
+        msgs[k].msg_hdr.msg_namelen = sizeof mcast_group;
+        msgs[k].msg_hdr.msg_iov = &iov[k];
+        msgs[k].msg_hdr.msg_iovlen = 1;
+    }
+    if ((sent = sendmmsg(mcast_fd, msgs, mcast_batch_count, 0)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("sendmmsg multicast");
+        sent = 0;
+    }
+    for (int k = 0; k < sent; k++) {
+        bytes += mcast_batch_len[k];
+    }
+    mcast_sent += sent;
+    mcast_dropped += mcast_batch_count - sent;
+    mcast_batch_count = 0;
+    return bytes;
+}
+
+// Add a frame to the datagrams sent at the end of this iteration
+void multicast_publish(const uint8_t *frame, size_t len) {
+    if (mcast_batch_count == MULTICAST_BATCH) multicast_flush();
+    memcpy(mcast_batch[mcast_batch_count], frame, len);
+    mcast_batch_len[mcast_batch_count++] = len;
+}
+
+// Whether a room's messages go to the multicast group: it has subscribers here
+// (local > 0) or, in pre-fork mode, on another worker
+int multicast_wanted(int room_id, int local) {
+    if (local > 0) return 1;
+    if (bus == NULL) return 0;
+    for (int w = 0; w < bus->num_workers; w++) {
+        if (w != worker_id && __atomic_load_n(&bus->mcast_rooms[w][room_id], __ATOMIC_RELAXED)) return 1;
+    }
+    return 0;
+}
+
+// Function to handle broadcasting a received message to all other clients in a room
+// that are connected to this process. message is a complete frame; only its header is looked at.
+// Multicast subscribers, the sender included, get a CHAT frame from the one datagram
+// published for all of them instead. Only the process the message came in on publishes
+// it (publish != 0): a frame from the bus has gone to the group already.
+void broadcast_local(int sender_fd, int room_id, const char *message, size_t len, int publish) {
+    uint32_t sender_id = chat_sender((const uint8_t *)message);
+    int is_chat = chat_type((const uint8_t *)message) == CHAT_MSG_CHAT;
+    int subscribers = 0;
+    // The body (payload length and payload) is copied once and the same buffer is queued
+    // for every recipient. Each queue entry holds its own copy of the 24-byte header, the
+    // place for any field that differs per recipient, so none of them re-encodes the body.
+    struct out_buf *body = out_buf_new(message + CHAT_HEADER_LEN, len - CHAT_HEADER_LEN);
+
+    if (body == NULL) return;
+    if (is_chat) {
+        recent_cache_append(room_id, (const uint8_t *)message, len);
+    }
     for(int i = 0; i < MAX_CLIENTS; i++) {
         int sfd = client_socket[i];
-        printf("%s has %d bytes\n", message, len);
         if(sfd <= 0) continue; // Non active socket
+        if(is_chat && client_session[i].multicast && client_session[i].room_id == room_id) {
+            introduce_user(i, sender_id);
+            subscribers++;
+            continue;
+        }
         if(sfd == sender_fd) continue; //We don't broadcast message back to sender
-        send_bytes = send(sfd, message, len, 0);
-        printf("send_bytes is %d bytes\n", send_bytes);
-        if(send_bytes == -1) {
-            perror("send");
-            close(sfd);
-            client_socket[i] = 0;
-            return;
+        if(client_session[i].room_id != room_id) continue; // Different room
+        introduce_user(i, sender_id);
+        if(client_socket[i] > 0) {
+            queue_split_to_client(i, OUTQ_INTERACTIVE, (const uint8_t *)message, CHAT_HEADER_LEN, body);
         }
-        if (send_bytes < len) {
-            // WARNING: Partial send. Not all data was sent in one call.
-            printf("[SEND WARNING] Sent only %zd of %zu bytes. You must loop to send remaining data.\n", send_bytes, len);
-        } else {
-            // SUCCESS: All data was sent.
-            printf("[SENT SUCCESS] Message: '%s' (%zd bytes sent)\n", message, len);
+    }
+    out_buf_release(body);
+    if (is_chat && mcast_fd != -1 && multicast_wanted(room_id, subscribers)) {
+        if (publish) multicast_publish((const uint8_t *)message, len);
+        if (chat_sequence((const uint8_t *)message) > mcast_last_seq[room_id]) {
+            mcast_last_seq[room_id] = chat_sequence((const uint8_t *)message);
         }
+    }
+}
 
+// Function to handle broadcasting a received message to all other clients in a room.
+// In pre-fork mode the other workers get it through the bus.
+void broadcast_message(int sender_fd, int room_id, const char *message, size_t len) {
+    loop_watch_broadcast_begin();
+    broadcast_local(sender_fd, room_id, message, len, 1);
+    if (bus != NULL) {
+        bus_publish(bus, worker_id, BUS_ROOM, 0, message, len);
     }
+    loop_watch_broadcast_end();
 }
 
-int main() {
-    //printf("[DIAGNOSTIC] Server execution started.\n");
-    int running = 1;
-    socklen_t sin_size;
-    int afd = -1;
-    fd_set readfds;
-    int max_fd = 0; //Highest file descriptor + 1
-    //int client_socket[MAX_CLIENTS]; // This list holds the client sockets that are attempting connection to the server
-    int activity;
-    char buffer[BUF_SIZE];
-    ssize_t recv_bytes;
+/**
+ * @brief offline_write_fn for a reconnecting user: each batch of frames becomes one
+ * bulk-lane buffer. Returns -1 (pause) once enough bulk data is queued or the client is
+ * out of credit; delivery resumes from resume_offline_delivery() as the client drains
+ * its queue and grants more credit.
+ */
+static int deliver_batch(void *ctx, const char *buf, size_t len) {
+    int slot = *(int *)ctx;
 
-    // Clear out all the client sockets before proceeding further
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        client_socket[i] = 0;
+    if (client_session[slot].outq.bytes[OUTQ_BULK] >= OUTQ_BULK_HIGH_WATER || !client_has_credit(slot)) {
+        return -1;
     }
+    return queue_to_client(slot, OUTQ_BULK, buf, len);
+}
 
-    //printf("Before running setup_listener\n");
+void resume_offline_delivery(int slot) {
+    int user_id = client_session[slot].user_id;
 
-    if((listener_sfd = setup_listener()) == 0) {
-        printf("listener socket is %d\n", listener_sfd);
-        perror("Couldn't set up a listening socket");
-        exit(1);
+    if (user_id < 0 || !offline_queue_pending(&registered_users[user_id].queue)
+            || client_session[slot].outq.bytes[OUTQ_BULK] >= OUTQ_BULK_HIGH_WATER || !client_has_credit(slot)) {
+        return;
     }
+    if (offline_queue_deliver(&registered_users[user_id].queue, deliver_batch, &slot) == 0) {
+        printf("[OFFLINE] Finished delivering queued messages to '%s'\n", registered_users[user_id].name);
+    }
+}
 
-    max_fd = listener_sfd;
-    // Infinite loop that allows the socket to listen forever
-    while(running) {
-        // 1. CLEAR THE SET
-        FD_ZERO(&readfds);
-        FD_SET(STDIN_FILENO, &readfds);
-        // 2. RE-POPULATE THE SET
-        // Add the listener socket back
-        FD_SET(listener_sfd, &readfds);
+// Add a user to this process's table; the caller makes sure there is room
+int add_local_user(const char *name) {
+    int user_id = num_users++;
+    char queue_name[MAX_NAME_LEN + 8];
 
-        for(int i = 0; i < MAX_CLIENTS; i++) {
-            if(client_socket[i] > 0) {
-                printf("Index %d is populated by socket %d\n", i, client_socket[i]);
-                FD_SET(client_socket[i], &readfds);
-            }
-            if(client_socket[i] > max_fd) {
-                max_fd = client_socket[i];
-            }
-        }
-        // --- B. WAITING (select() call) ---
-        // Blocks here until activity occurs on ANY monitored socket
-        printf("\nWaiting for activity (max_fd + 1: %d)...\n", max_fd + 1);
-        activity = select(max_fd + 1, &readfds, NULL, NULL, NULL);
+    strcpy(registered_users[user_id].name, name);
+    registered_users[user_id].slot = -1;
+    // Each pre-fork worker keeps its own offline queue per user, in its own file
+    if (bus != NULL) {
+        snprintf(queue_name, sizeof queue_name, "%s@%d", name, worker_id);
+    } else {
+        snprintf(queue_name, sizeof queue_name, "%s", name);
+    }
+    offline_queue_init(&registered_users[user_id].queue, queue_name);
+    dedup_init(&registered_users[user_id].seen);
+    presence_register(user_id, name);
+    return user_id;
+}
 
-        if ((activity < 0) && (errno != EINTR)) {
-            // A genuine, non-interrupt error occurred
-            perror("select error");
-            // Server should likely continue or attempt recovery, but for simplicity:
-            continue; 
+/**
+ * @brief Pre-fork mode: copy users registered by other workers into the local table.
+ * The bus assigns ids in order, so local index == bus user id.
+ */
+void sync_users(void) {
+    char name[BUS_NAME_LEN];
+
+    if (bus == NULL) return;
+    for (;;) {
+        bus_lock(bus);
+        if (num_users >= bus->num_users) {
+            bus_unlock(bus);
+            return;
         }
-        // --- C. EXECUTION (Handling the ready sockets) ---
-        // 1. Check STDIN_FILENO (Server Command)
-        if (FD_ISSET(STDIN_FILENO, &readfds)) {
-            char cmd_buffer[16];
-            // Read 15 chars plus null terminator
-            if (fgets(cmd_buffer, 16, stdin) != NULL) {
-                if (strncmp(cmd_buffer, "quit", 4) == 0) {
-                    printf("Server received 'quit' command. Shutting down...\n");
-                    // Implement cleanup here: close listener_sd and all client FDs
-                    // exit(0);
-                } else {
-                    printf("Command ignored.\n");
-                }
+        strcpy(name, bus->user_names[num_users]);
+        bus_unlock(bus);
+        add_local_user(name);
+    }
+}
+
+int find_user(const char *name) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int u = 0; u < num_users; u++) {
+            if (strcmp(registered_users[u].name, name) == 0) {
+                return u;
             }
         }
-        printf("About to accept client messages\n");
-        // Now time for the listener socket to accept and accept client messages
-        if(FD_ISSET(listener_sfd, &readfds)) {
-            struct sockaddr_storage their_addr; // connector's address info
-            sin_size = sizeof their_addr;
-            char remote_ip[INET6_ADDRSTRLEN];
+        if (bus == NULL) break;
+        sync_users(); // Maybe another worker registered them
+    }
+    return -1;
+}
 
-            printf("Now inside the accepting function\n");
+/**
+ * @brief Register a new user name.
+ * @return The new user id, or -1 if the table is full.
+ */
+int register_user(const char *name) {
+    int user_id;
 
-            if( (afd = accept(listener_sfd, (struct sockaddr *)&their_addr, &sin_size)) == -1) {
-                perror("Couldn't accept");
-                continue;
-            }
-            // Successfully accepted, print client details
-            inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr), remote_ip, sizeof(remote_ip));
-            printf("New connection accepted on socket %d from IP: %s\n", afd, remote_ip);
-
-            
-            //afd is the new client connection, loop through client sockets
-            for(int i = 0; i < MAX_CLIENTS; i++) {
-                int client_fd = client_socket[i];
-                if(client_fd == 0) {
-                    client_socket[i] = afd;
-                    printf("Client assigned to array slot [%d]\n", i);
-                    // Quickly update max_fd
-                    if(client_socket[i] > max_fd) {
-                        max_fd = client_socket[i];
-                    }
-                    break;
-                }
-            }
+    if (bus != NULL) {
+        if ((user_id = bus_register_user(bus, name)) == -1) return -1;
+        sync_users();
+        return user_id;
+    }
+    if (num_users == MAX_USERS) {
+        return -1;
+    }
+    user_id = add_local_user(name);
+    printf("Registered new user '%s'\n", name);
+    return user_id;
+}
+
+// User and room names double as file names, so only allow a safe character set
+int valid_name(const char *name) {
+    size_t len = strlen(name);
+
+    if (len == 0 || len >= MAX_NAME_LEN) return 0;
+    for (size_t k = 0; k < len; k++) {
+        if (!isalnum((unsigned char)name[k]) && name[k] != '_' && name[k] != '-') return 0;
+    }
+    return 1;
+}
+
+const char *sender_name(int slot) {
+    int user_id = client_session[slot].user_id;
+    return user_id >= 0 ? registered_users[user_id].name : "anonymous";
+}
+
+/**
+ * @brief Send a NOTICE to a registered user, or queue it if they are offline.
+ * Queued notices are stored as encoded frames and replayed with CHAT_FLAG_REPLAY set.
+ */
+void deliver_or_queue(int user_id, const char *text) {
+    struct registered_user *user = &registered_users[user_id];
+    uint8_t frame[CHAT_MAX_FRAME];
+    size_t len;
+
+    if (user->slot >= 0) {
+        queue_notice(user->slot, OUTQ_INTERACTIVE, 0, text);
+        return;
+    }
+    // Logged in on another worker: hand it over. An unlocked read is fine here; if the
+    // user logs out meanwhile, the receiving worker queues the notice instead.
+    if (bus != NULL && bus->user_owner[user_id] != 0) {
+        len = chat_encode(frame, CHAT_MSG_NOTICE, 0, 0, CHAT_ANONYMOUS, 0, now_us(), text, strlen(text));
+        bus_publish(bus, worker_id, BUS_USER, user_id, frame, len);
+        return;
+    }
+    len = chat_encode(frame, CHAT_MSG_NOTICE, CHAT_FLAG_REPLAY, 0, CHAT_ANONYMOUS, 0, now_us(), text, strlen(text));
+    offline_queue_push(&user->queue, (const char *)frame, len);
+}
+
+/**
+ * @brief Handle "/login <name>": register the name on first use, then attach the
+ * connection to it and flush anything that was queued while the user was away.
+ */
+void login_user(int slot, const char *name) {
+    char reply[BUF_SIZE];
+    int user_id;
+
+    if (!valid_name(name)) {
+        queue_error(slot, "ERR invalid name");
+        return;
+    }
+    if ((user_id = find_user(name)) == -1 && (user_id = register_user(name)) == -1) {
+        queue_error(slot, "ERR user table full");
+        return;
+    }
+    if (registered_users[user_id].slot >= 0
+            || (bus != NULL && bus_set_owner(bus, user_id, worker_id + 1) == -1)) {
+        queue_error(slot, "ERR already logged in elsewhere");
+        return;
+    }
+    if (client_session[slot].user_id >= 0) {
+        registered_users[client_session[slot].user_id].slot = -1;
+        if (bus != NULL) bus_set_owner(bus, client_session[slot].user_id, 0);
+        presence_set(client_session[slot].user_id, client_session[slot].room_id, PRESENCE_OFFLINE, now_ms());
+    }
+    client_session[slot].user_id = user_id;
+    registered_users[user_id].slot = slot;
+    presence_set(user_id, client_session[slot].room_id, PRESENCE_ONLINE, now_ms());
+
+    snprintf(reply, sizeof reply, "Logged in as %s", name);
+    queue_notice(slot, OUTQ_INTERACTIVE, 0, reply);
+
+    if (offline_queue_pending(&registered_users[user_id].queue)) {
+        printf("[OFFLINE] Delivering queued messages to '%s'\n", name);
+        resume_offline_delivery(slot);
+    }
+}
+
+/**
+ * @brief Read rooms from the persisted room table that are not in room_names[] yet.
+ */
+void read_room_file(void) {
+    FILE *f = fopen(HISTORY_ROOMS, "r");
+    char line[MAX_NAME_LEN + 2];
+    int line_no = 0;
+
+    if (f == NULL) return;
+    while (num_rooms < MAX_ROOMS && fgets(line, sizeof line, f) != NULL) {
+        if (line_no++ < num_rooms) continue;
+        line[strcspn(line, "\n")] = '\0';
+        strcpy(room_names[num_rooms++], line);
+    }
+    fclose(f);
+}
+
+int find_or_create_room(const char *name) {
+    int room_id = -1;
+    FILE *f;
+
+    // Pre-fork workers share the room file: re-read it under the bus lock so two
+    // workers never give the same room different ids
+    if (bus != NULL) {
+        bus_lock(bus);
+        read_room_file();
+    }
+    for (int r = 0; r < num_rooms && room_id == -1; r++) {
+        if (strcmp(room_names[r], name) == 0) {
+            room_id = r;
+        }
+    }
+    if (room_id == -1 && num_rooms < MAX_ROOMS) {
+        if ((f = fopen(HISTORY_ROOMS, "a")) != NULL) {
+            fprintf(f, "%s\n", name);
+            fclose(f);
         }
+        strcpy(room_names[num_rooms], name);
+        printf("Created room #%s\n", name);
+        room_id = num_rooms++;
+    }
+    if (bus != NULL) {
+        bus_unlock(bus);
+    }
+    return room_id;
+}
 
+/**
+ * @brief Load the persisted room table, creating the lobby on first start.
+ */
+void load_rooms(void) {
+    read_room_file();
+    if (num_rooms == 0) {
+        find_or_create_room("lobby");
+    }
+}
 
+/**
+ * @brief recent_fill_fn: load the latest messages of a room from the history log into
+ * the recent cache. The search indexer keeps the positions of every room's latest
+ * records, so normally only those records are read, plus the room's records in the
+ * part of the log the indexer has not reached yet. While it is still catching up on
+ * the newest RECENT_FILL_SEGMENTS segments (or is not running) those segments are
+ * scanned instead, which bounds the cost of a miss; a room quiet for longer than that
+ * starts out empty.
+ */
+static void fill_recent(void *ctx, int room_id) {
+    uint64_t pos[RECENT_PER_ROOM], seg_pos[RECENT_PER_ROOM], indexed_pos[RECENT_PER_ROOM], indexed_to = 0;
+    struct history_reader reader;
+    struct history_record *rec = malloc(sizeof *rec);
+    uint8_t frame[CHAT_MAX_FRAME];
+    uint32_t *segments;
+    int num_segments, oldest, indexed, found = 0;
+    (void)ctx;
+
+    if (rec == NULL) return;
+    if ((num_segments = history_list_segments(HISTORY_DIR, &segments, NULL)) <= 0) {
+        free(rec);
+        return;
+    }
+    oldest = num_segments > RECENT_FILL_SEGMENTS ? num_segments - RECENT_FILL_SEGMENTS : 0;
+    history_reader_open(&reader, HISTORY_DIR);
+    indexed = search_index_recent(room_id, indexed_pos, RECENT_PER_ROOM, &indexed_to);
+    // Either way positions end up in pos[RECENT_PER_ROOM - found ...], oldest first
+    if (indexed >= 0 && indexed_to >= HISTORY_POS(segments[oldest], 0)) {
+        // The room's records the indexer has not seen yet are the newest
+        int n = 0, take, from_index;
+
+        reader.pos = indexed_to;
+        while (history_read_next(&reader, rec) == 1) {
+            if (rec->room_id == room_id) {
+                seg_pos[n++ % RECENT_PER_ROOM] = rec->pos;
+            }
+        }
+        take = n < RECENT_PER_ROOM ? n : RECENT_PER_ROOM;
+        from_index = indexed < RECENT_PER_ROOM - take ? indexed : RECENT_PER_ROOM - take;
+        for (int j = 0; j < take; j++) {
+            pos[RECENT_PER_ROOM - take + j] = seg_pos[(n - take + j) % RECENT_PER_ROOM];
+        }
+        for (int j = 0; j < from_index; j++) {
+            pos[RECENT_PER_ROOM - take - from_index + j] = indexed_pos[indexed - from_index + j];
+        }
+        found = take + from_index;
+    } else {
+        // Newest segment first
+        for (int k = num_segments - 1; k >= oldest && found < RECENT_PER_ROOM; k--) {
+            int need = RECENT_PER_ROOM - found, n = 0;
+
+            reader.pos = HISTORY_POS(segments[k], 0);
+            while (history_read_next(&reader, rec) == 1 && HISTORY_SEG(rec->pos) == segments[k]) {
+                if (rec->room_id == room_id) {
+                    seg_pos[n++ % need] = rec->pos; // Keep the segment's last `need`
+                }
+            }
+            int take = n < need ? n : need;
+            for (int j = 0; j < take; j++) {
+                pos[RECENT_PER_ROOM - found - take + j] = seg_pos[(n - take + j) % need];
+            }
+            found += take;
+        }
+    }
+    for (int k = RECENT_PER_ROOM - found; k < RECENT_PER_ROOM; k++) {
+        int user_id;
+        size_t len;
+
+        if (history_read_at(&reader, pos[k], rec) != 1) continue;
+        user_id = find_user(rec->sender);
+        // Users are not persisted: someone who last spoke before a restart gets their id back
+        if (user_id == -1 && strcmp(rec->sender, "anonymous") != 0 && valid_name(rec->sender)) {
+            user_id = register_user(rec->sender);
+        }
+        len = chat_encode(frame, CHAT_MSG_CHAT, 0, room_id, user_id >= 0 ? (uint32_t)user_id : CHAT_ANONYMOUS,
+                          rec->seq, rec->ts, rec->text, rec->text_len);
+        recent_cache_append(room_id, frame, len);
+    }
+    history_reader_close(&reader);
+    free(segments);
+    free(rec);
+}
+
+/**
+ * @brief Send the JOINED reply followed by the room's recent messages from the cache.
+ * The names of their senders, the reply and the replay go out in a single writev()
+ * when nothing else is queued for the client; whatever the socket does not take is
+ * queued on the control lane so it is written next, ahead of anything queued later.
+ * Otherwise everything is queued: names on the control lane, the reply on the
+ * interactive lane and the replay on the bulk lane. A client using credits is
+ * replayed at most as many messages as it has credit for.
+ */
+void send_joined(int slot, int room_id, const uint8_t *joined, size_t joined_len) {
+    struct client_session *s = &client_session[slot];
+    struct recent_view view;
+    uint8_t names[MAX_USERS * (CHAT_HEADER_LEN + 1 + MAX_NAME_LEN)];
+    size_t names_len = 0, total;
+    struct iovec iov[4];
+    int max = RECENT_PER_ROOM, n, iovcnt = 0;
+    ssize_t written = 0;
+
+    if (s->credit_enabled && s->credits - 1 < max) {
+        max = s->credits - 1 > 0 ? (int)(s->credits - 1) : 0; // One goes to the reply
+    }
+    if (max == 0 || (n = recent_cache_lookup(room_id, max, &view, fill_recent, NULL)) == -1) {
+        n = 0;
+    }
+    for (int k = 0; k < n; k++) {
+        uint32_t user_id = view.senders[k];
+        const char *name;
+
+        if (user_id >= (uint32_t)num_users || (s->known_users[user_id / 8] & (1 << (user_id % 8)))) {
+            continue;
+        }
+        name = registered_users[user_id].name;
+        names_len += chat_encode(names + names_len, CHAT_MSG_USER, 0, room_id, user_id, 0, now_us(),
+                                 name, strlen(name));
+        s->known_users[user_id / 8] |= 1 << (user_id % 8);
+    }
+    if (s->credit_enabled) {
+        s->credits -= 1 + n;
+    }
+
+    if (!outq_empty(&s->outq) || (s->tls != NULL && tls_wants_write(s->tls))) {
+        int failed = (names_len > 0 && outq_push_copy(&s->outq, OUTQ_CONTROL, (const char *)names, names_len) == -1)
+                     || outq_push_copy(&s->outq, OUTQ_INTERACTIVE, (const char *)joined, joined_len) == -1;
+        for (int k = 0; k < view.iovcnt && n > 0 && !failed; k++) {
+            failed = outq_push_copy(&s->outq, OUTQ_BULK, view.iov[k].iov_base, view.iov[k].iov_len) == -1;
+        }
+        if (failed || s->outq.total_bytes > OUTQ_MAX_BYTES) {
+            printf("[OUTQ] Client on socket %d has %zu bytes queued, disconnecting\n",
+                   client_socket[slot], s->outq.total_bytes);
+            disconnect_client(slot);
+        }
+        return;
+    }
+
+    iov[iovcnt++] = (struct iovec){ names, names_len };
+    iov[iovcnt++] = (struct iovec){ (void *)joined, joined_len };
+    total = names_len + joined_len;
+    for (int k = 0; k < view.iovcnt && n > 0; k++) {
+        iov[iovcnt++] = view.iov[k];
+        total += view.iov[k].iov_len;
+    }
+    // A hard error is left for the next flush to find
+    if ((written = client_writev(&slot, iov, iovcnt)) < 0) written = 0;
+
+    // Queue the unwritten tail, in order
+    for (int k = 0; k < iovcnt && (size_t)written < total; k++) {
+        size_t skip = (size_t)written < iov[k].iov_len ? (size_t)written : iov[k].iov_len;
+        written -= skip;
+        if (skip < iov[k].iov_len && outq_push_copy(&s->outq, OUTQ_CONTROL, (const char *)iov[k].iov_base + skip,
+                                                    iov[k].iov_len - skip) == -1) {
+            disconnect_client(slot);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Handle "/join <room>", creating the room if it does not exist yet.
+ * The JOINED reply tells the client which room_id to put in its CHAT frames.
+ */
+void join_room(int slot, const char *name) {
+    uint8_t frame[CHAT_HEADER_LEN + 1 + MAX_NAME_LEN];
+    size_t len;
+    int room_id;
+
+    if (!valid_name(name)) {
+        queue_error(slot, "ERR invalid room name");
+        return;
+    }
+    if ((room_id = find_or_create_room(name)) == -1) {
+        queue_error(slot, "ERR room table full");
+        return;
+    }
+    client_session[slot].room_id = room_id;
+    if (client_session[slot].multicast) note_multicast_rooms();
+    if (client_session[slot].user_id >= 0) {
+        int user_id = client_session[slot].user_id;
+        presence_set(user_id, room_id, presence_get(user_id), now_ms());
+    }
+    // The room's numbering so far: a multicast subscriber watches for gaps from there
+    len = chat_encode(frame, CHAT_MSG_JOINED, 0, room_id, CHAT_ANONYMOUS,
+                      __atomic_load_n(&room_seq[room_id], __ATOMIC_RELAXED), now_us(), name, strlen(name));
+    send_joined(slot, room_id, frame, len);
+}
+
+/**
+ * @brief Handle "/multicast on" and "/multicast off". The reply to a client that
+ * subscribes is a plain NOTICE; it should already have joined the group.
+ */
+void set_multicast(int slot, const char *arg) {
+    char text[128];
+
+    if (mcast_fd == -1) {
+        queue_error(slot, "ERR multicast is not enabled on this server");
+    } else if (strcmp(arg, "on") == 0) {
+        client_session[slot].multicast = 1;
+        snprintf(text, sizeof text, "Messages of your room now come from multicast group %s", mcast_spec);
+        queue_notice(slot, OUTQ_INTERACTIVE, 0, text);
+    } else if (strcmp(arg, "off") == 0) {
+        client_session[slot].multicast = 0;
+        queue_notice(slot, OUTQ_INTERACTIVE, 0, "Messages of your room now come over this connection");
+    } else {
+        queue_error(slot, "ERR usage: /multicast on|off");
+        return;
+    }
+    note_multicast_rooms();
+}
+
+// Copy len bytes starting at offset off of a recent-cache view (which may wrap)
+static void view_copy(const struct recent_view *view, size_t off, uint8_t *dst, size_t len) {
+    for (int k = 0; k < view->iovcnt && len > 0; k++) {
+        size_t n;
+
+        if (off >= view->iov[k].iov_len) {
+            off -= view->iov[k].iov_len;
+            continue;
+        }
+        n = view->iov[k].iov_len - off < len ? view->iov[k].iov_len - off : len;
+        memcpy(dst, (const uint8_t *)view->iov[k].iov_base + off, n);
+        dst += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+/**
+ * @brief Handle a NACK: resend the client's room's messages first..last from the
+ * recent cache (the last RECENT_PER_ROOM of the room), as live CHAT frames on its
+ * connection. Those no longer in the cache are reported with an error NOTICE so the
+ * client stops asking.
+ */
+void repair_messages(int slot, const uint8_t *frame, const uint8_t *payload, size_t payload_len) {
+    int room_id = chat_room(frame);
+    uint64_t first = chat_sequence(frame), last = payload_len == 8 ? chat_load64(payload) : first;
+    uint64_t found = 0;
+    struct recent_view view;
+    uint8_t msg[CHAT_MAX_FRAME];
+    char text[96];
+    size_t off = 0, payload_off, msg_payload_len;
+    int n;
+
+    if (room_id != client_session[slot].room_id || last < first) {
+        queue_error(slot, "ERR bad NACK");
+        return;
+    }
+    if ((n = recent_cache_lookup(room_id, RECENT_PER_ROOM, &view, fill_recent, NULL)) == -1) n = 0;
+    for (int k = 0; k < n && client_socket[slot] > 0; k++) {
+        size_t avail = view.len - off < sizeof msg ? view.len - off : sizeof msg;
+        ssize_t msg_len;
+        uint64_t seq;
+
+        view_copy(&view, off, msg, avail);
+        if ((msg_len = chat_frame_parse(msg, avail, &payload_off, &msg_payload_len)) <= 0) break;
+        off += msg_len;
+        seq = chat_sequence(msg);
+        if (seq < first || seq > last) continue;
+        chat_set_flags(msg, chat_flags(msg) & ~CHAT_FLAG_REPLAY);
+        introduce_user(slot, chat_sender(msg));
+        queue_to_client(slot, OUTQ_INTERACTIVE, msg, msg_len);
+        found++;
+    }
+    mcast_repaired += found;
+    if (found < last - first + 1 && client_socket[slot] > 0) {
+        mcast_unavailable += last - first + 1 - found;
+        snprintf(text, sizeof text, "ERR %llu of messages %llu-%llu are no longer available",
+                 (unsigned long long)(last - first + 1 - found), (unsigned long long)first, (unsigned long long)last);
+        queue_error(slot, text);
+    }
+}
+
+/**
+ * @brief Every MULTICAST_SYNC_MS, publish a SYNC with the last message number of each
+ * room that has subscribers, so that a lost last message is noticed. In pre-fork mode
+ * worker 0 sends them for every worker: it sees all rooms' messages through the bus.
+ */
+void multicast_tick(long now) {
+    uint8_t frame[CHAT_HEADER_LEN + 1];
+    int has_subscribers[MAX_ROOMS] = { 0 };
+
+    if (now < mcast_next_sync) return;
+    mcast_next_sync = now + MULTICAST_SYNC_MS;
+    if (bus != NULL && worker_id != 0) return;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_socket[i] > 0 && client_session[i].multicast) has_subscribers[client_session[i].room_id] = 1;
+    }
+    for (int r = 0; r < num_rooms; r++) {
+        if (!multicast_wanted(r, has_subscribers[r]) || mcast_last_seq[r] == 0) continue;
+        chat_encode_header(frame, CHAT_MSG_SYNC, 0, r, CHAT_ANONYMOUS, mcast_last_seq[r], now_us(), 0);
+        multicast_publish(frame, sizeof frame);
+    }
+}
+
+/**
+ * @brief presence_emit_fn: send one coalesced PRESENCE frame to every member of a room.
+ * This deliberately bypasses broadcast_message(): a tick produces at most one frame per
+ * room no matter how many state changes happened since the previous tick.
+ */
+static void send_presence(void *ctx, int room_id, const char *line, size_t len) {
+    uint8_t frame[CHAT_MAX_FRAME];
+    struct out_buf *body;
+    (void)ctx;
+
+    len = chat_encode(frame, CHAT_MSG_PRESENCE, 0, room_id, CHAT_ANONYMOUS, 0, now_us(), line, len);
+    if ((body = out_buf_new((const char *)frame, len)) == NULL) return;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_socket[i] > 0 && client_session[i].room_id == room_id) {
+            queue_buf_to_client(i, OUTQ_INTERACTIVE, body);
+        }
+    }
+    out_buf_release(body);
+    if (bus != NULL) {
+        bus_publish(bus, worker_id, BUS_ROOM, 0, frame, len);
+    }
+}
+
+/**
+ * @brief bus_deliver_fn: a room frame or a user notice published by another worker.
+ */
+static void deliver_bus_message(void *ctx, const struct bus_msg *msg) {
+    uint32_t sender_id = chat_sender(msg->data);
+    uint8_t frame[CHAT_MAX_FRAME];
+    (void)ctx;
+
+    // Ids in the frame may belong to users this worker has not heard of yet
+    if ((sender_id != CHAT_ANONYMOUS && sender_id >= (uint32_t)num_users) || msg->target >= (uint32_t)num_users) {
+        sync_users();
+    }
+    if (msg->kind == BUS_ROOM) {
+        if (chat_room(msg->data) >= num_rooms) read_room_file();
+        broadcast_local(-1, chat_room(msg->data), (const char *)msg->data, msg->len, 0);
+    } else if (msg->kind == BUS_USER && msg->target < (uint32_t)num_users) {
+        struct registered_user *user = &registered_users[msg->target];
+        if (user->slot >= 0) {
+            queue_to_client(user->slot, OUTQ_INTERACTIVE, msg->data, msg->len);
+            return;
+        }
+        // Logged out after the sender looked: keep it for their next login here
+        memcpy(frame, msg->data, msg->len);
+        chat_set_flags(frame, chat_flags(frame) | CHAT_FLAG_REPLAY);
+        offline_queue_push(&user->queue, (const char *)frame, msg->len);
+    }
+}
+
+/**
+ * @brief Handle "/away", "/back" and "/typing". Only logged-in users have presence.
+ */
+void set_presence(int slot, enum presence_state state) {
+    if (client_session[slot].user_id < 0) {
+        queue_error(slot, "ERR /login first");
+        return;
+    }
+    presence_set(client_session[slot].user_id, client_session[slot].room_id, state, now_ms());
+}
+
+/**
+ * @brief Handle "/search <terms>": messages in the current room containing all terms.
+ * The lookup goes through the inverted index; only the matching records are read
+ * back from the log.
+ */
+void search_history(int slot, const char *query) {
+    int room_id = client_session[slot].room_id;
+    uint64_t positions[SEARCH_MAX_RESULTS];
+    struct history_record rec;
+    char out[HISTORY_MAX_SENDER + HISTORY_MAX_TEXT + 16];
+    int found = search_index_query(room_id, query, positions, SEARCH_MAX_RESULTS), shown = 0;
+
+    for (int k = 0; k < found && client_has_credit(slot); k++) {
+        // Hits dropped by retention since they were indexed read back as missing
+        if (history_read_at(&history_search_reader, positions[k], &rec) != 1) continue;
+        snprintf(out, sizeof out, "[search] %s: %s", rec.sender, rec.text);
+        if (queue_notice(slot, OUTQ_BULK, CHAT_FLAG_REPLAY, out) == -1) return;
+        shown++;
+    }
+    found = shown;
+    snprintf(out, sizeof out, "[search] %d result(s) in #%s", found, room_names[room_id]);
+    queue_notice(slot, OUTQ_BULK, CHAT_FLAG_REPLAY, out);
+}
+
+/**
+ * @brief Handle a CREDIT frame: the client is ready for n more messages.
+ */
+void grant_credit(int slot, uint64_t n) {
+    struct client_session *s = &client_session[slot];
+    char notice[64];
+
+    if (n == 0) {
+        return;
+    }
+    s->credit_enabled = 1;
+    s->credits = n > (uint64_t)(CREDIT_MAX - s->credits) ? CREDIT_MAX : s->credits + (long)n;
+    if (s->dropped > 0) {
+        snprintf(notice, sizeof notice, "* %lu message(s) dropped while out of credit", s->dropped);
+        s->dropped = 0;
+        queue_notice(slot, OUTQ_CONTROL, 0, notice);
+    }
+}
+
+/**
+ * @brief Handle "/msg <name> <text>".
+ */
+void direct_message(int slot, char *args) {
+    char out[CHAT_MAX_PAYLOAD + MAX_NAME_LEN + 32];
+    char *text = strchr(args, ' ');
+    int user_id;
+
+    if (text == NULL) {
+        queue_error(slot, "ERR usage: /msg <name> <text>");
+        return;
+    }
+    *text++ = '\0';
+    if ((user_id = find_user(args)) == -1) {
+        queue_error(slot, "ERR unknown user");
+        return;
+    }
+    snprintf(out, sizeof out, "[DM from %s] %s", sender_name(slot), text);
+    deliver_or_queue(user_id, out);
+}
+
+/**
+ * @brief Queue "@name" mentions for users who are offline. Online users already
+ * receive the message through the normal broadcast.
+ */
+void queue_mentions(int slot, const char *payload, size_t payload_len) {
+    char text[CHAT_MAX_PAYLOAD + 1];
+    int queued[MAX_USERS];
+    int num_queued = 0;
+
+    memcpy(text, payload, payload_len);
+    text[payload_len] = '\0';
+    for (const char *at = strchr(text, '@'); at != NULL; at = strchr(at + 1, '@')) {
+        char name[MAX_NAME_LEN];
+        size_t n = 0;
+        int user_id;
+        int seen = 0;
+
+        while (n < MAX_NAME_LEN - 1 && (isalnum((unsigned char)at[1 + n]) || at[1 + n] == '_' || at[1 + n] == '-')) {
+            name[n] = at[1 + n];
+            n++;
+        }
+        name[n] = '\0';
+        if (n == 0 || (user_id = find_user(name)) == -1 || registered_users[user_id].slot >= 0) {
+            continue;
+        }
+        for (int k = 0; k < num_queued; k++) {
+            if (queued[k] == user_id) seen = 1;
+        }
+        if (!seen) {
+            char out[CHAT_MAX_PAYLOAD + MAX_NAME_LEN + 32]; // chat_encode() truncates to CHAT_MAX_PAYLOAD
+            snprintf(out, sizeof out, "[mention from %s] %s", sender_name(slot), text);
+            deliver_or_queue(user_id, out);
+            queued[num_queued++] = user_id;
+        }
+    }
+}
+
+/**
+ * @brief Handle a COMMAND frame. line is a NUL-terminated copy of the payload.
+ * Every command is acknowledged with its seq after it has been handled.
+ */
+void handle_command(int slot, char *line, uint64_t seq) {
+    if (strncmp(line, "/login ", 7) == 0) {
+        login_user(slot, line + 7);
+    } else if (strncmp(line, "/msg ", 5) == 0) {
+        direct_message(slot, line + 5);
+    } else if (strncmp(line, "/join ", 6) == 0) {
+        join_room(slot, line + 6);
+    } else if (strncmp(line, "/search ", 8) == 0) {
+        search_history(slot, line + 8);
+    } else if (strcmp(line, "/typing") == 0) {
+        set_presence(slot, PRESENCE_TYPING);
+    } else if (strcmp(line, "/away") == 0) {
+        set_presence(slot, PRESENCE_AWAY);
+    } else if (strcmp(line, "/back") == 0) {
+        set_presence(slot, PRESENCE_ONLINE);
+    } else if (strncmp(line, "/multicast ", 11) == 0) {
+        set_multicast(slot, line + 11);
+    } else {
+        queue_error(slot, "ERR unknown command");
+    }
+    if (client_socket[slot] > 0) {
+        queue_command_ack(slot, seq);
+    }
+}
+
+/**
+ * @brief Number a message for its room. Only the event loop hands out numbers, so a
+ * single process needs no lock; pre-fork workers share the counters in the bus, where
+ * an atomic add keeps them unique without taking the bus lock.
+ */
+uint64_t next_room_seq(int room_id) {
+    if (bus != NULL) {
+        return __atomic_add_fetch(&room_seq[room_id], 1, __ATOMIC_RELAXED);
+    }
+    return ++room_seq[room_id];
+}
+
+/**
+ * @brief Handle a CHAT frame. The frame sits in the slot's receive buffer and is
+ * forwarded from there: only header fields are read, and the only modifications are
+ * stamping the authenticated sender_id, the room's sequence number and the time of
+ * arrival into the header.
+ */
+void handle_chat(int slot, uint8_t *frame, size_t frame_len, const uint8_t *payload, size_t payload_len) {
+    int fd = client_socket[slot];
+    int room_id = chat_room(frame);
+    int user_id = client_session[slot].user_id;
+    uint64_t seq, ts;
+
+    if (room_id != client_session[slot].room_id) {
+        queue_error(slot, "ERR not in that room");
+        return;
+    }
+    chat_set_sender(frame, user_id >= 0 ? (uint32_t)user_id : CHAT_ANONYMOUS);
+    chat_set_flags(frame, 0);
+
+    // Sending a message ends "typing"
+    if (user_id >= 0 && presence_get(user_id) == PRESENCE_TYPING) {
+        presence_set(user_id, room_id, PRESENCE_ONLINE, now_ms());
+    }
+
+    // B. Send acknowledgement (optional but good practice), with the client's own id
+    queue_ack(slot, chat_sequence(frame));
+    seq = next_room_seq(room_id);
+    ts = now_us();
+    chat_set_sequence(frame, seq);
+    chat_set_timestamp(frame, ts);
+    // C. BROADCAST the frame as received to the rest of the room
+    broadcast_message(fd, room_id, (const char *)frame, frame_len);
+    if (memchr(payload, '@', payload_len) != NULL) {
+        queue_mentions(slot, (const char *)payload, payload_len);
+    }
+
+    // D. Persist the message; the indexer thread picks it up from the log
+    if (history_log.fd != -1 && history_append(&history_log, room_id, seq, ts, sender_name(slot), (const char *)payload, payload_len) == 0) {
+        search_index_notify();
+    }
+}
+
+/**
+ * @brief Whether a CHAT or COMMAND frame is a retransmit of one already handled.
+ * Ids are tracked per user once logged in, so a resend after reconnecting is still
+ * caught; in pre-fork mode the window lives in the bus, since the reconnect may land
+ * on another worker. A duplicate is acknowledged again (the first ACK may be what got lost) but
+ * never reaches broadcast_message().
+ */
+int is_duplicate(int slot, uint64_t seq) {
+    int user_id = client_session[slot].user_id;
+    struct dedup_window *w = &client_session[slot].seen;
+
+    if (user_id >= 0) {
+        w = bus != NULL ? &bus->user_seen[user_id] : &registered_users[user_id].seen;
+    }
+
+    if (dedup_check_and_set(w, seq)) {
+        return 0;
+    }
+    queue_ack(slot, seq);
+    return 1;
+}
+
+/**
+ * @brief Dispatch one complete frame received from a client.
+ */
+void handle_client_frame(int slot, uint8_t *frame, size_t frame_len, size_t payload_off, size_t payload_len) {
+    char line[CHAT_MAX_PAYLOAD + 1];
+
+    if ((chat_type(frame) == CHAT_MSG_CHAT || chat_type(frame) == CHAT_MSG_COMMAND)
+            && is_duplicate(slot, chat_sequence(frame))) {
+        return;
+    }
+
+    switch (chat_type(frame)) {
+    case CHAT_MSG_CHAT:
+        handle_chat(slot, frame, frame_len, frame + payload_off, payload_len);
+        break;
+    case CHAT_MSG_COMMAND:
+        memcpy(line, frame + payload_off, payload_len);
+        line[payload_len] = '\0';
+        handle_command(slot, line, chat_sequence(frame));
+        break;
+    case CHAT_MSG_CREDIT:
+        grant_credit(slot, chat_sequence(frame));
+        break;
+    case CHAT_MSG_PING:
+        send_pong(slot, frame);
+        break;
+    case CHAT_MSG_NACK:
+        repair_messages(slot, frame, frame + payload_off, payload_len);
+        break;
+    default:
+        queue_error(slot, "ERR unexpected frame type");
+        break;
+    }
+}
+
+/**
+ * @brief Handle up to max_frames complete frames in the slot's receive buffer.
+ * A partial frame stays in the buffer until the rest arrives, and so do frames beyond
+ * max_frames; a malformed frame (bad length) means the stream can't be resynchronised,
+ * so the client is dropped.
+ * @return Number of frames handled.
+ */
+int process_client_input(int slot, int max_frames) {
+    struct client_session *s = &client_session[slot];
+    size_t start = 0;
+    int handled = 0;
+
+    while (start < s->inbuf_len && handled < max_frames) {
+        size_t payload_off, payload_len;
+        ssize_t frame_len = chat_frame_parse(s->inbuf + start, s->inbuf_len - start, &payload_off, &payload_len);
+
+        if (frame_len == 0) break;
+        if (frame_len < 0) {
+            printf("Malformed frame from socket %d, disconnecting\n", client_socket[slot]);
+            disconnect_client(slot);
+            return handled;
+        }
+        handle_client_frame(slot, s->inbuf + start, frame_len, payload_off, payload_len);
+        handled++;
+        if (client_socket[slot] == 0) return handled; // Disconnected while handling the frame
+        start += frame_len;
+    }
+    memmove(s->inbuf, s->inbuf + start, s->inbuf_len - start);
+    s->inbuf_len -= start;
+    return handled;
+}
+
+/**
+ * @brief Read and handle a client's input until the socket is drained, or until it
+ * has had READ_BUDGET_BYTES or READ_BUDGET_FRAMES this iteration. A client cut off by
+ * its budget may still have input (unread socket data, decrypted TLS data, frames left
+ * in its buffer) that the poller will not necessarily report again, so it is flagged
+ * and served again next iteration, after every other client has had its turn.
+ * That way one heavy sender costs the others at most one budget's worth of latency.
+ * @return Bytes read.
+ */
+size_t service_client_input(int slot) {
+    struct client_session *s = &client_session[slot];
+    size_t bytes = 0;
+    ssize_t recv_bytes;
+    int frames;
+
+    s->read_more = 0;
+    // Frames left over from the previous turn go first
+    frames = process_client_input(slot, READ_BUDGET_FRAMES);
+    while (client_socket[slot] > 0 && frames < READ_BUDGET_FRAMES && bytes < READ_BUDGET_BYTES) {
+        // Every complete frame has been handled, so a partial one leaves room to read into
+        recv_bytes = client_read(slot, s->inbuf + s->inbuf_len, sizeof s->inbuf - s->inbuf_len);
+        if (recv_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return bytes;
+        }
+        if (recv_bytes <= 0) {
+            // Client Disconnected/Error: Clean up sender_fd
+            disconnect_client(slot);
+            return bytes;
+        }
+        bytes += recv_bytes;
+        s->inbuf_len += recv_bytes;
+        frames += process_client_input(slot, READ_BUDGET_FRAMES - frames);
+    }
+    if (client_socket[slot] > 0) {
+        s->read_more = 1;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Write out what is queued for a client. Anything the socket does not accept
+ * stays queued and the socket is watched for POLLER_OUT. A paused offline delivery is
+ * topped up again each time the queue drains.
+ * @return Bytes written.
+ */
+size_t flush_client(int i) {
+    struct tls_conn *tls = client_session[i].tls;
+    size_t total = 0;
+    ssize_t written;
+    int staged;
+
+    // Finish a TLS record left over from the previous flush before anything else
+    if(tls != NULL && (staged = tls_flush(tls)) != 1) {
+        if(staged == -1) disconnect_client(i);
+        return 0;
+    }
+    // Retransmissions and packets the congestion window held back go first
+    if(client_session[i].rudp != NULL && rudp_flush(client_session[i].rudp) == -1) {
+        perror("UDP client unreachable");
+        disconnect_client(i);
+        return 0;
+    }
+    do {
+        resume_offline_delivery(i);
+        if(outq_empty(&client_session[i].outq)) break;
+        if((written = outq_flush(&client_session[i].outq, client_writev, &i)) == -1) {
+            perror("send");
+            disconnect_client(i);
+            break;
+        }
+        total += written;
+    } while(written > 0 && outq_empty(&client_session[i].outq) && client_session[i].user_id >= 0
+            && offline_queue_pending(&registered_users[client_session[i].user_id].queue));
+    return total;
+}
+
+/**
+ * @brief Accept a connection and give it a free slot. With a TLS context the
+ * handshake is started here and finished by the main loop as the socket becomes
+ * readable (or writable).
+ */
+void accept_client(int listen_fd, SSL_CTX *ctx) {
+    struct sockaddr_storage their_addr; // connector's address info
+    socklen_t sin_size = sizeof their_addr;
+    char remote_ip[INET6_ADDRSTRLEN];
+    int afd, one = 1;
+
+    if( (afd = accept(listen_fd, (struct sockaddr *)&their_addr, &sin_size)) == -1) {
+        perror("Couldn't accept");
+        return;
+    }
+    // Successfully accepted, print client details
+    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr), remote_ip, sizeof(remote_ip));
+    printf("New %sconnection accepted on socket %d from IP: %s\n", ctx != NULL ? "TLS " : "", afd, remote_ip);
+    // Writes go through the outbound queue, so the socket must never block the loop
+    fcntl(afd, F_SETFL, fcntl(afd, F_GETFL) | O_NONBLOCK);
+    // The outbound queue already batches with writev(); Nagle would only hold a PONG or
+    // an ACK back until the client ACKs the previous segment
+    setsockopt(afd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+#ifdef SO_BUSY_POLL
+    // Let reads on this socket poll the device queue instead of waiting for an interrupt.
+    // Raising it above net.core.busy_read needs CAP_NET_ADMIN, so this is best effort.
+    if (busy_poll_us > 0) {
+        static int warned = 0;
+        int usec = (int)busy_poll_us;
+        if (setsockopt(afd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec) == -1 && !warned) {
+            perror("setsockopt SO_BUSY_POLL (continuing with event loop spinning only)");
+            warned = 1;
+        }
+    }
+#endif
+
+    //afd is the new client connection, loop through client sockets
+    for(int i = 0; i < MAX_CLIENTS; i++) {
+        int client_fd = client_socket[i];
+        if(client_fd == 0) {
+            if (poller_add(poller, afd, POLLER_IN) == -1) {
+                perror("poller_add client");
+                close(afd);
+                return;
+            }
+            if (ctx != NULL && ((client_session[i].tls = tls_new(ctx, afd, NULL)) == NULL
+                    || tls_handshake(client_session[i].tls) == -1)) {
+                tls_free(client_session[i].tls);
+                client_session[i].tls = NULL;
+                poller_del(poller, afd);
+                close(afd);
+                return;
+            }
+            client_socket[i] = afd;
+            printf("Client assigned to array slot [%d]\n", i);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Take every HELLO waiting on the UDP listener. Each new client gets a socket
+ * of its own, connected to it (rudp_open()), so from here on it sits in a slot like
+ * a TCP client. A HELLO from a client that already has a slot is a retry whose
+ * WELCOME got lost; its connection answers the retry itself.
+ */
+void accept_udp_clients(int listen_fd) {
+    struct rudp_hello hello;
+    char remote_ip[INET6_ADDRSTRLEN];
+    int afd, rv, slot;
+
+    while ((rv = rudp_next_hello(listen_fd, &hello)) == 1) {
+        for (slot = 0; slot < MAX_CLIENTS; slot++) {
+            if (client_socket[slot] > 0 && client_session[slot].rudp != NULL
+                    && rudp_same_peer(client_session[slot].rudp, &hello)) break;
+        }
+        if (slot < MAX_CLIENTS) continue;
+        for (slot = 0; slot < MAX_CLIENTS && client_socket[slot] != 0; slot++) {
+        }
+        inet_ntop(hello.peer.ss_family, get_in_addr((struct sockaddr *)&hello.peer), remote_ip, sizeof(remote_ip));
+        if (slot == MAX_CLIENTS) {
+            printf("No free slot for the UDP client at %s\n", remote_ip);
+            continue;
+        }
+        if ((afd = rudp_open(&hello)) == -1) continue;
+        if (poller_add(poller, afd, POLLER_IN) == -1) {
+            perror("poller_add client");
+            close(afd);
+            continue;
+        }
+        if ((client_session[slot].rudp = rudp_new(afd, RUDP_SERVER | RUDP_PER_ROOM)) == NULL) {
+            poller_del(poller, afd);
+            close(afd);
+            continue;
+        }
+        client_socket[slot] = afd;
+        printf("New UDP connection on socket %d from IP: %s\n", afd, remote_ip);
+        printf("Client assigned to array slot [%d]\n", slot);
+    }
+}
+
+// --- Pre-fork supervisor ---
+
+#define WORKER_MIN_UPTIME 1 // Seconds; a worker dying faster than this is restarted after a pause
+
+volatile sig_atomic_t supervisor_stop = 0;
+
+static void supervisor_signal(int sig) {
+    (void)sig;
+    supervisor_stop = 1;
+}
+
+/**
+ * @brief Fork worker w. Returns 0 in the child, the pid (or -1) in the supervisor.
+ */
+static pid_t start_worker(int w) {
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork worker");
+    } else if (pid == 0) {
+#ifdef __linux__
+        // Do not outlive the supervisor
+        prctl(PR_SET_PDEATHSIG, SIGINT);
+#endif
+        worker_id = w;
+    } else {
+        printf("[SUPERVISOR] Started worker %d (pid %d)\n", w, (int)pid);
+    }
+    return pid;
+}
+
+/**
+ * @brief Pre-fork mode: run num_workers copies of the server and keep them running.
+ * Each worker binds its own SO_REUSEPORT listener, so the kernel spreads connections
+ * across them, and they exchange room broadcasts, presence and direct messages over
+ * the shared bus. A worker that crashes only takes its own clients with it; the
+ * supervisor releases its users and starts a replacement.
+ * The supervisor keeps the admin console: "quit" on stdin stops every worker.
+ * @return Only in a worker process, with that worker's index.
+ */
+int run_supervisor(int num_workers) {
+    pid_t pids[BUS_MAX_WORKERS];
+    time_t started[BUS_MAX_WORKERS];
+    struct sigaction sa;
+
+    for (int w = 0; w < num_workers; w++) {
+        if ((pids[w] = start_worker(w)) == 0) return w;
+        started[w] = time(NULL);
+    }
+
+    // No SA_RESTART: a signal has to interrupt select() so the loop can stop
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = supervisor_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!supervisor_stop) {
+        struct timeval tv = { 1, 0 };
+        fd_set readfds;
+        int status;
+        pid_t pid;
+
+        FD_ZERO(&readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+        if (select(STDIN_FILENO + 1, &readfds, NULL, NULL, &tv) > 0) {
+            char cmd_buffer[16];
+            if (fgets(cmd_buffer, sizeof cmd_buffer, stdin) == NULL || strncmp(cmd_buffer, "quit", 4) == 0) {
+                printf("Supervisor received 'quit' command. Shutting down...\n");
+                break;
+            }
+            printf("Command ignored.\n");
+        }
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int w = 0; w < num_workers; w++) {
+                if (pids[w] != pid) continue;
+                printf("[SUPERVISOR] Worker %d (pid %d) %s %d, restarting\n", w, (int)pid,
+                       WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+                       WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+                bus_worker_died(bus, w);
+                if (time(NULL) - started[w] < WORKER_MIN_UPTIME) {
+                    sleep(WORKER_MIN_UPTIME); // Don't spin on a worker that dies at startup
+                }
+                if ((pids[w] = start_worker(w)) == 0) return w;
+                started[w] = time(NULL);
+            }
+        }
+    }
+
+    // Workers spill their offline queues on SIGINT, just like the single-process server
+    for (int w = 0; w < num_workers; w++) {
+        if (pids[w] > 0) kill(pids[w], SIGINT);
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    printf("All workers stopped. Exiting supervisor.\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    //printf("[DIAGNOSTIC] Server execution started.\n");
+    int running = 1;
+    const char *tls_cert = NULL, *tls_key = NULL;
+    int num_workers = 0;
+    int backend = POLLER_DEFAULT;
+    struct poller_event ev;
+    struct sigaction sa;
+    int stdin_ready, listener_ready, tls_listener_ready, udp_listener_ready, bus_ready;
+    int udp = 0;
+    //int client_socket[MAX_CLIENTS]; // This list holds the client sockets that are attempting connection to the server
+    int activity;
+    int read_start = 0; // Client slot served first this iteration, rotated every iteration
+    char buffer[BUF_SIZE];
+
+    // Clear out all the client sockets before proceeding further
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        client_socket[i] = 0;
+        client_session[i].user_id = -1;
+        client_session[i].room_id = 0;
+        client_session[i].inbuf_len = 0;
+        client_session[i].credit_enabled = 0;
+        client_session[i].credits = 0;
+        client_session[i].dropped = 0;
+        memset(client_session[i].known_users, 0, sizeof client_session[i].known_users);
+        dedup_init(&client_session[i].seen);
+        outq_init(&client_session[i].outq);
+        client_session[i].tls = NULL;
+        client_session[i].rudp = NULL;
+        client_session[i].revents = 0;
+        client_session[i].read_more = 0;
+        client_session[i].multicast = 0;
+    }
+
+    for (int k = 1; k < argc; k++) {
+        if (strcmp(argv[k], "--tls-cert") == 0 && k + 1 < argc) {
+            tls_cert = argv[++k];
+        } else if (strcmp(argv[k], "--tls-key") == 0 && k + 1 < argc) {
+            tls_key = argv[++k];
+        } else if (strcmp(argv[k], "--workers") == 0 && k + 1 < argc) {
+            num_workers = atoi(argv[++k]);
+        } else if (strcmp(argv[k], "--poller") == 0 && k + 1 < argc) {
+            if ((backend = poller_parse_backend(argv[++k])) == -1) {
+                fprintf(stderr, "Unknown or unavailable poller backend '%s'\n", argv[k]);
+                exit(1);
+            }
+        } else if (strcmp(argv[k], "--busy-poll") == 0 && k + 1 < argc) {
+            busy_poll_us = atol(argv[++k]);
+        } else if (strcmp(argv[k], "--retain-age") == 0 && k + 1 < argc) {
+            retention.max_age_sec = strtoull(argv[++k], NULL, 10);
+        } else if (strcmp(argv[k], "--retain-count") == 0 && k + 1 < argc) {
+            retention.max_count = strtoull(argv[++k], NULL, 10);
+        } else if (strcmp(argv[k], "--retain-bytes") == 0 && k + 1 < argc) {
+            retention.max_bytes = strtoull(argv[++k], NULL, 10);
+        } else if (strcmp(argv[k], "--compact-rate") == 0 && k + 1 < argc) {
+            retention.rate_bytes = strtoull(argv[++k], NULL, 10);
+        } else if (strcmp(argv[k], "--recent-cache") == 0 && k + 1 < argc) {
+            recent_cache_bytes = strtoull(argv[++k], NULL, 10);
+        } else if (strcmp(argv[k], "--slow-loop") == 0 && k + 1 < argc) {
+            slow_loop_us = strtoul(argv[++k], NULL, 10);
+        } else if (strcmp(argv[k], "--stall-timeout") == 0 && k + 1 < argc) {
+            stall_timeout_ms = strtoul(argv[++k], NULL, 10);
+        } else if (strcmp(argv[k], "--profile") == 0 && k + 1 < argc) {
+            profile_hz = atoi(argv[++k]);
+        } else if (strcmp(argv[k], "--multicast") == 0 && k + 1 < argc) {
+            mcast_spec = argv[++k];
+            if (multicast_parse_group(mcast_spec, &mcast_group) == -1) {
+                fprintf(stderr, "--multicast needs an IPv4 multicast GROUP:PORT, e.g. 239.255.0.1:5000\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[k], "--multicast-if") == 0 && k + 1 < argc) {
+            mcast_if = argv[++k];
+        } else if (strcmp(argv[k], "--udp") == 0) {
+            udp = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--poller select|poll|epoll|io_uring] [--busy-poll USEC] [--workers N]"
+                    " [--tls-cert FILE --tls-key FILE] [--retain-age SEC] [--retain-count N]"
+                    " [--retain-bytes N] [--compact-rate BYTES_PER_SEC] [--recent-cache BYTES]"
+                    " [--slow-loop USEC] [--stall-timeout MS] [--profile HZ]"
+                    " [--multicast GROUP:PORT [--multicast-if ADDR]] [--udp]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // Fork before anything else: the workers start their own threads and sockets
+    if (num_workers > 0) {
+        if ((bus = bus_create(num_workers)) == NULL) {
+            exit(1);
+        }
+        room_seq = bus->room_seq;
+    }
+    // Message numbering carries on from the log. Loaded before forking, so a restarted
+    // worker does not take back numbers the others have given out since.
+    if (history_last_seqs(HISTORY_DIR, room_seq, MAX_ROOMS) > 0) {
+        printf("Message numbering resumed from the history log\n");
+    }
+    if (bus != NULL) {
+        worker_id = run_supervisor(num_workers);
+        bus_read_seq = bus_cursor(bus);
+        printf("Worker %d running as pid %d\n", worker_id, (int)getpid());
+    }
+
+    if (pipe(stop_pipe) == -1 || fcntl(stop_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+        perror("stop pipe");
+        exit(1);
+    }
+    // No SA_RESTART: a signal has to interrupt poller_wait() so the loop can stop
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = sigint_handler;
+    if (sigaction(SIGINT, &sa, NULL) == -1) {
+        perror("Could not set up SIGINT handler");
+    }
+    // A client that disconnects while we write to it must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (mkdir(OFFLINE_DIR, 0700) == -1 && errno != EEXIST) {
+        perror("mkdir offline queue directory");
+    }
+    if (presence_init(MAX_USERS) == -1 || recent_cache_init(MAX_ROOMS, recent_cache_bytes) == -1) {
+        exit(1);
+    }
+    if (history_open(&history_log) == 0) {
+        history_reader_open(&history_search_reader, HISTORY_DIR);
+        search_index_start(HISTORY_DIR);
+        // One compactor for the whole log, also in pre-fork mode
+        if (worker_id <= 0) {
+            compactor_start(HISTORY_DIR, &retention);
+        }
+    }
+    load_rooms();
+    // After the fork: each worker watches its own loop
+    if (loop_watch_start(slow_loop_us, stall_timeout_ms) == -1) {
+        exit(1);
+    }
+    // Samples this thread, the one running the event loop
+    if (profile_hz > 0) {
+        if (profiler_start(profile_hz) == -1) {
+            exit(1);
+        }
+        printf("Profiling the event loop at %d Hz\n", profile_hz);
+    }
+
+    // Created after the fork: every worker needs its own epoll / io_uring instance
+    if ((poller = poller_create(backend)) == NULL) {
+        exit(1);
+    }
+    printf("Using the %s poller\n", poller_backend_name(backend));
+    if (busy_poll_us > 0) {
+        poller_set_busy_poll(poller, busy_poll_us);
+        printf("Busy polling: spinning up to %ld us before each blocking wait\n", busy_poll_us);
+    }
+    // In pre-fork mode the supervisor owns the console and the bus wakes us instead
+    if (bus != NULL) {
+        if (poller_add(poller, bus->event_fd[worker_id], POLLER_IN) == -1) {
+            perror("poller_add bus");
+            exit(1);
+        }
+    } else if (poller_add(poller, STDIN_FILENO, POLLER_IN) == -1) {
+        // epoll refuses regular files, e.g. stdin redirected from /dev/null
+        perror("Admin console disabled: poller_add stdin");
+    }
+    if (poller_add(poller, stop_pipe[0], POLLER_IN) == -1) {
+        perror("poller_add stop pipe");
+        exit(1);
+    }
+
+    if (mcast_spec != NULL) {
+        if ((mcast_fd = multicast_open_sender(mcast_if)) == -1) {
+            exit(1);
+        }
+        printf("Rooms with subscribers are published to multicast group %s\n", mcast_spec);
+    }
+
+    //printf("Before running setup_listener\n");
+
+    if((listener_sfd = setup_listener(PORT, SOCK_STREAM)) == 0) {
+        printf("listener socket is %d\n", listener_sfd);
+        perror("Couldn't set up a listening socket");
+        exit(1);
+    }
+    if (poller_add(poller, listener_sfd, POLLER_IN) == -1) {
+        perror("poller_add listener");
+        exit(1);
+    }
+
+    if (tls_cert != NULL || tls_key != NULL) {
+        if (tls_cert == NULL || tls_key == NULL || (tls_ctx = tls_server_ctx(tls_cert, tls_key, 1)) == NULL) {
+            fprintf(stderr, "TLS needs both a usable --tls-cert and --tls-key\n");
+            exit(1);
+        }
+        if ((tls_listener_sfd = setup_listener(TLS_PORT, SOCK_STREAM)) == 0) {
+            perror("Couldn't set up the TLS listening socket");
+            exit(1);
+        }
+        // Resumption keys come from a secret shared by every server process on the host
+        tls_enable_tickets(tls_ctx, TLS_TICKET_SECRET);
+        printf("Accepting TLS connections on port %s\n", TLS_PORT);
+        if (poller_add(poller, tls_listener_sfd, POLLER_IN) == -1) {
+            perror("poller_add TLS listener");
+            exit(1);
+        }
+    }
+    if (udp) {
+        if ((udp_listener_sfd = setup_listener(RUDP_PORT, SOCK_DGRAM)) == 0) {
+            perror("Couldn't set up the UDP listening socket");
+            exit(1);
+        }
+        printf("Accepting UDP connections on port %s\n", RUDP_PORT);
+        if (poller_add(poller, udp_listener_sfd, POLLER_IN) == -1) {
+            perror("poller_add UDP listener");
+            exit(1);
+        }
+    }
+    // Infinite loop that allows the socket to listen forever
+    while(running) {
+        // 1. UPDATE WRITE INTEREST
+        // Every socket is always watched for input; clients with queued output (or a
+        // handshake waiting to write) are also watched for writability
+        for(int i = 0; i < MAX_CLIENTS; i++) {
+            if(client_socket[i] > 0) {
+                struct tls_conn *tls = client_session[i].tls;
+                int events = POLLER_IN;
+                if (tls != NULL && !tls->established) {
+                    if (tls->want_write) events |= POLLER_OUT;
+                } else if (client_session[i].rudp != NULL) {
+                    // A UDP socket is nearly always writable; what it waits for is ACKs
+                    // and timers, so only a full socket buffer is worth watching
+                    if (rudp_wants_write(client_session[i].rudp)) events |= POLLER_OUT;
+                } else if (!outq_empty(&client_session[i].outq) || (tls != NULL && tls_wants_write(tls))) {
+                    events |= POLLER_OUT;
+                }
+                poller_mod(poller, client_socket[i], events);
+            }
+        }
+        // --- B. WAITING (poller_wait() call) ---
+        // Blocks here until activity occurs on ANY monitored socket, or until the
+        // next presence snapshot is due
+        long presence_wait = presence_timeout_ms(now_ms());
+        if (mcast_fd != -1) {
+            long sync_wait = mcast_next_sync - now_ms();
+            if (sync_wait < 0) sync_wait = 0;
+            if (presence_wait < 0 || sync_wait < presence_wait) presence_wait = sync_wait;
+        }
+        // Clients with input left over from the last iteration must not wait for new events,
+        // and UDP clients have retransmission, pacing and keepalive timers of their own
+        for(int i = 0; i < MAX_CLIENTS; i++) {
+            if(client_socket[i] <= 0) continue;
+            if(client_session[i].read_more) presence_wait = 0;
+            if(client_session[i].rudp != NULL) {
+                long udp_wait = rudp_timeout_ms(client_session[i].rudp);
+                if (presence_wait < 0 || udp_wait < presence_wait) presence_wait = udp_wait;
+            }
+        }
+        activity = poller_wait(poller, (int)presence_wait);
+
+        if (stop_requested) {
+            printf("Server received SIGINT. Shutting down...\n");
+            cleanup_and_exit();
+        }
+        if ((activity < 0) && (errno != EINTR)) {
+            // A genuine, non-interrupt error occurred
+            perror("poller_wait error");
+            // Server should likely continue or attempt recovery, but for simplicity:
+            continue; 
+        }
+        loop_watch_iteration_begin();
+        // Sort the ready descriptors into flags for the handlers below
+        stdin_ready = listener_ready = tls_listener_ready = udp_listener_ready = bus_ready = 0;
         for(int i = 0; i < MAX_CLIENTS; i++) {
+            client_session[i].revents = 0;
+        }
+        while (poller_next(poller, &ev)) {
+            if (bus == NULL && ev.fd == STDIN_FILENO) {
+                stdin_ready = 1;
+            } else if (bus != NULL && ev.fd == bus->event_fd[worker_id]) {
+                bus_ready = 1;
+            } else if (ev.fd == listener_sfd) {
+                listener_ready = 1;
+            } else if (ev.fd == tls_listener_sfd) {
+                tls_listener_ready = 1;
+            } else if (ev.fd == udp_listener_sfd) {
+                udp_listener_ready = 1;
+            } else {
+                for(int i = 0; i < MAX_CLIENTS; i++) {
+                    if(client_socket[i] == ev.fd) {
+                        client_session[i].revents = ev.events;
+                        break;
+                    }
+                }
+            }
+        }
+        // --- C. EXECUTION (Handling the ready sockets) ---
+        // 1. Check STDIN_FILENO (Server Command)
+        if (stdin_ready) {
+            char cmd_buffer[16];
+            loop_watch_handler_begin(LOOP_CONSOLE, STDIN_FILENO);
+            // Read 15 chars plus null terminator
+            if (fgets(cmd_buffer, 16, stdin) != NULL) {
+                if (strncmp(cmd_buffer, "quit", 4) == 0) {
+                    printf("Server received 'quit' command. Shutting down...\n");
+                    cleanup_and_exit();
+                } else if (strncmp(cmd_buffer, "stats", 5) == 0) {
+                    print_recent_cache_stats();
+                    print_loop_stats();
+                    print_multicast_stats();
+                    print_udp_stats();
+                } else if (strncmp(cmd_buffer, "slow", 4) == 0) {
+                    loop_watch_dump(stdout);
+                } else {
+                    printf("Command ignored.\n");
+                }
+            }
+            loop_watch_handler_end(0);
+        }
+        // Now time for the listener socket to accept and accept client messages
+        if(listener_ready) {
+            loop_watch_handler_begin(LOOP_ACCEPT, listener_sfd);
+            accept_client(listener_sfd, NULL);
+            loop_watch_handler_end(0);
+        }
+        if(tls_listener_ready) {
+            loop_watch_handler_begin(LOOP_ACCEPT, tls_listener_sfd);
+            accept_client(tls_listener_sfd, tls_ctx);
+            loop_watch_handler_end(0);
+        }
+        if(udp_listener_ready) {
+            loop_watch_handler_begin(LOOP_ACCEPT, udp_listener_sfd);
+            accept_udp_clients(udp_listener_sfd);
+            loop_watch_handler_end(0);
+        }
+
+        // Start one slot further every iteration so no client is always served first
+        for(int k = 0; k < MAX_CLIENTS; k++) {
+            int i = (read_start + k) % MAX_CLIENTS;
             int avail_cfd = client_socket[i];
             // This is an accepted client socket from which we can receive
-            if(avail_cfd > 0 && FD_ISSET(avail_cfd, &readfds)) {
-                char buffer_test[BUF_SIZE];
-                recv_bytes = recv(avail_cfd, buffer_test, BUF_SIZE - 1, 0);
-                if (recv_bytes <= 0) {
-                    // Client Disconnected/Error: Clean up sender_fd
-                    close(avail_cfd);
-                    client_socket[i] = 0;
-                    continue; // Go to the next client slot
+            struct client_session *s = &client_session[i];
+            if(avail_cfd > 0 && s->tls != NULL && !s->tls->established) {
+                // Nothing but the handshake happens until it completes
+                if (s->revents != 0) {
+                    loop_watch_handler_begin(LOOP_HANDSHAKE, avail_cfd);
+                    if (tls_handshake(s->tls) == -1) {
+                        disconnect_client(i);
+                    }
+                    loop_watch_handler_end(0);
                 }
-                buffer_test[recv_bytes] = '\0'; // Null-terminate the received data
-                printf("[RECV SUCCESS] Server says: '%s' (%d bytes received)\n", buffer_test, recv_bytes);
-                // B. Send acknowledgement (optional but good practice)
-                send(avail_cfd, "ACK", 3, 0);
-                // C. BROADCAST to others (Go to Step 3)
-                // Pass the actual sender's FD to the broadcast function
-                broadcast_message(avail_cfd, buffer_test, recv_bytes);
+                continue;
+            }
+            if(avail_cfd > 0 && ((s->revents & POLLER_IN) || s->read_more)) {
+                loop_watch_handler_begin(LOOP_READ, avail_cfd);
+                loop_watch_handler_end(service_client_input(i));
+            }
+        }
+        read_start = (read_start + 1) % MAX_CLIENTS;
+
+        // Messages other workers published for our clients
+        if (bus_ready) {
+            loop_watch_handler_begin(LOOP_BUS, bus->event_fd[worker_id]);
+            bus_poll(bus, worker_id, &bus_read_seq, deliver_bus_message, NULL);
+            loop_watch_handler_end(0);
+        }
+
+        // Send the coalesced presence deltas if a snapshot is due
+        loop_watch_handler_begin(LOOP_PRESENCE, -1);
+        presence_tick(now_ms(), send_presence, NULL);
+        loop_watch_handler_end(0);
+
+        // --- D. FLUSH the outbound queues ---
+        // Anything queued during this iteration is written right away
+        int clients = 0, deepest_fd = -1;
+        size_t queued = 0, deepest = 0;
+        for(int i = 0; i < MAX_CLIENTS; i++) {
+            struct tls_conn *tls = client_session[i].tls;
+            if(client_socket[i] <= 0) continue;
+            if(tls != NULL && !tls->established) continue;
+            loop_watch_handler_begin(LOOP_FLUSH, client_socket[i]);
+            loop_watch_handler_end(flush_client(i));
+            if(client_socket[i] <= 0) continue;
+            clients++;
+            queued += client_session[i].outq.total_bytes;
+            if(client_session[i].outq.total_bytes > deepest) {
+                deepest = client_session[i].outq.total_bytes;
+                deepest_fd = client_socket[i];
             }
         }
+        // Datagrams last: the frames introducing their senders went out just above
+        if (mcast_fd != -1) {
+            loop_watch_handler_begin(LOOP_MULTICAST, mcast_fd);
+            multicast_tick(now_ms());
+            loop_watch_handler_end(multicast_flush());
+        }
+        loop_watch_iteration_end(clients, queued, deepest, deepest_fd);
     // End of infinite while loop
     }
+    poller_free(poller);
     close(listener_sfd);
 
     for(int k = 0; k < MAX_CLIENTS; k++) {
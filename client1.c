@@ -1,4 +1,17 @@
 // Craft a client that connects to a server and sends a message
+//
+// Build: gcc -Wall -o client1 client1.c tls.c poller.c multicast.c rudp.c -lssl -lcrypto
+// Usage: client1 [--tls server.crt | --udp] [--poller select|poll|epoll|io_uring]
+//                [--probe PINGS_PER_SEC [--probe-count N] | --send FILE]
+//                [--multicast GROUP:PORT [--multicast-if ADDR]]
+//        (TLS: connect to TLS_PORT, trusting server.crt)
+// --udp connects to RUDP_PORT over UDP (server started with --udp): each room's messages
+// arrive in order, but a packet lost on the way only holds back its own rooms (see rudp.h).
+// --probe does not chat: it sends N pings at the given rate, then prints an RTT histogram.
+// --send sends every line of FILE ("-" for standard input) as fast as the server
+// acknowledges them, then exits; lines starting with '/' are commands as usual.
+// --multicast joins the server's multicast group and asks for the room's messages to
+// come from there (see multicast.h); gaps are asked for again over the connection.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,15 +21,45 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/ioctl.h> // FIONREAD
+#include <fcntl.h>
+#include <poll.h>
+
+#include "chat_protocol.h"
+#include "tls.h"
+#include "poller.h"
+#include "multicast.h"
+#include "rudp.h"
+#define TLS_SERVER_NAME "localhost" // Name the server certificate must be issued to
 
 #define PORT "3491"
 #define HOST "127.0.0.1"
 #define MAX_MESSAGE_LENGTH 256
 #define MESSAGE_PROMPT "Type Message > "
+#define CREDIT_WINDOW 256 // Messages the server may send before we grant more
+#define MAX_KNOWN_USERS 64 // Size of the sender_id -> name table
+#define MAX_NAME_LEN 32
+#define PROBE_DEFAULT_COUNT 1000
+#define PROBE_DRAIN_MS      1000 // How long to wait for the last pongs
+#define PROBE_BUCKETS       24   // Histogram buckets: [2^k, 2^(k+1)) microseconds
+#define PROBE_BAR_WIDTH     50
+#define RECV_BUF_SIZE       (64 * 1024)  // Socket bytes read (and frames parsed) per read call
+#define DRAIN_MAX_BYTES     (256 * 1024) // Socket bytes handled per wakeup before stdin gets a turn
+#define RENDER_BUF_SIZE     (64 * 1024)  // Terminal output collected for one write
+#define RENDER_INTERVAL_MS  33           // While output floods, update the terminal at most ~30 times/s
+#define BULK_WINDOW         256          // --send: chat messages sent but not acknowledged yet
+#define BULK_INPUT_BUF      (64 * 1024)  // --send: input read per read call
+#define BULK_SEND_BUF       (64 * 1024)  // --send: frames written per send
+#define BULK_REPLY_MS       2000         // --send: longest wait for a command's ACK
+#define MC_WINDOW           1024         // --multicast: message numbers tracked below the highest seen
+#define MC_MAX_NACKS        16           // --multicast: NACK frames (missing ranges) sent per round
 
 // A flag to control the main while loop. It's declared 'volatile' 
 // because it is modified asynchronously by the signal handler.
@@ -44,18 +87,723 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int main() {
+// Names announced by the server in USER frames, indexed by sender_id
+char user_names[MAX_KNOWN_USERS][MAX_NAME_LEN];
+int current_room = 0;     // room_id from the last JOINED frame; everyone starts in the lobby
+uint64_t next_seq = 0;    // Client-assigned id of the last CHAT/COMMAND frame sent
+struct tls_conn *server_tls = NULL; // Set when connected with --tls
+struct rudp_conn *server_rudp = NULL; // Set when connected with --udp
+
+// Terminal output is collected here and written in one go, followed by the prompt,
+// instead of a printf() and a prompt redraw per message
+char render_buf[RENDER_BUF_SIZE];
+size_t render_len = 0;
+uint64_t last_render_us = 0;
+int stdout_is_tty = 0;
+int render_quiet = 0; // --send: what the server sends is not printed
+
+/**
+ * @brief Send an encoded frame, looping over partial sends.
+ * @return 0 on success, -1 on a socket error.
+ */
+int send_encoded(int sockfd, const uint8_t *frame, size_t total) {
+    size_t sent = 0;
+
+    while (sent < total) {
+        struct iovec iov = { (void *)(frame + sent), total - sent };
+        ssize_t n;
+
+        if (server_tls != NULL) n = tls_writev(server_tls, &iov, 1);
+        else if (server_rudp != NULL) n = rudp_writev(server_rudp, &iov, 1);
+        else n = send(sockfd, frame + sent, total - sent, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            // The UDP send window is full until ACKs (or a retransmission timer) free it
+            if (server_rudp != NULL && errno == EAGAIN) {
+                struct pollfd pfd = { sockfd, POLLIN, 0 };
+                if ((poll(&pfd, 1, rudp_timeout_ms(server_rudp)) != -1 || errno == EINTR)
+                        && rudp_input(server_rudp) == 0 && rudp_flush(server_rudp) == 0) {
+                    continue;
+                }
+            }
+            perror("send");
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+int send_frame(int sockfd, uint8_t type, uint64_t seq, const char *payload, size_t len) {
+    uint8_t frame[CHAT_MAX_FRAME];
+    size_t total = chat_encode(frame, type, 0, current_room, CHAT_ANONYMOUS, seq, 0, payload, len);
+
+    return send_encoded(sockfd, frame, total);
+}
+
+ssize_t client_read(int sockfd, void *buf, size_t len) {
+    if (server_tls != NULL) {
+        return tls_read(server_tls, buf, len);
+    }
+    if (server_rudp != NULL) {
+        return rudp_read(server_rudp, buf, len);
+    }
+    return recv(sockfd, buf, len, 0);
+}
+
+// Bytes client_read() returns without touching the socket, where the poller cannot see them
+size_t server_buffered(void) {
+    if (server_tls != NULL) return tls_pending(server_tls);
+    if (server_rudp != NULL) return rudp_pending(server_rudp);
+    return 0;
+}
+
+/**
+ * @brief With --udp, run the transport's timers (retransmissions, keepalives) and
+ * shorten a poller timeout to when they are due next, or to 0 if received data is
+ * waiting in the connection.
+ * @return The timeout to wait with, or -2 if the server is unreachable.
+ */
+int server_tick(int timeout) {
+    int due;
+
+    if (server_rudp == NULL) return timeout;
+    if (rudp_flush(server_rudp) == -1) {
+        perror("Server unreachable");
+        return -2;
+    }
+    due = rudp_pending(server_rudp) > 0 ? 0 : rudp_timeout_ms(server_rudp);
+    return timeout == -1 || due < timeout ? due : timeout;
+}
+
+// Monotonic microseconds: what the client puts in a PING's timestamp
+uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Write the collected output and the prompt with a single write(). On a
+ * terminal the prompt line is cleared first, so messages do not start after it.
+ */
+void render_flush(void) {
+    static const char clear_line[] = "\r\033[K";
+    static char out[sizeof clear_line + RENDER_BUF_SIZE + sizeof MESSAGE_PROMPT];
+    size_t len = 0, done = 0;
+
+    if (stdout_is_tty && render_len > 0) {
+        memcpy(out, clear_line, sizeof clear_line - 1);
+        len = sizeof clear_line - 1;
+    }
+    memcpy(out + len, render_buf, render_len);
+    len += render_len;
+    memcpy(out + len, MESSAGE_PROMPT, sizeof MESSAGE_PROMPT - 1);
+    len += sizeof MESSAGE_PROMPT - 1;
+
+    while (done < len) {
+        ssize_t n = write(STDOUT_FILENO, out + done, len - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+    render_len = 0;
+    last_render_us = monotonic_us();
+}
+
+// printf() into the render buffer; written by the next render_flush()
+void render_printf(const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (render_quiet) return;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_start(ap, fmt);
+        n = vsnprintf(render_buf + render_len, sizeof render_buf - render_len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < sizeof render_buf - render_len) {
+            render_len += n;
+            return;
+        }
+        render_flush(); // Full: write what we have and try again with an empty buffer
+    }
+    render_len = sizeof render_buf - 1; // Longer than the whole buffer: keep what fit
+}
+
+// Milliseconds until buffered output may be rendered, -1 if there is none
+int render_timeout_ms(void) {
+    uint64_t now = monotonic_us(), due = last_render_us + RENDER_INTERVAL_MS * 1000u;
+
+    if (render_len == 0) return -1;
+    return now >= due ? 0 : (int)((due - now + 999) / 1000);
+}
+
+const char *user_name(uint32_t sender_id) {
+    if (sender_id < MAX_KNOWN_USERS && user_names[sender_id][0] != '\0') {
+        return user_names[sender_id];
+    }
+    return "anonymous";
+}
+
+// --multicast: the room's CHAT frames arrive as datagrams, and a few over the connection
+// (resent on request, or sent before the switch). Each message number is shown once.
+enum { MC_OFF, MC_REQUESTED, MC_ON } mc_state = MC_OFF;
+int mc_started = 0;          // Whether mc_high is known yet for the current room
+uint64_t mc_high;            // Highest message number known to exist in the current room
+uint64_t mc_floor;           // Lowest one we look for gaps from
+unsigned char mc_seen[MC_WINDOW / 8]; // Received, by number modulo MC_WINDOW, for (mc_high - MC_WINDOW, mc_high]
+uint64_t mc_nack_due_us = 0; // When to look for gaps (again), 0 if none are pending
+int mc_nack_tries = 0;
+unsigned long mc_lost = 0;
+
+static int mc_bit(uint64_t seq) {
+    return mc_seen[seq % MC_WINDOW / 8] & (1 << (seq % 8));
+}
+
+static void mc_set_bit(uint64_t seq, int on) {
+    if (on) mc_seen[seq % MC_WINDOW / 8] |= 1 << (seq % 8);
+    else mc_seen[seq % MC_WINDOW / 8] &= ~(1 << (seq % 8));
+}
+
+// Start over in a room whose messages up to seq are not our concern
+void mc_reset(uint64_t seq) {
+    mc_started = 1;
+    mc_high = seq;
+    mc_floor = seq + 1;
+    memset(mc_seen, 0, sizeof mc_seen);
+    mc_nack_due_us = 0;
+    mc_nack_tries = 0;
+}
+
+// Messages up to seq exist: the ones we do not have yet are missing
+void mc_note_high(uint64_t seq) {
+    if (!mc_started) mc_reset(seq);
+    if (seq <= mc_high) return;
+    if (seq - mc_high >= MC_WINDOW) {
+        memset(mc_seen, 0, sizeof mc_seen);
+    } else {
+        for (uint64_t s = mc_high + 1; s <= seq; s++) mc_set_bit(s, 0);
+    }
+    mc_high = seq;
+    if (mc_high - mc_floor >= MC_WINDOW) mc_floor = mc_high - MC_WINDOW + 1;
+    if (mc_nack_due_us == 0) mc_nack_due_us = monotonic_us() + MULTICAST_NACK_DELAY_MS * 1000u;
+}
+
+/**
+ * @brief Note that message seq of the current room arrived.
+ * @return 1 if it is new and should be shown, 0 for a duplicate.
+ */
+int mc_accept(uint64_t seq) {
+    if (!mc_started) mc_reset(seq - 1);
+    if (seq < mc_floor) return 1; // From before the switch (or too old to track)
+    if (seq > mc_high) {
+        if (seq > mc_high + 1) mc_note_high(seq - 1);
+        mc_high = seq;
+        if (mc_high - mc_floor >= MC_WINDOW) mc_floor = mc_high - MC_WINDOW + 1;
+    } else if (mc_bit(seq)) {
+        return 0;
+    }
+    mc_set_bit(seq, 1);
+    return 1;
+}
+
+/**
+ * @brief Once a gap has been open for MULTICAST_NACK_DELAY_MS, send a NACK for every
+ * missing range; repeat every MULTICAST_NACK_RETRY_MS while anything is still missing,
+ * and after MULTICAST_NACK_TRIES rounds give it up as lost.
+ */
+void mc_check_gaps(int sockfd) {
+    uint8_t frame[CHAT_HEADER_LEN + 1 + 8], last_be[8];
+    uint64_t missing = 0, start = 0;
+    int nacks = 0;
+
+    if (mc_nack_due_us == 0 || monotonic_us() < mc_nack_due_us) return;
+    for (uint64_t s = mc_floor; s <= mc_high + 1; s++) {
+        int have = s > mc_high || mc_bit(s);
+        if (!have) {
+            if (start == 0) start = s;
+            missing++;
+        } else if (start != 0) {
+            if (mc_nack_tries == MULTICAST_NACK_TRIES) {
+                for (uint64_t m = start; m < s; m++) mc_set_bit(m, 1);
+            } else if (nacks < MC_MAX_NACKS) {
+                chat_store64(last_be, s - 1);
+                send_encoded(sockfd, frame, chat_encode(frame, CHAT_MSG_NACK, 0, current_room, CHAT_ANONYMOUS,
+                                                        start, 0, last_be, sizeof last_be));
+                nacks++;
+            }
+            start = 0;
+        }
+    }
+    if (missing == 0) {
+        mc_nack_due_us = 0;
+        mc_nack_tries = 0;
+    } else if (mc_nack_tries == MULTICAST_NACK_TRIES) {
+        mc_lost += missing;
+        render_printf("[WARNING] %llu message(s) lost\n", (unsigned long long)missing);
+        mc_nack_due_us = 0;
+        mc_nack_tries = 0;
+    } else {
+        mc_nack_tries++;
+        mc_nack_due_us = monotonic_us() + MULTICAST_NACK_RETRY_MS * 1000u;
+    }
+}
+
+// Milliseconds until mc_check_gaps() has something to do, -1 if nothing is pending
+int mc_timeout_ms(void) {
+    uint64_t now = monotonic_us();
+
+    if (mc_nack_due_us == 0) return -1;
+    return now >= mc_nack_due_us ? 0 : (int)((mc_nack_due_us - now + 999) / 1000);
+}
+
+/**
+ * @brief Display (or act on) one frame from the server.
+ * @return 1 if the frame counts against our credit window, 0 for control frames.
+ */
+int handle_server_frame(const uint8_t *frame, const uint8_t *payload, size_t payload_len) {
+    int text_len = (int)payload_len;
+    const char *text = (const char *)payload;
+    uint32_t sender_id = chat_sender(frame);
+
+    switch (chat_type(frame)) {
+    case CHAT_MSG_CHAT:
+        // Already shown from the multicast group (or this is a resend we got twice)
+        if (mc_state == MC_ON && !(chat_flags(frame) & CHAT_FLAG_REPLAY) && chat_room(frame) == current_room
+                && !mc_accept(chat_sequence(frame))) {
+            return 1;
+        }
+        // Replayed on join: messages from before we got here
+        render_printf("[%s] %s: %.*s\n", (chat_flags(frame) & CHAT_FLAG_REPLAY) ? "HISTORY" : "RECV SUCCESS",
+                      user_name(sender_id), text_len, text);
+        return 1;
+    case CHAT_MSG_ACK:
+        render_printf("[ACK] Message %llu delivered\n", (unsigned long long)chat_sequence(frame));
+        return 0;
+    case CHAT_MSG_USER:
+        if (sender_id < MAX_KNOWN_USERS) {
+            snprintf(user_names[sender_id], MAX_NAME_LEN, "%.*s", text_len, text);
+        }
+        return 0;
+    case CHAT_MSG_JOINED:
+        current_room = chat_room(frame);
+        if (mc_state == MC_ON) mc_reset(chat_sequence(frame));
+        render_printf("[RECV SUCCESS] Joined #%.*s\n", text_len, text);
+        return 1;
+    case CHAT_MSG_PRESENCE:
+        render_printf("[RECV SUCCESS] %.*s\n", text_len, text);
+        return 1;
+    case CHAT_MSG_NOTICE:
+        // "/multicast on" is sent before anything else, so the first NOTICE answers it
+        if (mc_state == MC_REQUESTED) {
+            mc_state = (chat_flags(frame) & CHAT_FLAG_ERROR) ? MC_OFF : MC_ON;
+            mc_started = 0;
+        }
+        if (chat_flags(frame) & CHAT_FLAG_ERROR) {
+            render_printf("[SERVER ERROR] %.*s\n", text_len, text);
+            return 0;
+        }
+        render_printf("[RECV SUCCESS] Server says: '%.*s'\n", text_len, text);
+        return 1;
+    default:
+        render_printf("[WARNING] Ignoring frame of unknown type %d\n", chat_type(frame));
+        return 0;
+    }
+}
+
+/**
+ * @brief Read every datagram waiting on the multicast socket. CHAT frames of our room
+ * are shown like those from the connection, but do not count against our credit:
+ * the server did not charge for them. SYNC frames only tell where the numbering is.
+ */
+void mc_receive(int mcast_fd) {
+    uint8_t datagram[CHAT_MAX_FRAME];
+    size_t payload_off, payload_len;
+    ssize_t n;
+
+    while ((n = recv(mcast_fd, datagram, sizeof datagram, 0)) > 0) {
+        if (mc_state != MC_ON || chat_frame_parse(datagram, n, &payload_off, &payload_len) != n
+                || chat_room(datagram) != current_room) {
+            continue;
+        }
+        if (chat_type(datagram) == CHAT_MSG_SYNC) {
+            mc_note_high(chat_sequence(datagram));
+        } else if (chat_type(datagram) == CHAT_MSG_CHAT && mc_accept(chat_sequence(datagram))) {
+            render_printf("[RECV SUCCESS] %s: %.*s\n", user_name(chat_sender(datagram)), (int)payload_len,
+                          (const char *)datagram + payload_off);
+        }
+    }
+}
+
+// --probe and --send: Ctrl+C stops sending, and the summary is still printed
+void stop_sigint_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void print_rtt_histogram(uint64_t *rtts, int received, int sent) {
+    int buckets[PROBE_BUCKETS] = { 0 };
+    int first = PROBE_BUCKETS, last = 0, most = 1;
+    uint64_t sum = 0;
+
+    printf("\n--- %d pings sent, %d pongs received, %d lost ---\n", sent, received, sent - received);
+    if (received == 0) return;
+    qsort(rtts, received, sizeof rtts[0], cmp_u64);
+    for (int k = 0; k < received; k++) {
+        int b = 0;
+        while (b < PROBE_BUCKETS - 1 && rtts[k] >= (2ull << b)) b++;
+        buckets[b]++;
+        sum += rtts[k];
+        if (b < first) first = b;
+        if (b > last) last = b;
+    }
+    printf("RTT min %llu us, avg %llu us, p50 %llu us, p99 %llu us, max %llu us\n",
+           (unsigned long long)rtts[0], (unsigned long long)(sum / received),
+           (unsigned long long)rtts[received / 2], (unsigned long long)rtts[received * 99 / 100],
+           (unsigned long long)rtts[received - 1]);
+    for (int b = first; b <= last; b++) {
+        if (buckets[b] > most) most = buckets[b];
+    }
+    for (int b = first; b <= last; b++) {
+        int width = buckets[b] * PROBE_BAR_WIDTH / most;
+        printf("%8llu - %-8llu us |%-*.*s| %d\n", b == 0 ? 0ull : 1ull << b, (2ull << b) - 1,
+               PROBE_BAR_WIDTH, width, "##################################################", buckets[b]);
+    }
+}
+
+/**
+ * @brief --probe: send count pings at rate per second and collect the pongs. Other
+ * frames are ignored. Ctrl+C stops early and still prints the histogram.
+ * @return Process exit status.
+ */
+int run_probe(int sockfd, struct poller *poller, int rate, int count) {
+    uint8_t recv_buffer[2 * CHAT_MAX_FRAME];
+    size_t recv_len = 0;
+    uint64_t *rtts = calloc(count, sizeof *rtts);
+    uint64_t interval = 1000000u / rate, next_send = monotonic_us(), drain_until = 0;
+    int sent = 0, received = 0, one = 1;
+
+    if (rtts == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    signal(SIGINT, stop_sigint_handler);
+    // Each ping goes out on its own instead of waiting behind Nagle for the last pong
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    printf("Probing with %d pings at %d/s...\n", count, rate);
+
+    while (running) {
+        uint64_t now = monotonic_us();
+        struct poller_event ev;
+        int timeout_ms;
+
+        if (sent == count && (received == sent || now >= drain_until)) break;
+        if (sent < count && now >= next_send) {
+            uint8_t ping[CHAT_HEADER_LEN + 1];
+            size_t len = chat_encode_header(ping, CHAT_MSG_PING, 0, 0, CHAT_ANONYMOUS, sent, now, 0);
+            if (send_encoded(sockfd, ping, len) == -1) break;
+            sent++;
+            next_send += interval;
+            if (sent == count) drain_until = now + PROBE_DRAIN_MS * 1000u;
+            continue;
+        }
+        timeout_ms = (int)(((sent < count ? next_send : drain_until) - now + 999) / 1000);
+        if ((timeout_ms = server_tick(timeout_ms)) == -2) break;
+        if (poller_wait(poller, timeout_ms) < 0 && errno != EINTR) {
+            perror("poller_wait error");
+            break;
+        }
+        if (!poller_next(poller, &ev) && server_buffered() == 0) continue;
+
+        do {
+            ssize_t n = client_read(sockfd, recv_buffer + recv_len, sizeof recv_buffer - recv_len);
+            size_t start = 0;
+
+            if (n == -1 && errno == EAGAIN) break; // Only an ACK or a keepalive (--udp)
+            if (n <= 0) {
+                printf("[INFO] Server disconnected.\n");
+                running = 0;
+                break;
+            }
+            recv_len += n;
+            while (start < recv_len) {
+                size_t payload_off, payload_len;
+                ssize_t frame_len = chat_frame_parse(recv_buffer + start, recv_len - start, &payload_off, &payload_len);
+                if (frame_len <= 0) {
+                    if (frame_len < 0) running = 0;
+                    break;
+                }
+                if (chat_type(recv_buffer + start) == CHAT_MSG_PONG && received < count) {
+                    rtts[received++] = monotonic_us() - chat_timestamp(recv_buffer + start);
+                }
+                start += frame_len;
+            }
+            memmove(recv_buffer, recv_buffer + start, recv_len - start);
+            recv_len -= start;
+        } while (running && server_buffered() > 0);
+    }
+
+    print_rtt_histogram(rtts, received, sent);
+    free(rtts);
+    return sent > 0 && received == sent ? 0 : 1;
+}
+
+/**
+ * @brief Watch an input descriptor next to the server socket. epoll refuses regular
+ * files, so for input redirected from a file the poller is replaced by a poll() one.
+ * @return 0 on success, -1 on error.
+ */
+int watch_input(struct poller **poller, int sockfd, int fd) {
+    if (poller_add(*poller, fd, POLLER_IN) == 0) return 0;
+    poller_free(*poller);
+    if ((*poller = poller_create(POLLER_POLL)) == NULL || poller_add(*poller, sockfd, POLLER_IN) == -1
+            || poller_add(*poller, fd, POLLER_IN) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief --send: send every line of in_fd as fast as flow control allows. Lines are
+ * framed in batches into one buffer that goes out with a single send, and at most
+ * BULK_WINDOW chat messages are waiting for their ACK at any time. A command ('/')
+ * waits until everything before it is acknowledged, and the lines after it wait for
+ * its own ACK (at most BULK_REPLY_MS). The server sends that ACK after the command's
+ * reply, so chat lines after "/join room" go to that room.
+ * @return Process exit status: 0 if every line was sent and accepted.
+ */
+int run_bulk_send(int sockfd, struct poller **pp, int in_fd) {
+    static char in_buf[BULK_INPUT_BUF];
+    static uint8_t out_buf[BULK_SEND_BUF];
+    static uint8_t recv_buffer[RECV_BUF_SIZE];
+    size_t in_len = 0, recv_len = 0;
+    int in_eof = 0, watching = 1, in_flight = 0;
+    unsigned long sent = 0, acked = 0, rejected = 0;
+    long received_since_grant = 0;
+    uint64_t started = monotonic_us(), reply_deadline = 0;
+    uint64_t command_seq = 0; // Command waiting for its ACK, 0 if none
+    double elapsed;
+    struct poller *poller;
+
+    if (watch_input(pp, sockfd, in_fd) == -1) {
+        fprintf(stderr, "ERROR: Could not watch the input.\n");
+        return 3;
+    }
+    poller = *pp;
+    signal(SIGINT, stop_sigint_handler);
+    render_quiet = 1; // handle_server_frame() still keeps track of names, rooms and credit
+
+    while (running) {
+        size_t start = 0, out_len = 0;
+        struct poller_event ev;
+        int want_input, server_ready, timeout_ms = -1;
+
+        // A. Frame as many complete lines as the window allows
+        while (command_seq == 0 && in_flight < BULK_WINDOW && out_len + CHAT_MAX_FRAME <= sizeof out_buf) {
+            char *line = in_buf + start, *nl = memchr(line, '\n', in_len - start);
+            size_t used = nl != NULL ? (size_t)(nl - line) + 1 : in_len - start;
+            size_t len = nl != NULL ? used - 1 : used;
+
+            // Without a newline only the last line of the input, or one that fills the
+            // whole buffer (it is cut), can be sent yet
+            if (used == 0 || (nl == NULL && !in_eof && !(start == 0 && in_len == sizeof in_buf))) break;
+            if (len > 0 && line[len - 1] == '\r') len--;
+            if (len == 0) {
+                start += used;
+                continue;
+            }
+            if (line[0] == '/') {
+                if (out_len > 0 || in_flight > 0) break;
+                command_seq = ++next_seq;
+                out_len += chat_encode(out_buf + out_len, CHAT_MSG_COMMAND, 0, current_room, CHAT_ANONYMOUS,
+                                       command_seq, 0, line, len);
+                reply_deadline = monotonic_us() + BULK_REPLY_MS * 1000u;
+            } else {
+                out_len += chat_encode(out_buf + out_len, CHAT_MSG_CHAT, 0, current_room, CHAT_ANONYMOUS,
+                                       ++next_seq, 0, line, len);
+                in_flight++;
+            }
+            start += used;
+            sent++;
+        }
+        memmove(in_buf, in_buf + start, in_len - start);
+        in_len -= start;
+        if (out_len > 0 && send_encoded(sockfd, out_buf, out_len) == -1) break;
+        if (in_eof && in_len == 0 && in_flight == 0 && command_seq == 0) break;
+
+        // B. Read more input only while it could be sent
+        want_input = !in_eof && in_len < sizeof in_buf && command_seq == 0 && in_flight < BULK_WINDOW;
+        if (want_input != watching) {
+            if (want_input) poller_add(poller, in_fd, POLLER_IN);
+            else poller_del(poller, in_fd);
+            watching = want_input;
+        }
+        if (out_len + CHAT_MAX_FRAME > sizeof out_buf) {
+            timeout_ms = 0; // The send buffer was full, not the window: go on right away
+        } else if (command_seq != 0) {
+            uint64_t now = monotonic_us();
+            if (now >= reply_deadline) {
+                command_seq = 0; // A server that does not acknowledge commands
+                continue;
+            }
+            timeout_ms = (int)((reply_deadline - now + 999) / 1000);
+        }
+        if ((timeout_ms = server_tick(timeout_ms)) == -2) break;
+        if (poller_wait(poller, timeout_ms) < 0 && errno != EINTR) {
+            perror("poller_wait error");
+            break;
+        }
+
+        server_ready = server_buffered() > 0;
+        while (poller_next(poller, &ev)) {
+            if (ev.fd == in_fd) {
+                ssize_t n = read(in_fd, in_buf + in_len, sizeof in_buf - in_len);
+                if (n > 0) {
+                    in_len += n;
+                } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                    if (n == -1) perror("read input");
+                    in_eof = 1;
+                }
+            } else {
+                server_ready = 1;
+            }
+        }
+
+        // C. ACKs (and rejections) open the window again
+        if (server_ready) {
+            do {
+                ssize_t n = client_read(sockfd, recv_buffer + recv_len, sizeof recv_buffer - recv_len);
+                size_t pos = 0;
+
+                if (n == -1 && errno == EAGAIN) break; // Only an ACK or a keepalive (--udp)
+                if (n <= 0) {
+                    printf("[INFO] Server disconnected.\n");
+                    running = 0;
+                    break;
+                }
+                recv_len += n;
+                while (pos < recv_len) {
+                    size_t payload_off, payload_len;
+                    ssize_t frame_len = chat_frame_parse(recv_buffer + pos, recv_len - pos, &payload_off, &payload_len);
+                    const uint8_t *frame = recv_buffer + pos;
+                    int error = chat_type(frame) == CHAT_MSG_NOTICE && (chat_flags(frame) & CHAT_FLAG_ERROR);
+
+                    if (frame_len <= 0) {
+                        if (frame_len < 0) running = 0;
+                        break;
+                    }
+                    received_since_grant += handle_server_frame(frame, frame + payload_off, payload_len);
+                    if (error) {
+                        fprintf(stderr, "[SERVER ERROR] %.*s\n", (int)payload_len, (const char *)frame + payload_off);
+                        rejected++;
+                    }
+                    if (command_seq != 0) {
+                        // Only its own ACK ends the wait: the reply is in by then, and presence, SYNCs
+                        // or offline notices that happen to arrive first say nothing
+                        if (chat_type(frame) == CHAT_MSG_ACK && chat_sequence(frame) == command_seq) command_seq = 0;
+                    } else if (chat_type(frame) == CHAT_MSG_ACK || error) {
+                        if (in_flight > 0) in_flight--;
+                        if (!error) acked++;
+                    }
+                    pos += frame_len;
+                }
+                memmove(recv_buffer, recv_buffer + pos, recv_len - pos);
+                recv_len -= pos;
+            } while (running && server_buffered() > 0);
+
+            if (received_since_grant >= CREDIT_WINDOW / 2) {
+                send_frame(sockfd, CHAT_MSG_CREDIT, received_since_grant, NULL, 0);
+                received_since_grant = 0;
+            }
+        }
+    }
+
+    elapsed = (monotonic_us() - started) / 1e6;
+    printf("Sent %lu line(s) in %.2f s (%.0f/s): %lu acknowledged, %lu rejected, %d unanswered\n",
+           sent, elapsed, elapsed > 0 ? sent / elapsed : 0.0, acked, rejected, in_flight);
+    return in_eof && in_len == 0 && in_flight == 0 && rejected == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
 
     // Definitions for socket creation
     struct addrinfo hints, *res, *p;
     int activity;
-    size_t numbytes;
-    size_t bytes_received;
 	int status;
 	char ipstr[INET6_ADDRSTRLEN];
     int sockfd, cfd = -1;
-    int max_fd;
-    fd_set readfds;
+    struct poller *poller;
+    struct poller_event ev;
+    int backend = POLLER_DEFAULT;
+    int stdin_ready, server_ready;
+    int probe_rate = 0, probe_count = PROBE_DEFAULT_COUNT;
+    const char *send_path = NULL;
+    int send_fd = -1;
+    const char *mcast_spec = NULL, *mcast_if = NULL;
+    struct sockaddr_in mcast_group;
+    int mcast_fd = -1, mcast_ready;
+
+    const char *tls_ca = NULL;
+    SSL_CTX *tls_ctx = NULL;
+    int udp = 0;
+
+    for (int k = 1; k < argc; k++) {
+        if (strcmp(argv[k], "--tls") == 0 && k + 1 < argc) {
+            tls_ca = argv[++k];
+        } else if (strcmp(argv[k], "--poller") == 0 && k + 1 < argc) {
+            if ((backend = poller_parse_backend(argv[++k])) == -1) {
+                fprintf(stderr, "Unknown or unavailable poller backend '%s'\n", argv[k]);
+                return 1;
+            }
+        } else if (strcmp(argv[k], "--probe") == 0 && k + 1 < argc) {
+            probe_rate = atoi(argv[++k]);
+        } else if (strcmp(argv[k], "--probe-count") == 0 && k + 1 < argc) {
+            probe_count = atoi(argv[++k]);
+        } else if (strcmp(argv[k], "--send") == 0 && k + 1 < argc) {
+            send_path = argv[++k];
+        } else if (strcmp(argv[k], "--multicast") == 0 && k + 1 < argc) {
+            mcast_spec = argv[++k];
+        } else if (strcmp(argv[k], "--multicast-if") == 0 && k + 1 < argc) {
+            mcast_if = argv[++k];
+        } else if (strcmp(argv[k], "--udp") == 0) {
+            udp = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--tls CA_FILE | --udp] [--poller select|poll|epoll|io_uring]"
+                    " [--probe PINGS_PER_SEC [--probe-count N] | --send FILE]"
+                    " [--multicast GROUP:PORT [--multicast-if ADDR]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (mcast_spec != NULL && multicast_parse_group(mcast_spec, &mcast_group) == -1) {
+        fprintf(stderr, "--multicast needs an IPv4 multicast GROUP:PORT, e.g. 239.255.0.1:5000\n");
+        return 1;
+    }
+    if (udp && tls_ca != NULL) {
+        fprintf(stderr, "--tls and --udp cannot be combined\n");
+        return 1;
+    }
+    if (probe_rate < 0 || probe_rate > 1000000 || probe_count <= 0) {
+        fprintf(stderr, "--probe needs 1-1000000 pings per second and --probe-count at least 1\n");
+        return 1;
+    }
+    if (send_path != NULL) {
+        if (probe_rate > 0) {
+            fprintf(stderr, "--probe and --send cannot be combined\n");
+            return 1;
+        }
+        if ((send_fd = strcmp(send_path, "-") == 0 ? STDIN_FILENO : open(send_path, O_RDONLY)) == -1) {
+            perror(send_path);
+            return 1;
+        }
+    }
 
     if(signal(SIGINT, sigint_handler) == SIG_ERR) {
         perror("Could not set up SIGINT handler");
@@ -64,7 +812,7 @@ int main() {
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
     
 
     
@@ -73,7 +821,7 @@ int main() {
 
     // Now we got the message stored message_buffer, time to create sockets
 
-    if((status = getaddrinfo(HOST, PORT, &hints, &res)) != 0) {
+    if((status = getaddrinfo(HOST, tls_ca != NULL ? TLS_PORT : udp ? RUDP_PORT : PORT, &hints, &res)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
 		return 2;
     }
@@ -139,95 +887,227 @@ int main() {
         return 3;
     }
 
+    if (tls_ca != NULL) {
+        // A server that goes away mid-write must not kill us with SIGPIPE
+        signal(SIGPIPE, SIG_IGN);
+        if ((tls_ctx = tls_client_ctx(tls_ca, 1)) != NULL) {
+            // Reconnects resume the previous session instead of a full handshake
+            tls_cache_sessions(tls_ctx, TLS_SESSION_CACHE);
+        }
+        if (tls_ctx == NULL
+                || (server_tls = tls_new(tls_ctx, sockfd, TLS_SERVER_NAME)) == NULL
+                || tls_handshake(server_tls) != 1) {
+            fprintf(stderr, "ERROR: TLS handshake with the server failed.\n");
+            return 3;
+        }
+    }
+    if (udp) {
+        // connect() on a UDP socket only sets the address: the HELLO is the real test
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+        if ((server_rudp = rudp_new(sockfd, 0)) == NULL || rudp_connect(server_rudp) == -1) {
+            fprintf(stderr, "ERROR: No answer from the server over UDP (started with --udp?).\n");
+            return 3;
+        }
+    }
+
+    // The server remembers recent message ids per user, so a restarted client must not
+    // reuse them: start numbering from the current time in microseconds
+    struct timespec start_time;
+    clock_gettime(CLOCK_REALTIME, &start_time);
+    next_seq = (uint64_t)start_time.tv_sec * 1000000u + start_time.tv_nsec / 1000;
+
+    // Flow control: the server only sends as many messages as we have granted it
+    long received_since_grant = 0;
+    send_frame(sockfd, CHAT_MSG_CREDIT, CREDIT_WINDOW, NULL, 0);
+
+    // Received bytes that do not form a complete frame yet
+    static uint8_t recv_buffer[RECV_BUF_SIZE];
+    size_t recv_len = 0;
+
+    if ((poller = poller_create(backend)) == NULL || poller_add(poller, sockfd, POLLER_IN) == -1) {
+        fprintf(stderr, "ERROR: Could not set up the %s poller.\n", poller_backend_name(backend));
+        return 3;
+    }
+    if (probe_rate > 0) {
+        status = run_probe(sockfd, poller, probe_rate, probe_count);
+        poller_free(poller);
+        rudp_free(server_rudp);
+        close(sockfd);
+        return status;
+    }
+    if (send_fd != -1) {
+        status = run_bulk_send(sockfd, &poller, send_fd);
+        if (poller != NULL) poller_free(poller);
+        rudp_free(server_rudp);
+        close(sockfd);
+        return status;
+    }
+
+    // Join the group before asking for it, so that nothing sent in between is missed
+    if (mcast_spec != NULL) {
+        if ((mcast_fd = multicast_open_receiver(&mcast_group, mcast_if)) == -1
+                || poller_add(poller, mcast_fd, POLLER_IN) == -1) {
+            fprintf(stderr, "ERROR: Could not join multicast group %s.\n", mcast_spec);
+            return 3;
+        }
+        if (send_frame(sockfd, CHAT_MSG_COMMAND, ++next_seq, "/multicast on", 13) == 0) {
+            mc_state = MC_REQUESTED;
+        }
+    }
+
     printf("--- Interactive Input Console ---\n");
+    printf("Commands: /login <name>, /msg <name> <text>, /join <room>, /search <words>.\n");
+    printf("Presence: /away, /back, /typing. Mention offline users with @name.\n");
     printf("Press Ctrl+C at any time to quit.\n\n");
-    max_fd = sockfd;
-
-    // 2. The core indefinite loop. It runs as long as the 'running' flag is 1.
-    while (running) {
-        FD_ZERO(&readfds);
-        FD_SET(STDIN_FILENO, &readfds);
-        // 2. RE-POPULATE THE SET
-        // Add the listener socket back
-        FD_SET(sockfd, &readfds);
 
-        printf("%s", MESSAGE_PROMPT);
-        fflush(stdout); // Ensures the prompt appears immediately
-        
+    if (watch_input(&poller, sockfd, STDIN_FILENO) == -1) {
+        fprintf(stderr, "ERROR: Could not watch standard input.\n");
+        return 3;
+    }
 
+    fflush(stdout); // Everything from here on goes through render_flush()
+    stdout_is_tty = isatty(STDOUT_FILENO);
+    render_flush();
 
+    // 2. The core indefinite loop. It runs as long as the 'running' flag is 1.
+    while (running) {
+        size_t drained = 0;
+        int available = 0;
 
-        // --- B. WAITING (select() call) ---
-        // Blocks here until activity occurs on ANY monitored socket
-        //printf("\nWaiting for activity (max_fd + 1: %d)...\n", max_fd + 1);
-        activity = select(max_fd + 1, &readfds, NULL, NULL, NULL);
+        // --- B. WAITING (poller_wait() call) ---
+        // Blocks here until activity occurs on stdin or the server socket, or until
+        // output held back by the render rate limit is due
+        int timeout = render_timeout_ms();
+        if (mc_timeout_ms() != -1 && (timeout == -1 || mc_timeout_ms() < timeout)) timeout = mc_timeout_ms();
+        if ((timeout = server_tick(timeout)) == -2) break;
+        activity = poller_wait(poller, timeout);
 
         if ((activity < 0) && (errno != EINTR)) {
             // A genuine, non-interrupt error occurred
-            perror("select error");
+            perror("poller_wait error");
             // Server should likely continue or attempt recovery, but for simplicity:
             continue; 
         }        
+        stdin_ready = mcast_ready = 0;
+        server_ready = server_buffered() > 0;
+        while (poller_next(poller, &ev)) {
+            if (ev.fd == STDIN_FILENO) stdin_ready = 1;
+            if (ev.fd == sockfd) server_ready = 1;
+            if (ev.fd == mcast_fd) mcast_ready = 1;
+        }
 
-        if(FD_ISSET(STDIN_FILENO, &readfds)) {
+        if(stdin_ready) {
 
             // 3. Safely read input from the keyboard (stdin).
             if (fgets(message_buffer, MAX_MESSAGE_LENGTH, stdin) == NULL) {
                 // Handle stream closure or error if it happens unexpectedly
                 if (running) {
-                    printf("\n[ERROR] Input stream closed. Exiting.\n");
+                    render_printf("\n[ERROR] Input stream closed. Exiting.\n");
                 }
                 break; 
             }
 
             // 4. Clean up the input string by removing the newline character.
             size_t len = strlen(message_buffer);
-            size_t bytes_to_send = len + 1;
             if (len > 0 && message_buffer[len - 1] == '\n') {
                 message_buffer[len - 1] = '\0';
+                len--;
             }
 
-            // ... send and receive data here ...
-            if( (numbytes = send(sockfd, message_buffer, strlen(message_buffer), 0)) == -1) {
-                perror("send");
+            if (len == 0) {
+                render_flush(); // Fresh prompt, like a shell on an empty line
+                continue;
             }
 
-            else if (numbytes < bytes_to_send) {
-                // WARNING: Partial send. Not all data was sent in one call.
-                printf("[SEND WARNING] Sent only %zd of %zu bytes. You must loop to send remaining data.\n", numbytes, bytes_to_send);
-            } else {
-                // SUCCESS: All data was sent.
-                printf("[SENT SUCCESS] Message: '%s' (%zd bytes sent)\n", message_buffer, numbytes);
+            // Slash commands travel as COMMAND frames, everything else as CHAT for our room
+            uint8_t type = message_buffer[0] == '/' ? CHAT_MSG_COMMAND : CHAT_MSG_CHAT;
+            if (send_frame(sockfd, type, ++next_seq, message_buffer, len) == 0) {
+                render_printf("[SENT SUCCESS] Message %llu: '%s'\n", (unsigned long long)next_seq, message_buffer);
             }
+            // The user is waiting for their own line to show: no rate limit here
+            render_flush();
         }
 
-        if(FD_ISSET(sockfd, &readfds)) {
-            // --- START OF NEW RECV() LOGIC ---
-            char recv_buffer[MAX_MESSAGE_LENGTH]; // Buffer for receiving data
-            int bytes_received;
-
-            printf("[INFO] Waiting for server response...\n");
-            fflush(stdout); // Ensure message appears before blocking on recv
+        // Drain everything the socket has (up to DRAIN_MAX_BYTES) before rendering.
+        // A TLS or UDP connection can also hold data that the poller does not see.
+        if(server_ready) do {
+            ssize_t bytes_received;
 
             // Receive data from the server
-            if ((bytes_received = recv(sockfd, recv_buffer, MAX_MESSAGE_LENGTH - 1, 0)) == -1) {
+            bytes_received = client_read(sockfd, recv_buffer + recv_len, sizeof recv_buffer - recv_len);
+            if (bytes_received == -1 && errno == EAGAIN) {
+                break; // Only an ACK or a keepalive (--udp)
+            } else if (bytes_received == -1) {
                 perror("recv error");
                 // If recv fails, it might indicate a lost connection or server issue
-                // You might want to set running = 0 here to exit gracefully
                 running = 0;
             } else if (bytes_received == 0) {
                 // Server gracefully closed the connection
-                printf("[INFO] Server disconnected.\n");
+                render_printf("[INFO] Server disconnected.\n");
                 running = 0; // Exit the loop as server is gone
             } else {
-                // Data successfully received
-                recv_buffer[bytes_received] = '\0'; // Null-terminate the received data
-                printf("[RECV SUCCESS] Server says: '%s' (%d bytes received)\n", recv_buffer, bytes_received);
+                size_t start = 0;
+                recv_len += bytes_received;
+                drained += bytes_received;
+
+                // Handle every complete frame; keep a partial one for the next recv
+                while (start < recv_len) {
+                    size_t payload_off, payload_len;
+                    ssize_t frame_len = chat_frame_parse(recv_buffer + start, recv_len - start,
+                                                         &payload_off, &payload_len);
+                    if (frame_len == 0) break;
+                    if (frame_len < 0) {
+                        render_printf("[ERROR] Malformed frame from server. Exiting.\n");
+                        running = 0;
+                        break;
+                    }
+                    received_since_grant += handle_server_frame(recv_buffer + start,
+                                                                recv_buffer + start + payload_off, payload_len);
+                    start += frame_len;
+                }
+                memmove(recv_buffer, recv_buffer + start, recv_len - start);
+                recv_len -= start;
+
+                // Every message we have printed is one we are done with; hand the
+                // credit back once half the window has been used up
+                if (received_since_grant >= CREDIT_WINDOW / 2) {
+                    send_frame(sockfd, CHAT_MSG_CREDIT, received_since_grant, NULL, 0);
+                    received_since_grant = 0;
+                }
             }
+            if (!running || drained >= DRAIN_MAX_BYTES) break;
+            if (server_tls != NULL || server_rudp != NULL) {
+                // FIONREAD would count ciphertext, possibly a partial record that
+                // would block SSL_read(), or datagrams not in order yet; only go on
+                // while data ready to read is buffered
+                available = server_buffered();
+            } else if (ioctl(sockfd, FIONREAD, &available) == -1) {
+                available = 0;
+            }
+        } while (available > 0);
+
+        if (mcast_ready) {
+            mc_receive(mcast_fd);
+        }
+        if (mc_state == MC_ON) {
+            mc_check_gaps(sockfd);
+        }
+
+        // Render whatever arrived, unless the terminal was updated too recently
+        if (render_timeout_ms() == 0) {
+            render_flush();
         }
     }
 
+    if (render_len > 0) render_flush();
+    printf("\n");
+    poller_free(poller);
+    rudp_free(server_rudp);
     close(sockfd);
+    if (mcast_fd != -1) {
+        if (mc_lost > 0) printf("%lu multicast message(s) were lost.\n", mc_lost);
+        close(mcast_fd);
+    }
     printf("Socket closed and program finished.\n");
 
     return 0;
@@ -0,0 +1,362 @@
+/**
+ * @file compactor.c
+ * @brief History sealing and retention in a background thread (see compactor.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+
+#include "history.h"
+#include "compactor.h"
+
+#define NUM_ROOM_IDS 65536 // room_id is a u16
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int started;
+    int stopping;
+    char dir[128];
+    struct compactor_config config;
+    double budget;       // Bytes that may still be read or written without sleeping
+    uint64_t last_refill_us;
+} comp = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// Per pass, indexed by room id: what newer segments kept, and the highest number seen
+static uint64_t kept_count[NUM_ROOM_IDS], kept_bytes[NUM_ROOM_IDS], last_seq[NUM_ROOM_IDS];
+// Per segment being rewritten
+static uint64_t seg_count[NUM_ROOM_IDS], seg_bytes[NUM_ROOM_IDS];
+static uint64_t seen_count[NUM_ROOM_IDS], seen_bytes[NUM_ROOM_IDS];
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static int still_running(void) {
+    int stopping;
+
+    pthread_mutex_lock(&comp.lock);
+    stopping = comp.stopping;
+    pthread_mutex_unlock(&comp.lock);
+    return !stopping;
+}
+
+/**
+ * @brief Charge bytes of I/O against the rate budget, sleeping once it is used up.
+ * The sleep is cut short by compactor_stop().
+ * @return 0 to carry on, -1 if the compactor is being stopped.
+ */
+static int throttle(size_t bytes) {
+    uint64_t now;
+
+    if (comp.config.rate_bytes == 0) return still_running() ? 0 : -1;
+    now = monotonic_us();
+    comp.budget += (now - comp.last_refill_us) * (double)comp.config.rate_bytes / 1e6;
+    if (comp.budget > comp.config.rate_bytes) comp.budget = comp.config.rate_bytes; // At most 1 s of burst
+    comp.last_refill_us = now;
+    comp.budget -= bytes;
+    if (comp.budget < 0) {
+        uint64_t wait_us = (uint64_t)(-comp.budget * 1e6 / comp.config.rate_bytes);
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait_us / 1000000u;
+        deadline.tv_nsec += (wait_us % 1000000u) * 1000;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&comp.lock);
+        if (!comp.stopping) pthread_cond_timedwait(&comp.wake, &comp.lock, &deadline);
+        pthread_mutex_unlock(&comp.lock);
+    }
+    return still_running() ? 0 : -1;
+}
+
+// Per-room totals of one segment: from a sealed segment's trailer, or by reading it
+static int segment_stats(const char *dir, uint32_t segment, int sealed, struct history_room_stats **rooms, uint32_t *num_rooms) {
+    struct history_reader reader;
+    struct history_record *rec;
+    uint32_t n = 0;
+
+    history_reader_open(&reader, dir);
+    *rooms = NULL;
+    *num_rooms = 0;
+    if (sealed) {
+        char path[160];
+        struct history_sealed *s;
+        int fd;
+
+        history_segment_path(path, sizeof path, dir, segment, 1);
+        if ((fd = open(path, O_RDONLY)) == -1) return -1;
+        s = history_load_sealed(fd);
+        close(fd);
+        if (s == NULL) return -1;
+        *rooms = s->rooms;
+        *num_rooms = s->num_rooms;
+        s->rooms = NULL;
+        history_free_sealed(s);
+        return 0;
+    }
+
+    if ((rec = malloc(sizeof *rec)) == NULL) return -1;
+    reader.pos = HISTORY_POS(segment, 0);
+    while (history_read_next(&reader, rec) == 1 && HISTORY_SEG(rec->pos) == segment) {
+        struct history_room_stats *st = NULL;
+
+        for (uint32_t k = 0; k < n && st == NULL; k++) {
+            if ((*rooms)[k].room_id == rec->room_id) st = &(*rooms)[k];
+        }
+        if (st == NULL) {
+            struct history_room_stats *nr = realloc(*rooms, (n + 1) * sizeof *nr);
+            if (nr == NULL) break;
+            *rooms = nr;
+            st = &nr[n++];
+            *st = (struct history_room_stats){ .room_id = rec->room_id, .oldest_ts = rec->ts };
+        }
+        st->count++;
+        st->bytes += rec->size;
+        if (rec->ts < st->oldest_ts) st->oldest_ts = rec->ts;
+        if (rec->seq > st->last_seq) st->last_seq = rec->seq;
+        if (throttle(rec->size) == -1) break;
+    }
+    history_reader_close(&reader);
+    free(rec);
+    *num_rooms = n;
+    return still_running() ? 0 : -1;
+}
+
+/**
+ * @brief Rewrite a segment as a sealed one, without what retention drops. Records are
+ * visited oldest first, so how many records and bytes of its room are newer than each
+ * one comes from the totals of this segment (seg_*) minus what has been passed
+ * (seen_*), plus what newer segments kept.
+ * @return Records kept, or -1 on error or when stopped (the segment is then unchanged).
+ */
+static long rewrite_segment(const char *dir, uint32_t segment, const struct history_room_stats *rooms,
+                            uint32_t num_rooms, uint64_t cutoff_ts) {
+    const struct compactor_config *cfg = &comp.config;
+    struct history_reader reader;
+    struct history_sealer sealer;
+    struct history_record *rec;
+    uint64_t written = 0;
+    long kept = 0;
+    int rv = 0;
+
+    for (uint32_t k = 0; k < num_rooms; k++) {
+        seg_count[rooms[k].room_id] = rooms[k].count;
+        seg_bytes[rooms[k].room_id] = rooms[k].bytes;
+        seen_count[rooms[k].room_id] = seen_bytes[rooms[k].room_id] = 0;
+    }
+    if ((rec = malloc(sizeof *rec)) == NULL) return -1;
+    if (history_seal_begin(&sealer, dir, segment) == -1) {
+        free(rec);
+        return -1;
+    }
+    history_reader_open(&reader, dir);
+    reader.pos = HISTORY_POS(segment, 0);
+    while (rv == 0 && (rv = history_read_next(&reader, rec)) == 1 && HISTORY_SEG(rec->pos) == segment) {
+        uint16_t r = rec->room_id;
+        uint64_t newer = kept_count[r] + seg_count[r] - seen_count[r] - 1;
+        uint64_t bytes_from_here = kept_bytes[r] + seg_bytes[r] - seen_bytes[r];
+
+        seen_count[r]++;
+        seen_bytes[r] += rec->size;
+        rv = 0;
+        if ((cfg->max_age_sec && rec->ts < cutoff_ts) || (cfg->max_count && newer >= cfg->max_count)
+                || (cfg->max_bytes && bytes_from_here > cfg->max_bytes)) {
+            rv = throttle(rec->size);
+            continue;
+        }
+        if (history_seal_add(&sealer, rec) == -1) {
+            rv = -1;
+            break;
+        }
+        kept++;
+        rv = throttle(rec->size + (sealer.bytes_written - written));
+        written = sealer.bytes_written;
+    }
+    history_reader_close(&reader);
+    free(rec);
+    if (rv == -1 || history_seal_finish(&sealer) == -1) {
+        history_seal_abort(&sealer);
+        return -1;
+    }
+    // What survived counts as "newer" for the segments before this one
+    for (uint32_t k = 0; k < sealer.num_rooms; k++) {
+        kept_count[sealer.rooms[k].room_id] += sealer.rooms[k].count;
+        kept_bytes[sealer.rooms[k].room_id] += sealer.rooms[k].bytes;
+    }
+    free(sealer.rooms);
+    return kept;
+}
+
+/**
+ * @brief One compaction pass over every segment in dir.
+ * @return Number of segments rewritten, or -1 on error.
+ */
+static int compact_pass(const char *dir, const struct compactor_config *cfg) {
+    uint32_t *segments;
+    int *sealed;
+    long *remaining;
+    int n, rewritten = 0, seqs_saved = 0;
+    uint64_t cutoff_ts = 0;
+    time_t now = time(NULL);
+
+    if (cfg->max_age_sec > 0 && (uint64_t)now > cfg->max_age_sec) {
+        cutoff_ts = ((uint64_t)now - cfg->max_age_sec) * 1000000u;
+    }
+    if ((n = history_list_segments(dir, &segments, &sealed)) <= 0) return n;
+    if ((remaining = malloc(n * sizeof *remaining)) == NULL) {
+        free(segments);
+        free(sealed);
+        return -1;
+    }
+    for (int k = 0; k < n; k++) {
+        remaining[k] = -1; // Not looked at (yet)
+    }
+    memset(kept_count, 0, sizeof kept_count);
+    memset(kept_bytes, 0, sizeof kept_bytes);
+    memset(last_seq, 0, sizeof last_seq);
+
+    for (int k = n - 1; k >= 0; k--) {
+        struct history_room_stats *rooms;
+        uint32_t num_rooms;
+        int sealable = 0, drops = 0;
+        long kept;
+
+        if (!sealed[k] && k < n - 1) {
+            char path[160];
+            struct stat st;
+            history_segment_path(path, sizeof path, dir, segments[k], 0);
+            sealable = stat(path, &st) == 0 && now - st.st_mtime >= COMPACT_SEAL_GRACE_SEC;
+        }
+        if (segment_stats(dir, segments[k], sealed[k], &rooms, &num_rooms) == -1) break;
+
+        remaining[k] = 0;
+        for (uint32_t r = 0; r < num_rooms; r++) {
+            const struct history_room_stats *st = &rooms[r];
+            if ((cfg->max_age_sec && st->oldest_ts < cutoff_ts)
+                    || (cfg->max_count && kept_count[st->room_id] + st->count > cfg->max_count)
+                    || (cfg->max_bytes && kept_bytes[st->room_id] + st->bytes > cfg->max_bytes)) {
+                drops = 1;
+            }
+            if (st->last_seq > last_seq[st->room_id]) last_seq[st->room_id] = st->last_seq;
+            remaining[k] += st->count;
+        }
+
+        if ((sealed[k] && !drops) || (!sealed[k] && !sealable)) {
+            // Left as it is (the newest segment always is)
+            for (uint32_t r = 0; r < num_rooms; r++) {
+                kept_count[rooms[r].room_id] += rooms[r].count;
+                kept_bytes[rooms[r].room_id] += rooms[r].bytes;
+            }
+            free(rooms);
+            continue;
+        }
+        // Before dropping anything, record the highest number given out per room, so
+        // numbering never goes back even when a room's whole history is dropped.
+        // Segments are visited newest first: every room losing records here has its
+        // highest number in last_seq already.
+        if (drops && !seqs_saved) {
+            history_load_room_seqs(dir, last_seq, NUM_ROOM_IDS);
+            if (history_save_room_seqs(dir, last_seq, NUM_ROOM_IDS) == -1) {
+                free(rooms);
+                break;
+            }
+            seqs_saved = 1;
+        }
+        kept = rewrite_segment(dir, segments[k], rooms, num_rooms, cutoff_ts);
+        free(rooms);
+        if (kept == -1) break;
+        printf("[COMPACT] %s segment %u: kept %ld of %ld record(s)\n", sealed[k] ? "Rewrote" : "Sealed",
+               segments[k], kept, remaining[k]);
+        remaining[k] = kept;
+        sealed[k] = 1;
+        rewritten++;
+    }
+
+    // Segments emptied at the old end of the log are not needed as placeholders
+    for (int k = 0; k < n - 1 && sealed[k] && remaining[k] == 0 && still_running(); k++) {
+        char path[160];
+        history_segment_path(path, sizeof path, dir, segments[k], 1);
+        if (unlink(path) == 0) printf("[COMPACT] Deleted empty segment %u\n", segments[k]);
+    }
+    free(segments);
+    free(sealed);
+    free(remaining);
+    return rewritten;
+}
+
+static void *compactor_main(void *arg) {
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    (void)arg;
+
+    // Background work: lowest CPU priority, and disk time only when nobody else wants it
+    if (setpriority(PRIO_PROCESS, tid, 19) == -1) perror("setpriority compactor");
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+        perror("ioprio_set compactor");
+    }
+
+    pthread_mutex_lock(&comp.lock);
+    while (!comp.stopping) {
+        struct timespec deadline;
+
+        pthread_mutex_unlock(&comp.lock);
+        comp.last_refill_us = monotonic_us();
+        comp.budget = 0;
+        compact_pass(comp.dir, &comp.config);
+        pthread_mutex_lock(&comp.lock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += COMPACT_INTERVAL_SEC;
+        while (!comp.stopping && pthread_cond_timedwait(&comp.wake, &comp.lock, &deadline) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&comp.lock);
+    return NULL;
+}
+
+/**
+ * @brief Start the compactor thread. The first pass runs right away.
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+int compactor_start(const char *dir, const struct compactor_config *config) {
+    snprintf(comp.dir, sizeof comp.dir, "%s", dir);
+    comp.config = *config;
+    comp.stopping = 0;
+    if ((errno = pthread_create(&comp.thread, NULL, compactor_main, NULL)) != 0) {
+        perror("pthread_create compactor");
+        return -1;
+    }
+    comp.started = 1;
+    return 0;
+}
+
+/**
+ * @brief Stop the compactor thread. A segment being rewritten is left as it was.
+ */
+void compactor_stop(void) {
+    if (!comp.started) return;
+    pthread_mutex_lock(&comp.lock);
+    comp.stopping = 1;
+    pthread_cond_broadcast(&comp.wake);
+    pthread_mutex_unlock(&comp.lock);
+    pthread_join(comp.thread, NULL);
+    comp.started = 0;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file compactor.h
+ * @brief Background compaction of the history log: sealing and retention.
+ *
+ * Every COMPACT_INTERVAL_SEC the compactor thread walks the history segments
+ * (history.h) from newest to oldest, keeping per-room totals of what it keeps:
+ *   - a full raw segment that the writers have left alone for COMPACT_SEAL_GRACE_SEC
+ *     is sealed: rewritten as zlib-compressed blocks with a seek index
+ *   - a sealed segment holding records the retention policy drops is rewritten
+ *     without them; segments left empty at the old end of the log are deleted
+ *
+ * Retention applies to each room separately: a record is dropped once it is older
+ * than max_age_sec, or not among the newest max_count records of its room, or not
+ * within the newest max_bytes of its room (0 = no limit). Records from before
+ * numbering have no timestamp and count as older than any age limit. The newest,
+ * unsealed segment is never rewritten, so its records are only dropped once sealed.
+ *
+ * Compaction must not cost the event loop latency: the thread runs at nice 19 with
+ * idle I/O priority, and reads plus writes at most rate_bytes per second, sleeping
+ * whenever it gets ahead. Only one process may run it (worker 0 in pre-fork mode).
+ */
+#ifndef COMPACTOR_H
+#define COMPACTOR_H
+
+#include <stdint.h>
+
+#ifndef COMPACT_INTERVAL_SEC
+#define COMPACT_INTERVAL_SEC   60
+#endif
+#define COMPACT_SEAL_GRACE_SEC 10               // Writers still on a full segment get this long to move on
+#define COMPACT_DEFAULT_RATE   (8 * 1024 * 1024) // Bytes per second read + written
+
+struct compactor_config {
+    uint64_t max_age_sec;
+    uint64_t max_count;
+    uint64_t max_bytes;
+    uint64_t rate_bytes; // I/O budget per second, 0 for unlimited
+};
+
+int compactor_start(const char *dir, const struct compactor_config *config);
+void compactor_stop(void);
+
+#endif // COMPACTOR_H
@@ -0,0 +1,60 @@
+/**
+ * @file dedup.h
+ * @brief Sliding window of recently seen client message ids, for dropping retransmits.
+ *
+ * A window remembers the highest sequence seen (top) and one bit for each of the
+ * DEDUP_WINDOW ids at or below it, stored as a ring indexed by seq % DEDUP_WINDOW.
+ * Checking an id is a bit test; memory is constant whatever the sender does. Ids that
+ * have fallen off the bottom of the window are reported as duplicates: a retransmit
+ * that late is indistinguishable from a replay and is safer to drop.
+ *
+ * Sequence 0 means "no id" and is never deduplicated.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define DEDUP_WINDOW 1024 // Ids remembered per sender (a multiple of 64)
+
+struct dedup_window {
+    uint64_t top;                        // Highest id seen, 0 if none yet
+    uint64_t bits[DEDUP_WINDOW / 64];    // Bit (id % DEDUP_WINDOW) set if id was seen
+};
+
+static inline void dedup_init(struct dedup_window *w) {
+    memset(w, 0, sizeof *w);
+}
+
+/**
+ * @brief Record seq as seen.
+ * @return 1 if seq is new, 0 if it is a duplicate (or too old to tell).
+ */
+static inline int dedup_check_and_set(struct dedup_window *w, uint64_t seq) {
+    uint64_t word, mask;
+
+    if (seq == 0) return 1;
+    if (seq > w->top) {
+        uint64_t advance = seq - w->top;
+        if (w->top == 0 || advance >= DEDUP_WINDOW) {
+            memset(w->bits, 0, sizeof w->bits);
+        } else {
+            // Forget the ids that slide out of the window, i.e. the slots the new ids reuse
+            for (uint64_t s = w->top + 1; s <= seq; s++) {
+                w->bits[(s % DEDUP_WINDOW) / 64] &= ~(1ull << (s % 64));
+            }
+        }
+        w->top = seq;
+    } else if (w->top - seq >= DEDUP_WINDOW) {
+        return 0;
+    }
+
+    word = (seq % DEDUP_WINDOW) / 64;
+    mask = 1ull << (seq % 64);
+    if (w->bits[word] & mask) return 0;
+    w->bits[word] |= mask;
+    return 1;
+}
+
+#endif // DEDUP_H
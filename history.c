@@ -0,0 +1,747 @@
+/**
+ * @file history.c
+ * @brief Segmented message history log, its readers and the sealed segment format
+ * (see history.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "history.h"
+#include "chat_protocol.h" // chat_load/store helpers
+
+#define RECORD_LEN_FIELD 4
+#define RECORD_FIXED     19 // room_id + seq + ts + sender_len
+#define RECORD_FIXED_OLD 3  // room_id + sender_len, records without HISTORY_STAMPED
+#define RECORD_MAX       (RECORD_LEN_FIELD + RECORD_FIXED + HISTORY_MAX_SENDER + HISTORY_MAX_TEXT)
+#define ENTRY_OFFSET_LEN 4  // Offset stored in front of each record in a sealed block
+#define INDEX_ENTRY_LEN  24
+#define ROOM_STATS_LEN   30
+#define TRAILER_LEN      20
+
+void history_segment_path(char *buf, size_t size, const char *dir, uint32_t segment, int sealed) {
+    snprintf(buf, size, "%s/seg-%08x.%s", dir, segment, sealed ? "hz" : "log");
+}
+
+static int segment_exists(const char *dir, uint32_t segment) {
+    char path[160];
+    struct stat st;
+
+    history_segment_path(path, sizeof path, dir, segment, 1);
+    if (stat(path, &st) == 0) return 1;
+    history_segment_path(path, sizeof path, dir, segment, 0);
+    return stat(path, &st) == 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief List the segments in dir, oldest first. A segment with both a raw and a
+ * sealed file (sealing was interrupted before the raw one was removed) counts as sealed.
+ * @param sealed If not NULL, receives whether each segment is sealed.
+ * @return Number of segments (*segments must be freed), or -1 on error.
+ */
+int history_list_segments(const char *dir, uint32_t **segments, int **sealed) {
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    uint32_t *list = NULL;
+    int n = 0, cap = 0;
+
+    *segments = NULL;
+    if (sealed != NULL) *sealed = NULL;
+    if (d == NULL) return errno == ENOENT ? 0 : -1;
+    while ((de = readdir(d)) != NULL) {
+        unsigned int seg;
+        char ext[4];
+        if (sscanf(de->d_name, "seg-%8x.%3s", &seg, ext) != 2 || (strcmp(ext, "log") != 0 && strcmp(ext, "hz") != 0)) {
+            continue;
+        }
+        if (n == cap) {
+            uint32_t *nl = realloc(list, (cap = cap ? cap * 2 : 64) * sizeof *nl);
+            if (nl == NULL) {
+                free(list);
+                closedir(d);
+                return -1;
+            }
+            list = nl;
+        }
+        list[n++] = seg;
+    }
+    closedir(d);
+
+    qsort(list, n, sizeof *list, cmp_u32);
+    int unique = 0;
+    for (int k = 0; k < n; k++) {
+        if (unique == 0 || list[unique - 1] != list[k]) list[unique++] = list[k];
+    }
+    if (sealed != NULL && unique > 0) {
+        if ((*sealed = malloc(unique * sizeof **sealed)) == NULL) {
+            free(list);
+            return -1;
+        }
+        for (int k = 0; k < unique; k++) {
+            char path[160];
+            history_segment_path(path, sizeof path, dir, list[k], 1);
+            (*sealed)[k] = access(path, F_OK) == 0;
+        }
+    }
+    *segments = list;
+    return unique;
+}
+
+// The first segment numbered from or later, or -1 if there is none
+static long next_segment(const char *dir, uint32_t from) {
+    uint32_t *list;
+    long next = -1;
+    int n;
+
+    if (segment_exists(dir, from)) return from;
+    if ((n = history_list_segments(dir, &list, NULL)) <= 0) return -1;
+    for (int k = 0; k < n && next == -1; k++) {
+        if (list[k] >= from) next = list[k];
+    }
+    free(list);
+    return next;
+}
+
+// Encode a record in raw layout; buf must hold RECORD_MAX bytes
+static size_t encode_record(uint8_t *buf, uint16_t room_id, uint64_t seq, uint64_t ts,
+                            const char *sender, size_t sender_len, const char *text, size_t len) {
+    if (sender_len >= HISTORY_MAX_SENDER) sender_len = HISTORY_MAX_SENDER - 1;
+    if (len > HISTORY_MAX_TEXT) len = HISTORY_MAX_TEXT;
+
+    chat_store32(buf, (uint32_t)(RECORD_FIXED + sender_len + len) | HISTORY_STAMPED);
+    chat_store16(buf + 4, room_id);
+    chat_store64(buf + 6, seq);
+    chat_store64(buf + 14, ts);
+    buf[22] = (uint8_t)sender_len;
+    memcpy(buf + 23, sender, sender_len);
+    memcpy(buf + 23 + sender_len, text, len);
+    return RECORD_LEN_FIELD + RECORD_FIXED + sender_len + len;
+}
+
+/**
+ * @brief Decode the record at the start of buf.
+ * @return Its size, 0 if buf holds only part of it, -1 if it is corrupt.
+ */
+static ssize_t parse_record(const uint8_t *buf, size_t avail, struct history_record *rec) {
+    uint32_t body_len;
+    size_t fixed = RECORD_FIXED_OLD, sender_len;
+
+    if (avail < RECORD_LEN_FIELD) return 0;
+    body_len = chat_load32(buf);
+    if (body_len & HISTORY_STAMPED) {
+        body_len &= ~HISTORY_STAMPED;
+        fixed = RECORD_FIXED;
+    }
+    if (body_len < fixed || body_len > RECORD_MAX - RECORD_LEN_FIELD) return -1;
+    if (avail < RECORD_LEN_FIELD + body_len) return 0;
+
+    sender_len = buf[RECORD_LEN_FIELD + fixed - 1];
+    if (fixed + sender_len > body_len || sender_len >= HISTORY_MAX_SENDER) return -1;
+    rec->size = RECORD_LEN_FIELD + body_len;
+    rec->room_id = chat_load16(buf + 4);
+    rec->seq = fixed == RECORD_FIXED ? chat_load64(buf + 6) : 0;
+    rec->ts = fixed == RECORD_FIXED ? chat_load64(buf + 14) : 0;
+    memcpy(rec->sender, buf + RECORD_LEN_FIELD + fixed, sender_len);
+    rec->sender[sender_len] = '\0';
+    rec->text_len = body_len - fixed - sender_len;
+    memcpy(rec->text, buf + RECORD_LEN_FIELD + fixed + sender_len, rec->text_len);
+    rec->text[rec->text_len] = '\0';
+    return (ssize_t)rec->size;
+}
+
+// Point the log at segment (or the first later one that is not sealed yet)
+static int open_for_append(struct history_log *log, uint32_t segment) {
+    char path[160];
+    int fd;
+
+    for (;; segment++) {
+        history_segment_path(path, sizeof path, HISTORY_DIR, segment, 1);
+        if (access(path, F_OK) == 0) continue; // Sealed: nothing can be added any more
+        history_segment_path(path, sizeof path, HISTORY_DIR, segment, 0);
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600)) == -1) {
+            perror("open history segment");
+            return -1;
+        }
+        break;
+    }
+    if (log->fd != -1) close(log->fd);
+    log->fd = fd;
+    log->segment = segment;
+    return 0;
+}
+
+/**
+ * @brief Open (creating if needed) the newest history segment for appending. A log
+ * from before segments becomes segment 0.
+ * @return 0 on success, -1 on error (log->fd is then -1).
+ */
+int history_open(struct history_log *log) {
+    char path[160];
+    uint32_t *segments;
+    int n;
+
+    log->fd = -1;
+    if (mkdir(HISTORY_DIR, 0700) == -1 && errno != EEXIST) {
+        perror("mkdir history directory");
+        return -1;
+    }
+    history_segment_path(path, sizeof path, HISTORY_DIR, 0, 0);
+    if (access(HISTORY_LEGACY_LOG, F_OK) == 0 && !segment_exists(HISTORY_DIR, 0)
+            && rename(HISTORY_LEGACY_LOG, path) == 0) {
+        printf("[HISTORY] %s is now segment 0\n", HISTORY_LEGACY_LOG);
+    }
+    if ((n = history_list_segments(HISTORY_DIR, &segments, NULL)) == -1) {
+        perror("list history segments");
+        return -1;
+    }
+    n = open_for_append(log, n > 0 ? segments[n - 1] : 0);
+    free(segments);
+    return n;
+}
+
+/**
+ * @brief Append one message to the log.
+ * @return 0 on success, -1 on error.
+ */
+int history_append(struct history_log *log, uint16_t room_id, uint64_t seq, uint64_t ts,
+                   const char *sender, const char *text, size_t len) {
+    uint8_t rec[RECORD_MAX];
+    size_t total = encode_record(rec, room_id, seq, ts, sender, strlen(sender), text, len);
+    struct stat st;
+
+    // Move on once the segment is full; in pre-fork mode another worker may have filled it
+    while (fstat(log->fd, &st) == 0 && (st.st_size >= HISTORY_SEGMENT_BYTES || st.st_nlink == 0)) {
+        if (open_for_append(log, log->segment + 1) == -1) return -1;
+    }
+    // One write per record keeps appends from several writers from interleaving
+    if (write(log->fd, rec, total) != (ssize_t)total) {
+        perror("write history log");
+        return -1;
+    }
+    return 0;
+}
+
+void history_close(struct history_log *log) {
+    if (log->fd != -1) {
+        close(log->fd);
+        log->fd = -1;
+    }
+}
+
+/**
+ * @brief Read the index and room stats from a sealed segment's trailer.
+ * @return NULL if the file is not a complete sealed segment.
+ */
+struct history_sealed *history_load_sealed(int fd) {
+    uint8_t trailer[TRAILER_LEN], *buf = NULL;
+    struct history_sealed *s = NULL;
+    uint64_t index_pos;
+    size_t len;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size < TRAILER_LEN
+            || pread(fd, trailer, TRAILER_LEN, st.st_size - TRAILER_LEN) != TRAILER_LEN
+            || chat_load32(trailer + 16) != HISTORY_SEALED_MAGIC) {
+        return NULL;
+    }
+    index_pos = chat_load64(trailer);
+    if ((s = calloc(1, sizeof *s)) == NULL) return NULL;
+    s->num_blocks = chat_load32(trailer + 8);
+    s->num_rooms = chat_load32(trailer + 12);
+    len = (size_t)s->num_blocks * INDEX_ENTRY_LEN + (size_t)s->num_rooms * ROOM_STATS_LEN;
+    if (index_pos + len + TRAILER_LEN != (uint64_t)st.st_size
+            || (buf = malloc(len + 1)) == NULL
+            || pread(fd, buf, len, index_pos) != (ssize_t)len
+            || (s->blocks = calloc(s->num_blocks + 1, sizeof *s->blocks)) == NULL
+            || (s->rooms = calloc(s->num_rooms + 1, sizeof *s->rooms)) == NULL) {
+        free(buf);
+        history_free_sealed(s);
+        return NULL;
+    }
+    for (uint32_t k = 0; k < s->num_blocks; k++) {
+        const uint8_t *p = buf + k * INDEX_ENTRY_LEN;
+        s->blocks[k].first_offset = chat_load32(p);
+        s->blocks[k].last_offset = chat_load32(p + 4);
+        s->blocks[k].file_pos = chat_load64(p + 8);
+        s->blocks[k].compressed_len = chat_load32(p + 16);
+        s->blocks[k].raw_len = chat_load32(p + 20);
+    }
+    for (uint32_t k = 0; k < s->num_rooms; k++) {
+        const uint8_t *p = buf + s->num_blocks * INDEX_ENTRY_LEN + k * ROOM_STATS_LEN;
+        s->rooms[k].room_id = chat_load16(p);
+        s->rooms[k].count = chat_load32(p + 2);
+        s->rooms[k].bytes = chat_load64(p + 6);
+        s->rooms[k].oldest_ts = chat_load64(p + 14);
+        s->rooms[k].last_seq = chat_load64(p + 22);
+    }
+    free(buf);
+    return s;
+}
+
+void history_free_sealed(struct history_sealed *s) {
+    if (s == NULL) return;
+    free(s->blocks);
+    free(s->rooms);
+    free(s);
+}
+
+void history_reader_open(struct history_reader *r, const char *dir) {
+    memset(r, 0, sizeof *r);
+    snprintf(r->dir, sizeof r->dir, "%s", dir);
+    r->fd = -1;
+    r->block_no = -1;
+}
+
+static void reader_release(struct history_reader *r) {
+    if (r->fd != -1) close(r->fd);
+    r->fd = -1;
+    history_free_sealed(r->sealed);
+    r->sealed = NULL;
+    r->block_no = -1;
+}
+
+// Open segment, sealed if it has been sealed. -1 if it does not exist (any more).
+static int reader_switch(struct history_reader *r, uint32_t segment) {
+    char path[160];
+    struct stat st;
+
+    reader_release(r);
+    history_segment_path(path, sizeof path, r->dir, segment, 1);
+    if ((r->fd = open(path, O_RDONLY)) != -1) {
+        if ((r->sealed = history_load_sealed(r->fd)) == NULL) {
+            fprintf(stderr, "[HISTORY] %s is damaged, skipping it\n", path);
+            reader_release(r);
+            return -1;
+        }
+    } else {
+        history_segment_path(path, sizeof path, r->dir, segment, 0);
+        if ((r->fd = open(path, O_RDONLY)) == -1) return -1;
+    }
+    fstat(r->fd, &st);
+    r->ino = st.st_ino;
+    r->segment = segment;
+    return 0;
+}
+
+// Whether the open segment is still what its name refers to
+static int reader_current(struct history_reader *r) {
+    char path[160];
+    struct stat st;
+
+    if (r->fd == -1) return 0;
+    if (r->sealed == NULL) {
+        return fstat(r->fd, &st) == 0 && st.st_nlink > 0;
+    }
+    history_segment_path(path, sizeof path, r->dir, r->segment, 1);
+    return stat(path, &st) == 0 && st.st_ino == r->ino;
+}
+
+static int load_block(struct history_reader *r, uint32_t b) {
+    const struct history_block *blk = &r->sealed->blocks[b];
+    uint8_t *in;
+    uLongf out_len = blk->raw_len;
+    uint8_t *out;
+
+    if (r->block_no == (int)b) return 0;
+    if ((in = malloc(blk->compressed_len)) == NULL) return -1;
+    if ((out = realloc(r->block, blk->raw_len + 1)) == NULL) {
+        free(in);
+        return -1;
+    }
+    r->block = out;
+    r->block_no = -1;
+    if (pread(r->fd, in, blk->compressed_len, blk->file_pos) != (ssize_t)blk->compressed_len
+            || uncompress(out, &out_len, in, blk->compressed_len) != Z_OK || out_len != blk->raw_len) {
+        free(in);
+        return -1;
+    }
+    free(in);
+    r->block_no = (int)b;
+    r->block_len = out_len;
+    r->cursor = 0;
+    return 0;
+}
+
+/**
+ * @brief Find the first record at offset or later in the open sealed segment (only at
+ * offset if exact).
+ * @return 1 if found, 0 if there is none, -1 on a damaged segment.
+ */
+static int read_sealed(struct history_reader *r, uint32_t offset, int exact, struct history_record *rec) {
+    const struct history_sealed *s = r->sealed;
+    uint32_t lo = 0, hi = s->num_blocks;
+
+    // First block whose last record is at offset or later
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (s->blocks[mid].last_offset < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == s->num_blocks || (exact && s->blocks[lo].first_offset > offset)) return 0;
+    if (load_block(r, lo) == -1) return -1;
+
+    // Sequential reads continue where the previous lookup stopped
+    if (r->cursor >= r->block_len || chat_load32(r->block + r->cursor) > offset) r->cursor = 0;
+    while (r->cursor < r->block_len) {
+        uint32_t at = chat_load32(r->block + r->cursor);
+        ssize_t size = parse_record(r->block + r->cursor + ENTRY_OFFSET_LEN,
+                                    r->block_len - r->cursor - ENTRY_OFFSET_LEN, rec);
+        if (size <= 0) return -1;
+        if (at >= offset) {
+            if (exact && at != offset) return 0;
+            rec->pos = HISTORY_POS(r->segment, at);
+            return 1;
+        }
+        r->cursor += ENTRY_OFFSET_LEN + size;
+    }
+    return -1; // The index promised a record here
+}
+
+// Record at offset in the open raw segment: 1, 0 if not (fully) written yet, -1 if corrupt
+static int read_raw(struct history_reader *r, uint32_t offset, struct history_record *rec) {
+    uint8_t buf[RECORD_MAX];
+    ssize_t n = pread(r->fd, buf, sizeof buf, offset), size;
+
+    if (n < 0) return -1;
+    if ((size = parse_record(buf, n, rec)) <= 0) return (int)size;
+    rec->pos = HISTORY_POS(r->segment, offset);
+    return 1;
+}
+
+/**
+ * @brief Read the record at a given position.
+ * @return 1 if a complete record was read, 0 if there is none there (not fully written
+ * yet, or dropped by retention), -1 on a corrupt record.
+ */
+int history_read_at(struct history_reader *r, uint64_t pos, struct history_record *rec) {
+    if (r->fd == -1 || r->segment != HISTORY_SEG(pos) || !reader_current(r)) {
+        if (reader_switch(r, HISTORY_SEG(pos)) == -1) return 0;
+    }
+    if (r->sealed != NULL) return read_sealed(r, HISTORY_OFF(pos), 1, rec);
+    return read_raw(r, HISTORY_OFF(pos), rec);
+}
+
+/**
+ * @brief Read the next record and advance the reader, moving on to the next segment
+ * at the end of one.
+ * @return Same as history_read_at(); 0 means the reader has caught up with the writers.
+ */
+int history_read_next(struct history_reader *r, struct history_record *rec) {
+    for (;;) {
+        uint32_t segment = HISTORY_SEG(r->pos);
+        long next;
+        int rv;
+
+        if (r->fd == -1 || r->segment != segment) {
+            if (reader_switch(r, segment) == -1) {
+                // Dropped whole by retention (or damaged): go on with the next one left
+                if ((next = next_segment(r->dir, segment + 1)) == -1) return 0;
+                r->pos = HISTORY_POS(next, 0);
+                continue;
+            }
+        }
+        if (r->sealed != NULL) {
+            rv = read_sealed(r, HISTORY_OFF(r->pos), 0, rec);
+        } else {
+            rv = read_raw(r, HISTORY_OFF(r->pos), rec);
+        }
+        if (rv == 1) {
+            // Sealed segments have gaps where records were dropped: look for the next
+            // one from just past this one
+            r->pos = r->sealed != NULL ? rec->pos + 1 : rec->pos + rec->size;
+            return 1;
+        }
+        if (rv == -1 && r->sealed == NULL) return -1;
+
+        if (r->sealed == NULL) {
+            if (!reader_current(r)) {
+                reader_release(r); // Sealed since we opened it: continue in the sealed file
+                continue;
+            }
+            // The newest segment: wait for more
+            if (!segment_exists(r->dir, segment + 1)) return 0;
+            // Writers have moved on; take what was added before they did
+            if (read_raw(r, HISTORY_OFF(r->pos), rec) == 1) {
+                r->pos = rec->pos + rec->size;
+                return 1;
+            }
+        }
+        if ((next = next_segment(r->dir, segment + 1)) == -1) return 0;
+        r->pos = HISTORY_POS(next, 0);
+    }
+}
+
+void history_reader_close(struct history_reader *r) {
+    reader_release(r);
+    free(r->block);
+    r->block = NULL;
+}
+
+/**
+ * @brief Start writing a sealed version of a segment (to a temporary file).
+ * @return 0 on success, -1 on error.
+ */
+int history_seal_begin(struct history_sealer *s, const char *dir, uint32_t segment) {
+    memset(s, 0, sizeof *s);
+    s->segment = segment;
+    history_segment_path(s->path, sizeof s->path, dir, segment, 1);
+    history_segment_path(s->raw_path, sizeof s->raw_path, dir, segment, 0);
+    snprintf(s->tmp_path, sizeof s->tmp_path, "%s.tmp", s->path);
+    if ((s->block = malloc(HISTORY_BLOCK_BYTES + ENTRY_OFFSET_LEN + RECORD_MAX)) == NULL) return -1;
+    if ((s->fd = open(s->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror("open sealed segment");
+        free(s->block);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int flush_block(struct history_sealer *s) {
+    uLongf comp_len = compressBound(s->block_len);
+    uint8_t *comp;
+
+    if (s->block_len == 0) return 0;
+    if (s->num_blocks == s->blocks_cap) {
+        struct history_block *nb = realloc(s->blocks, (s->blocks_cap = s->blocks_cap ? s->blocks_cap * 2 : 64) * sizeof *nb);
+        if (nb == NULL) return -1;
+        s->blocks = nb;
+    }
+    if ((comp = malloc(comp_len)) == NULL) return -1;
+    if (compress2(comp, &comp_len, s->block, s->block_len, Z_DEFAULT_COMPRESSION) != Z_OK
+            || write_all(s->fd, comp, comp_len) == -1) {
+        free(comp);
+        return -1;
+    }
+    free(comp);
+    s->blocks[s->num_blocks++] = (struct history_block){ s->block_first, s->block_last, s->file_pos,
+                                                         (uint32_t)comp_len, (uint32_t)s->block_len };
+    s->file_pos += comp_len;
+    s->bytes_written += comp_len;
+    s->block_len = 0;
+    return 0;
+}
+
+/**
+ * @brief Add a record (read from the segment being sealed) to the sealed version.
+ * @return 0 on success, -1 on error.
+ */
+int history_seal_add(struct history_sealer *s, const struct history_record *rec) {
+    struct history_room_stats *st = NULL;
+    size_t size;
+
+    if (s->block_len == 0) s->block_first = HISTORY_OFF(rec->pos);
+    s->block_last = HISTORY_OFF(rec->pos);
+    chat_store32(s->block + s->block_len, HISTORY_OFF(rec->pos));
+    size = encode_record(s->block + s->block_len + ENTRY_OFFSET_LEN, rec->room_id, rec->seq, rec->ts,
+                         rec->sender, strlen(rec->sender), rec->text, rec->text_len);
+    s->block_len += ENTRY_OFFSET_LEN + size;
+
+    // Every room needs its stats in the trailer: history_last_seqs() and retention rely on them
+    for (uint32_t k = 0; k < s->num_rooms && st == NULL; k++) {
+        if (s->rooms[k].room_id == rec->room_id) st = &s->rooms[k];
+    }
+    if (st == NULL) {
+        if (s->num_rooms == s->rooms_cap) {
+            struct history_room_stats *nr = realloc(s->rooms, (s->rooms_cap = s->rooms_cap ? s->rooms_cap * 2 : 16) * sizeof *nr);
+            if (nr == NULL) return -1;
+            s->rooms = nr;
+        }
+        st = &s->rooms[s->num_rooms++];
+        *st = (struct history_room_stats){ .room_id = rec->room_id, .oldest_ts = rec->ts };
+    }
+    st->count++;
+    st->bytes += size;
+    if (rec->ts < st->oldest_ts) st->oldest_ts = rec->ts;
+    if (rec->seq > st->last_seq) st->last_seq = rec->seq;
+    return s->block_len >= HISTORY_BLOCK_BYTES ? flush_block(s) : 0;
+}
+
+/**
+ * @brief Write the index and trailer, then replace the segment with the sealed file.
+ * On success s->rooms is left for the caller to read and free.
+ * @return 0 on success, -1 on error (the segment is left as it was).
+ */
+int history_seal_finish(struct history_sealer *s) {
+    size_t len;
+    uint8_t *buf, *p;
+    int rv = -1;
+
+    if (flush_block(s) == -1) {
+        history_seal_abort(s);
+        return -1;
+    }
+    len = (size_t)s->num_blocks * INDEX_ENTRY_LEN + (size_t)s->num_rooms * ROOM_STATS_LEN + TRAILER_LEN;
+    if ((buf = malloc(len)) == NULL) {
+        history_seal_abort(s);
+        return -1;
+    }
+    p = buf;
+    for (uint32_t k = 0; k < s->num_blocks; k++, p += INDEX_ENTRY_LEN) {
+        chat_store32(p, s->blocks[k].first_offset);
+        chat_store32(p + 4, s->blocks[k].last_offset);
+        chat_store64(p + 8, s->blocks[k].file_pos);
+        chat_store32(p + 16, s->blocks[k].compressed_len);
+        chat_store32(p + 20, s->blocks[k].raw_len);
+    }
+    for (uint32_t k = 0; k < s->num_rooms; k++, p += ROOM_STATS_LEN) {
+        chat_store16(p, s->rooms[k].room_id);
+        chat_store32(p + 2, s->rooms[k].count);
+        chat_store64(p + 6, s->rooms[k].bytes);
+        chat_store64(p + 14, s->rooms[k].oldest_ts);
+        chat_store64(p + 22, s->rooms[k].last_seq);
+    }
+    chat_store64(p, s->file_pos);
+    chat_store32(p + 8, s->num_blocks);
+    chat_store32(p + 12, s->num_rooms);
+    chat_store32(p + 16, HISTORY_SEALED_MAGIC);
+
+    // The sealed file only takes the segment's name once it is complete on disk
+    if (write_all(s->fd, buf, len) == 0 && fsync(s->fd) == 0 && rename(s->tmp_path, s->path) == 0) {
+        s->bytes_written += len;
+        unlink(s->raw_path);
+        rv = 0;
+    }
+    free(buf);
+    close(s->fd);
+    s->fd = -1;
+    if (rv == -1) {
+        perror("write sealed segment");
+        unlink(s->tmp_path);
+    }
+    free(s->block);
+    free(s->blocks);
+    s->block = NULL;
+    s->blocks = NULL;
+    return rv;
+}
+
+void history_seal_abort(struct history_sealer *s) {
+    if (s->fd != -1) {
+        close(s->fd);
+        unlink(s->tmp_path);
+        s->fd = -1;
+    }
+    free(s->block);
+    free(s->blocks);
+    free(s->rooms);
+    s->block = NULL;
+    s->blocks = NULL;
+    s->rooms = NULL;
+}
+
+// Raise last_seq[] to what the HISTORY_ROOM_SEQS file says
+void history_load_room_seqs(const char *dir, uint64_t *last_seq, int max_rooms) {
+    char path[160];
+    unsigned int room;
+    unsigned long long seq;
+    FILE *f;
+
+    snprintf(path, sizeof path, "%s/%s", dir, HISTORY_ROOM_SEQS);
+    if ((f = fopen(path, "r")) == NULL) return;
+    while (fscanf(f, "%u %llu", &room, &seq) == 2) {
+        if (room < (unsigned int)max_rooms && seq > last_seq[room]) last_seq[room] = seq;
+    }
+    fclose(f);
+}
+
+/**
+ * @brief Replace the HISTORY_ROOM_SEQS file: "room_id last_seq" per line.
+ * @return 0 on success, -1 on error.
+ */
+int history_save_room_seqs(const char *dir, const uint64_t *last_seq, int max_rooms) {
+    char path[160], tmp[168];
+    FILE *f;
+
+    snprintf(path, sizeof path, "%s/%s", dir, HISTORY_ROOM_SEQS);
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    if ((f = fopen(tmp, "w")) == NULL) {
+        perror("open room sequence file");
+        return -1;
+    }
+    for (int r = 0; r < max_rooms; r++) {
+        if (last_seq[r] > 0) fprintf(f, "%d %llu\n", r, (unsigned long long)last_seq[r]);
+    }
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        perror("write room sequence file");
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(f);
+    if (rename(tmp, path) == -1) {
+        perror("rename room sequence file");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Raise last_seq[room] to the highest sequence number the log has seen for each
+ * room, so numbering carries on where it stopped before a restart. Sealed segments
+ * answer from their trailers, and numbers of records dropped by retention come from
+ * the HISTORY_ROOM_SEQS file the compactor keeps.
+ * @return Number of records accounted for, or -1 if the log cannot be listed.
+ */
+long history_last_seqs(const char *dir, uint64_t *last_seq, int max_rooms) {
+    uint32_t *segments;
+    int *sealed, n;
+    long count = 0;
+
+    history_load_room_seqs(dir, last_seq, max_rooms);
+    if ((n = history_list_segments(dir, &segments, &sealed)) <= 0) {
+        return n;
+    }
+    for (int k = 0; k < n; k++) {
+        struct history_reader reader;
+        struct history_record rec;
+
+        history_reader_open(&reader, dir);
+        if (sealed[k] && reader_switch(&reader, segments[k]) == 0 && reader.sealed != NULL) {
+            for (uint32_t s = 0; s < reader.sealed->num_rooms; s++) {
+                const struct history_room_stats *st = &reader.sealed->rooms[s];
+                if (st->room_id < max_rooms && st->last_seq > last_seq[st->room_id]) {
+                    last_seq[st->room_id] = st->last_seq;
+                }
+                count += st->count;
+            }
+        } else if (!sealed[k]) {
+            reader.pos = HISTORY_POS(segments[k], 0);
+            while (history_read_next(&reader, &rec) == 1 && HISTORY_SEG(rec.pos) == segments[k]) {
+                if (rec.room_id < max_rooms && rec.seq > last_seq[rec.room_id]) {
+                    last_seq[rec.room_id] = rec.seq;
+                }
+                count++;
+            }
+        }
+        history_reader_close(&reader);
+    }
+    free(segments);
+    free(sealed);
+    return count;
+}
@@ -0,0 +1,165 @@
+/**
+ * @file history.h
+ * @brief Segmented log of every chat message the server has broadcast.
+ *
+ * The log is a series of numbered segments in HISTORY_DIR. New records are appended
+ * to the newest one; once it reaches HISTORY_SEGMENT_BYTES the writers move on to the
+ * next number. A full segment is later sealed by the compactor (compactor.h): rewritten
+ * as a compressed file, minus whatever the retention policy drops.
+ *
+ *   seg-NNNNNNNN.log   raw segment, records back to back
+ *   seg-NNNNNNNN.hz    sealed segment (layout below)
+ *
+ * Raw record layout (all integers big-endian):
+ *   u32 len        bytes that follow this field, ORed with HISTORY_STAMPED
+ *   u16 room_id
+ *   u64 seq        the room's sequence number, assigned by the server on arrival
+ *   u64 ts         server timestamp, microseconds since the Unix epoch
+ *   u8  sender_len
+ *   sender bytes
+ *   text bytes     (len - 19 - sender_len)
+ *
+ * Records written before messages were numbered have no HISTORY_STAMPED bit and no
+ * seq or ts fields; they read back with both set to 0. So does the single-file log of
+ * older versions, which history_open() takes over as segment 0.
+ *
+ * Sealed segment layout:
+ *   blocks         zlib streams of about HISTORY_BLOCK_BYTES, each holding whole
+ *                  records as u32 offset + the record in raw layout
+ *   block index    per block: u32 first_offset, u32 last_offset, u64 file_pos,
+ *                  u32 compressed_len, u32 raw_len
+ *   room stats     per room with records: u16 room_id, u32 count, u64 bytes,
+ *                  u64 oldest_ts, u64 last_seq
+ *   trailer        u64 index_pos, u32 num_blocks, u32 num_rooms, u32 HISTORY_SEALED_MAGIC
+ *
+ * A record is identified by its position: segment number in the high 32 bits and byte
+ * offset in the raw segment in the low 32. Sealing keeps the offsets, so positions
+ * handed out earlier (the search index) stay valid; a record dropped by retention just
+ * reads back as missing. Appends are a single write() on an O_APPEND descriptor, so
+ * readers never see a half-written header followed by another writer's data.
+ */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HISTORY_DIR        "history"
+#define HISTORY_LEGACY_LOG HISTORY_DIR "/chat_history.log" // Single-file log of older versions
+#define HISTORY_ROOMS      HISTORY_DIR "/rooms.txt"  // One room name per line, line number = room id
+#define HISTORY_ROOM_SEQS  "room_seqs"               // In the history dir: numbering of dropped records
+#define HISTORY_MAX_SENDER 32
+#define HISTORY_MAX_TEXT   1024
+#define HISTORY_STAMPED    0x80000000u // Flag in the len field: the record has seq and ts
+#define HISTORY_SEALED_MAGIC 0x485a3031u // "HZ01"
+
+// Build-time overridable, e.g. -DHISTORY_SEGMENT_BYTES=65536 to watch sealing happen
+#ifndef HISTORY_SEGMENT_BYTES
+#define HISTORY_SEGMENT_BYTES (4 * 1024 * 1024) // Writers move on to a new segment past this
+#endif
+#ifndef HISTORY_BLOCK_BYTES
+#define HISTORY_BLOCK_BYTES   (64 * 1024)       // Raw bytes compressed together in a sealed segment
+#endif
+
+#define HISTORY_POS(seg, off) (((uint64_t)(seg) << 32) | (uint32_t)(off))
+#define HISTORY_SEG(pos)      ((uint32_t)((pos) >> 32))
+#define HISTORY_OFF(pos)      ((uint32_t)(pos))
+
+struct history_record {
+    uint64_t pos;                          // Position of the record in the log
+    size_t size;                           // Bytes the record occupies in its raw layout
+    uint16_t room_id;
+    uint64_t seq;                          // 0 in records from before numbering
+    uint64_t ts;
+    char sender[HISTORY_MAX_SENDER];
+    char text[HISTORY_MAX_TEXT + 1];       // NUL-terminated
+    size_t text_len;
+};
+
+// Append side: one per writing process
+struct history_log {
+    int fd;
+    uint32_t segment;
+};
+
+struct history_block {
+    uint32_t first_offset;
+    uint32_t last_offset;
+    uint64_t file_pos;
+    uint32_t compressed_len;
+    uint32_t raw_len;
+};
+
+struct history_room_stats {
+    uint16_t room_id;
+    uint32_t count;
+    uint64_t bytes;     // Raw record bytes
+    uint64_t oldest_ts;
+    uint64_t last_seq;
+};
+
+// What the trailer of a sealed segment describes
+struct history_sealed {
+    uint32_t num_blocks;
+    struct history_block *blocks;
+    uint32_t num_rooms;
+    struct history_room_stats *rooms;
+};
+
+// Reader that follows the log across segments, or fetches records by position
+struct history_reader {
+    char dir[128];
+    uint64_t pos;                  // Position of the next record to read
+    int fd;                        // Open segment, -1 if none
+    uint32_t segment;              // ...its number
+    ino_t ino;                     // ...and inode, to notice it being sealed or rewritten
+    struct history_sealed *sealed; // Seek index if the open segment is sealed
+    uint8_t *block;                // Last block decompressed...
+    int block_no;                  // ...which one, -1 if none
+    size_t block_len;
+    size_t cursor;                 // Where the previous lookup in the block stopped
+};
+
+// Builds a sealed segment; records must be added in position order
+struct history_sealer {
+    char tmp_path[168];
+    char path[160];
+    char raw_path[160];
+    int fd;
+    uint32_t segment;
+    uint8_t *block;
+    size_t block_len;
+    uint32_t block_first, block_last;
+    uint64_t file_pos;
+    struct history_block *blocks;
+    uint32_t num_blocks, blocks_cap;
+    struct history_room_stats *rooms; // Grown as rooms turn up; still valid after
+    uint32_t num_rooms, rooms_cap;    // history_seal_finish(), for the caller to free
+    uint64_t bytes_written;        // Compressed bytes so far, for I/O throttling
+};
+
+int history_open(struct history_log *log);
+int history_append(struct history_log *log, uint16_t room_id, uint64_t seq, uint64_t ts,
+                   const char *sender, const char *text, size_t len);
+void history_close(struct history_log *log);
+long history_last_seqs(const char *dir, uint64_t *last_seq, int max_rooms);
+void history_load_room_seqs(const char *dir, uint64_t *last_seq, int max_rooms);
+int history_save_room_seqs(const char *dir, const uint64_t *last_seq, int max_rooms);
+
+void history_reader_open(struct history_reader *r, const char *dir);
+int history_read_next(struct history_reader *r, struct history_record *rec);
+int history_read_at(struct history_reader *r, uint64_t pos, struct history_record *rec);
+void history_reader_close(struct history_reader *r);
+
+// Segment bookkeeping, used by the compactor
+int history_list_segments(const char *dir, uint32_t **segments, int **sealed);
+void history_segment_path(char *buf, size_t size, const char *dir, uint32_t segment, int sealed);
+struct history_sealed *history_load_sealed(int fd);
+void history_free_sealed(struct history_sealed *s);
+int history_seal_begin(struct history_sealer *s, const char *dir, uint32_t segment);
+int history_seal_add(struct history_sealer *s, const struct history_record *rec);
+int history_seal_finish(struct history_sealer *s);
+void history_seal_abort(struct history_sealer *s);
+
+#endif // HISTORY_H
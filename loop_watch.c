@@ -0,0 +1,256 @@
+/**
+ * @file loop_watch.c
+ * @brief Event loop timing and stall watchdog (see loop_watch.h).
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "loop_watch.h"
+
+static const char *handler_names[LOOP_NUM_HANDLERS] = {
+    "console", "accept", "handshake", "read", "bus", "presence", "flush", "multicast"
+};
+
+// Owned by the event loop thread
+static struct {
+    uint32_t slow_us;
+    uint64_t start_us;
+    uint64_t handler_start_us;
+    uint64_t broadcast_start_us;
+    struct loop_iteration cur;  // The iteration in progress
+    struct loop_iteration ring[LOOP_WATCH_RING];
+    unsigned long ring_next;    // Slow iterations captured so far; the next one goes in ring_next % LOOP_WATCH_RING
+    uint64_t noted_us;          // When the last slow-iteration note went out
+    unsigned long unnoted;      // Slow iterations since then
+    uint32_t unnoted_max_us;    // Longest of them
+    struct loop_watch_stats stats;
+} loop = { .slow_us = LOOP_WATCH_DEFAULT_SLOW_US };
+
+// Shared with the watchdog thread, through __atomic loads and stores only
+static struct {
+    uint64_t busy_since_us;       // Start of the iteration in progress, 0 while waiting
+    unsigned long iteration;      // Number of the iteration in progress
+    int handler;                  // Handler running, -1 for none
+    int fd;
+    unsigned long stalled;        // Last iteration the watchdog reported
+    unsigned long stalls;
+} shared = { .handler = -1 };
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int started;
+    int stopping;
+    uint32_t stall_ms;
+} dog = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static uint64_t wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+const char *loop_handler_name(enum loop_handler handler) {
+    return handler < LOOP_NUM_HANDLERS ? handler_names[handler] : "?";
+}
+
+/**
+ * @brief Look at the loop every quarter of the stall timeout. A stall is reported
+ * once; the loop itself says when it is over.
+ */
+static void *watchdog_main(void *arg) {
+    uint64_t stall_us = (uint64_t)dog.stall_ms * 1000;
+    long period_ns = (long)dog.stall_ms * 1000000L / 4;
+    (void)arg;
+
+    pthread_mutex_lock(&dog.lock);
+    while (!dog.stopping) {
+        struct timespec deadline;
+        uint64_t since = __atomic_load_n(&shared.busy_since_us, __ATOMIC_ACQUIRE);
+        unsigned long iteration = __atomic_load_n(&shared.iteration, __ATOMIC_RELAXED);
+
+        if (since != 0 && monotonic_us() - since > stall_us
+                && __atomic_load_n(&shared.stalled, __ATOMIC_RELAXED) != iteration) {
+            int handler = __atomic_load_n(&shared.handler, __ATOMIC_RELAXED);
+            int fd = __atomic_load_n(&shared.fd, __ATOMIC_RELAXED);
+
+            __atomic_store_n(&shared.stalled, iteration, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&shared.stalls, 1, __ATOMIC_RELAXED);
+            if (handler >= 0) {
+                fprintf(stderr, "WATCHDOG: event loop stuck for %llu ms in the %s handler (fd %d)\n",
+                        (unsigned long long)(monotonic_us() - since) / 1000, loop_handler_name(handler), fd);
+            } else {
+                fprintf(stderr, "WATCHDOG: event loop stuck for %llu ms between handlers\n",
+                        (unsigned long long)(monotonic_us() - since) / 1000);
+            }
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += period_ns;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!dog.stopping && pthread_cond_timedwait(&dog.wake, &dog.lock, &deadline) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&dog.lock);
+    return NULL;
+}
+
+/**
+ * @brief Set the slow-iteration threshold and start the watchdog thread.
+ * @param slow_us Capture iterations at least this long; 0 captures none.
+ * @param stall_ms Watchdog timeout; 0 runs no watchdog.
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+int loop_watch_start(uint32_t slow_us, uint32_t stall_ms) {
+    loop.slow_us = slow_us;
+    if (stall_ms == 0) return 0;
+    dog.stall_ms = stall_ms;
+    dog.stopping = 0;
+    if ((errno = pthread_create(&dog.thread, NULL, watchdog_main, NULL)) != 0) {
+        perror("pthread_create watchdog");
+        return -1;
+    }
+    dog.started = 1;
+    return 0;
+}
+
+void loop_watch_stop(void) {
+    if (!dog.started) return;
+    pthread_mutex_lock(&dog.lock);
+    dog.stopping = 1;
+    pthread_cond_broadcast(&dog.wake);
+    pthread_mutex_unlock(&dog.lock);
+    pthread_join(dog.thread, NULL);
+    dog.started = 0;
+}
+
+// Call as soon as the poller returns
+void loop_watch_iteration_begin(void) {
+    loop.start_us = monotonic_us();
+    loop.cur.wall_us = wall_us();
+    loop.cur.broadcast_us = 0;
+    loop.cur.broadcasts = 0;
+    loop.cur.num_calls = 0;
+    loop.cur.recorded = 0;
+    __atomic_store_n(&shared.iteration, loop.stats.iterations + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared.busy_since_us, loop.start_us, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Call before going back to wait, with the state of the outbound queues.
+ * Captures the iteration if it was slow. A note goes to stderr at most every
+ * LOOP_WATCH_NOTE_MS, so a loop that is slow all the time does not add a line
+ * of output to every iteration.
+ */
+void loop_watch_iteration_end(int clients, size_t outq_bytes, size_t outq_max_bytes, int outq_max_fd) {
+    uint64_t us = monotonic_us() - loop.start_us;
+
+    __atomic_store_n(&shared.busy_since_us, 0, __ATOMIC_RELEASE);
+    loop.stats.iterations++;
+    if (us > loop.stats.max_us) loop.stats.max_us = (uint32_t)us;
+    if (__atomic_load_n(&shared.stalled, __ATOMIC_RELAXED) == loop.stats.iterations) {
+        fprintf(stderr, "WATCHDOG: event loop running again after %llu ms\n", (unsigned long long)us / 1000);
+    }
+    if (loop.slow_us == 0 || us < loop.slow_us) return;
+
+    loop.cur.us = (uint32_t)us;
+    loop.cur.clients = clients;
+    loop.cur.outq_bytes = outq_bytes;
+    loop.cur.outq_max_bytes = outq_max_bytes;
+    loop.cur.outq_max_fd = outq_max_fd;
+    loop.ring[loop.ring_next % LOOP_WATCH_RING] = loop.cur;
+    loop.ring_next++;
+    loop.stats.slow++;
+
+    loop.unnoted++;
+    if (us > loop.unnoted_max_us) loop.unnoted_max_us = (uint32_t)us;
+    if (loop.noted_us != 0 && loop.start_us + us - loop.noted_us < (uint64_t)LOOP_WATCH_NOTE_MS * 1000) return;
+    fprintf(stderr, "Slow loop: %lu iteration(s) of %u us or more, longest %.1f ms (\"slow\" shows the last %d)\n",
+            loop.unnoted, loop.slow_us, loop.unnoted_max_us / 1000.0, LOOP_WATCH_RING);
+    loop.noted_us = loop.start_us + us;
+    loop.unnoted = 0;
+    loop.unnoted_max_us = 0;
+}
+
+void loop_watch_handler_begin(enum loop_handler handler, int fd) {
+    loop.cur.calls[loop.cur.recorded].handler = handler; // Filled in by loop_watch_handler_end()
+    loop.cur.calls[loop.cur.recorded].fd = fd;
+    __atomic_store_n(&shared.fd, fd, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared.handler, (int)handler, __ATOMIC_RELAXED);
+    loop.handler_start_us = monotonic_us();
+}
+
+void loop_watch_handler_end(size_t bytes) {
+    uint32_t us = (uint32_t)(monotonic_us() - loop.handler_start_us);
+    struct loop_call *call = &loop.cur.calls[loop.cur.recorded];
+
+    __atomic_store_n(&shared.handler, -1, __ATOMIC_RELAXED);
+    loop.stats.calls[call->handler]++;
+    loop.stats.total_us[call->handler] += us;
+    if (us > loop.stats.handler_max_us[call->handler]) loop.stats.handler_max_us[call->handler] = us;
+    loop.cur.num_calls++;
+    if ((bytes == 0 && us < LOOP_WATCH_TRIVIAL_US) || loop.cur.recorded == LOOP_WATCH_MAX_CALLS - 1) {
+        return; // The last entry stays free for the next begin
+    }
+    call->us = us;
+    call->bytes = (uint32_t)bytes;
+    loop.cur.recorded++;
+}
+
+void loop_watch_broadcast_begin(void) {
+    loop.broadcast_start_us = monotonic_us();
+}
+
+void loop_watch_broadcast_end(void) {
+    loop.cur.broadcast_us += (uint32_t)(monotonic_us() - loop.broadcast_start_us);
+    loop.cur.broadcasts++;
+}
+
+void loop_watch_get_stats(struct loop_watch_stats *out) {
+    *out = loop.stats;
+    out->stalls = __atomic_load_n(&shared.stalls, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Print the captured slow iterations, oldest first.
+ */
+void loop_watch_dump(FILE *out) {
+    unsigned long first = loop.ring_next > LOOP_WATCH_RING ? loop.ring_next - LOOP_WATCH_RING : 0;
+
+    if (loop.ring_next == 0) {
+        fprintf(out, "No loop iteration has taken %u us or more\n", loop.slow_us);
+        return;
+    }
+    for (unsigned long n = first; n < loop.ring_next; n++) {
+        const struct loop_iteration *it = &loop.ring[n % LOOP_WATCH_RING];
+        time_t secs = (time_t)(it->wall_us / 1000000u);
+        struct tm tm;
+        char when[16];
+
+        localtime_r(&secs, &tm);
+        strftime(when, sizeof when, "%H:%M:%S", &tm);
+        fprintf(out, "%s.%03u  %.3f ms, %d handler call(s), %u broadcast(s) taking %.3f ms; "
+                "%d client(s) with %zu bytes queued, longest queue %zu bytes (fd %d)\n",
+                when, (unsigned)(it->wall_us / 1000 % 1000), it->us / 1000.0, it->num_calls, it->broadcasts,
+                it->broadcast_us / 1000.0, it->clients, it->outq_bytes, it->outq_max_bytes, it->outq_max_fd);
+        for (int k = 0; k < it->recorded; k++) {
+            const struct loop_call *c = &it->calls[k];
+            fprintf(out, "    %-9s fd %-4d %8.3f ms  %u bytes\n", loop_handler_name(c->handler), c->fd,
+                    c->us / 1000.0, c->bytes);
+        }
+        if (it->recorded < it->num_calls) {
+            fprintf(out, "    (%d quick or further call(s) not shown)\n", it->num_calls - it->recorded);
+        }
+    }
+}
@@ -0,0 +1,93 @@
+/**
+ * @file loop_watch.h
+ * @brief Timing of the event loop: slow-iteration capture and a stall watchdog.
+ *
+ * The server marks the start and end of every loop iteration (the part after the
+ * poller wakes it up) and of every handler it runs in between: the admin console,
+ * accepts, TLS handshakes, reading a client, the bus, presence, flushing a client and
+ * sending multicast datagrams.
+ * Each handler call notes the fd it served and the bytes it moved; time spent in
+ * broadcast_message() is added up separately.
+ *
+ * An iteration that takes LOOP_WATCH_DEFAULT_SLOW_US or longer (or whatever was
+ * given to loop_watch_start()) is copied, handler calls, broadcast time and outbound
+ * queue depths included, into a ring of the last LOOP_WATCH_RING slow iterations,
+ * which loop_watch_dump() prints ("slow" on the admin console). A one-line count of
+ * them goes to stderr at most every LOOP_WATCH_NOTE_MS.
+ *
+ * A loop that never finishes its iteration records nothing, so a watchdog thread
+ * checks on it every quarter of the stall timeout and reports on stderr, once per
+ * stall, a loop that has been busy for longer than that and in which handler.
+ */
+#ifndef LOOP_WATCH_H
+#define LOOP_WATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOOP_WATCH_RING             64    // Slow iterations kept for loop_watch_dump()
+#define LOOP_WATCH_MAX_CALLS        32    // Handler calls recorded per iteration; later ones are only counted
+#define LOOP_WATCH_TRIVIAL_US       10    // A call that moved nothing in less than this is not recorded
+#define LOOP_WATCH_DEFAULT_SLOW_US  10000 // Iterations at least this long are captured
+#define LOOP_WATCH_DEFAULT_STALL_MS 1000  // The watchdog reports a loop busy for longer than this
+#define LOOP_WATCH_NOTE_MS          10000 // Slow iterations are noted on stderr at most this often
+
+enum loop_handler {
+    LOOP_CONSOLE = 0, // Admin command on stdin
+    LOOP_ACCEPT,
+    LOOP_HANDSHAKE,   // TLS handshake step
+    LOOP_READ,        // Reading and handling a client's frames
+    LOOP_BUS,         // Messages from the other workers
+    LOOP_PRESENCE,    // Presence snapshot
+    LOOP_FLUSH,       // Writing a client's outbound queue
+    LOOP_MULTICAST,   // Sending the iteration's multicast datagrams
+    LOOP_NUM_HANDLERS
+};
+
+struct loop_call {
+    uint8_t handler;  // enum loop_handler
+    int fd;
+    uint32_t us;
+    uint32_t bytes;   // Read or written
+};
+
+// One captured slow iteration
+struct loop_iteration {
+    uint64_t wall_us;       // When it started (wall clock)
+    uint32_t us;            // How long it took
+    uint32_t broadcast_us;  // Of which inside broadcast_message()
+    uint32_t broadcasts;
+    int num_calls;          // Handler calls made; those worth recording are in calls[], while there is room
+    int recorded;
+    struct loop_call calls[LOOP_WATCH_MAX_CALLS];
+    // Outbound queues once the iteration was over
+    int clients;
+    size_t outq_bytes;      // All clients together
+    size_t outq_max_bytes;  // The longest queue...
+    int outq_max_fd;        // ...and whose it is
+};
+
+struct loop_watch_stats {
+    unsigned long iterations;
+    unsigned long slow;      // Captured iterations
+    unsigned long stalls;    // Reported by the watchdog
+    uint32_t max_us;         // Longest iteration
+    unsigned long calls[LOOP_NUM_HANDLERS];
+    uint64_t total_us[LOOP_NUM_HANDLERS];
+    uint32_t handler_max_us[LOOP_NUM_HANDLERS];
+};
+
+int loop_watch_start(uint32_t slow_us, uint32_t stall_ms);
+void loop_watch_stop(void);
+void loop_watch_iteration_begin(void);
+void loop_watch_iteration_end(int clients, size_t outq_bytes, size_t outq_max_bytes, int outq_max_fd);
+void loop_watch_handler_begin(enum loop_handler handler, int fd);
+void loop_watch_handler_end(size_t bytes);
+void loop_watch_broadcast_begin(void);
+void loop_watch_broadcast_end(void);
+void loop_watch_get_stats(struct loop_watch_stats *stats);
+void loop_watch_dump(FILE *out);
+const char *loop_handler_name(enum loop_handler handler);
+
+#endif // LOOP_WATCH_H
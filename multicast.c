@@ -0,0 +1,107 @@
+/**
+ * @file multicast.c
+ * @brief Multicast group parsing and socket setup (see multicast.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "multicast.h"
+
+/**
+ * @brief Parse "GROUP:PORT", e.g. "239.255.0.1:5000".
+ * @return 0 on success, -1 if it is not an IPv4 multicast address and port.
+ */
+int multicast_parse_group(const char *spec, struct sockaddr_in *group) {
+    char addr[INET_ADDRSTRLEN];
+    const char *colon = strrchr(spec, ':');
+    long port;
+
+    if (colon == NULL || (size_t)(colon - spec) >= sizeof addr) return -1;
+    memcpy(addr, spec, colon - spec);
+    addr[colon - spec] = '\0';
+    port = strtol(colon + 1, NULL, 10);
+
+    memset(group, 0, sizeof *group);
+    group->sin_family = AF_INET;
+    group->sin_port = htons((uint16_t)port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, addr, &group->sin_addr) != 1
+            || !IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open a non-blocking socket for sending to a group, out of the interface
+ * with address if_addr (NULL: the one the routing table picks).
+ * @return The socket, or -1.
+ */
+int multicast_open_sender(const char *if_addr) {
+    unsigned char ttl = 1, loop = 1;
+    struct in_addr iface;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        perror("socket multicast");
+        return -1;
+    }
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof ttl) == -1
+            || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof loop) == -1) {
+        perror("setsockopt multicast");
+        close(fd);
+        return -1;
+    }
+    if (if_addr != NULL && (inet_pton(AF_INET, if_addr, &iface) != 1
+            || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof iface) == -1)) {
+        fprintf(stderr, "Cannot send multicast from interface %s\n", if_addr);
+        close(fd);
+        return -1;
+    }
+    // Better to lose a datagram (and have it repaired) than to block the event loop
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * @brief Open a non-blocking socket bound to the group's port that has joined the
+ * group on the interface with address if_addr (NULL: the one the routing table picks).
+ * Several receivers on one host can share the port.
+ * @return The socket, or -1.
+ */
+int multicast_open_receiver(const struct sockaddr_in *group, const char *if_addr) {
+    struct ip_mreq mreq;
+    int fd, one = 1;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        perror("socket multicast");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    // Bound to the group address, not INADDR_ANY: datagrams for other groups that
+    // happen to use the same port are not ours
+    if (bind(fd, (const struct sockaddr *)group, sizeof *group) == -1) {
+        perror("bind multicast");
+        close(fd);
+        return -1;
+    }
+    mreq.imr_multiaddr = group->sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (if_addr != NULL && inet_pton(AF_INET, if_addr, &mreq.imr_interface) != 1) {
+        fprintf(stderr, "Bad interface address %s\n", if_addr);
+        close(fd);
+        return -1;
+    }
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) == -1) {
+        perror("setsockopt IP_ADD_MEMBERSHIP");
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
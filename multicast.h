@@ -0,0 +1,36 @@
+/**
+ * @file multicast.h
+ * @brief IPv4 multicast sockets for LAN-local room fan-out.
+ *
+ * With --multicast GROUP:PORT the server sends the CHAT frames of every room that
+ * has a subscribed member once, as a UDP datagram to the group, instead of once per
+ * member over TCP; the switch (the router or the kernel on loopback) does the fan-out.
+ * A datagram is exactly the frame of chat_protocol.h, so it carries the room id and
+ * the room's sequence number, and receivers keep the frames of their own room.
+ *
+ * A client opts in with "/multicast on" after joining the group. From then on its
+ * room's messages only arrive over multicast, and it finds lost datagrams by the gaps
+ * in their sequence numbers. Every MULTICAST_SYNC_MS the server also sends a SYNC
+ * datagram with the last sequence number it published in each room, so that losing
+ * the last message before a quiet spell shows up too. Missing messages are asked for
+ * again with a NACK frame over the TCP connection and resent on it from the recent
+ * cache (recent_cache.h); older ones are reported lost.
+ *
+ * Datagrams go out with TTL 1 (they do not leave the segment) and IP_MULTICAST_LOOP
+ * on, so clients on the server's own host receive them too, loopback tests included.
+ */
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <netinet/in.h>
+
+#define MULTICAST_SYNC_MS      1000 // Interval between two SYNC datagrams
+#define MULTICAST_NACK_DELAY_MS  20 // A gap may just be reordering: wait this long before asking
+#define MULTICAST_NACK_RETRY_MS 200 // Ask again after this long
+#define MULTICAST_NACK_TRIES      3 // Then give the messages up as lost
+
+int multicast_parse_group(const char *spec, struct sockaddr_in *group);
+int multicast_open_sender(const char *if_addr);
+int multicast_open_receiver(const struct sockaddr_in *group, const char *if_addr);
+
+#endif // MULTICAST_H
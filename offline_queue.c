@@ -0,0 +1,337 @@
+/**
+ * @file offline_queue.c
+ * @brief In-memory queue with append-only on-disk spillover for disconnected users.
+ *
+ * Ordering rule: the in-memory list always holds the oldest messages and the spill
+ * file holds the newer ones. Once anything has been spilled, new messages go straight
+ * to the file until it has been fully delivered, so delivery order is always
+ * "memory first, then file".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h> // htonl/ntohl for the record length prefix
+
+#include "offline_queue.h"
+
+#define RECORD_HDR_LEN 4 // Each spilled record is a 4-byte big-endian length followed by the data
+
+void offline_queue_init(struct offline_queue *q, const char *user) {
+    struct stat st;
+
+    memset(q, 0, sizeof *q);
+    q->spill_fd = -1;
+    snprintf(q->path, sizeof q->path, "%s/%s.queue", OFFLINE_DIR, user);
+
+    // A spill file left over from a previous run still holds undelivered messages
+    if ((q->spill_fd = open(q->path, O_RDWR | O_APPEND)) == -1) {
+        return;
+    }
+    if (fstat(q->spill_fd, &st) == -1 || st.st_size == 0) {
+        close(q->spill_fd);
+        q->spill_fd = -1;
+        unlink(q->path);
+        return;
+    }
+    q->spill_size = st.st_size;
+    printf("[OFFLINE] Found %lld spilled bytes for %s\n", (long long)q->spill_size, user);
+}
+
+static int spill_append(struct offline_queue *q, const char *msg, size_t len) {
+    uint32_t hdr = htonl((uint32_t)len);
+    struct iovec iov[2];
+
+    if (q->spill_size + RECORD_HDR_LEN + (off_t)len > OFFLINE_DISK_LIMIT) {
+        q->dropped++;
+        fprintf(stderr, "[OFFLINE] %s is full, dropping message (%zu dropped so far)\n",
+                q->path, q->dropped);
+        return -1;
+    }
+    if (q->spill_fd == -1) {
+        if ((q->spill_fd = open(q->path, O_RDWR | O_CREAT | O_APPEND, 0600)) == -1) {
+            perror("open offline spill file");
+            return -1;
+        }
+        printf("[OFFLINE] Spilling to %s\n", q->path);
+    }
+
+    // Header and data go out in one append so a record is never split by another writer
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = RECORD_HDR_LEN;
+    iov[1].iov_base = (void *)msg;
+    iov[1].iov_len = len;
+    if (writev(q->spill_fd, iov, 2) != (ssize_t)(RECORD_HDR_LEN + len)) {
+        perror("writev offline spill file");
+        return -1;
+    }
+    q->spill_size += RECORD_HDR_LEN + len;
+    return 0;
+}
+
+/**
+ * @brief Queue a message for a disconnected user.
+ * @return 0 if the message was queued, -1 if it was dropped.
+ */
+int offline_queue_push(struct offline_queue *q, const char *msg, size_t len) {
+    struct offline_entry *e;
+
+    if (q->spill_fd != -1 || q->mem_bytes + len > OFFLINE_MEM_LIMIT) {
+        return spill_append(q, msg, len);
+    }
+
+    if ((e = malloc(sizeof *e + len)) == NULL) {
+        perror("malloc offline entry");
+        return -1;
+    }
+    e->next = NULL;
+    e->len = len;
+    memcpy(e->data, msg, len);
+    if (q->tail != NULL) {
+        q->tail->next = e;
+    } else {
+        q->head = e;
+    }
+    q->tail = e;
+    q->mem_bytes += len;
+    q->mem_count++;
+    return 0;
+}
+
+int offline_queue_pending(const struct offline_queue *q) {
+    return q->head != NULL || q->spill_fd != -1;
+}
+
+static void pop_head(struct offline_queue *q) {
+    struct offline_entry *e = q->head;
+
+    q->head = e->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    q->mem_bytes -= e->len;
+    q->mem_count--;
+    free(e);
+}
+
+// Deliver the in-memory part, packing as many whole messages per write as fit in a batch
+static int deliver_memory(struct offline_queue *q, offline_write_fn write_batch, void *ctx) {
+    char batch[OFFLINE_BATCH_SIZE];
+
+    while (q->head != NULL) {
+        struct offline_entry *e = q->head;
+        const char *out = batch;
+        size_t used = 0;
+        int count = 0;
+
+        if (e->len > sizeof batch) {
+            // Oversized message, write it on its own straight from the entry
+            out = e->data;
+            used = e->len;
+            count = 1;
+        } else {
+            while (e != NULL && used + e->len <= sizeof batch) {
+                memcpy(batch + used, e->data, e->len);
+                used += e->len;
+                count++;
+                e = e->next;
+            }
+        }
+
+        if (write_batch(ctx, out, used) != 0) {
+            return -1;
+        }
+        // Only drop the entries once their batch has been accepted
+        while (count-- > 0) {
+            pop_head(q);
+        }
+    }
+    return 0;
+}
+
+// Deliver the spilled part starting at delivered_off, advancing it after each batch
+static int deliver_spill(struct offline_queue *q, offline_write_fn write_batch, void *ctx) {
+    char batch[OFFLINE_BATCH_SIZE];
+    size_t used = 0;
+    off_t off = q->delivered_off;
+
+    while (off < q->spill_size) {
+        uint32_t hdr;
+        size_t len;
+
+        if (pread(q->spill_fd, &hdr, RECORD_HDR_LEN, off) != RECORD_HDR_LEN) {
+            fprintf(stderr, "[OFFLINE] Truncated record in %s at offset %lld, discarding rest\n",
+                    q->path, (long long)off);
+            q->spill_size = off;
+            break;
+        }
+        len = ntohl(hdr);
+
+        if (used > 0 && used + len > sizeof batch) {
+            if (write_batch(ctx, batch, used) != 0) {
+                return -1;
+            }
+            q->delivered_off = off;
+            used = 0;
+        }
+
+        if (len > sizeof batch) {
+            char *big = malloc(len);
+            if (big == NULL || pread(q->spill_fd, big, len, off + RECORD_HDR_LEN) != (ssize_t)len
+                    || write_batch(ctx, big, len) != 0) {
+                free(big);
+                return -1;
+            }
+            free(big);
+            off += RECORD_HDR_LEN + len;
+            q->delivered_off = off;
+            continue;
+        }
+
+        if (pread(q->spill_fd, batch + used, len, off + RECORD_HDR_LEN) != (ssize_t)len) {
+            fprintf(stderr, "[OFFLINE] Short read in %s at offset %lld, discarding rest\n",
+                    q->path, (long long)off);
+            q->spill_size = off;
+            break;
+        }
+        used += len;
+        off += RECORD_HDR_LEN + len;
+    }
+
+    if (used > 0) {
+        if (write_batch(ctx, batch, used) != 0) {
+            return -1;
+        }
+    }
+    q->delivered_off = off;
+    return 0;
+}
+
+/**
+ * @brief Deliver every queued message (memory first, then the spill file) in batches.
+ * Stops at the first batch that cannot be written (the callback may also use that to
+ * pause delivery); whatever was delivered up to that point is not delivered again.
+ * Runs a compaction pass once the queue is drained or at least half of the spill
+ * file has been delivered, so a paused delivery does not rewrite the file every time.
+ * @return 0 if the queue was fully drained, -1 otherwise.
+ */
+int offline_queue_deliver(struct offline_queue *q, offline_write_fn write_batch, void *ctx) {
+    int rv = deliver_memory(q, write_batch, ctx);
+
+    if (rv == 0 && q->spill_fd != -1) {
+        rv = deliver_spill(q, write_batch, ctx);
+    }
+    if (rv == 0 || q->delivered_off * 2 >= q->spill_size) {
+        offline_queue_compact(q);
+    }
+    return rv;
+}
+
+/**
+ * @brief Rewrite the spill file as [in-memory messages] + [undelivered spilled records].
+ * Used both by compaction (with_memory = 0) and at shutdown (with_memory = 1).
+ */
+static int rewrite_spill(struct offline_queue *q, int with_memory) {
+    char tmp_path[sizeof q->path + 4];
+    char chunk[OFFLINE_BATCH_SIZE];
+    off_t off;
+    int tmp_fd;
+
+    snprintf(tmp_path, sizeof tmp_path, "%s.tmp", q->path);
+    if ((tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror("open offline compaction file");
+        return -1;
+    }
+
+    if (with_memory) {
+        for (struct offline_entry *e = q->head; e != NULL; e = e->next) {
+            uint32_t hdr = htonl((uint32_t)e->len);
+            if (write(tmp_fd, &hdr, RECORD_HDR_LEN) != RECORD_HDR_LEN
+                    || write(tmp_fd, e->data, e->len) != (ssize_t)e->len) {
+                goto fail;
+            }
+        }
+    }
+
+    for (off = q->delivered_off; q->spill_fd != -1 && off < q->spill_size; ) {
+        size_t want = sizeof chunk;
+        ssize_t n;
+        if ((off_t)want > q->spill_size - off) {
+            want = q->spill_size - off;
+        }
+        if ((n = pread(q->spill_fd, chunk, want, off)) <= 0 || write(tmp_fd, chunk, n) != n) {
+            goto fail;
+        }
+        off += n;
+    }
+
+    if (rename(tmp_path, q->path) == -1) {
+        goto fail;
+    }
+    if (q->spill_fd != -1) {
+        close(q->spill_fd);
+    }
+    close(tmp_fd);
+
+    q->spill_fd = open(q->path, O_RDWR | O_APPEND);
+    q->spill_size = lseek(q->spill_fd, 0, SEEK_END);
+    q->delivered_off = 0;
+    return 0;
+
+fail:
+    perror("rewrite offline spill file");
+    close(tmp_fd);
+    unlink(tmp_path);
+    return -1;
+}
+
+/**
+ * @brief Compaction pass: drop records that have already been delivered.
+ * A fully delivered spill file is removed; a partially delivered one is rewritten
+ * so that it only contains the undelivered tail.
+ */
+void offline_queue_compact(struct offline_queue *q) {
+    if (q->spill_fd == -1 || q->delivered_off == 0) {
+        return;
+    }
+    if (q->delivered_off >= q->spill_size) {
+        close(q->spill_fd);
+        unlink(q->path);
+        q->spill_fd = -1;
+        q->spill_size = 0;
+        q->delivered_off = 0;
+        return;
+    }
+    printf("[OFFLINE] Compacting %s (%lld of %lld bytes delivered)\n", q->path,
+           (long long)q->delivered_off, (long long)q->spill_size);
+    rewrite_spill(q, 0);
+}
+
+/**
+ * @brief Move every in-memory message to the spill file so nothing is lost on shutdown.
+ */
+void offline_queue_spill_all(struct offline_queue *q) {
+    if (q->head == NULL) {
+        return;
+    }
+    if (rewrite_spill(q, 1) == 0) {
+        while (q->head != NULL) {
+            pop_head(q);
+        }
+    }
+}
+
+void offline_queue_free(struct offline_queue *q) {
+    while (q->head != NULL) {
+        pop_head(q);
+    }
+    if (q->spill_fd != -1) {
+        close(q->spill_fd);
+        q->spill_fd = -1;
+    }
+}
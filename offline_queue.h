@@ -0,0 +1,55 @@
+/**
+ * @file offline_queue.h
+ * @brief Per-user queue of messages that arrived while the user was disconnected.
+ *
+ * Messages are kept in memory until OFFLINE_MEM_LIMIT bytes are queued. After that
+ * they are appended to a per-user spill file (length-prefixed records), capped at
+ * OFFLINE_DISK_LIMIT bytes. On reconnect everything is delivered oldest first in
+ * batches of up to OFFLINE_BATCH_SIZE bytes per write, and a compaction pass removes
+ * the delivered records from the spill file.
+ */
+#ifndef OFFLINE_QUEUE_H
+#define OFFLINE_QUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OFFLINE_DIR        "offline"      // Directory that holds the spill files
+#define OFFLINE_MEM_LIMIT  (16 * 1024)    // Bytes kept in memory before spilling to disk
+#define OFFLINE_DISK_LIMIT (1024 * 1024)  // Maximum size of one user's spill file
+#define OFFLINE_BATCH_SIZE 4096           // Maximum bytes handed to one write on delivery
+
+// A single queued message held in memory
+struct offline_entry {
+    struct offline_entry *next;
+    size_t len;
+    char data[];
+};
+
+struct offline_queue {
+    char path[256];               // Spill file path (offline/<user>.queue)
+    struct offline_entry *head;   // Oldest in-memory message
+    struct offline_entry *tail;   // Newest in-memory message
+    size_t mem_bytes;             // Payload bytes currently held in memory
+    size_t mem_count;             // Number of messages held in memory
+    int spill_fd;                 // Open spill file, or -1 if none
+    off_t spill_size;             // Bytes written to the spill file
+    off_t delivered_off;          // Bytes at the front of the spill file already delivered
+    size_t dropped;               // Messages rejected because the disk limit was reached
+};
+
+/**
+ * @brief Callback used to hand one batch of messages to the connection.
+ * @return 0 on success, -1 if the batch could not be written (delivery stops).
+ */
+typedef int (*offline_write_fn)(void *ctx, const char *buf, size_t len);
+
+void offline_queue_init(struct offline_queue *q, const char *user);
+int offline_queue_push(struct offline_queue *q, const char *msg, size_t len);
+int offline_queue_pending(const struct offline_queue *q);
+int offline_queue_deliver(struct offline_queue *q, offline_write_fn write_batch, void *ctx);
+void offline_queue_compact(struct offline_queue *q);
+void offline_queue_spill_all(struct offline_queue *q);
+void offline_queue_free(struct offline_queue *q);
+
+#endif // OFFLINE_QUEUE_H
@@ -0,0 +1,217 @@
+/**
+ * @file outq.c
+ * @brief Priority-lane outbound queues (see outq.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "outq.h"
+
+static const long lane_weight[OUTQ_NUM_LANES] = {
+    OUTQ_WEIGHT_CONTROL, OUTQ_WEIGHT_INTERACT, OUTQ_WEIGHT_BULK
+};
+
+struct out_buf *out_buf_new(const char *data, size_t len) {
+    struct out_buf *b = malloc(sizeof *b + len);
+
+    if (b == NULL) {
+        perror("malloc out_buf");
+        return NULL;
+    }
+    b->refs = 1;
+    b->len = len;
+    memcpy(b->data, data, len);
+    return b;
+}
+
+void out_buf_release(struct out_buf *b) {
+    if (b != NULL && --b->refs == 0) {
+        free(b);
+    }
+}
+
+void outq_init(struct outq *q) {
+    memset(q, 0, sizeof *q);
+}
+
+/**
+ * @brief Queue a message on a lane: hdr (copied, at most OUTQ_HDR_MAX bytes) followed
+ * by the shared body b. The queue takes its own reference to b.
+ * @return 0 on success, -1 if out of memory.
+ */
+int outq_push_split(struct outq *q, enum outq_lane lane, const void *hdr, size_t hdr_len, struct out_buf *b) {
+    struct out_item *item;
+
+    if (hdr_len > OUTQ_HDR_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if ((item = malloc(sizeof *item)) == NULL) {
+        perror("malloc out_item");
+        return -1;
+    }
+    b->refs++;
+    item->next = NULL;
+    item->buf = b;
+    item->off = 0;
+    item->hdr_len = (unsigned char)hdr_len;
+    memcpy(item->hdr, hdr, hdr_len);
+    if (q->tail[lane] != NULL) {
+        q->tail[lane]->next = item;
+    } else {
+        q->head[lane] = item;
+    }
+    q->tail[lane] = item;
+    q->bytes[lane] += hdr_len + b->len;
+    q->total_bytes += hdr_len + b->len;
+    return 0;
+}
+
+/**
+ * @brief Queue a message body on a lane. The queue takes its own reference.
+ * @return 0 on success, -1 if out of memory.
+ */
+int outq_push(struct outq *q, enum outq_lane lane, struct out_buf *b) {
+    return outq_push_split(q, lane, NULL, 0, b);
+}
+
+int outq_push_copy(struct outq *q, enum outq_lane lane, const char *data, size_t len) {
+    struct out_buf *b = out_buf_new(data, len);
+    int rv;
+
+    if (b == NULL) return -1;
+    rv = outq_push(q, lane, b);
+    out_buf_release(b);
+    return rv;
+}
+
+int outq_empty(const struct outq *q) {
+    return q->total_bytes == 0;
+}
+
+static void pop_head(struct outq *q, int lane) {
+    struct out_item *item = q->head[lane];
+
+    q->head[lane] = item->next;
+    if (q->head[lane] == NULL) {
+        q->tail[lane] = NULL;
+    }
+    out_buf_release(item->buf);
+    free(item);
+}
+
+/**
+ * @brief Write as much queued data as the socket accepts, up to OUTQ_FLUSH_BUDGET.
+ * Messages are picked across lanes by deficit round robin and gathered into one
+ * writev() per batch, done through write_fn so the caller decides what sits between
+ * the queue and the socket (plain writev(), TLS).
+ * @return Bytes written (0 if the socket was full), or -1 on a socket error.
+ */
+ssize_t outq_flush(struct outq *q, outq_writev_fn write_fn, void *ctx) {
+    size_t written_total = 0;
+
+    while (q->total_bytes > 0 && written_total < OUTQ_FLUSH_BUDGET) {
+        struct iovec iov[OUTQ_IOV_MAX];
+        int picked_lane[OUTQ_IOV_MAX];   // Per message picked
+        size_t picked_len[OUTQ_IOV_MAX];
+        struct out_item *cursor[OUTQ_NUM_LANES];
+        size_t gathered = 0;
+        ssize_t w;
+        int n = 0, niov = 0;
+
+        for (int lane = 0; lane < OUTQ_NUM_LANES; lane++) {
+            cursor[lane] = q->head[lane];
+        }
+
+        // 1. Pick messages round by round until the batch is full or every lane is exhausted.
+        //    A message takes two iovecs while part of its own header is unwritten.
+        while (niov + 2 <= OUTQ_IOV_MAX && gathered < OUTQ_FLUSH_BUDGET - written_total) {
+            int lanes_left = 0;
+
+            for (int lane = 0; lane < OUTQ_NUM_LANES && niov + 2 <= OUTQ_IOV_MAX; lane++) {
+                if (cursor[lane] == NULL) continue;
+                lanes_left = 1;
+                q->deficit[lane] += lane_weight[lane] * OUTQ_QUANTUM;
+                while (cursor[lane] != NULL && niov + 2 <= OUTQ_IOV_MAX) {
+                    struct out_item *item = cursor[lane];
+                    size_t rem = item->hdr_len + item->buf->len - item->off;
+                    if ((long)rem > q->deficit[lane]) break;
+                    q->deficit[lane] -= rem;
+                    if (item->off < item->hdr_len) {
+                        iov[niov].iov_base = item->hdr + item->off;
+                        iov[niov].iov_len = item->hdr_len - item->off;
+                        niov++;
+                    }
+                    if (item->buf->len > 0) {
+                        size_t body_off = item->off > item->hdr_len ? item->off - item->hdr_len : 0;
+                        iov[niov].iov_base = item->buf->data + body_off;
+                        iov[niov].iov_len = item->buf->len - body_off;
+                        niov++;
+                    }
+                    picked_lane[n] = lane;
+                    picked_len[n] = rem;
+                    n++;
+                    gathered += rem;
+                    cursor[lane] = item->next;
+                }
+            }
+            if (!lanes_left) break;
+        }
+
+        // 2. One writev for the whole batch
+        do {
+            w = write_fn(ctx, iov, niov);
+        } while (w == -1 && errno == EINTR);
+        if (w == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (w == -1) {
+            w = 0;
+        }
+
+        // 3. Retire what was written. writev fills the iovecs in order, so everything
+        //    after the first partially written message is unwritten and gets its credit back.
+        size_t batch_written = w;
+        for (int k = 0; k < n; k++) {
+            int lane = picked_lane[k];
+            struct out_item *item = q->head[lane];
+            size_t rem = picked_len[k];
+
+            if ((size_t)w >= rem) {
+                w -= rem;
+                q->bytes[lane] -= rem;
+                q->total_bytes -= rem;
+                pop_head(q, lane);
+                continue;
+            }
+            item->off += w;
+            q->bytes[lane] -= w;
+            q->total_bytes -= w;
+            q->deficit[lane] += rem - w;
+            for (int j = k + 1; j < n; j++) {
+                q->deficit[picked_lane[j]] += picked_len[j];
+            }
+            break;
+        }
+        written_total += batch_written;
+
+        for (int lane = 0; lane < OUTQ_NUM_LANES; lane++) {
+            if (q->head[lane] == NULL) q->deficit[lane] = 0; // DRR: an idle lane keeps no credit
+        }
+        if (batch_written < gathered) {
+            break; // Socket buffer is full
+        }
+    }
+    return written_total;
+}
+
+void outq_clear(struct outq *q) {
+    for (int lane = 0; lane < OUTQ_NUM_LANES; lane++) {
+        while (q->head[lane] != NULL) {
+            pop_head(q, lane);
+        }
+    }
+    outq_init(q);
+}
@@ -0,0 +1,85 @@
+/**
+ * @file outq.h
+ * @brief Per-connection outbound queue with priority lanes.
+ *
+ * Everything the server sends to a client goes through one of these queues and is
+ * written when the (non-blocking) socket is writable. There are three lanes:
+ *   OUTQ_CONTROL      ACKs, errors, pings, kicks
+ *   OUTQ_INTERACTIVE  live chat, direct messages, presence, command replies
+ *   OUTQ_BULK         history replay (offline queue delivery, search results)
+ * A flush interleaves the lanes with deficit round robin: every round each non-empty
+ * lane earns its weight times OUTQ_QUANTUM bytes of credit and sends whole messages
+ * while it has credit, control first. A client replaying a large backlog still gets
+ * new live messages and control frames within one round.
+ *
+ * Message bodies are reference counted so a broadcast is copied once, not once per
+ * recipient. A message may also carry a short header of its own in front of the shared
+ * body (up to OUTQ_HDR_MAX bytes, stored in the queue entry): the fields that differ
+ * per recipient go there, and the body is still encoded only once. Both are written
+ * with the same writev(), as two iovecs.
+ */
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define OUTQ_QUANTUM         1024         // Bytes of credit per weight unit per round
+#define OUTQ_WEIGHT_CONTROL  8
+#define OUTQ_WEIGHT_INTERACT 4
+#define OUTQ_WEIGHT_BULK     1
+#define OUTQ_MAX_BYTES       (1024 * 1024) // Queued bytes beyond which a client counts as stalled
+#define OUTQ_BULK_HIGH_WATER (64 * 1024)   // Bulk producers pause above this many queued bulk bytes
+#define OUTQ_FLUSH_BUDGET    (256 * 1024)  // Maximum bytes written to one connection per flush
+#define OUTQ_IOV_MAX         64            // iovecs gathered into one writev()
+#define OUTQ_HDR_MAX         32            // Largest per-recipient header
+
+enum outq_lane {
+    OUTQ_CONTROL = 0,
+    OUTQ_INTERACTIVE,
+    OUTQ_BULK,
+    OUTQ_NUM_LANES
+};
+
+// A message body that may be queued on many connections at once
+struct out_buf {
+    int refs;
+    size_t len;
+    char data[];
+};
+
+struct out_item {
+    struct out_item *next;
+    struct out_buf *buf;
+    size_t off;                     // Bytes of hdr, then buf, already written
+    unsigned char hdr_len;
+    unsigned char hdr[OUTQ_HDR_MAX]; // This recipient's header, sent ahead of buf
+};
+
+struct outq {
+    struct out_item *head[OUTQ_NUM_LANES];
+    struct out_item *tail[OUTQ_NUM_LANES];
+    size_t bytes[OUTQ_NUM_LANES]; // Unwritten bytes per lane
+    size_t total_bytes;
+    long deficit[OUTQ_NUM_LANES];
+};
+
+/**
+ * @brief Gather-write callback used by outq_flush(), with writev() semantics:
+ * bytes accepted, or -1 with errno set (EAGAIN/EWOULDBLOCK when the socket is full).
+ */
+typedef ssize_t (*outq_writev_fn)(void *ctx, const struct iovec *iov, int iovcnt);
+
+struct out_buf *out_buf_new(const char *data, size_t len);
+void out_buf_release(struct out_buf *b);
+
+void outq_init(struct outq *q);
+int outq_push(struct outq *q, enum outq_lane lane, struct out_buf *b);
+int outq_push_split(struct outq *q, enum outq_lane lane, const void *hdr, size_t hdr_len, struct out_buf *b);
+int outq_push_copy(struct outq *q, enum outq_lane lane, const char *data, size_t len);
+int outq_empty(const struct outq *q);
+ssize_t outq_flush(struct outq *q, outq_writev_fn write_fn, void *ctx);
+void outq_clear(struct outq *q);
+
+#endif // OUTQ_H
@@ -0,0 +1,676 @@
+/**
+ * @file poller.c
+ * @brief select(), poll(), epoll and io_uring backends behind one interface (see poller.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/select.h>
+
+#include "poller.h" // Decides which of the backends below are compiled in
+
+#ifdef POLLER_HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef POLLER_HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void push_ready(struct poller *p, int fd, int readable, int writable, int error) {
+    int interest = p->fds[fd].events;
+    int events = (readable ? POLLER_IN : 0) | (writable ? POLLER_OUT : 0);
+
+    // Like select(): an error or hangup makes the descriptor ready for whatever the
+    // caller is waiting for, so the next read or write reports it
+    if (error) events |= POLLER_ERR | interest;
+    events &= interest | POLLER_ERR;
+    if (events == 0) return;
+    p->ready[p->num_ready].fd = fd;
+    p->ready[p->num_ready].events = events;
+    p->num_ready++;
+}
+
+// --- select() ---
+
+struct select_state {
+    fd_set in;
+    fd_set out;
+    int max_fd; // Highest registered descriptor, -1 if none
+};
+
+static int select_init(struct poller *p) {
+    struct select_state *s = calloc(1, sizeof *s);
+
+    if (s == NULL) return -1;
+    FD_ZERO(&s->in);
+    FD_ZERO(&s->out);
+    s->max_fd = -1;
+    p->impl = s;
+    return 0;
+}
+
+static int select_ctl(struct poller *p, int fd, int old_events, int new_events) {
+    struct select_state *s = p->impl;
+
+    (void)old_events;
+    if (fd >= FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    FD_CLR(fd, &s->in);
+    FD_CLR(fd, &s->out);
+    if (new_events & POLLER_IN) FD_SET(fd, &s->in);
+    if (new_events & POLLER_OUT) FD_SET(fd, &s->out);
+    if (new_events != 0 && fd > s->max_fd) {
+        s->max_fd = fd;
+    } else if (new_events == 0 && fd == s->max_fd) {
+        do {
+            s->max_fd--;
+        } while (s->max_fd >= 0 && p->fds[s->max_fd].events == 0);
+    }
+    return 0;
+}
+
+static int select_wait(struct poller *p, int timeout_ms) {
+    struct select_state *s = p->impl;
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    fd_set in = s->in, out = s->out;
+    int n = select(s->max_fd + 1, &in, &out, NULL, timeout_ms >= 0 ? &tv : NULL);
+
+    if (n <= 0) return n;
+    for (int fd = 0; fd <= s->max_fd; fd++) {
+        if (p->fds[fd].events != 0) {
+            push_ready(p, fd, FD_ISSET(fd, &in), FD_ISSET(fd, &out), 0);
+        }
+    }
+    return 0;
+}
+
+static void select_destroy(struct poller *p) {
+    free(p->impl);
+}
+
+static const struct poller_ops select_ops = { select_init, select_ctl, select_wait, select_destroy };
+
+// --- poll() ---
+
+struct poll_state {
+    struct pollfd *pfds; // One entry per registered descriptor, in no particular order
+    int cap;
+};
+
+static short poll_mask(int events) {
+    return (events & POLLER_IN ? POLLIN : 0) | (events & POLLER_OUT ? POLLOUT : 0);
+}
+
+static int poll_init(struct poller *p) {
+    return (p->impl = calloc(1, sizeof(struct poll_state))) == NULL ? -1 : 0;
+}
+
+static int poll_ctl(struct poller *p, int fd, int old_events, int new_events) {
+    struct poll_state *s = p->impl;
+    struct poller_fd *f = &p->fds[fd];
+
+    if (old_events == 0) {
+        if (p->count == s->cap) {
+            int cap = s->cap ? s->cap * 2 : 64;
+            struct pollfd *pfds = realloc(s->pfds, cap * sizeof *pfds);
+            if (pfds == NULL) return -1;
+            s->pfds = pfds;
+            s->cap = cap;
+        }
+        f->index = p->count;
+        s->pfds[f->index].fd = fd;
+        s->pfds[f->index].events = poll_mask(new_events);
+    } else if (new_events == 0) {
+        // Move the last entry into the hole
+        s->pfds[f->index] = s->pfds[p->count - 1];
+        p->fds[s->pfds[f->index].fd].index = f->index;
+    } else {
+        s->pfds[f->index].events = poll_mask(new_events);
+    }
+    return 0;
+}
+
+static int poll_wait(struct poller *p, int timeout_ms) {
+    struct poll_state *s = p->impl;
+    int n = poll(s->pfds, p->count, timeout_ms);
+
+    if (n <= 0) return n;
+    for (int k = 0; k < p->count; k++) {
+        short re = s->pfds[k].revents;
+        if (re != 0) {
+            push_ready(p, s->pfds[k].fd, re & POLLIN, re & POLLOUT, re & (POLLERR | POLLHUP | POLLNVAL));
+        }
+    }
+    return 0;
+}
+
+static void poll_destroy(struct poller *p) {
+    struct poll_state *s = p->impl;
+
+    free(s->pfds);
+    free(s);
+}
+
+static const struct poller_ops poll_ops = { poll_init, poll_ctl, poll_wait, poll_destroy };
+
+// --- epoll ---
+
+#ifdef POLLER_HAVE_EPOLL
+struct epoll_state {
+    int epfd;
+    struct epoll_event *evs;
+    int cap;
+};
+
+static int epoll_init_backend(struct poller *p) {
+    struct epoll_state *s = calloc(1, sizeof *s);
+
+    if (s == NULL) return -1;
+    if ((s->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        free(s);
+        return -1;
+    }
+    p->impl = s;
+    return 0;
+}
+
+static int epoll_ctl_backend(struct poller *p, int fd, int old_events, int new_events) {
+    struct epoll_state *s = p->impl;
+    struct epoll_event ev;
+    int op = old_events == 0 ? EPOLL_CTL_ADD : new_events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = (new_events & POLLER_IN ? EPOLLIN : 0) | (new_events & POLLER_OUT ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    return epoll_ctl(s->epfd, op, fd, &ev);
+}
+
+static int epoll_wait_backend(struct poller *p, int timeout_ms) {
+    struct epoll_state *s = p->impl;
+    int n;
+
+    // epoll_wait() rejects maxevents == 0, even with nothing registered
+    if (s->cap < p->ready_cap || s->cap == 0) {
+        int cap = p->ready_cap > 0 ? p->ready_cap : 1;
+        struct epoll_event *evs = realloc(s->evs, cap * sizeof *evs);
+        if (evs == NULL) return -1;
+        s->evs = evs;
+        s->cap = cap;
+    }
+    if ((n = epoll_wait(s->epfd, s->evs, s->cap, timeout_ms)) <= 0) return n;
+    for (int k = 0; k < n; k++) {
+        uint32_t re = s->evs[k].events;
+        push_ready(p, s->evs[k].data.fd, re & EPOLLIN, re & EPOLLOUT, re & (EPOLLERR | EPOLLHUP));
+    }
+    return 0;
+}
+
+static void epoll_destroy_backend(struct poller *p) {
+    struct epoll_state *s = p->impl;
+
+    close(s->epfd);
+    free(s->evs);
+    free(s);
+}
+
+static const struct poller_ops epoll_ops = {
+    epoll_init_backend, epoll_ctl_backend, epoll_wait_backend, epoll_destroy_backend
+};
+#endif // POLLER_HAVE_EPOLL
+
+// --- io_uring ---
+//
+// Each registered descriptor has one one-shot IORING_OP_POLL_ADD request outstanding.
+// When it completes the descriptor is reported and a new request is submitted at the
+// start of the next wait, after the caller has had a chance to drain it; that keeps
+// the level-triggered behaviour of the other backends. A request's user_data carries
+// the descriptor and a generation number, so completions of requests that were since
+// removed or replaced (by poller_mod()/poller_del()) are recognised and dropped.
+
+#ifdef POLLER_HAVE_URING
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_IGNORE     UINT64_MAX // user_data of requests whose completion we do not care about
+
+struct uring_state {
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail_local;          // Our tail, published to the kernel after each entry
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    int *rearm;                      // Descriptors reported by the last wait
+    int rearm_len;
+    int rearm_cap;
+};
+
+static int uring_enter(struct uring_state *u, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+    unsigned to_submit = u->sq_tail_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    return (int)syscall(__NR_io_uring_enter, u->ring_fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring_state *u) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    // Ring full: hand what we have to the kernel first
+    if (u->sq_tail_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries
+            && uring_enter(u, 0, 0, NULL, 0) == -1) {
+        return NULL;
+    }
+    idx = u->sq_tail_local & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    u->sq_array[idx] = idx;
+    u->sq_tail_local++;
+    return sqe;
+}
+
+static void uring_publish(struct uring_state *u) {
+    __atomic_store_n(u->sq_tail, u->sq_tail_local, __ATOMIC_RELEASE);
+}
+
+static int uring_poll_add(struct poller *p, int fd) {
+    struct uring_state *u = p->impl;
+    struct poller_fd *f = &p->fds[fd];
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    uint32_t mask = (f->events & POLLER_IN ? POLLIN : 0) | (f->events & POLLER_OUT ? POLLOUT : 0);
+
+    if (sqe == NULL) return -1;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    mask = (mask << 16) | (mask >> 16); // The kernel reads poll32_events as two halves
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = ((uint64_t)f->gen << 32) | (uint32_t)fd;
+    uring_publish(u);
+    f->armed = 1;
+    return 0;
+}
+
+static int uring_init(struct poller *p) {
+    struct uring_state *u = calloc(1, sizeof *u);
+    struct io_uring_params params;
+
+    if (u == NULL) return -1;
+    memset(&params, 0, sizeof params);
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    if ((u->ring_fd = (int)syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params)) == -1) {
+        perror("io_uring_setup");
+        free(u);
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring: kernel has no IORING_FEAT_EXT_ARG (needs 5.11+)\n");
+        close(u->ring_fd);
+        free(u);
+        return -1;
+    }
+
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = 0;
+    }
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->ring_fd, IORING_OFF_SQ_RING);
+    u->cq_ring = u->cq_ring_size == 0 ? u->sq_ring
+               : mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->ring_fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->ring_fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        perror("mmap io_uring");
+        close(u->ring_fd);
+        free(u);
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)((char *)u->sq_ring + params.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ring + params.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ring + params.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + params.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_ring + params.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ring + params.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + params.cq_off.cqes);
+    u->sq_entries = params.sq_entries;
+    u->sq_tail_local = *u->sq_tail;
+    p->impl = u;
+    return 0;
+}
+
+static int uring_ctl(struct poller *p, int fd, int old_events, int new_events) {
+    struct uring_state *u = p->impl;
+    struct poller_fd *f = &p->fds[fd];
+
+    (void)old_events;
+    if (f->armed) {
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        if (sqe == NULL) return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ((uint64_t)f->gen << 32) | (uint32_t)fd;
+        sqe->user_data = URING_IGNORE;
+        uring_publish(u);
+        f->armed = 0;
+    }
+    f->gen++;
+    if (new_events == 0) {
+        // The poll request holds a reference to the file: cancel it now, before the
+        // caller closes the descriptor, or the peer would not see the close
+        return uring_enter(u, 0, 0, NULL, 0) == -1 ? -1 : 0;
+    }
+    f->events = new_events; // uring_poll_add() reads the new interest
+    return uring_poll_add(p, fd);
+}
+
+static void uring_reap(struct poller *p) {
+    struct uring_state *u = p->impl;
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        int fd = (int)(uint32_t)cqe->user_data;
+        struct poller_fd *f;
+
+        if (cqe->user_data == URING_IGNORE || fd >= p->fds_cap) continue;
+        f = &p->fds[fd];
+        if (f->events == 0 || f->gen != (uint32_t)(cqe->user_data >> 32)) continue; // Stale request
+        f->armed = 0;
+        if (cqe->res < 0) {
+            push_ready(p, fd, 0, 0, 1);
+        } else {
+            push_ready(p, fd, cqe->res & POLLIN, cqe->res & POLLOUT, cqe->res & (POLLERR | POLLHUP | POLLNVAL));
+        }
+        if (u->rearm_len == u->rearm_cap) {
+            int cap = u->rearm_cap ? u->rearm_cap * 2 : 64;
+            int *rearm = realloc(u->rearm, cap * sizeof *rearm);
+            if (rearm == NULL) continue; // Stays disarmed until the next poller_mod()
+            u->rearm = rearm;
+            u->rearm_cap = cap;
+        }
+        u->rearm[u->rearm_len++] = fd;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_wait(struct poller *p, int timeout_ms) {
+    struct uring_state *u = p->impl;
+    long long deadline = timeout_ms > 0 ? monotonic_us() + timeout_ms * 1000LL : 0;
+
+    // Watch again whatever the caller was told about last time
+    for (int k = 0; k < u->rearm_len; k++) {
+        int fd = u->rearm[k];
+        if (p->fds[fd].events != 0 && !p->fds[fd].armed && uring_poll_add(p, fd) == -1) {
+            return -1;
+        }
+    }
+    u->rearm_len = 0;
+
+    uring_reap(p);
+    // Completions of cancelled requests wake us without reporting anything, so keep
+    // waiting until something is ready or the time is up
+    while (p->num_ready == 0 && timeout_ms != 0) {
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+
+        memset(&arg, 0, sizeof arg);
+        if (timeout_ms > 0) {
+            long long left = deadline - monotonic_us();
+            if (left <= 0) break;
+            ts.tv_sec = left / 1000000;
+            ts.tv_nsec = (left % 1000000) * 1000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        if (uring_enter(u, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg) == -1
+                && errno != ETIME) {
+            return -1;
+        }
+        uring_reap(p);
+    }
+    // Submit the re-arms even when nothing had to be waited for
+    if (u->sq_tail_local != __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) && uring_enter(u, 0, 0, NULL, 0) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static void uring_destroy(struct poller *p) {
+    struct uring_state *u = p->impl;
+
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->ring_fd);
+    free(u->rearm);
+    free(u);
+}
+
+static const struct poller_ops uring_ops = { uring_init, uring_ctl, uring_wait, uring_destroy };
+#endif // POLLER_HAVE_URING
+
+// --- Common front end ---
+
+static const char *backend_names[POLLER_NUM_BACKENDS] = { "select", "poll", "epoll", "io_uring" };
+
+static const struct poller_ops *backend_ops[POLLER_NUM_BACKENDS] = {
+    &select_ops,
+    &poll_ops,
+#ifdef POLLER_HAVE_EPOLL
+    &epoll_ops,
+#else
+    NULL,
+#endif
+#ifdef POLLER_HAVE_URING
+    &uring_ops,
+#else
+    NULL,
+#endif
+};
+
+const char *poller_backend_name(enum poller_backend backend) {
+    return backend < POLLER_NUM_BACKENDS ? backend_names[backend] : "unknown";
+}
+
+/**
+ * @brief Map a backend name ("select", "poll", "epoll", "io_uring") to its enum value.
+ * @return -1 if the name is unknown or the backend is not compiled in.
+ */
+int poller_parse_backend(const char *name) {
+    for (int b = 0; b < POLLER_NUM_BACKENDS; b++) {
+        if (strcmp(name, backend_names[b]) == 0) {
+            return backend_ops[b] != NULL ? b : -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Create a poller with the given backend.
+ * @return NULL if the backend is not available (not compiled in, or the kernel refuses).
+ */
+struct poller *poller_create(enum poller_backend backend) {
+    struct poller *p;
+
+    if (backend >= POLLER_NUM_BACKENDS || backend_ops[backend] == NULL) {
+        fprintf(stderr, "Poller backend %s is not available in this build\n", poller_backend_name(backend));
+        return NULL;
+    }
+    if ((p = calloc(1, sizeof *p)) == NULL) {
+        perror("calloc poller");
+        return NULL;
+    }
+    p->backend = backend;
+    p->ops = backend_ops[backend];
+    if (p->ops->init(p) == -1) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+// Make room for descriptor fd in the table and for one more ready event
+static int poller_reserve(struct poller *p, int fd) {
+    if (fd >= p->fds_cap) {
+        int cap = p->fds_cap ? p->fds_cap : 64;
+        struct poller_fd *fds;
+
+        while (cap <= fd) cap *= 2;
+        if ((fds = realloc(p->fds, cap * sizeof *fds)) == NULL) return -1;
+        memset(fds + p->fds_cap, 0, (cap - p->fds_cap) * sizeof *fds);
+        p->fds = fds;
+        p->fds_cap = cap;
+    }
+    if (p->count + 1 > p->ready_cap) {
+        int cap = p->ready_cap ? p->ready_cap * 2 : 64;
+        struct poller_event *ready = realloc(p->ready, cap * sizeof *ready);
+
+        if (ready == NULL) return -1;
+        p->ready = ready;
+        p->ready_cap = cap;
+    }
+    return 0;
+}
+
+/**
+ * @brief Start watching fd for events (POLLER_IN and/or POLLER_OUT).
+ * @return 0 on success, -1 with errno set (EEXIST if already registered).
+ */
+int poller_add(struct poller *p, int fd, int events) {
+    if (fd < 0 || (events & (POLLER_IN | POLLER_OUT)) == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (poller_reserve(p, fd) == -1) return -1;
+    if (p->fds[fd].events != 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (p->ops->ctl(p, fd, 0, events) == -1) return -1;
+    p->fds[fd].events = events;
+    p->count++;
+    return 0;
+}
+
+/**
+ * @brief Change the events watched on fd. Cheap when nothing changes, so it can be
+ * called every loop iteration.
+ */
+int poller_mod(struct poller *p, int fd, int events) {
+    if (fd < 0 || fd >= p->fds_cap || p->fds[fd].events == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    if ((events & (POLLER_IN | POLLER_OUT)) == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (events == p->fds[fd].events) return 0;
+    if (p->ops->ctl(p, fd, p->fds[fd].events, events) == -1) return -1;
+    p->fds[fd].events = events;
+    return 0;
+}
+
+// Stop watching fd. Call before closing it.
+int poller_del(struct poller *p, int fd) {
+    if (fd < 0 || fd >= p->fds_cap || p->fds[fd].events == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (p->ops->ctl(p, fd, p->fds[fd].events, 0) == -1) return -1;
+    p->fds[fd].events = 0;
+    p->count--;
+    return 0;
+}
+
+/**
+ * @brief Spin for up to budget_us microseconds in every poller_wait() before blocking
+ * (0 turns spinning off). See poller.h.
+ */
+void poller_set_busy_poll(struct poller *p, long budget_us) {
+    p->busy_poll_us = budget_us > 0 ? budget_us : 0;
+}
+
+/**
+ * @brief Wait up to timeout_ms milliseconds (-1: forever, 0: just check) for events.
+ * @return Number of ready descriptors (walk them with poller_next()), or -1 with errno
+ * set (EINTR if a signal arrived).
+ */
+int poller_wait(struct poller *p, int timeout_ms) {
+    p->num_ready = 0;
+    p->next_ready = 0;
+    if (p->busy_poll_us > 0 && timeout_ms != 0) {
+        long long start = monotonic_us(), now = start;
+        long long spin_end = start + p->busy_poll_us;
+
+        // Busy-poll mode: non-blocking checks until something is ready or the budget
+        // (or the caller's timeout) runs out, then block for whatever time is left
+        if (timeout_ms > 0 && start + timeout_ms * 1000LL < spin_end) {
+            spin_end = start + timeout_ms * 1000LL;
+        }
+        while (now < spin_end) {
+            if (p->ops->wait(p, 0) == -1) {
+                p->num_ready = 0;
+                return -1;
+            }
+            if (p->num_ready > 0) {
+                p->spin_hits++;
+                return p->num_ready;
+            }
+            now = monotonic_us();
+        }
+        p->spin_misses++;
+        if (timeout_ms > 0) {
+            timeout_ms -= (int)((now - start) / 1000);
+            if (timeout_ms <= 0) return 0;
+        }
+    }
+    if (p->ops->wait(p, timeout_ms) == -1) {
+        p->num_ready = 0;
+        return -1;
+    }
+    return p->num_ready;
+}
+
+/**
+ * @brief Fetch the next ready descriptor from the last poller_wait().
+ * @return 1 if ev was filled in, 0 when there are no more.
+ */
+int poller_next(struct poller *p, struct poller_event *ev) {
+    if (p->next_ready >= p->num_ready) return 0;
+    *ev = p->ready[p->next_ready++];
+    return 1;
+}
+
+void poller_free(struct poller *p) {
+    if (p == NULL) return;
+    p->ops->destroy(p);
+    free(p->fds);
+    free(p->ready);
+    free(p);
+}
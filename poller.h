@@ -0,0 +1,113 @@
+/**
+ * @file poller.h
+ * @brief Readiness notification with interchangeable backends: select(), poll(),
+ * epoll and io_uring.
+ *
+ * Descriptors are registered once with the events of interest and changed only when
+ * that interest changes (typically: add POLLER_OUT while a client has queued output).
+ * poller_wait() blocks until something is ready or the timeout expires, and
+ * poller_next() then walks the ready descriptors. Every backend is level-triggered:
+ * a descriptor that is still readable is reported again by the next wait.
+ *
+ * Which backend is used is a runtime choice (poller_create()); POLLER_DEFAULT picks
+ * the one used when none is asked for and can be overridden at build time with
+ * -DPOLLER_DEFAULT=POLLER_POLL and so on. epoll and io_uring only exist on Linux;
+ * io_uring is driven through the raw system calls, so it needs linux/io_uring.h but
+ * not liburing, and a 5.11+ kernel (IORING_FEAT_EXT_ARG for wait timeouts).
+ *
+ * Busy-poll mode (poller_set_busy_poll()) trades CPU for wakeup latency: each wait
+ * first spins on non-blocking checks (a zero-timeout epoll_wait() and so on; with
+ * io_uring just a look at the completion ring) for up to the budget, and only then
+ * blocks. An event that arrives during the spin is picked up without a sleep/wakeup
+ * round trip through the scheduler. It pays off with a core to spare; on a loaded
+ * machine the spinning thread competes with whatever produces the events.
+ *
+ * Backend limits: select() cannot watch descriptors >= FD_SETSIZE (poller_add()
+ * fails with EINVAL), and select() and poll() cost O(registered descriptors) per
+ * wait. bench/bench_poller.c checks that all backends behave the same and measures
+ * the wakeup cost of each at different descriptor counts.
+ */
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <stdint.h>
+
+// Event bits, both for interest and for what poller_next() reports
+#define POLLER_IN  0x1
+#define POLLER_OUT 0x2
+#define POLLER_ERR 0x4 // Error or hangup. Always reported, together with whatever was asked for
+
+#ifdef __linux__
+#define POLLER_HAVE_EPOLL 1
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define POLLER_HAVE_URING 1
+#endif
+#endif
+#endif
+
+enum poller_backend {
+    POLLER_SELECT = 0,
+    POLLER_POLL,
+    POLLER_EPOLL,
+    POLLER_URING,
+    POLLER_NUM_BACKENDS
+};
+
+#ifndef POLLER_DEFAULT
+#ifdef POLLER_HAVE_EPOLL
+#define POLLER_DEFAULT POLLER_EPOLL
+#else
+#define POLLER_DEFAULT POLLER_POLL
+#endif
+#endif
+
+struct poller_event {
+    int fd;
+    int events; // POLLER_* bits
+};
+
+// Per-descriptor registration, indexed by fd
+struct poller_fd {
+    int events;   // Interest, 0 while not registered
+    int index;    // poll(): position in the pollfd array
+    int armed;    // io_uring: a poll request is outstanding
+    uint32_t gen; // io_uring: tells completions of old requests from the current one
+};
+
+struct poller {
+    enum poller_backend backend;
+    const struct poller_ops *ops;
+    struct poller_fd *fds;
+    int fds_cap;
+    int count;                  // Registered descriptors
+    struct poller_event *ready; // Filled by poller_wait()
+    int ready_cap;
+    int num_ready;
+    int next_ready;             // poller_next() position
+    long busy_poll_us;          // Spin budget per wait, 0 when busy polling is off
+    unsigned long spin_hits;    // Busy-poll waits that found events while spinning...
+    unsigned long spin_misses;  // ...and ones that had to block after all
+    void *impl;                 // Backend state
+};
+
+struct poller_ops {
+    int (*init)(struct poller *p);
+    // old_events == 0: add, new_events == 0: remove, otherwise modify
+    int (*ctl)(struct poller *p, int fd, int old_events, int new_events);
+    int (*wait)(struct poller *p, int timeout_ms);
+    void (*destroy)(struct poller *p);
+};
+
+struct poller *poller_create(enum poller_backend backend);
+int poller_add(struct poller *p, int fd, int events);
+int poller_mod(struct poller *p, int fd, int events);
+int poller_del(struct poller *p, int fd);
+void poller_set_busy_poll(struct poller *p, long budget_us);
+int poller_wait(struct poller *p, int timeout_ms);
+int poller_next(struct poller *p, struct poller_event *ev);
+void poller_free(struct poller *p);
+const char *poller_backend_name(enum poller_backend backend);
+int poller_parse_backend(const char *name);
+
+#endif // POLLER_H
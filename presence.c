@@ -0,0 +1,179 @@
+/**
+ * @file presence.c
+ * @brief Coalesced presence tracking (see presence.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "presence.h"
+
+#define PRESENCE_NAME_LEN  32
+#define PRESENCE_LINE_SIZE 1024 // Longer deltas are split over several lines
+
+struct presence_entry {
+    char name[PRESENCE_NAME_LEN];
+    enum presence_state state;     // Current state
+    enum presence_state announced; // State the room was last told about
+    int room_id;                   // Current room
+    int announced_room;            // Room the last announcement went to, -1 if none
+    int dirty;
+    long typing_since_ms;
+};
+
+static struct presence_entry *entries;
+static int num_entries;
+static int num_dirty;
+static long last_flush_ms;
+
+static const char *state_names[] = { "offline", "online", "away", "typing" };
+
+int presence_init(int max_users) {
+    if ((entries = calloc(max_users, sizeof *entries)) == NULL) {
+        perror("calloc presence table");
+        return -1;
+    }
+    num_entries = max_users;
+    for (int u = 0; u < max_users; u++) {
+        entries[u].announced_room = -1;
+    }
+    return 0;
+}
+
+void presence_register(int user_id, const char *name) {
+    snprintf(entries[user_id].name, sizeof entries[user_id].name, "%s", name);
+}
+
+static void mark_dirty(struct presence_entry *e) {
+    if (!e->dirty) {
+        e->dirty = 1;
+        num_dirty++;
+    }
+}
+
+/**
+ * @brief Record a state (or room) change. Nothing is sent until the next tick.
+ */
+void presence_set(int user_id, int room_id, enum presence_state state, long now_ms) {
+    struct presence_entry *e = &entries[user_id];
+
+    if (state == PRESENCE_TYPING) {
+        e->typing_since_ms = now_ms;
+    }
+    if (e->state == state && e->room_id == room_id) {
+        return;
+    }
+    e->state = state;
+    e->room_id = room_id;
+    mark_dirty(e);
+}
+
+enum presence_state presence_get(int user_id) {
+    return entries[user_id].state;
+}
+
+/**
+ * @brief How long the event loop may block before presence_tick() has work to do.
+ * @return Milliseconds to wait, or -1 if nothing is pending.
+ */
+long presence_timeout_ms(long now_ms) {
+    long wait = -1;
+
+    if (num_dirty > 0) {
+        wait = last_flush_ms + PRESENCE_FLUSH_MS - now_ms;
+        if (wait < 0) wait = 0;
+    }
+    for (int u = 0; u < num_entries; u++) {
+        if (entries[u].state == PRESENCE_TYPING) {
+            long expiry = entries[u].typing_since_ms + PRESENCE_TYPING_TIMEOUT_MS - now_ms;
+            if (expiry < 0) expiry = 0;
+            if (wait < 0 || expiry < wait) wait = expiry;
+        }
+    }
+    return wait;
+}
+
+// Append "name=state" to the room's delta line, emitting the line first if it is full
+static void add_to_delta(int room_id, const char *name, enum presence_state state,
+                         char *line, size_t *len, presence_emit_fn emit, void *ctx) {
+    static const char prefix[] = "* presence:";
+    size_t need = strlen(name) + strlen(state_names[state]) + 3;
+
+    if (*len > 0 && *len + need > PRESENCE_LINE_SIZE) {
+        emit(ctx, room_id, line, *len);
+        *len = 0;
+    }
+    if (*len == 0) {
+        memcpy(line, prefix, sizeof prefix - 1);
+        *len = sizeof prefix - 1;
+    }
+    *len += snprintf(line + *len, PRESENCE_LINE_SIZE - *len, " %s=%s", name, state_names[state]);
+}
+
+/**
+ * @brief Expire stale typing states and, if the flush interval has passed, emit one
+ * delta line per room whose visible presence changed since the last tick.
+ */
+void presence_tick(long now_ms, presence_emit_fn emit, void *ctx) {
+    char line[PRESENCE_LINE_SIZE];
+
+    for (int u = 0; u < num_entries; u++) {
+        struct presence_entry *e = &entries[u];
+        if (e->state == PRESENCE_TYPING && now_ms - e->typing_since_ms >= PRESENCE_TYPING_TIMEOUT_MS) {
+            e->state = PRESENCE_ONLINE;
+            mark_dirty(e);
+        }
+    }
+    if (num_dirty == 0 || now_ms - last_flush_ms < PRESENCE_FLUSH_MS) {
+        return;
+    }
+    last_flush_ms = now_ms;
+
+    // 1. Collect every room touched by a dirty user (the room they left and the one they are in)
+    int *rooms = malloc(2 * num_dirty * sizeof *rooms);
+    int num_rooms = 0;
+    if (rooms == NULL) return;
+    for (int u = 0; u < num_entries; u++) {
+        int candidates[2] = { entries[u].announced_room, entries[u].room_id };
+        if (!entries[u].dirty) continue;
+        for (int k = 0; k < 2; k++) {
+            int seen = candidates[k] < 0;
+            for (int r = 0; r < num_rooms && !seen; r++) {
+                seen = rooms[r] == candidates[k];
+            }
+            if (!seen) rooms[num_rooms++] = candidates[k];
+        }
+    }
+
+    // 2. One delta line per room, covering all of its dirty members at once
+    for (int r = 0; r < num_rooms; r++) {
+        int room_id = rooms[r];
+        size_t len = 0;
+
+        for (int u = 0; u < num_entries; u++) {
+            struct presence_entry *e = &entries[u];
+            if (!e->dirty) continue;
+            if (e->announced_room == room_id && (e->room_id != room_id || e->state == PRESENCE_OFFLINE)) {
+                // Left the room or disconnected
+                add_to_delta(room_id, e->name, PRESENCE_OFFLINE, line, &len, emit, ctx);
+            } else if (e->room_id == room_id && e->state != PRESENCE_OFFLINE
+                       && (e->announced_room != room_id || e->announced != e->state)) {
+                add_to_delta(room_id, e->name, e->state, line, &len, emit, ctx);
+            }
+        }
+        if (len > 0) {
+            emit(ctx, room_id, line, len);
+        }
+    }
+    free(rooms);
+
+    // 3. Remember what every room has now been told
+    for (int u = 0; u < num_entries; u++) {
+        struct presence_entry *e = &entries[u];
+        if (!e->dirty) continue;
+        e->announced = e->state;
+        e->announced_room = e->state == PRESENCE_OFFLINE ? -1 : e->room_id;
+        e->dirty = 0;
+    }
+    num_dirty = 0;
+}
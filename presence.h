@@ -0,0 +1,38 @@
+/**
+ * @file presence.h
+ * @brief Online / away / typing state per user, broadcast as coalesced per-room deltas.
+ *
+ * State changes only mark a user dirty. At most once every PRESENCE_FLUSH_MS the
+ * server calls presence_tick(), which compares each dirty user's current state with
+ * what was last announced and emits one delta line per affected room. A user who
+ * starts and stops typing ten times between two ticks costs nothing; a user whose
+ * state ends up where it started produces no delta at all.
+ */
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stddef.h>
+
+#define PRESENCE_FLUSH_MS          500  // Minimum interval between two delta snapshots
+#define PRESENCE_TYPING_TIMEOUT_MS 5000 // "typing" falls back to "online" after this long
+
+enum presence_state {
+    PRESENCE_OFFLINE = 0,
+    PRESENCE_ONLINE,
+    PRESENCE_AWAY,
+    PRESENCE_TYPING
+};
+
+/**
+ * @brief Callback that delivers one delta line (no trailing newline) to every member of a room.
+ */
+typedef void (*presence_emit_fn)(void *ctx, int room_id, const char *line, size_t len);
+
+int presence_init(int max_users);
+void presence_register(int user_id, const char *name);
+void presence_set(int user_id, int room_id, enum presence_state state, long now_ms);
+enum presence_state presence_get(int user_id);
+long presence_timeout_ms(long now_ms);
+void presence_tick(long now_ms, presence_emit_fn emit, void *ctx);
+
+#endif // PRESENCE_H
@@ -0,0 +1,230 @@
+/**
+ * @file profiler.c
+ * @brief SIGPROF sampling profiler writing collapsed stacks (see profiler.h).
+ */
+#define _GNU_SOURCE // dladdr()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+
+#include "profiler.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid // Not named by older glibc headers
+#endif
+
+#define SKIP_FRAMES 2  // The handler itself and the signal trampoline
+#define MAX_PROBES  64 // Slots tried before a new stack counts as dropped
+
+struct stack {
+    uint64_t hash;  // 0 for a free slot
+    unsigned long count;
+    int depth;
+    void *pc[PROFILE_MAX_DEPTH]; // Leaf first
+};
+
+static struct stack *table;
+static timer_t timer;
+static int running;
+static volatile unsigned long samples, dropped;
+
+static uint64_t hash_stack(void *const *pc, int depth) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a over the addresses
+
+    for (int k = 0; k < depth; k++) {
+        h = (h ^ (uintptr_t)pc[k]) * 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+// SIGPROF handler: only backtrace() and the preallocated table, nothing that locks
+static void on_sigprof(int sig, siginfo_t *info, void *ucontext) {
+    void *frames[PROFILE_MAX_DEPTH + SKIP_FRAMES];
+    int saved_errno = errno;
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+    uint64_t h;
+    (void)sig;
+    (void)info;
+    (void)ucontext;
+
+    samples++;
+    if (depth <= 0) {
+        dropped++;
+        errno = saved_errno;
+        return;
+    }
+    h = hash_stack(frames + SKIP_FRAMES, depth);
+    for (int probe = 0; probe < MAX_PROBES; probe++) {
+        struct stack *s = &table[(h + probe) % PROFILE_MAX_STACKS];
+
+        if (s->hash == 0) {
+            s->hash = h;
+            s->depth = depth;
+            memcpy(s->pc, frames + SKIP_FRAMES, depth * sizeof(void *));
+        }
+        if (s->hash == h && s->depth == depth && memcmp(s->pc, frames + SKIP_FRAMES, depth * sizeof(void *)) == 0) {
+            s->count++;
+            errno = saved_errno;
+            return;
+        }
+    }
+    dropped++;
+    errno = saved_errno;
+}
+
+/**
+ * @brief Start sampling the calling thread hz times per second of its CPU time.
+ * @return 0 on success, -1 on failure (errno set, reason printed).
+ */
+int profiler_start(int hz) {
+    struct sigaction sa;
+    struct sigevent sev;
+    struct itimerspec its;
+    void *warmup[1];
+
+    if (hz <= 0 || hz > 10000) {
+        fprintf(stderr, "Profiler: sampling rate must be 1 to 10000 Hz\n");
+        errno = EINVAL;
+        return -1;
+    }
+    if ((table = calloc(PROFILE_MAX_STACKS, sizeof *table)) == NULL) {
+        perror("calloc profiler");
+        return -1;
+    }
+    // The first backtrace() loads the unwinder, which must not happen in the handler
+    backtrace(warmup, 1);
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) == -1) {
+        perror("sigaction SIGPROF");
+        return -1;
+    }
+
+    // Counts this thread's CPU time only, and signals this thread only
+    memset(&sev, 0, sizeof sev);
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) == -1) {
+        perror("timer_create profiler");
+        return -1;
+    }
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000L / hz;
+    its.it_value = its.it_interval;
+    if (timer_settime(timer, 0, &its, NULL) == -1) {
+        perror("timer_settime profiler");
+        timer_delete(timer);
+        return -1;
+    }
+    running = 1;
+    return 0;
+}
+
+/**
+ * @brief Name one frame into buf: the symbol, or module+offset when there is none.
+ * Return addresses point after the call, so callers are looked up one byte back.
+ */
+static void frame_name(void *pc, int leaf, char *buf, size_t size) {
+    void *at = leaf ? pc : (char *)pc - 1;
+    const char *module;
+    Dl_info dl;
+
+    if (dladdr(at, &dl) == 0 || dl.dli_fname == NULL) {
+        snprintf(buf, size, "%p", pc);
+    } else if (dl.dli_sname != NULL) {
+        snprintf(buf, size, "%s", dl.dli_sname);
+    } else {
+        module = strrchr(dl.dli_fname, '/');
+        snprintf(buf, size, "%s+0x%lx", module ? module + 1 : dl.dli_fname,
+                 (unsigned long)((char *)at - (char *)dl.dli_fbase));
+    }
+}
+
+struct line {
+    char *frames;
+    unsigned long count;
+};
+
+static int compare_lines(const void *a, const void *b) {
+    return strcmp(((const struct line *)a)->frames, ((const struct line *)b)->frames);
+}
+
+/**
+ * @brief Stop sampling and write the collapsed stacks to path. Stacks that differ
+ * only in addresses within the same functions come out as one line. Not
+ * async-signal-safe; call it from normal context only.
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int profiler_write(const char *path) {
+    struct line *lines;
+    int num_lines = 0;
+    FILE *out;
+
+    if (!running) return 0;
+    timer_delete(timer);
+    signal(SIGPROF, SIG_IGN);
+    running = 0;
+
+    if ((lines = calloc(PROFILE_MAX_STACKS, sizeof *lines)) == NULL) {
+        perror("calloc profiler output");
+        return -1;
+    }
+    for (int k = 0; k < PROFILE_MAX_STACKS; k++) {
+        const struct stack *s = &table[k];
+        size_t cap = 1024, len = 0;
+        char name[256], *frames;
+
+        if (s->hash == 0 || (frames = malloc(cap)) == NULL) continue;
+        frames[0] = '\0';
+        // Root first
+        for (int f = s->depth - 1; f >= 0; f--) {
+            size_t n;
+
+            frame_name(s->pc[f], f == 0, name, sizeof name);
+            n = strlen(name);
+            if (len + n + 2 > cap) {
+                char *bigger = realloc(frames, cap = (len + n + 2) * 2);
+                if (bigger == NULL) break;
+                frames = bigger;
+            }
+            len += sprintf(frames + len, "%s%s", len ? ";" : "", name);
+        }
+        lines[num_lines].frames = frames;
+        lines[num_lines].count = s->count;
+        num_lines++;
+    }
+    qsort(lines, num_lines, sizeof *lines, compare_lines);
+
+    if ((out = fopen(path, "w")) == NULL) {
+        perror("fopen profile");
+        for (int k = 0; k < num_lines; k++) free(lines[k].frames);
+        free(lines);
+        return -1;
+    }
+    for (int k = 0; k < num_lines; ) {
+        unsigned long count = 0;
+        int next = k;
+
+        for (; next < num_lines && strcmp(lines[next].frames, lines[k].frames) == 0; next++) {
+            count += lines[next].count;
+        }
+        fprintf(out, "%s %lu\n", lines[k].frames, count);
+        for (; k < next; k++) free(lines[k].frames);
+    }
+    fclose(out);
+    free(lines);
+    printf("Profile: %lu sample(s) written to %s, %lu dropped\n", samples, path, dropped);
+    return 0;
+}
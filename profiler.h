@@ -0,0 +1,29 @@
+/**
+ * @file profiler.h
+ * @brief Built-in sampling profiler for the event loop thread (--profile).
+ *
+ * A timer on the CPU clock of the thread that called profiler_start() sends it
+ * SIGPROF hz times per second of CPU time it uses. The handler takes a backtrace()
+ * and counts it in a hash table of distinct stacks allocated up front, so sampling
+ * never allocates and memory stays bounded however long the server runs; samples of
+ * new stacks that find the table full are only counted as dropped. Time the thread
+ * spends blocked (in poller_wait(), say) uses no CPU and gets no samples.
+ *
+ * profiler_write() stops sampling and writes the stacks in the collapsed format of
+ * flame-graph tools, root first, one "frame;frame;...;leaf count" line per stack:
+ *   flamegraph.pl profile.1234.folded > profile.svg
+ * Frames are named with dladdr(), which needs the server linked with -rdynamic;
+ * static functions still show as "module+0xoffset", for addr2line -e module.
+ * It allocates and does stdio, so it is not async-signal-safe: the server calls it
+ * from the event loop's shutdown path, after SIGINT has only set a flag.
+ */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#define PROFILE_MAX_DEPTH  48   // Frames kept per sample, from the leaf up
+#define PROFILE_MAX_STACKS 4096 // Distinct stacks the table holds
+
+int profiler_start(int hz);
+int profiler_write(const char *path);
+
+#endif // PROFILER_H
@@ -0,0 +1,229 @@
+/**
+ * @file recent_cache.c
+ * @brief Per-room cache of recent messages in wire format (see recent_cache.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_protocol.h"
+#include "recent_cache.h"
+
+enum room_state {
+    ROOM_UNCACHED = 0,
+    ROOM_FILLING,  // Being loaded from the log by the fill callback
+    ROOM_CACHED
+};
+
+struct recent_room {
+    enum room_state state;
+    uint8_t *data;                      // Circular buffer of frames, oldest at head
+    size_t cap;
+    size_t head;
+    size_t used;
+    uint32_t len[RECENT_PER_ROOM];      // Ring of frame lengths...
+    uint32_t sender[RECENT_PER_ROOM];   // ...and sender ids
+    int first;                          // Ring index of the oldest message
+    int count;
+    uint64_t fill_seq;                  // Newest message the fill loaded from the log
+    int prev, next;                     // LRU list of cached rooms, most recent first
+};
+
+static struct recent_room *rooms;
+static int num_rooms;
+static int lru_head = -1, lru_tail = -1;
+static struct recent_cache_stats stats;
+
+int recent_cache_init(int max_rooms, size_t max_bytes) {
+    if ((rooms = calloc(max_rooms, sizeof *rooms)) == NULL) {
+        perror("calloc recent cache");
+        return -1;
+    }
+    num_rooms = max_rooms;
+    for (int k = 0; k < max_rooms; k++) {
+        rooms[k].prev = rooms[k].next = -1;
+    }
+    stats.max_bytes = max_bytes;
+    return 0;
+}
+
+static void lru_unlink(int room_id) {
+    struct recent_room *r = &rooms[room_id];
+
+    if (r->prev != -1) rooms[r->prev].next = r->next;
+    else lru_head = r->next;
+    if (r->next != -1) rooms[r->next].prev = r->prev;
+    else lru_tail = r->prev;
+    r->prev = r->next = -1;
+}
+
+// Make room_id the most recently used room
+static void lru_touch(int room_id) {
+    struct recent_room *r = &rooms[room_id];
+
+    if (lru_head == room_id) return;
+    if (r->prev != -1 || lru_tail == room_id) lru_unlink(room_id);
+    r->next = lru_head;
+    if (lru_head != -1) rooms[lru_head].prev = room_id;
+    lru_head = room_id;
+    if (lru_tail == -1) lru_tail = room_id;
+}
+
+static void evict(int room_id) {
+    struct recent_room *r = &rooms[room_id];
+
+    lru_unlink(room_id);
+    free(r->data);
+    stats.bytes -= r->cap;
+    stats.rooms--;
+    stats.evictions++;
+    r->data = NULL;
+    r->cap = r->head = r->used = 0;
+    r->first = r->count = 0;
+    r->state = ROOM_UNCACHED;
+}
+
+static void drop_oldest(struct recent_room *r) {
+    r->head = (r->head + r->len[r->first]) % r->cap;
+    r->used -= r->len[r->first];
+    r->first = (r->first + 1) % RECENT_PER_ROOM;
+    if (--r->count == 0) r->head = 0;
+}
+
+// Move the buffer to a bigger allocation, oldest frame first
+static int grow(struct recent_room *r, size_t new_cap) {
+    uint8_t *data = malloc(new_cap);
+    size_t part;
+
+    if (data == NULL) return -1;
+    if (r->used > 0) {
+        part = r->cap - r->head < r->used ? r->cap - r->head : r->used;
+        memcpy(data, r->data + r->head, part);
+        memcpy(data + part, r->data, r->used - part);
+    }
+    free(r->data);
+    stats.bytes += new_cap - r->cap;
+    r->data = data;
+    r->cap = new_cap;
+    r->head = 0;
+    return 0;
+}
+
+/**
+ * @brief Make space for one more frame of len bytes, growing the buffer (and evicting
+ * other rooms to pay for it) until it holds RECENT_PER_ROOM messages, and dropping the
+ * room's own oldest messages beyond that or when the limit leaves no other choice.
+ * @return 0 on success, -1 if the frame cannot fit at all.
+ */
+static int make_space(int room_id, size_t len) {
+    struct recent_room *r = &rooms[room_id];
+
+    if (r->count == RECENT_PER_ROOM) drop_oldest(r);
+    while (r->used + len > r->cap) {
+        size_t new_cap = r->cap ? r->cap * 2 : RECENT_MIN_ROOM_BYTES;
+        while (new_cap < r->used + len) new_cap *= 2;
+
+        while (stats.bytes + (new_cap - r->cap) > stats.max_bytes && lru_tail != -1 && lru_tail != room_id) {
+            evict(lru_tail);
+        }
+        if (stats.bytes + (new_cap - r->cap) <= stats.max_bytes && grow(r, new_cap) == 0) {
+            break;
+        }
+        if (r->count == 0) return -1;
+        drop_oldest(r);
+    }
+    return 0;
+}
+
+/**
+ * @brief Add a CHAT frame to a cached room's ring; rooms that are not cached ignore it.
+ * The copy gets CHAT_FLAG_REPLAY. Frames the fill already loaded from the log (by
+ * sequence number) are skipped, so a message can arrive both ways.
+ */
+void recent_cache_append(int room_id, const uint8_t *frame, size_t len) {
+    struct recent_room *r;
+    uint64_t seq = chat_sequence(frame);
+    size_t tail, part;
+    int slot;
+
+    if (room_id < 0 || room_id >= num_rooms || rooms[room_id].state == ROOM_UNCACHED) return;
+    r = &rooms[room_id];
+    if (r->state == ROOM_CACHED && seq != 0 && seq <= r->fill_seq) return;
+    if (r->state == ROOM_FILLING && seq > r->fill_seq) r->fill_seq = seq;
+
+    if (make_space(room_id, len) == -1) {
+        // Cannot keep the room complete: better refilled from the log later
+        evict(room_id);
+        return;
+    }
+    tail = (r->head + r->used) % r->cap;
+    part = r->cap - tail < len ? r->cap - tail : len;
+    memcpy(r->data + tail, frame, part);
+    memcpy(r->data, frame + part, len - part);
+    r->data[(tail + 1) % r->cap] |= CHAT_FLAG_REPLAY; // The flags byte
+    r->used += len;
+
+    slot = (r->first + r->count) % RECENT_PER_ROOM;
+    r->len[slot] = (uint32_t)len;
+    r->sender[slot] = chat_sender(frame);
+    r->count++;
+    stats.appends++;
+    lru_touch(room_id);
+}
+
+/**
+ * @brief Get the newest messages of a room, loading it through fill on a miss.
+ * The view points into the cache and is valid until the next append or lookup.
+ * @param max_messages At most this many (and at most RECENT_PER_ROOM) messages.
+ * @return Number of messages in the view, or -1 if the room could not be cached.
+ */
+int recent_cache_lookup(int room_id, int max_messages, struct recent_view *view, recent_fill_fn fill, void *ctx) {
+    struct recent_room *r;
+    size_t start, skipped = 0;
+    int n, skip;
+
+    view->iovcnt = view->count = 0;
+    view->len = 0;
+    if (room_id < 0 || room_id >= num_rooms) return -1;
+    r = &rooms[room_id];
+    stats.lookups++;
+    if (r->state == ROOM_CACHED) {
+        stats.hits++;
+    } else {
+        stats.fills++;
+        stats.rooms++;
+        r->state = ROOM_FILLING;
+        r->fill_seq = 0;
+        lru_touch(room_id);
+        fill(ctx, room_id);
+        if (r->state != ROOM_FILLING) return -1; // Did not fit
+        r->state = ROOM_CACHED;
+    }
+    lru_touch(room_id);
+
+    n = max_messages < r->count ? max_messages : r->count;
+    if (n <= 0) return 0;
+    skip = r->count - n;
+    for (int k = 0; k < skip; k++) {
+        skipped += r->len[(r->first + k) % RECENT_PER_ROOM];
+    }
+    for (int k = 0; k < n; k++) {
+        view->senders[k] = r->sender[(r->first + skip + k) % RECENT_PER_ROOM];
+    }
+    start = (r->head + skipped) % r->cap;
+    view->len = r->used - skipped;
+    view->iov[0].iov_base = r->data + start;
+    view->iov[0].iov_len = r->cap - start < view->len ? r->cap - start : view->len;
+    view->iovcnt = 1;
+    if (view->iov[0].iov_len < view->len) {
+        view->iov[1].iov_base = r->data;
+        view->iov[1].iov_len = view->len - view->iov[0].iov_len;
+        view->iovcnt = 2;
+    }
+    view->count = n;
+    return n;
+}
+
+void recent_cache_get_stats(struct recent_cache_stats *out) {
+    *out = stats;
+}
@@ -0,0 +1,62 @@
+/**
+ * @file recent_cache.h
+ * @brief Read-through cache of the latest messages of each room, kept in wire format.
+ *
+ * A join replays the room's last RECENT_PER_ROOM messages. Each cached room holds
+ * them as encoded CHAT frames (CHAT_FLAG_REPLAY set) back to back in a circular
+ * buffer, so a lookup hands out at most two iovecs and the replay goes out in the
+ * same writev() as the JOINED reply, without touching the history log.
+ *
+ * A room enters the cache on its first lookup: the fill callback reads its recent
+ * history from the log and adds it with recent_cache_append(). From then on every
+ * CHAT frame broadcast in the room is appended as it goes out. Rooms nobody joins
+ * are never cached, and appends to them cost nothing.
+ *
+ * Buffers together stay under the byte limit given to recent_cache_init(); past it
+ * the least recently used rooms (by lookups and appends) are dropped whole and
+ * refilled from the log when someone next joins them.
+ */
+#ifndef RECENT_CACHE_H
+#define RECENT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define RECENT_PER_ROOM       100                // Messages replayed on join
+#define RECENT_DEFAULT_BYTES  (4 * 1024 * 1024)  // Default limit for all rooms together
+#define RECENT_MIN_ROOM_BYTES (4 * 1024)         // First buffer given to a room, doubled as needed
+
+// The newest messages of a room, oldest first: iov[0] then iov[1] (if iovcnt is 2)
+struct recent_view {
+    struct iovec iov[2];
+    int iovcnt;
+    int count;                         // Messages in the view
+    size_t len;                        // Bytes in the view
+    uint32_t senders[RECENT_PER_ROOM]; // sender_id of each message, oldest first
+};
+
+struct recent_cache_stats {
+    unsigned long lookups;
+    unsigned long hits;       // Lookups served from memory
+    unsigned long fills;      // Misses, each filled from the log
+    unsigned long evictions;  // Rooms dropped to stay under the limit
+    unsigned long appends;
+    int rooms;                // Rooms cached right now
+    size_t bytes;             // Buffer bytes in use right now
+    size_t max_bytes;
+};
+
+/**
+ * @brief Called on a miss to load a room's recent history: should recent_cache_append()
+ * its latest messages, oldest first. More than RECENT_PER_ROOM is fine, the oldest
+ * are dropped.
+ */
+typedef void (*recent_fill_fn)(void *ctx, int room_id);
+
+int recent_cache_init(int max_rooms, size_t max_bytes);
+int recent_cache_lookup(int room_id, int max_messages, struct recent_view *view, recent_fill_fn fill, void *ctx);
+void recent_cache_append(int room_id, const uint8_t *frame, size_t len);
+void recent_cache_get_stats(struct recent_cache_stats *stats);
+
+#endif // RECENT_CACHE_H
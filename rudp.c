@@ -0,0 +1,879 @@
+/**
+ * @file rudp.c
+ * @brief Reliable datagram transport with selective acknowledgement (see rudp.h).
+ */
+#define _GNU_SOURCE // recvmmsg(), sendmmsg(), struct in6_pktinfo
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "rudp.h"
+
+#define RUDP_PKT_SENT          0x01 // Transmitted at least once
+#define RUDP_PKT_ACKED         0x02
+#define RUDP_PKT_LOST          0x04 // Waiting to be sent again
+#define RUDP_PKT_RETRANSMITTED 0x08 // Its ACK says nothing about the round trip time (Karn)
+
+#define ACK_MAX_LEN (RUDP_HEADER_LEN + 17 + 16 * RUDP_MAX_SACK_BLOCKS)
+
+static uint64_t mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static void encode_header(uint8_t *p, uint8_t type, uint8_t version, uint64_t pkt) {
+    memset(p, 0, RUDP_HEADER_LEN);
+    p[0] = type;
+    p[1] = version;
+    chat_store64(p + 8, pkt);
+}
+
+// Whether stream sequence number a comes before b, allowing for wraparound
+static int seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+// Send a header-only packet (HELLO, WELCOME, PING, CLOSE); loss is somebody else's problem
+static void send_control(struct rudp_conn *c, uint8_t type) {
+    uint8_t p[RUDP_HEADER_LEN];
+
+    encode_header(p, type, type == RUDP_HELLO ? RUDP_VERSION : 0, 0);
+    if (send(c->fd, p, sizeof p, 0) == (ssize_t)sizeof p) {
+        c->last_send_us = mono_us();
+    }
+}
+
+// --- Listener side ---
+
+/**
+ * @brief Prepare a bound UDP socket to take HELLOs (setup_listener() calls this
+ * instead of listen()): non-blocking, and reporting the address each datagram was
+ * sent to, so the connection can be answered from that same address.
+ * @return 0 on success, -1 on error.
+ */
+int rudp_listen(int fd) {
+    struct sockaddr_storage local;
+    socklen_t len = sizeof local;
+    int one = 1, rv;
+
+    if (getsockname(fd, (struct sockaddr *)&local, &len) == -1) {
+        perror("getsockname UDP listener");
+        return -1;
+    }
+    if (local.ss_family == AF_INET6) {
+        rv = setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof one);
+    } else {
+        rv = setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &one, sizeof one);
+    }
+    if (rv == -1) {
+        perror("setsockopt PKTINFO");
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+/**
+ * @brief Read the listener until a HELLO turns up. Anything else is dropped: data
+ * for a connection that no longer exists, or a retransmitted HELLO that arrived
+ * before its connection's socket was connected.
+ * @return 1 with hello filled in, 0 once the listener is drained, -1 on error.
+ */
+int rudp_next_hello(int listen_fd, struct rudp_hello *hello) {
+    uint8_t p[RUDP_HEADER_LEN + 1];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+        struct cmsghdr align;
+    } control;
+
+    for (;;) {
+        struct iovec iov = { p, sizeof p };
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        ssize_t n;
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_name = &hello->peer;
+        msg.msg_namelen = sizeof hello->peer;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof control.buf;
+        if ((n = recvmsg(listen_fd, &msg, 0)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            perror("recvmsg UDP listener");
+            return -1;
+        }
+        if (n != RUDP_HEADER_LEN || p[0] != RUDP_HELLO || p[1] != RUDP_VERSION) continue;
+        hello->peer_len = msg.msg_namelen;
+
+        // The address the HELLO went to, with the listener's port
+        hello->local_len = sizeof hello->local;
+        if (getsockname(listen_fd, (struct sockaddr *)&hello->local, &hello->local_len) == -1) {
+            perror("getsockname UDP listener");
+            return -1;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+                struct in_pktinfo info;
+                memcpy(&info, CMSG_DATA(cmsg), sizeof info);
+                ((struct sockaddr_in *)&hello->local)->sin_addr = info.ipi_addr;
+            } else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+                struct in6_pktinfo info;
+                memcpy(&info, CMSG_DATA(cmsg), sizeof info);
+                ((struct sockaddr_in6 *)&hello->local)->sin6_addr = info.ipi6_addr;
+            }
+        }
+        return 1;
+    }
+}
+
+/**
+ * @brief Open the socket for a new connection: bound to the address and port the
+ * HELLO was sent to and connected to its sender. The kernel prefers a connected
+ * socket to the listener, so from now on the client's datagrams arrive here.
+ * @return The non-blocking socket, or -1.
+ */
+int rudp_open(const struct rudp_hello *hello) {
+    int fd, one = 1;
+
+    if ((fd = socket(hello->local.ss_family, SOCK_DGRAM, 0)) == -1) {
+        perror("socket UDP client");
+        return -1;
+    }
+    // Shares the port with the listener. Not SO_REUSEPORT: a connected socket must
+    // not be picked by the listener group's hash for other clients' datagrams.
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1
+            || bind(fd, (const struct sockaddr *)&hello->local, hello->local_len) == -1
+            || connect(fd, (const struct sockaddr *)&hello->peer, hello->peer_len) == -1) {
+        perror("UDP client socket");
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Whether hello comes from the peer this connection already serves
+int rudp_same_peer(const struct rudp_conn *c, const struct rudp_hello *hello) {
+    return c->peer_len == hello->peer_len && memcmp(&c->peer, &hello->peer, c->peer_len) == 0;
+}
+
+// --- Connections ---
+
+/**
+ * @brief Wrap a connected, non-blocking UDP socket. With RUDP_SERVER the connection
+ * is open right away and a WELCOME goes out; a client calls rudp_connect() next.
+ * @return NULL on error.
+ */
+struct rudp_conn *rudp_new(int fd, int flags) {
+    struct rudp_conn *c = calloc(1, sizeof *c);
+
+    if (c == NULL) {
+        perror("calloc rudp_conn");
+        return NULL;
+    }
+    c->fd = fd;
+    c->flags = flags;
+    c->peer_len = sizeof c->peer;
+    if (getpeername(fd, (struct sockaddr *)&c->peer, &c->peer_len) == -1) {
+        perror("getpeername");
+        free(c);
+        return NULL;
+    }
+    c->peer_limit = RUDP_WINDOW;
+    c->adv_limit = RUDP_WINDOW;
+    c->cwnd = RUDP_INITIAL_CWND;
+    c->ssthresh = RUDP_WINDOW;
+    c->rto_us = RUDP_INITIAL_RTO_MS * 1000u;
+    c->last_send_us = c->last_recv_us = c->pace_last_us = mono_us();
+    if (flags & RUDP_SERVER) {
+        c->established = 1;
+        send_control(c, RUDP_WELCOME);
+    }
+    return c;
+}
+
+/**
+ * @brief Client side: send HELLO every RUDP_HELLO_RETRY_MS until the server answers,
+ * at most RUDP_HELLO_TRIES times. Blocks.
+ * @return 0 once connected, -1 with errno set.
+ */
+int rudp_connect(struct rudp_conn *c) {
+    for (int tries = 0; tries < RUDP_HELLO_TRIES; tries++) {
+        struct pollfd pfd = { c->fd, POLLIN, 0 };
+        uint64_t deadline;
+
+        send_control(c, RUDP_HELLO);
+        deadline = mono_us() + RUDP_HELLO_RETRY_MS * 1000u;
+        while (!c->established) {
+            uint64_t now = mono_us();
+            if (now >= deadline) break;
+            if (poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) == -1 && errno != EINTR) return -1;
+            if (rudp_input(c) == -1) return -1;
+        }
+        if (c->established) {
+            c->last_recv_us = mono_us();
+            return 0;
+        }
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+// --- Receive side ---
+
+static void send_ack(struct rudp_conn *c) {
+    uint8_t p[ACK_MAX_LEN];
+    uint64_t limit = c->rcv_base + RUDP_WINDOW, at = c->rcv_high;
+    size_t len = RUDP_HEADER_LEN + 17;
+    int blocks = 0;
+
+    encode_header(p, RUDP_ACK, 0, 0);
+    chat_store64(p + RUDP_HEADER_LEN, c->rcv_cum);
+    chat_store64(p + RUDP_HEADER_LEN + 8, limit);
+    // Received ranges above rcv_cum, from the newest down
+    while (at > c->rcv_cum && blocks < RUDP_MAX_SACK_BLOCKS) {
+        uint64_t end;
+
+        while (at > c->rcv_cum && !c->in[(at - 1) % RUDP_WINDOW].received) at--;
+        if (at == c->rcv_cum) break;
+        end = at;
+        while (at > c->rcv_cum && c->in[(at - 1) % RUDP_WINDOW].received) at--;
+        chat_store64(p + len, at);
+        chat_store64(p + len + 8, end);
+        len += 16;
+        blocks++;
+    }
+    p[RUDP_HEADER_LEN + 16] = (uint8_t)blocks;
+    if (send(c->fd, p, len, 0) == (ssize_t)len) {
+        c->adv_limit = limit;
+        c->last_send_us = mono_us();
+        c->stats.acks_sent++;
+    }
+}
+
+/**
+ * @brief Move received chunks whose stream is up to them into the ready buffer, in
+ * packet order, which within a stream is stream_seq order. Chunks waiting for an
+ * earlier one of their own stream stay behind; other streams go past them. A packet
+ * is done once all of its chunks are.
+ */
+static void deliver(struct rudp_conn *c) {
+    for (uint64_t pkt = c->rcv_base; pkt < c->rcv_high; pkt++) {
+        struct rudp_in *in = &c->in[pkt % RUDP_WINDOW];
+        int done = 1;
+
+        if (!in->received || in->delivered) continue;
+        for (size_t off = 0; off < in->len; ) {
+            uint16_t stream = chat_load16(in->data + off) % RUDP_MAX_STREAMS;
+            uint32_t stream_seq = chat_load32(in->data + off + 2);
+            uint16_t len = chat_load16(in->data + off + 6);
+            const uint8_t *frames = in->data + off + RUDP_CHUNK_HEADER_LEN;
+
+            off += RUDP_CHUNK_HEADER_LEN + len;
+            if (seq_before(stream_seq, c->rx_stream_seq[stream])) continue; // Delivered before
+            if (stream_seq != c->rx_stream_seq[stream]) {
+                done = 0;
+                continue;
+            }
+            if (RUDP_READY_BYTES - c->ready_len < len) {
+                memmove(c->ready, c->ready + c->ready_off, c->ready_len - c->ready_off);
+                c->ready_len -= c->ready_off;
+                c->ready_off = 0;
+                if (RUDP_READY_BYTES - c->ready_len < len) return; // Reader is behind: flow control
+            }
+            memcpy(c->ready + c->ready_len, frames, len);
+            c->ready_len += len;
+            c->rx_stream_seq[stream]++;
+        }
+        in->delivered = done;
+    }
+    while (c->rcv_base < c->rcv_high && c->in[c->rcv_base % RUDP_WINDOW].delivered) {
+        c->in[c->rcv_base % RUDP_WINDOW].received = 0;
+        c->in[c->rcv_base % RUDP_WINDOW].delivered = 0;
+        c->rcv_base++;
+    }
+}
+
+// Store a DATA packet. Returns 1 if it was new.
+static int receive_data(struct rudp_conn *c, const uint8_t *p, size_t n) {
+    uint64_t pkt = chat_load64(p + 8);
+    struct rudp_in *in;
+    size_t off = RUDP_HEADER_LEN;
+
+    c->stats.received++;
+    // Chunks must fill the payload exactly
+    while (off + RUDP_CHUNK_HEADER_LEN <= n) off += RUDP_CHUNK_HEADER_LEN + chat_load16(p + off + 6);
+    if (off != n || n == RUDP_HEADER_LEN) return 0;
+    if (pkt < c->rcv_base || pkt >= c->rcv_base + RUDP_WINDOW || c->in[pkt % RUDP_WINDOW].received) {
+        c->stats.duplicates++;
+        return 0;
+    }
+    in = &c->in[pkt % RUDP_WINDOW];
+    in->received = 1;
+    in->delivered = 0;
+    in->len = (uint16_t)(n - RUDP_HEADER_LEN);
+    memcpy(in->data, p + RUDP_HEADER_LEN, in->len);
+    if (pkt >= c->rcv_high) c->rcv_high = pkt + 1;
+    while (c->rcv_cum < c->rcv_high && c->in[c->rcv_cum % RUDP_WINDOW].received) c->rcv_cum++;
+    return 1;
+}
+
+// --- Send side ---
+
+// Loss response, once per episode: halve the window
+static void on_congestion(struct rudp_conn *c, uint64_t pkt) {
+    if (c->recovery_end != 0 && pkt <= c->recovery_end) return;
+    c->ssthresh = c->cwnd / 2 > 2 ? c->cwnd / 2 : 2;
+    c->cwnd = c->ssthresh;
+    c->cwnd_acc = 0;
+    c->recovery_end = c->snd_next - 1;
+}
+
+static void update_rtt(struct rudp_conn *c, uint64_t sample) {
+    uint64_t min_rto = RUDP_MIN_RTO_MS * 1000u;
+
+    if (c->srtt_us == 0) {
+        c->srtt_us = sample;
+        c->rttvar_us = sample / 2;
+    } else {
+        uint64_t err = c->srtt_us > sample ? c->srtt_us - sample : sample - c->srtt_us;
+        c->rttvar_us = (3 * c->rttvar_us + err) / 4;
+        c->srtt_us = (7 * c->srtt_us + sample) / 8;
+    }
+    c->rto_us = c->srtt_us + 4 * c->rttvar_us;
+    if (c->rto_us < min_rto) c->rto_us = min_rto;
+    if (c->rto_us > RUDP_MAX_RTO_MS * 1000u) c->rto_us = RUDP_MAX_RTO_MS * 1000u;
+}
+
+// Mark [first, end) acknowledged; returns how many were new
+static int ack_range(struct rudp_conn *c, uint64_t first, uint64_t end, uint64_t *newest_tx, uint64_t *sample) {
+    int acked = 0;
+
+    if (first < c->snd_una) first = c->snd_una;
+    if (end > c->snd_next) end = c->snd_next;
+    for (uint64_t pkt = first; pkt < end; pkt++) {
+        struct rudp_out *o = &c->out[pkt % RUDP_WINDOW];
+
+        if (!(o->state & RUDP_PKT_SENT) || (o->state & RUDP_PKT_ACKED)) continue;
+        if (!(o->state & RUDP_PKT_LOST)) c->in_flight--;
+        if (o->tx > *newest_tx) {
+            *newest_tx = o->tx;
+            *sample = (o->state & RUDP_PKT_RETRANSMITTED) ? 0 : mono_us() - o->sent_us;
+        }
+        o->state = (o->state | RUDP_PKT_ACKED) & ~RUDP_PKT_LOST;
+        acked++;
+        // Slow start, then one packet per window; not while recovering from a loss
+        if (c->recovery_end == 0 || pkt > c->recovery_end) {
+            if (c->cwnd < c->ssthresh) c->cwnd++;
+            else if (++c->cwnd_acc >= c->cwnd) {
+                c->cwnd++;
+                c->cwnd_acc = 0;
+            }
+            if (c->cwnd > RUDP_WINDOW) c->cwnd = RUDP_WINDOW;
+        }
+    }
+    return acked;
+}
+
+static void receive_ack(struct rudp_conn *c, const uint8_t *p, size_t n) {
+    uint64_t cum, limit, newest_tx = 0, sample = 0;
+    int blocks, acked;
+    uint32_t thresh;
+
+    if (n < RUDP_HEADER_LEN + 17) return;
+    cum = chat_load64(p + RUDP_HEADER_LEN);
+    limit = chat_load64(p + RUDP_HEADER_LEN + 8);
+    blocks = p[RUDP_HEADER_LEN + 16];
+    if (cum > c->snd_next || n < RUDP_HEADER_LEN + 17 + 16 * (size_t)blocks) return;
+    c->stats.acks_received++;
+    if (limit > c->peer_limit) c->peer_limit = limit;
+
+    acked = ack_range(c, c->snd_una, cum, &newest_tx, &sample);
+    for (int b = 0; b < blocks; b++) {
+        const uint8_t *block = p + RUDP_HEADER_LEN + 17 + 16 * b;
+        acked += ack_range(c, chat_load64(block), chat_load64(block + 8), &newest_tx, &sample);
+    }
+    if (acked == 0) return;
+
+    if (sample > 0) update_rtt(c, sample);
+    c->backoff = 0;
+    c->probe_sent = 0;
+    while (c->snd_una < c->snd_next && (c->out[c->snd_una % RUDP_WINDOW].state & RUDP_PKT_ACKED)) {
+        c->out[c->snd_una % RUDP_WINDOW].state = 0;
+        c->snd_una++;
+    }
+    if (c->recovery_end != 0 && c->snd_una > c->recovery_end) c->recovery_end = 0;
+
+    // A packet is lost once enough packets sent after it have been acknowledged. The
+    // answer to a tail loss probe is as good as it gets: everything sent before it is.
+    if (newest_tx > c->largest_acked_tx) c->largest_acked_tx = newest_tx;
+    thresh = c->probe_tx != 0 && c->largest_acked_tx >= c->probe_tx ? 1 : RUDP_REORDER_THRESH;
+    if (thresh == 1) c->probe_tx = 0;
+    for (uint64_t pkt = c->snd_una; pkt < c->snd_next; pkt++) {
+        struct rudp_out *o = &c->out[pkt % RUDP_WINDOW];
+
+        if ((o->state & (RUDP_PKT_SENT | RUDP_PKT_ACKED | RUDP_PKT_LOST)) != RUDP_PKT_SENT) continue;
+        if (o->tx + thresh <= c->largest_acked_tx) {
+            o->state |= RUDP_PKT_LOST;
+            c->in_flight--;
+            on_congestion(c, pkt);
+        }
+    }
+}
+
+/**
+ * @brief Read and handle every datagram waiting on the socket, RUDP_BATCH per
+ * recvmmsg(): acknowledgements, and data, which goes to the ready buffer as far as
+ * stream order allows. A batch that brought data is answered with one ACK.
+ * @return 0, or -1 if the connection is dead (errno set).
+ */
+int rudp_input(struct rudp_conn *c) {
+    struct mmsghdr msgs[RUDP_BATCH];
+    struct iovec iov[RUDP_BATCH];
+    int n;
+
+    if (c->dead) {
+        errno = c->dead_errno;
+        return -1;
+    }
+    for (int k = 0; k < RUDP_BATCH; k++) {
+        iov[k].iov_base = c->batch[k];
+        iov[k].iov_len = RUDP_MTU;
+        memset(&msgs[k].msg_hdr, 0, sizeof msgs[k].msg_hdr);
+        msgs[k].msg_hdr.msg_iov = &iov[k];
+        msgs[k].msg_hdr.msg_iovlen = 1;
+    }
+    // Always read on: ACKs must get through to a writer blocked on a full window, and
+    // data beyond what the ready buffer takes waits in the receive window, which the
+    // limit in our ACKs keeps the peer within. Two windows' worth at most per call; the
+    // poller reports the socket again for the rest.
+    for (int rounds = 0; rounds < 2 * RUDP_WINDOW / RUDP_BATCH
+            && (n = recvmmsg(c->fd, msgs, RUDP_BATCH, MSG_DONTWAIT, NULL)) != 0; rounds++) {
+        int answer = 0;
+
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            // ICMP port unreachable and the like: nobody is listening any more
+            c->dead = 1;
+            c->dead_errno = errno;
+            return -1;
+        }
+        c->last_recv_us = mono_us();
+        for (int k = 0; k < n; k++) {
+            const uint8_t *p = c->batch[k];
+            size_t len = msgs[k].msg_len;
+
+            if (len < RUDP_HEADER_LEN) continue;
+            if (p[0] != RUDP_HELLO && p[0] != RUDP_CLOSE) c->established = 1;
+            switch (p[0]) {
+            case RUDP_DATA:
+                receive_data(c, p, len);
+                answer = 1;
+                break;
+            case RUDP_ACK:
+                receive_ack(c, p, len);
+                break;
+            case RUDP_HELLO:
+                // Our WELCOME got lost
+                if (c->flags & RUDP_SERVER) send_control(c, RUDP_WELCOME);
+                break;
+            case RUDP_PING:
+                answer = 1;
+                break;
+            case RUDP_CLOSE:
+                c->closed = 1;
+                break;
+            default:
+                break;
+            }
+        }
+        if (answer) {
+            deliver(c);
+            send_ack(c);
+        }
+        if (n < RUDP_BATCH) break;
+    }
+    return 0;
+}
+
+/**
+ * @brief recv() equivalent: frames in stream order. Datagrams are read from the
+ * socket only once the ready buffer is empty.
+ * @return Bytes read; 0 once the peer has closed the connection; -1 with errno set
+ * (EAGAIN when there is nothing yet, ETIMEDOUT and others when the peer is gone).
+ */
+ssize_t rudp_read(struct rudp_conn *c, void *buf, size_t len) {
+    size_t n;
+
+    if (c->ready_off == c->ready_len && rudp_input(c) == -1) return -1;
+    if (c->ready_off == c->ready_len) {
+        if (c->closed) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    n = c->ready_len - c->ready_off < len ? c->ready_len - c->ready_off : len;
+    memcpy(buf, c->ready + c->ready_off, n);
+    c->ready_off += n;
+    if (c->ready_off == c->ready_len) {
+        c->ready_off = c->ready_len = 0;
+    }
+    // Packets held back for lack of room go in now; tell the sender if that opened
+    // its window by a good deal, it may be waiting for just that
+    if (c->rcv_base < c->rcv_high) {
+        deliver(c);
+        if (c->rcv_base + RUDP_WINDOW - c->adv_limit >= RUDP_WINDOW / 4) send_ack(c);
+    }
+    return n;
+}
+
+// Available bytes that rudp_read() returns without touching the socket
+size_t rudp_pending(const struct rudp_conn *c) {
+    return c->ready_len - c->ready_off;
+}
+
+/**
+ * @brief Pack the staged bytes into packets, whole frames only. A frame goes into the
+ * newest packet if that one has not been sent yet and has room, appended to the chunk
+ * of its stream there or in a new chunk; otherwise into a new packet, while the send
+ * window has one free.
+ * @return 0, or -1 if the staged bytes are not frames.
+ */
+static int pack_stage(struct rudp_conn *c) {
+    size_t off = 0, payload_off, payload_len;
+    ssize_t n;
+
+    while ((n = chat_frame_parse(c->stage + off, c->stage_len - off, &payload_off, &payload_len)) > 0) {
+        uint16_t stream = (c->flags & RUDP_PER_ROOM) ? chat_room(c->stage + off) % RUDP_MAX_STREAMS : 0;
+        struct rudp_out *o = c->snd_end > c->snd_next ? &c->out[(c->snd_end - 1) % RUDP_WINDOW] : NULL;
+        size_t chunk = RUDP_HEADER_LEN, at;
+
+        // This stream's chunk in the open packet, if it has one
+        while (o != NULL && chunk < o->len && chat_load16(o->buf + chunk) != stream) {
+            chunk += RUDP_CHUNK_HEADER_LEN + chat_load16(o->buf + chunk + 6);
+        }
+        if (o != NULL && o->len + n + (chunk == o->len ? RUDP_CHUNK_HEADER_LEN : 0) > RUDP_MTU) o = NULL;
+        if (o == NULL) {
+            if (c->snd_end - c->snd_una >= RUDP_WINDOW) break;
+            o = &c->out[c->snd_end++ % RUDP_WINDOW];
+            encode_header(o->buf, RUDP_DATA, 0, c->snd_end - 1);
+            o->len = chunk = RUDP_HEADER_LEN;
+            o->state = 0;
+        }
+        if (chunk == o->len) {
+            chat_store16(o->buf + chunk, stream);
+            chat_store32(o->buf + chunk + 2, c->tx_stream_seq[stream]++);
+            chat_store16(o->buf + chunk + 6, 0);
+            o->len += RUDP_CHUNK_HEADER_LEN;
+        }
+        // Append to the chunk, moving the chunks after it along
+        at = chunk + RUDP_CHUNK_HEADER_LEN + chat_load16(o->buf + chunk + 6);
+        memmove(o->buf + at + n, o->buf + at, o->len - at);
+        memcpy(o->buf + at, c->stage + off, n);
+        chat_store16(o->buf + chunk + 6, (uint16_t)(chat_load16(o->buf + chunk + 6) + n));
+        o->len += n;
+        off += n;
+    }
+    memmove(c->stage, c->stage + off, c->stage_len - off);
+    c->stage_len -= off;
+    if (n < 0) {
+        c->stage_len = 0;
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Bytes per second the pacer lets out, 0 while there is no RTT estimate to pace by
+static uint64_t pacing_rate(const struct rudp_conn *c) {
+    uint64_t rate;
+
+    if (c->srtt_us == 0) return 0;
+    rate = (uint64_t)c->cwnd * RUDP_MTU * 1000000u / c->srtt_us;
+    return c->cwnd < c->ssthresh ? 2 * rate : rate + rate / 4;
+}
+
+/**
+ * @brief Send what the congestion window and the pacer allow, lost packets first,
+ * with one sendmmsg() per RUDP_BATCH packets.
+ */
+static void output(struct rudp_conn *c, uint64_t now) {
+    struct mmsghdr msgs[RUDP_BATCH];
+    struct iovec iov[RUDP_BATCH];
+    uint64_t pkts[RUDP_BATCH], lost_scan = c->snd_una, rate = pacing_rate(c);
+    int n = 0, sent;
+
+    c->blocked = 0;
+    c->pace_until_us = 0;
+    if (rate > 0) {
+        int64_t cap = (int64_t)(rate / 1000); // A millisecond's worth: the event loop sleeps in ms
+        if (cap < RUDP_PACE_BURST * RUDP_MTU) cap = RUDP_PACE_BURST * RUDP_MTU;
+        uint64_t idle = now - c->pace_last_us < 1000000u ? now - c->pace_last_us : 1000000u;
+        c->pace_tokens += (int64_t)(rate * idle / 1000000u);
+        if (c->pace_tokens > cap) c->pace_tokens = cap;
+    }
+    c->pace_last_us = now;
+
+    for (;;) {
+        struct rudp_out *o = NULL;
+        uint64_t pkt;
+        int is_new = 0;
+
+        while (lost_scan < c->snd_next && !(c->out[lost_scan % RUDP_WINDOW].state & RUDP_PKT_LOST)) lost_scan++;
+        if (lost_scan < c->snd_next) {
+            pkt = lost_scan;
+        } else if (c->snd_next < c->snd_end && c->snd_next < c->peer_limit) {
+            pkt = c->snd_next;
+            is_new = 1;
+        } else {
+            break;
+        }
+        o = &c->out[pkt % RUDP_WINDOW];
+        if (c->in_flight >= c->cwnd) break;
+        if (rate > 0 && c->pace_tokens < o->len) {
+            c->pace_until_us = now + (o->len - c->pace_tokens) * 1000000u / rate;
+            break;
+        }
+        if (n == RUDP_BATCH) {
+            // Full batch: out with it and go on
+            break;
+        }
+        if (rate > 0) c->pace_tokens -= o->len;
+        if (o->state & RUDP_PKT_SENT) {
+            o->state |= RUDP_PKT_RETRANSMITTED;
+            c->stats.retransmitted++;
+        }
+        o->state = (o->state | RUDP_PKT_SENT) & ~RUDP_PKT_LOST;
+        o->tx = ++c->tx_count;
+        o->sent_us = now;
+        if (c->probe_sent && pkt == c->probe_pkt) c->probe_tx = o->tx;
+        c->in_flight++;
+        if (is_new) c->snd_next++;
+        else lost_scan++;
+
+        iov[n].iov_base = o->buf;
+        iov[n].iov_len = o->len;
+        memset(&msgs[n].msg_hdr, 0, sizeof msgs[n].msg_hdr);
+        msgs[n].msg_hdr.msg_iov = &iov[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+        pkts[n] = pkt;
+        n++;
+    }
+    if (n == 0) return;
+
+    sent = 0;
+    while (sent < n) {
+        int rv = sendmmsg(c->fd, msgs + sent, n - sent, MSG_DONTWAIT);
+        if (rv == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                c->dead = 1;
+                c->dead_errno = errno;
+            }
+            break;
+        }
+        sent += rv;
+    }
+    c->stats.sent += sent;
+    if (sent > 0) c->last_send_us = c->last_data_us = now;
+    // What the socket did not take goes out again as soon as it is writable
+    for (int k = sent; k < n; k++) {
+        c->out[pkts[k] % RUDP_WINDOW].state |= RUDP_PKT_LOST;
+        c->in_flight--;
+        c->blocked = 1;
+    }
+    if (n == RUDP_BATCH && sent == n) output(c, now);
+}
+
+/**
+ * @brief writev() equivalent. Bytes are staged until they form whole frames, which
+ * are packed into packets and sent as far as the congestion window allows; the rest
+ * waits in the send window for rudp_flush(). Bytes count as written once staged.
+ * @return Bytes accepted, or -1 with errno set (EAGAIN while the window is full).
+ */
+ssize_t rudp_writev(struct rudp_conn *c, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+
+    if (c->dead) {
+        errno = c->dead_errno;
+        return -1;
+    }
+    for (int k = 0; k < iovcnt; k++) {
+        size_t off = 0;
+
+        while (off < iov[k].iov_len) {
+            size_t n = iov[k].iov_len - off;
+
+            if (n > sizeof c->stage - c->stage_len) n = sizeof c->stage - c->stage_len;
+            if (n == 0) break;
+            memcpy(c->stage + c->stage_len, (const uint8_t *)iov[k].iov_base + off, n);
+            c->stage_len += n;
+            off += n;
+            total += n;
+            if (pack_stage(c) == -1) return -1;
+            if (c->stage_len == sizeof c->stage) break; // The window has no free packet
+        }
+        if (off < iov[k].iov_len) break;
+    }
+    output(c, mono_us());
+    if (total == 0 && iovcnt > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return total;
+}
+
+// Start of the oldest transmission still waiting for its ACK, 0 if none
+static uint64_t oldest_in_flight(const struct rudp_conn *c) {
+    uint64_t oldest = 0;
+
+    for (uint64_t pkt = c->snd_una; pkt < c->snd_next; pkt++) {
+        const struct rudp_out *o = &c->out[pkt % RUDP_WINDOW];
+        if ((o->state & (RUDP_PKT_SENT | RUDP_PKT_ACKED | RUDP_PKT_LOST)) == RUDP_PKT_SENT
+                && (oldest == 0 || o->sent_us < oldest)) {
+            oldest = o->sent_us;
+        }
+    }
+    return oldest;
+}
+
+static uint64_t probe_delay(const struct rudp_conn *c) {
+    uint64_t delay = 2 * c->srtt_us;
+
+    if (c->srtt_us == 0) return c->rto_us;
+    return delay > RUDP_MIN_PROBE_MS * 1000u ? delay : RUDP_MIN_PROBE_MS * 1000u;
+}
+
+// Whether the peer's window is all that keeps queued packets from going out
+static int window_blocked(const struct rudp_conn *c) {
+    return c->snd_next < c->snd_end && c->snd_next >= c->peer_limit && c->in_flight == 0;
+}
+
+/**
+ * @brief Run the timers and send what may be sent: the retransmission timeout, the
+ * tail loss probe, paced packets, keepalives and window probes.
+ * @return 0, or -1 if the connection is dead (errno set).
+ */
+int rudp_flush(struct rudp_conn *c) {
+    uint64_t now = mono_us(), oldest;
+
+    if (!c->dead && now - c->last_recv_us >= RUDP_IDLE_TIMEOUT_MS * 1000u) {
+        c->dead = 1;
+        c->dead_errno = ETIMEDOUT;
+    }
+    if (c->dead) {
+        errno = c->dead_errno;
+        return -1;
+    }
+    if (!c->established) return 0;
+    if (c->stage_len > 0 && pack_stage(c) == -1) return -1;
+
+    oldest = oldest_in_flight(c);
+    if (oldest != 0 && now - oldest >= c->rto_us << c->backoff) {
+        // Nothing heard for a whole timeout: everything in flight is lost
+        if (++c->backoff > RUDP_MAX_BACKOFF) {
+            c->dead = 1;
+            c->dead_errno = ETIMEDOUT;
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        for (uint64_t pkt = c->snd_una; pkt < c->snd_next; pkt++) {
+            struct rudp_out *o = &c->out[pkt % RUDP_WINDOW];
+            if ((o->state & (RUDP_PKT_SENT | RUDP_PKT_ACKED | RUDP_PKT_LOST)) == RUDP_PKT_SENT) {
+                o->state |= RUDP_PKT_LOST;
+            }
+        }
+        c->in_flight = 0;
+        c->ssthresh = c->cwnd / 2 > 2 ? c->cwnd / 2 : 2;
+        c->cwnd = 1;
+        c->cwnd_acc = 0;
+        c->recovery_end = c->snd_next - 1;
+        c->probe_sent = 1; // No probe until an ACK comes back
+        c->probe_pkt = UINT64_MAX;
+        c->probe_tx = 0;
+        c->stats.timeouts++;
+    } else if (oldest != 0 && !c->probe_sent && now - c->last_data_us >= probe_delay(c)) {
+        // Send the newest packet in flight again, whatever the congestion window says
+        for (uint64_t pkt = c->snd_next; pkt-- > c->snd_una; ) {
+            struct rudp_out *o = &c->out[pkt % RUDP_WINDOW];
+            if ((o->state & (RUDP_PKT_SENT | RUDP_PKT_ACKED | RUDP_PKT_LOST)) == RUDP_PKT_SENT) {
+                o->state |= RUDP_PKT_LOST;
+                c->in_flight--;
+                c->probe_sent = 1;
+                c->probe_pkt = pkt;
+                c->stats.probes++;
+                break;
+            }
+        }
+    }
+    output(c, now);
+    if (now - c->last_send_us >= RUDP_KEEPALIVE_MS * 1000u
+            || (window_blocked(c) && now - c->last_send_us >= c->rto_us)) {
+        send_control(c, RUDP_PING);
+    }
+    return 0;
+}
+
+// Whether the socket buffer was full: watch it for writability
+int rudp_wants_write(const struct rudp_conn *c) {
+    return c->blocked;
+}
+
+/**
+ * @brief Milliseconds until rudp_flush() has something to do (0: now).
+ */
+int rudp_timeout_ms(const struct rudp_conn *c) {
+    uint64_t now = mono_us(), due, oldest;
+
+    if (c->dead || c->closed) return 0;
+    due = c->last_recv_us + RUDP_IDLE_TIMEOUT_MS * 1000u;
+    if (c->last_send_us + RUDP_KEEPALIVE_MS * 1000u < due) due = c->last_send_us + RUDP_KEEPALIVE_MS * 1000u;
+    if ((oldest = oldest_in_flight(c)) != 0) {
+        uint64_t rto = oldest + (c->rto_us << c->backoff), probe = c->last_data_us + probe_delay(c);
+        if (rto < due) due = rto;
+        if (!c->probe_sent && probe < due) due = probe;
+    }
+    if (c->pace_until_us != 0 && c->pace_until_us < due) due = c->pace_until_us;
+    if (window_blocked(c) && c->last_send_us + c->rto_us < due) due = c->last_send_us + c->rto_us;
+    // Frames waiting for a free packet, or lost packets the window has room for now
+    if (c->stage_len > 0 && c->snd_end - c->snd_una < RUDP_WINDOW) due = now;
+    if (c->in_flight < c->cwnd && c->pace_until_us == 0 && !c->blocked) {
+        for (uint64_t pkt = c->snd_una; pkt < c->snd_next; pkt++) {
+            if (c->out[pkt % RUDP_WINDOW].state & RUDP_PKT_LOST) {
+                due = now;
+                break;
+            }
+        }
+        if (c->snd_next < c->snd_end && c->snd_next < c->peer_limit) due = now;
+    }
+    return due <= now ? 0 : (int)((due - now + 999) / 1000);
+}
+
+void rudp_get_stats(const struct rudp_conn *c, struct rudp_stats *stats) {
+    *stats = c->stats;
+    stats->cwnd = c->cwnd;
+    stats->in_flight = c->in_flight;
+    stats->queued = (uint32_t)(c->snd_end - c->snd_next);
+    stats->srtt_us = c->srtt_us;
+}
+
+/**
+ * @brief Send CLOSE (best effort) and free the connection. The socket itself is left
+ * for the caller to close.
+ */
+void rudp_free(struct rudp_conn *c) {
+    if (c == NULL) return;
+    if (c->established && !c->dead) send_control(c, RUDP_CLOSE);
+    free(c);
+}
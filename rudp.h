@@ -0,0 +1,207 @@
+/**
+ * @file rudp.h
+ * @brief Reliable datagram transport for chat frames over UDP (--udp).
+ *
+ * One TCP connection delivers everything in a single order, so a segment lost in
+ * transit holds back every later message, whatever room it belongs to. Over UDP each
+ * room is its own stream: frames arrive in order within a room, and a loss only
+ * delays the room it happened in. Lossy and mobile links are where that matters.
+ *
+ * Every datagram starts with a RUDP_HEADER_LEN-byte header (big-endian):
+ *
+ *   offset  size  field
+ *   0       1     type        (enum rudp_type)
+ *   1       1     version     (RUDP_VERSION; HELLO only, 0 otherwise)
+ *   2       6     reserved    (0)
+ *   8       8     packet      (DATA: 0, 1, ... per connection and direction)
+ *
+ * A DATA payload, at most RUDP_MAX_PAYLOAD bytes, is a run of chunks, each a
+ * RUDP_CHUNK_HEADER_LEN-byte header and one or more whole frames of chat_protocol.h:
+ *
+ *   0       2     stream      (room_id % RUDP_MAX_STREAMS, or 0)
+ *   2       4     stream_seq  (0, 1, ... per stream)
+ *   6       2     length      (of the frames that follow)
+ *
+ * Rooms share packets, so small frames of many rooms cost no more packets than those
+ * of one; a lost packet holds back only the rooms it had chunks of. It is sent again
+ * with the same packet number (it is the unit of acknowledgement), but only after
+ * RUDP_REORDER_THRESH packets sent after it were acknowledged, or a timer fired.
+ *
+ * An ACK payload is "all packets below cum received" (8 bytes), the window limit,
+ * i.e. "you may send packets below this" (8), a block count (1), then up to
+ * RUDP_MAX_SACK_BLOCKS received ranges [first, end) above cum, newest first (8 + 8
+ * each). Every batch of received datagrams is answered with one ACK.
+ *
+ * The sender keeps at most RUDP_WINDOW packets buffered, and never more in flight
+ * than its congestion window: slow start from RUDP_INITIAL_CWND packets, halved once
+ * per loss episode, back to one packet on a retransmission timeout (RTT estimate and
+ * backoff as in RFC 6298). The last packets of a burst have no later packets to
+ * reveal their loss, so after two round trips without an ACK the newest one is sent
+ * again as a probe. Packets go out paced at 1.25 times (2 in slow start) the rate
+ * cwnd / srtt allows, in bursts no larger than a millisecond's worth, with one
+ * sendmmsg() per flush; input is read with recvmmsg().
+ *
+ * Connections: the client sends HELLO to RUDP_PORT until a WELCOME comes back. The
+ * server answers from a new socket bound to the same address and port and connect()ed
+ * to the client (rudp_open()), so the kernel hands it that client's datagrams and the
+ * event loop sees one descriptor per client, as with TCP. Both ends PING an idle
+ * connection every RUDP_KEEPALIVE_MS; one that hears nothing for RUDP_IDLE_TIMEOUT_MS,
+ * or gives up retransmitting, is dead. rudp_free() sends CLOSE.
+ *
+ * The API follows tls.h: rudp_read() and rudp_writev() have recv()/writev() semantics
+ * on a non-blocking socket. Bytes written are staged until they form whole frames and
+ * packed into packets; a packet that the congestion window, pacing or the socket do
+ * not let out yet stays buffered, and rudp_flush() sends it later. Call rudp_flush()
+ * every time rudp_timeout_ms() says so, and watch for writability only while
+ * rudp_wants_write(). Data read off the socket may be buffered in the connection
+ * (rudp_pending()) where the poller does not see it. Not thread-safe: one connection
+ * belongs to one thread.
+ */
+#ifndef RUDP_H
+#define RUDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "chat_protocol.h"
+
+#define RUDP_PORT             "3493" // Port of the server's UDP listener
+#define RUDP_VERSION          1
+#define RUDP_HEADER_LEN       16
+#define RUDP_MTU              1232   // Largest datagram: fits the IPv6 minimum MTU with IP and UDP headers
+#define RUDP_MAX_PAYLOAD      (RUDP_MTU - RUDP_HEADER_LEN)
+#define RUDP_CHUNK_HEADER_LEN 8
+#define RUDP_WINDOW           128    // Packets buffered per direction (sent and unacknowledged, or queued)
+#define RUDP_MAX_STREAMS      64     // Independent orderings per connection
+#define RUDP_BATCH            32     // Datagrams per recvmmsg() / sendmmsg()
+#define RUDP_READY_BYTES      (32 * 1024) // Received frames in order, waiting for rudp_read()
+#define RUDP_STAGE_BYTES      (2 * CHAT_MAX_FRAME) // Written bytes not packed yet
+#define RUDP_MAX_SACK_BLOCKS  16
+#define RUDP_INITIAL_CWND     10     // Packets
+#define RUDP_REORDER_THRESH   3      // Later packets acknowledged before one counts as lost
+#define RUDP_INITIAL_RTO_MS   1000
+#define RUDP_MIN_RTO_MS       200
+#define RUDP_MAX_RTO_MS       10000
+#define RUDP_MAX_BACKOFF      6      // Timeouts in a row before the peer is given up
+#define RUDP_MIN_PROBE_MS     10     // Tail loss probe after max(2 * srtt, this)
+#define RUDP_PACE_BURST       4      // Packets that may always go out back to back
+#define RUDP_KEEPALIVE_MS     5000
+#define RUDP_IDLE_TIMEOUT_MS  30000
+#define RUDP_HELLO_RETRY_MS   250
+#define RUDP_HELLO_TRIES      8
+
+enum rudp_type {
+    RUDP_DATA = 1,
+    RUDP_ACK,
+    RUDP_HELLO,   // Client -> server listener: open a connection
+    RUDP_WELCOME, // Server -> client: connection open
+    RUDP_PING,    // Answer with an ACK (keepalive, window probe)
+    RUDP_CLOSE    // The peer is gone
+};
+
+// rudp_new() flags
+#define RUDP_SERVER   0x01 // Accepted by rudp_open(): answer HELLOs with WELCOME
+#define RUDP_PER_ROOM 0x02 // Put each room's frames on a stream of its own; otherwise one stream
+
+// A packet we sent (or will send), indexed by packet number modulo RUDP_WINDOW
+struct rudp_out {
+    uint8_t state;       // RUDP_PKT_* in rudp.c
+    uint16_t len;        // Header included
+    uint64_t sent_us;    // Last transmission
+    uint64_t tx;         // Transmission count at the last transmission
+    uint8_t buf[RUDP_MTU];
+};
+
+// A packet received and not delivered yet, indexed the same way
+struct rudp_in {
+    uint8_t received;
+    uint8_t delivered;   // All of its chunks are
+    uint16_t len;        // Payload only
+    uint8_t data[RUDP_MAX_PAYLOAD];
+};
+
+struct rudp_stats {
+    unsigned long sent;          // DATA transmissions, retransmissions included
+    unsigned long retransmitted;
+    unsigned long received;      // DATA packets, duplicates included
+    unsigned long duplicates;
+    unsigned long acks_sent;
+    unsigned long acks_received;
+    unsigned long probes;        // Tail loss probes
+    unsigned long timeouts;      // Retransmission timeouts
+    uint32_t cwnd;               // Packets
+    uint32_t in_flight;          // Packets
+    uint32_t queued;             // Packets buffered and not sent yet
+    uint64_t srtt_us;
+};
+
+struct rudp_conn {
+    int fd;
+    int flags;
+    int established;
+    int closed;                 // CLOSE received
+    int dead;                   // Peer unreachable; errno in dead_errno
+    int dead_errno;
+    int blocked;                // sendmmsg() found the socket buffer full
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    uint64_t last_send_us, last_recv_us;
+
+    // Send side. Packets [snd_una, snd_next) have been sent, [snd_next, snd_end) are queued.
+    uint64_t snd_una, snd_next, snd_end;
+    uint64_t peer_limit;        // Window limit from the peer's last ACK
+    uint32_t tx_stream_seq[RUDP_MAX_STREAMS];
+    uint64_t tx_count, largest_acked_tx;
+    uint32_t cwnd, ssthresh, cwnd_acc, in_flight;
+    uint64_t recovery_end;      // Losses of packets up to here belong to the current episode
+    uint64_t srtt_us, rttvar_us, rto_us;
+    int backoff;
+    uint64_t last_data_us;      // Newest DATA transmission, for the tail loss probe
+    int probe_sent;             // Probe sent and not answered by an ACK yet
+    uint64_t probe_pkt, probe_tx;
+    int64_t pace_tokens;        // Bytes
+    uint64_t pace_last_us, pace_until_us;
+    size_t stage_len;
+    uint8_t stage[RUDP_STAGE_BYTES];
+    struct rudp_out out[RUDP_WINDOW];
+
+    // Receive side. Packets below rcv_base are delivered, below rcv_cum received.
+    uint64_t rcv_base, rcv_cum, rcv_high;
+    uint64_t adv_limit;         // Window limit in our last ACK
+    uint32_t rx_stream_seq[RUDP_MAX_STREAMS];
+    struct rudp_in in[RUDP_WINDOW];
+    size_t ready_off, ready_len;
+    uint8_t ready[RUDP_READY_BYTES];
+    uint8_t batch[RUDP_BATCH][RUDP_MTU];
+
+    struct rudp_stats stats;
+};
+
+// A HELLO read from the listener
+struct rudp_hello {
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    struct sockaddr_storage local; // Address it was sent to
+    socklen_t local_len;
+};
+
+int rudp_listen(int fd);
+int rudp_next_hello(int listen_fd, struct rudp_hello *hello);
+int rudp_open(const struct rudp_hello *hello);
+int rudp_same_peer(const struct rudp_conn *c, const struct rudp_hello *hello);
+struct rudp_conn *rudp_new(int fd, int flags);
+int rudp_connect(struct rudp_conn *c);
+int rudp_input(struct rudp_conn *c);
+ssize_t rudp_read(struct rudp_conn *c, void *buf, size_t len);
+ssize_t rudp_writev(struct rudp_conn *c, const struct iovec *iov, int iovcnt);
+int rudp_flush(struct rudp_conn *c);
+size_t rudp_pending(const struct rudp_conn *c);
+int rudp_wants_write(const struct rudp_conn *c);
+int rudp_timeout_ms(const struct rudp_conn *c);
+void rudp_get_stats(const struct rudp_conn *c, struct rudp_stats *stats);
+void rudp_free(struct rudp_conn *c);
+
+#endif // RUDP_H
@@ -0,0 +1,395 @@
+/**
+ * @file search_index.c
+ * @brief Background-built inverted index over the history log (see search_index.h).
+ *
+ * Threading: the indexer thread is the only writer. Queries come from the event
+ * loop thread and take the same mutex; tokenizing and log reads happen outside
+ * the lock so the event loop only waits for the posting-list updates themselves.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "history.h"
+#include "search_index.h"
+
+#define INITIAL_BUCKETS    256
+#define MAX_TERMS_PER_DOC  128 // Distinct terms indexed per message; the rest are ignored
+#define MAX_QUERY_TERMS    8
+#define IDLE_WAIT_SEC      1   // How long the indexer sleeps when it has caught up
+
+struct term_entry {
+    struct term_entry *next;
+    uint32_t last_doc;  // Most recent document in the list (delta base, per-doc dedup)
+    uint32_t num_docs;
+    size_t len;         // Bytes used in postings
+    size_t cap;
+    uint8_t *postings;  // Varint-encoded gaps between consecutive document numbers
+    char term[SEARCH_MAX_TERM + 1];
+};
+
+// One term table per room
+struct partition {
+    struct term_entry **buckets;
+    size_t num_buckets;
+    size_t num_terms;
+    uint64_t recent[SEARCH_RECENT]; // Positions of the room's latest records, a ring
+    uint32_t num_recent;            // Records of the room so far; the next goes in num_recent % SEARCH_RECENT
+};
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running;
+    int notified;
+    char dir[256];           // History directory
+    struct partition *parts; // Indexed by room id
+    size_t num_parts;
+    uint64_t *doc_pos;       // Document number -> record position in the log
+    uint32_t num_docs;
+    size_t doc_cap;
+    uint64_t indexed_to;     // Log position the indexer has reached
+} idx = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+/**
+ * @brief Extract the next token from *p into term (lowercased, NUL-terminated).
+ * @return 1 if a token was found, 0 at the end of the text.
+ */
+static int next_token(const char **p, char *term) {
+    const char *s = *p;
+
+    for (;;) {
+        size_t n = 0;
+
+        while (*s != '\0' && !isalnum((unsigned char)*s)) s++;
+        if (*s == '\0') {
+            *p = s;
+            return 0;
+        }
+        while (isalnum((unsigned char)*s)) {
+            if (n < SEARCH_MAX_TERM) term[n++] = (char)tolower((unsigned char)*s);
+            s++;
+        }
+        term[n] = '\0';
+        if (n >= SEARCH_MIN_TERM) {
+            *p = s;
+            return 1;
+        }
+    }
+}
+
+static uint32_t hash_term(const char *term) {
+    uint32_t h = 2166136261u; // FNV-1a
+
+    while (*term) {
+        h ^= (unsigned char)*term++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct term_entry *find_term(const struct partition *part, const char *term) {
+    if (part->num_buckets == 0) return NULL;
+    for (struct term_entry *e = part->buckets[hash_term(term) & (part->num_buckets - 1)]; e; e = e->next) {
+        if (strcmp(e->term, term) == 0) return e;
+    }
+    return NULL;
+}
+
+static int grow_buckets(struct partition *part) {
+    size_t new_count = part->num_buckets ? part->num_buckets * 2 : INITIAL_BUCKETS;
+    struct term_entry **nb = calloc(new_count, sizeof *nb);
+
+    if (nb == NULL) return -1;
+    for (size_t b = 0; b < part->num_buckets; b++) {
+        struct term_entry *e = part->buckets[b];
+        while (e != NULL) {
+            struct term_entry *next = e->next;
+            size_t slot = hash_term(e->term) & (new_count - 1);
+            e->next = nb[slot];
+            nb[slot] = e;
+            e = next;
+        }
+    }
+    free(part->buckets);
+    part->buckets = nb;
+    part->num_buckets = new_count;
+    return 0;
+}
+
+static struct partition *get_partition(uint16_t room_id) {
+    if (room_id >= idx.num_parts) {
+        size_t new_count = (size_t)room_id + 1;
+        struct partition *np = realloc(idx.parts, new_count * sizeof *np);
+        if (np == NULL) return NULL;
+        memset(np + idx.num_parts, 0, (new_count - idx.num_parts) * sizeof *np);
+        idx.parts = np;
+        idx.num_parts = new_count;
+    }
+    return &idx.parts[room_id];
+}
+
+static int put_varint(struct term_entry *e, uint32_t v) {
+    if (e->cap - e->len < 5) {
+        size_t new_cap = e->cap ? e->cap * 2 : 8;
+        uint8_t *np = realloc(e->postings, new_cap);
+        if (np == NULL) return -1;
+        e->postings = np;
+        e->cap = new_cap;
+    }
+    while (v >= 0x80) {
+        e->postings[e->len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    e->postings[e->len++] = (uint8_t)v;
+    return 0;
+}
+
+// Caller holds idx.lock
+static void add_posting(struct partition *part, const char *term, uint32_t doc) {
+    struct term_entry *e = find_term(part, term);
+
+    if (e == NULL) {
+        size_t b;
+        if (part->num_terms >= 2 * part->num_buckets && grow_buckets(part) == -1) return;
+        if ((e = calloc(1, sizeof *e)) == NULL) return;
+        strcpy(e->term, term);
+        b = hash_term(term) & (part->num_buckets - 1);
+        e->next = part->buckets[b];
+        part->buckets[b] = e;
+        part->num_terms++;
+    } else if (e->last_doc == doc) {
+        return; // Term repeated within the same message
+    }
+
+    if (put_varint(e, e->num_docs ? doc - e->last_doc : doc) == 0) {
+        e->last_doc = doc;
+        e->num_docs++;
+    }
+}
+
+// next_pos is where the record after this one starts
+static void index_record(const struct history_record *rec, uint64_t next_pos) {
+    char terms[MAX_TERMS_PER_DOC][SEARCH_MAX_TERM + 1];
+    const char *p = rec->text;
+    int num_terms = 0;
+    struct partition *part;
+    uint32_t doc;
+
+    // Tokenize before taking the lock
+    while (num_terms < MAX_TERMS_PER_DOC && next_token(&p, terms[num_terms])) {
+        num_terms++;
+    }
+
+    pthread_mutex_lock(&idx.lock);
+    if (idx.num_docs == idx.doc_cap) {
+        size_t new_cap = idx.doc_cap ? idx.doc_cap * 2 : 1024;
+        uint64_t *np = realloc(idx.doc_pos, new_cap * sizeof *np);
+        if (np == NULL) {
+            pthread_mutex_unlock(&idx.lock);
+            return;
+        }
+        idx.doc_pos = np;
+        idx.doc_cap = new_cap;
+    }
+    doc = idx.num_docs++;
+    idx.doc_pos[doc] = rec->pos;
+    if ((part = get_partition(rec->room_id)) != NULL) {
+        for (int t = 0; t < num_terms; t++) {
+            add_posting(part, terms[t], doc);
+        }
+        part->recent[part->num_recent++ % SEARCH_RECENT] = rec->pos;
+    }
+    idx.indexed_to = next_pos;
+    pthread_mutex_unlock(&idx.lock);
+}
+
+static void *indexer_main(void *arg) {
+    struct history_reader reader;
+    struct history_record *rec = malloc(sizeof *rec);
+    (void)arg;
+
+    if (rec == NULL) return NULL;
+    history_reader_open(&reader, idx.dir);
+    pthread_mutex_lock(&idx.lock);
+    while (idx.running) {
+        int indexed = 0;
+        pthread_mutex_unlock(&idx.lock);
+
+        while (history_read_next(&reader, rec) == 1) {
+            index_record(rec, reader.pos);
+            indexed++;
+        }
+        if (indexed > 0) {
+            printf("[SEARCH] Indexed %d new messages (%u total)\n", indexed, idx.num_docs);
+        }
+
+        pthread_mutex_lock(&idx.lock);
+        if (indexed == 0 && !idx.notified && idx.running) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += IDLE_WAIT_SEC;
+            pthread_cond_timedwait(&idx.wake, &idx.lock, &deadline);
+        }
+        idx.notified = 0;
+    }
+    pthread_mutex_unlock(&idx.lock);
+
+    history_reader_close(&reader);
+    free(rec);
+    return NULL;
+}
+
+/**
+ * @brief Start the indexer thread. It indexes the existing log first, then follows it.
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+int search_index_start(const char *dir) {
+    snprintf(idx.dir, sizeof idx.dir, "%s", dir);
+    idx.running = 1;
+    if ((errno = pthread_create(&idx.thread, NULL, indexer_main, NULL)) != 0) {
+        perror("pthread_create search indexer");
+        idx.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wake the indexer after new records were appended to the log.
+ */
+void search_index_notify(void) {
+    pthread_mutex_lock(&idx.lock);
+    idx.notified = 1;
+    pthread_cond_signal(&idx.wake);
+    pthread_mutex_unlock(&idx.lock);
+}
+
+// Decode a posting list into absolute document numbers. Caller holds idx.lock.
+static uint32_t *decode_postings(const struct term_entry *e) {
+    uint32_t *docs = malloc(e->num_docs * sizeof *docs);
+    uint32_t doc = 0;
+    size_t off = 0;
+
+    if (docs == NULL) return NULL;
+    for (uint32_t k = 0; k < e->num_docs; k++) {
+        uint32_t v = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = e->postings[off++];
+            v |= (uint32_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        doc = k == 0 ? v : doc + v;
+        docs[k] = doc;
+    }
+    return docs;
+}
+
+/**
+ * @brief Find messages in a room that contain every term of the query.
+ * @param positions Receives the record positions of the matches, newest first.
+ * @return Number of positions written (0 if nothing matched).
+ */
+int search_index_query(uint16_t room_id, const char *query, uint64_t *positions, int max_results) {
+    char terms[MAX_QUERY_TERMS][SEARCH_MAX_TERM + 1];
+    const struct term_entry *entries[MAX_QUERY_TERMS];
+    uint32_t *result = NULL;
+    uint32_t result_len = 0;
+    int num_terms = 0;
+    int found = 0;
+
+    while (num_terms < MAX_QUERY_TERMS && next_token(&query, terms[num_terms])) {
+        num_terms++;
+    }
+    if (num_terms == 0) return 0;
+
+    pthread_mutex_lock(&idx.lock);
+    if (room_id >= idx.num_parts) goto done;
+    for (int t = 0; t < num_terms; t++) {
+        if ((entries[t] = find_term(&idx.parts[room_id], terms[t])) == NULL) goto done;
+    }
+
+    // Start from the shortest list so the intersection shrinks as fast as possible
+    for (int t = 1; t < num_terms; t++) {
+        if (entries[t]->num_docs < entries[0]->num_docs) {
+            const struct term_entry *tmp = entries[0];
+            entries[0] = entries[t];
+            entries[t] = tmp;
+        }
+    }
+    if ((result = decode_postings(entries[0])) == NULL) goto done;
+    result_len = entries[0]->num_docs;
+
+    for (int t = 1; t < num_terms && result_len > 0; t++) {
+        uint32_t *other = decode_postings(entries[t]);
+        uint32_t a = 0, b = 0, out = 0;
+        if (other == NULL) {
+            result_len = 0;
+            break;
+        }
+        while (a < result_len && b < entries[t]->num_docs) {
+            if (result[a] < other[b]) a++;
+            else if (result[a] > other[b]) b++;
+            else { result[out++] = result[a]; a++; b++; }
+        }
+        result_len = out;
+        free(other);
+    }
+
+    for (uint32_t k = result_len; k > 0 && found < max_results; k--) {
+        positions[found++] = idx.doc_pos[result[k - 1]];
+    }
+
+done:
+    pthread_mutex_unlock(&idx.lock);
+    free(result);
+    return found;
+}
+
+/**
+ * @brief The positions of a room's latest records, as far as the indexer has got.
+ * @param positions Receives up to max_results positions, oldest first.
+ * @param indexed_to Receives the log position the indexer has reached: records from
+ * there on are not reflected yet.
+ * @return Number of positions written, or -1 if the indexer is not running.
+ */
+int search_index_recent(uint16_t room_id, uint64_t *positions, int max_results, uint64_t *indexed_to) {
+    int found = 0;
+
+    pthread_mutex_lock(&idx.lock);
+    if (!idx.running) {
+        pthread_mutex_unlock(&idx.lock);
+        return -1;
+    }
+    *indexed_to = idx.indexed_to;
+    if (room_id < idx.num_parts) {
+        const struct partition *part = &idx.parts[room_id];
+        uint32_t n = part->num_recent < SEARCH_RECENT ? part->num_recent : SEARCH_RECENT;
+
+        if (n > (uint32_t)max_results) n = (uint32_t)max_results;
+        for (uint32_t k = part->num_recent - n; k < part->num_recent; k++) {
+            positions[found++] = part->recent[k % SEARCH_RECENT];
+        }
+    }
+    pthread_mutex_unlock(&idx.lock);
+    return found;
+}
+
+void search_index_stop(void) {
+    pthread_mutex_lock(&idx.lock);
+    if (!idx.running) {
+        pthread_mutex_unlock(&idx.lock);
+        return;
+    }
+    idx.running = 0;
+    pthread_cond_signal(&idx.wake);
+    pthread_mutex_unlock(&idx.lock);
+    pthread_join(idx.thread, NULL);
+}
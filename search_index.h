@@ -0,0 +1,33 @@
+/**
+ * @file search_index.h
+ * @brief Incremental inverted index over the message history log.
+ *
+ * A background thread follows the history log and indexes each new record. Terms
+ * are lowercase alphanumeric runs; every room has its own partition (term table),
+ * and each term keeps a delta-encoded posting list of document numbers (the
+ * ordinal of the record in the log). Queries intersect the posting lists of all
+ * query terms and return record positions, newest first. Positions stay valid when
+ * the compactor seals a segment; a record it later drops for retention is still
+ * returned here and simply reads back as missing (history_read_at).
+ *
+ * The indexer also keeps the positions of each room's latest SEARCH_RECENT records,
+ * so that loading a room into the recent cache reads those records instead of
+ * scanning the log for them.
+ */
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <stdint.h>
+
+#define SEARCH_MIN_TERM    2  // Shorter tokens ("a", "I") are not indexed
+#define SEARCH_MAX_TERM    32 // Longer tokens are truncated to this many bytes
+#define SEARCH_MAX_RESULTS 20 // Results returned for one /search
+#define SEARCH_RECENT      128 // Latest record positions kept per room (at least RECENT_PER_ROOM)
+
+int search_index_start(const char *dir);
+void search_index_notify(void);
+int search_index_query(uint16_t room_id, const char *query, uint64_t *positions, int max_results);
+int search_index_recent(uint16_t room_id, uint64_t *positions, int max_results, uint64_t *indexed_to);
+void search_index_stop(void);
+
+#endif // SEARCH_INDEX_H
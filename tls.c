@@ -0,0 +1,428 @@
+/**
+ * @file tls.c
+ * @brief TLS connections with kTLS offload (see tls.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stdint.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include <openssl/pem.h>
+
+#include "tls.h"
+
+static void print_ssl_error(const char *what) {
+    unsigned long err = ERR_get_error();
+    char buf[256];
+
+    if (err == 0) {
+        fprintf(stderr, "%s failed\n", what);
+        return;
+    }
+    ERR_error_string_n(err, buf, sizeof buf);
+    fprintf(stderr, "%s: %s\n", what, buf);
+    ERR_clear_error();
+}
+
+static SSL_CTX *new_ctx(const SSL_METHOD *method, int ktls) {
+    SSL_CTX *ctx = SSL_CTX_new(method);
+
+    if (ctx == NULL) {
+        print_ssl_error("SSL_CTX_new");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // A write interrupted by a full socket is retried from tls_flush() with the same
+    // staged bytes, but not necessarily from the same call site
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (ktls) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+    return ctx;
+}
+
+/**
+ * @brief Context for accepting connections with the given certificate chain and key.
+ * @param ktls Non-zero to offload record encryption to the kernel when possible.
+ * @return NULL on error.
+ */
+SSL_CTX *tls_server_ctx(const char *cert_file, const char *key_file, int ktls) {
+    SSL_CTX *ctx = new_ctx(TLS_server_method(), ktls);
+
+    if (ctx == NULL) return NULL;
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+            || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(ctx) != 1) {
+        print_ssl_error(cert_file);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * @brief Context for connecting to a server whose certificate chains to ca_file.
+ * @return NULL on error.
+ */
+SSL_CTX *tls_client_ctx(const char *ca_file, int ktls) {
+    SSL_CTX *ctx = new_ctx(TLS_client_method(), ktls);
+
+    if (ctx == NULL) return NULL;
+    if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+        print_ssl_error(ca_file);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    return ctx;
+}
+
+// --- Session tickets ---
+
+#define TICKET_SECRET_LEN 32
+
+// Read-only once tls_enable_tickets() has returned, so any thread may use it
+static unsigned char ticket_secret[TICKET_SECRET_LEN];
+
+/**
+ * @brief Load the ticket secret, creating it if this is the first server on the host.
+ * A new secret is written to a temporary file and link()ed into place, so when several
+ * processes start at once exactly one secret wins and everybody reads that one.
+ */
+static int load_ticket_secret(const char *path) {
+    char tmp_path[256];
+    unsigned char fresh[TICKET_SECRET_LEN];
+    int fd;
+
+    snprintf(tmp_path, sizeof tmp_path, "%s.%d", path, (int)getpid());
+    if (access(path, F_OK) == -1 && RAND_bytes(fresh, sizeof fresh) == 1
+            && (fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1) {
+        if (write(fd, fresh, sizeof fresh) == sizeof fresh && fsync(fd) == 0 && link(tmp_path, path) == 0) {
+            printf("[TLS] Created session ticket secret %s\n", path);
+        }
+        close(fd);
+        unlink(tmp_path);
+    }
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        perror("open ticket secret");
+        return -1;
+    }
+    if (read(fd, ticket_secret, sizeof ticket_secret) != sizeof ticket_secret) {
+        fprintf(stderr, "%s: short ticket secret\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// One of the two keys (label "enc" or "mac") for a rotation epoch
+static void derive_ticket_key(uint64_t epoch, const char *label, unsigned char out[32]) {
+    unsigned char msg[16];
+    unsigned int out_len = 32;
+
+    memset(msg, 0, sizeof msg);
+    memcpy(msg, label, strlen(label));
+    for (int k = 0; k < 8; k++) {
+        msg[8 + k] = (unsigned char)(epoch >> (56 - 8 * k));
+    }
+    HMAC(EVP_sha256(), ticket_secret, sizeof ticket_secret, msg, sizeof msg, out, &out_len);
+}
+
+/**
+ * @brief OpenSSL ticket key callback. The 16-byte key name is the big-endian epoch
+ * followed by 8 bytes of a keyed hash of it, so a ticket names the epoch whose keys
+ * decrypt it and forged names are rejected before any decryption is attempted.
+ * @return 1 to use the keys, 2 to use them and issue a new ticket, 0 to fall back to
+ * a full handshake, -1 on error.
+ */
+static int ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *ctx,
+                         EVP_MAC_CTX *hctx, int enc) {
+    uint64_t now_epoch = (uint64_t)time(NULL) / TLS_TICKET_ROTATE_SECS;
+    uint64_t epoch = now_epoch;
+    unsigned char enc_key[32], mac_key[32], check[32];
+    OSSL_PARAM params[2];
+    (void)ssl;
+
+    if (!enc) {
+        epoch = 0;
+        for (int k = 0; k < 8; k++) {
+            epoch = epoch << 8 | key_name[k];
+        }
+        if (epoch > now_epoch || now_epoch - epoch >= TLS_TICKET_KEEP_EPOCHS) {
+            return 0; // Expired, or from a clock we do not trust
+        }
+    }
+    derive_ticket_key(epoch, "name", check);
+    if (enc) {
+        for (int k = 0; k < 8; k++) {
+            key_name[k] = (unsigned char)(epoch >> (56 - 8 * k));
+        }
+        memcpy(key_name + 8, check, 8);
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+            return -1;
+        }
+    } else if (CRYPTO_memcmp(key_name + 8, check, 8) != 0) {
+        return 0;
+    }
+
+    derive_ticket_key(epoch, "enc", enc_key);
+    derive_ticket_key(epoch, "mac", mac_key);
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_init(hctx, mac_key, sizeof mac_key, params) != 1
+            || EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, enc_key, iv, enc) != 1) {
+        return -1;
+    }
+    // When decrypting, always ask for a fresh ticket: TLS 1.3 clients use a ticket only
+    // once, and a ticket from an older epoch gets replaced by a current one
+    return enc ? 1 : 2;
+}
+
+/**
+ * @brief Issue and accept stateless session tickets keyed from secret_file.
+ * Call once per server context, before any worker threads start.
+ * @return 0 on success, -1 if the secret cannot be loaded (tickets stay disabled).
+ */
+int tls_enable_tickets(SSL_CTX *ctx, const char *secret_file) {
+    if (load_ticket_secret(secret_file) == -1) {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        return -1;
+    }
+    // Tickets are the only resumption mechanism: a per-process cache would not help a
+    // client that reconnects to a different worker
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_timeout(ctx, TLS_TICKET_ROTATE_SECS * (TLS_TICKET_KEEP_EPOCHS - 1));
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+    return 0;
+}
+
+// Client side: save every new session (TLS 1.3 tickets arrive after the handshake)
+static int save_session_cb(SSL *ssl, SSL_SESSION *sess) {
+    const char *path = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    FILE *f;
+
+    if (path == NULL || (f = fopen(path, "w")) == NULL) {
+        return 0;
+    }
+    fchmod(fileno(f), 0600);
+    PEM_write_SSL_SESSION(f, sess);
+    fclose(f);
+    return 0; // We did not keep a reference
+}
+
+/**
+ * @brief Make a client context remember its session in path and offer it on the
+ * next tls_new(), so a reconnect is an abbreviated handshake.
+ */
+void tls_cache_sessions(SSL_CTX *ctx, const char *path) {
+    SSL_CTX_set_app_data(ctx, (void *)path);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, save_session_cb);
+}
+
+// Offer the session saved by tls_cache_sessions(), if any
+static void load_cached_session(struct tls_conn *c) {
+    const char *path = SSL_CTX_get_app_data(SSL_get_SSL_CTX(c->ssl));
+    SSL_SESSION *sess;
+    FILE *f;
+
+    if (path == NULL || (f = fopen(path, "r")) == NULL) {
+        return;
+    }
+    if ((sess = PEM_read_SSL_SESSION(f, NULL, NULL, NULL)) != NULL) {
+        SSL_set_session(c->ssl, sess);
+        SSL_SESSION_free(sess);
+    }
+    fclose(f);
+}
+
+/**
+ * @brief Wrap a connected socket. Call tls_handshake() until it returns 1.
+ * @param server_name Name to send in SNI and check the certificate against (client
+ * side), or NULL to accept as a server.
+ */
+struct tls_conn *tls_new(SSL_CTX *ctx, int fd, const char *server_name) {
+    struct tls_conn *c = malloc(sizeof *c);
+
+    if (c == NULL) {
+        perror("malloc tls_conn");
+        return NULL;
+    }
+    memset(c, 0, offsetof(struct tls_conn, stage));
+    c->fd = fd;
+    if ((c->ssl = SSL_new(ctx)) == NULL || SSL_set_fd(c->ssl, fd) != 1) {
+        print_ssl_error("SSL_new");
+        tls_free(c);
+        return NULL;
+    }
+    if (server_name != NULL) {
+        SSL_set_tlsext_host_name(c->ssl, server_name);
+        SSL_set1_host(c->ssl, server_name);
+        SSL_set_connect_state(c->ssl);
+        load_cached_session(c);
+    } else {
+        SSL_set_accept_state(c->ssl);
+    }
+    return c;
+}
+
+/**
+ * @brief Advance the handshake.
+ * @return 1 once established, 0 if it needs more I/O (see want_write), -1 on failure.
+ */
+int tls_handshake(struct tls_conn *c) {
+    int rv;
+
+    if (c->established) return 1;
+    c->want_write = 0;
+    if ((rv = SSL_do_handshake(c->ssl)) != 1) {
+        switch (SSL_get_error(c->ssl, rv)) {
+        case SSL_ERROR_WANT_READ:
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            c->want_write = 1;
+            return 0;
+        default:
+            print_ssl_error("TLS handshake");
+            return -1;
+        }
+    }
+    c->established = 1;
+    c->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(c->ssl)) > 0;
+    c->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(c->ssl)) > 0;
+    printf("[TLS] %s %s on socket %d with %s (kTLS tx %s, rx %s)\n", SSL_get_version(c->ssl),
+           SSL_session_reused(c->ssl) ? "resumed" : "established", c->fd, SSL_get_cipher_name(c->ssl),
+           c->ktls_tx ? "on" : "off", c->ktls_rx ? "on" : "off");
+    return 1;
+}
+
+/**
+ * @brief recv() equivalent: bytes read, 0 on orderly close, -1 with errno set
+ * (EAGAIN if no application data is available yet).
+ */
+ssize_t tls_read(struct tls_conn *c, void *buf, size_t len) {
+    int rv = SSL_read(c->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+
+    if (rv > 0) return rv;
+    switch (SSL_get_error(c->ssl, rv)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (rv == 0 || errno == 0) return 0; // Peer closed without close_notify
+        return -1;
+    default:
+        print_ssl_error("SSL_read");
+        errno = EIO;
+        return -1;
+    }
+}
+
+/**
+ * @brief Write out the staged bytes, finishing a record that an earlier SSL_write()
+ * left half written. With partial writes enabled SSL_write() returns after each
+ * record, and a peer that negotiated a small max_fragment_length gets several
+ * records per stage, so keep going until the stage is empty.
+ * @return 1 if nothing is left over, 0 if the socket is still full, -1 on error.
+ */
+int tls_flush(struct tls_conn *c) {
+    int rv = 0;
+
+    while (c->stage_len > 0) {
+        if ((rv = SSL_write(c->ssl, c->stage, (int)c->stage_len)) <= 0) break;
+        memmove(c->stage, c->stage + rv, c->stage_len - rv);
+        c->stage_len -= rv;
+    }
+    if (c->stage_len == 0) return 1;
+    if (SSL_get_error(c->ssl, rv) == SSL_ERROR_WANT_WRITE) return 0;
+    print_ssl_error("SSL_write");
+    return -1;
+}
+
+/**
+ * @brief writev() equivalent. With kTLS TX this is writev() on the socket. Otherwise
+ * the iovecs are copied into the staging buffer one record at a time and encrypted
+ * until everything is written or the socket is full; a record the socket could not
+ * take yet counts as written and is finished by tls_flush().
+ * @return Bytes accepted, or -1 with errno set (EAGAIN if the socket is full).
+ */
+ssize_t tls_writev(struct tls_conn *c, const struct iovec *iov, int iovcnt) {
+    size_t total = 0, off = 0;
+    int k = 0;
+    int rv;
+
+    if ((rv = tls_flush(c)) != 1) {
+        errno = rv == 0 ? EAGAIN : EIO;
+        return -1;
+    }
+    if (c->ktls_tx) {
+        return writev(c->fd, iov, iovcnt);
+    }
+
+    while (k < iovcnt) {
+        size_t len = 0;
+
+        // Fill one record, continuing where the previous one stopped (iovec k, offset off)
+        while (k < iovcnt && len < sizeof c->stage) {
+            size_t n = iov[k].iov_len - off;
+            if (n > sizeof c->stage - len) n = sizeof c->stage - len;
+            memcpy(c->stage + len, (const char *)iov[k].iov_base + off, n);
+            len += n;
+            off += n;
+            if (off == iov[k].iov_len) {
+                k++;
+                off = 0;
+            }
+        }
+        if (len == 0) break;
+        c->stage_len = len;
+        if ((rv = tls_flush(c)) == -1) {
+            c->stage_len = 0;
+            if (total > 0) return total;
+            errno = EIO;
+            return -1;
+        }
+        total += len;
+        if (rv == 0) break; // Socket is full; the staged record is finished later
+    }
+    return total;
+}
+
+// Decrypted bytes SSL_read() can return without touching the socket
+int tls_pending(const struct tls_conn *c) {
+    return SSL_pending(c->ssl) > 0;
+}
+
+int tls_wants_write(const struct tls_conn *c) {
+    return c->want_write || c->stage_len > 0;
+}
+
+/**
+ * @brief Send close_notify (best effort, never blocks the caller) and free the connection.
+ * The socket itself is left for the caller to close.
+ */
+void tls_free(struct tls_conn *c) {
+    if (c == NULL) return;
+    if (c->ssl != NULL) {
+        if (c->established) {
+            SSL_shutdown(c->ssl);
+        }
+        SSL_free(c->ssl);
+    }
+    free(c);
+}
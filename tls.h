@@ -0,0 +1,65 @@
+/**
+ * @file tls.h
+ * @brief TLS connections (OpenSSL) with kernel TLS offload when the kernel supports it.
+ *
+ * Contexts are created with SSL_OP_ENABLE_KTLS. Once the handshake is done OpenSSL
+ * hands the negotiated keys to the kernel (TLS_TX / TLS_RX) if the kernel "tls"
+ * module is loaded and the cipher is supported. With kTLS TX on, the socket itself
+ * encrypts: tls_writev() is a plain writev() on the descriptor, so the outbound
+ * queue's gather writes (and sendfile()/splice() on the fd) keep working unchanged.
+ * Without it, data is staged into one record at a time and encrypted by SSL_write().
+ *
+ * Reads always go through SSL_read(); with kTLS RX on, OpenSSL reads records that
+ * the kernel has already decrypted.
+ *
+ * Session resumption uses stateless tickets (tls_enable_tickets()). Ticket keys are
+ * derived from a secret file and the current rotation epoch, so every thread and
+ * every server process on the host that reads the same file issues and accepts the
+ * same tickets without sharing any state, and keys rotate on their own every
+ * TLS_TICKET_ROTATE_SECS. Clients keep their last session in a file
+ * (tls_cache_sessions()) and offer it on the next connect.
+ *
+ * Sockets may be non-blocking. A record that SSL_write() could not finish is kept in
+ * the connection and retried by tls_flush(); from the caller's point of view it has
+ * been written, so check tls_wants_write() when deciding whether to poll for POLLOUT.
+ */
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+#define TLS_PORT               "3492"      // Port of the server's TLS listener
+#define TLS_STAGE_SIZE         (16 * 1024) // One TLS record of plaintext
+#define TLS_TICKET_SECRET      "tls_ticket.secret" // Shared by all server processes on the host
+#define TLS_TICKET_ROTATE_SECS 3600 // New ticket keys every hour...
+#define TLS_TICKET_KEEP_EPOCHS 3    // ...and tickets stay valid for this many key periods
+#define TLS_SESSION_CACHE      ".chat_tls_session" // Client-side saved session
+
+struct tls_conn {
+    SSL *ssl;
+    int fd;
+    int established;   // Handshake finished
+    int want_write;    // Handshake is waiting for the socket to become writable
+    int ktls_tx;       // Kernel encrypts what we write
+    int ktls_rx;       // Kernel decrypts what we read
+    size_t stage_len;  // Bytes in stage that SSL_write() still has to finish
+    char stage[TLS_STAGE_SIZE];
+};
+
+SSL_CTX *tls_server_ctx(const char *cert_file, const char *key_file, int ktls);
+SSL_CTX *tls_client_ctx(const char *ca_file, int ktls);
+int tls_enable_tickets(SSL_CTX *ctx, const char *secret_file);
+void tls_cache_sessions(SSL_CTX *ctx, const char *path);
+struct tls_conn *tls_new(SSL_CTX *ctx, int fd, const char *server_name);
+int tls_handshake(struct tls_conn *c);
+ssize_t tls_read(struct tls_conn *c, void *buf, size_t len);
+ssize_t tls_writev(struct tls_conn *c, const struct iovec *iov, int iovcnt);
+int tls_flush(struct tls_conn *c);
+int tls_pending(const struct tls_conn *c);
+int tls_wants_write(const struct tls_conn *c);
+void tls_free(struct tls_conn *c);
+
+#endif // TLS_H